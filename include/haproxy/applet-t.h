@@ -80,23 +80,47 @@ struct appctx {
 				struct {
 					struct nst_memory_object  *obj;
 					struct nst_memory_item    *item;
+					unsigned int               offset;
+					struct {
+						uint64_t  beg;      /* bytes left to skip */
+						uint64_t  len;      /* bytes left to send */
+						uint64_t  total;    /* 0 if no range */
+					} range;
 				} memory;
 				struct {
 					int       fd;
 					int       header_len;
 					uint64_t  payload_len;
 					uint64_t  offset;
+					struct nst_disk_aio  *aio;
+					struct {
+						uint64_t  beg;
+						uint64_t  len;
+						uint64_t  total;
+					} range;
 				} disk;
 			} store;
 			struct {
 				struct nst_dict  *dict;
+				int               shard;
 				uint64_t          idx;
+				struct nst_dict_entry *entry;  /* index cursor, see purge-index */
+				struct nst_dict_tag   *tag;    /* tag index cursor, see tag-header */
 				struct buffer     buf;
 				struct ist        name;
 				struct ist        host;
 				struct ist        path;
 				struct my_regex  *regex;
 			} manager;
+			struct {
+				struct nst_dict_entry  *entry;
+				struct nst_rule        *rule;
+				struct nst_key         *key;
+				int                     state;    /* entry state to restore */
+			} refresh;
+			struct {
+				struct nst_warmer      *warmer;
+			} warm;
 		} nuster;
 		struct {
 			void *ptr;              /* current peer or NULL, do not use for something else */
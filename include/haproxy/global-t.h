@@ -195,8 +195,15 @@ struct global {
 			int disk_saver;                  /* the number of entries checked once for persist_async */
 			int clean_temp;                  /* clean temp file or not */
 			int always_check_disk;           /* always try to read disk file or not */
+			int purge_index;                 /* index entries by proxy, rule, host and path */
+			int disk_engine;                 /* file or segment */
+			uint64_t disk_segment_size;      /* segment size of the segment engine */
+			int disk_io_threads;             /* threads reading disk hits, 0: in the applet */
+			int disk_scan_threads;           /* threads loading and cleaning the file engine */
+			uint32_t disk_index_interval;    /* seconds between index snapshots, 0: off */
 
 			struct ist root;                 /* disk root directory */
+			struct ist tag_header;           /* response header of the tags of an entry */
 
 			struct nst_shmem    *shmem;      /* memory */
 		} cache;
@@ -213,6 +220,12 @@ struct global {
 			int disk_saver;                  /* the number of entries checked once for persist_async */
 			int clean_temp;                  /* clean temp file or not */
 			int always_check_disk;           /* always try to read disk file or not */
+			int purge_index;                 /* index entries by proxy, rule, host and path */
+			int disk_engine;                 /* file or segment */
+			uint64_t disk_segment_size;      /* segment size of the segment engine */
+			int disk_io_threads;             /* threads reading disk hits, 0: in the applet */
+			int disk_scan_threads;           /* threads loading and cleaning the file engine */
+			uint32_t disk_index_interval;    /* seconds between index snapshots, 0: off */
 
 			struct ist root;                 /* disk root directory */
 
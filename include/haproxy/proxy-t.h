@@ -454,6 +454,11 @@ struct proxy {
 	struct {
 		int mode;
 		struct list rules;              /* nuster rules */
+		struct {
+			char *file;             /* url list, see nuster warm */
+			int concurrency;        /* max warming streams */
+			int rate;               /* max urls per second, 0 for no limit */
+		} warm;
 	} nuster;
 
 	EXTRA_COUNTERS(extra_counters_fe);
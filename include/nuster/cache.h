@@ -25,6 +25,10 @@
 #include <nuster/common.h>
 
 
+/* ms, how often a waiting stream checks an entry filled by another process */
+#define NST_CACHE_WAIT_POLL     10
+
+
 extern hpx_flt_ops_t  nst_cache_filter_ops;
 extern const char    *nst_cache_flt_id;
 
@@ -35,10 +39,24 @@ void nst_cache_housekeeping();
 void nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx);
 int nst_cache_append(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsigned int len);
 int nst_cache_finish(nst_ctx_t *ctx);
+void nst_cache_revalidate(nst_ctx_t *ctx);
 void nst_cache_abort(nst_ctx_t *ctx);
-int nst_cache_exists(nst_ctx_t *ctx);
+int nst_cache_exists(hpx_stream_t *s, nst_ctx_t *ctx);
+int nst_cache_exists_variant(hpx_stream_t *s, nst_ctx_t *ctx);
+int nst_cache_wait(nst_ctx_t *ctx, hpx_task_t *task);
+int nst_cache_waiting(nst_ctx_t *ctx);
+void nst_cache_unwait(nst_ctx_t *ctx);
 int nst_cache_delete(nst_key_t *key);
+void nst_cache_refresh(hpx_stream_t *s, nst_ctx_t *ctx);
+int nst_cache_refresh_attach(hpx_stream_t *s, nst_ctx_t *ctx);
+int nst_cache_refreshing(hpx_stream_t *s);
+int nst_cache_stream_new(hpx_appctx_t *appctx, hpx_proxy_t *be, hpx_buffer_t *buf, int ssl);
+void nst_cache_discard_handler(hpx_appctx_t *appctx);
 void nst_cache_hit(hpx_stream_t *s, hpx_stream_interface_t *si, hpx_channel_t *req,
         hpx_channel_t *res, nst_ctx_t *ctx);
 
+/* warmer */
+void nst_cache_warm_init();
+int nst_cache_warm(hpx_ist_t name, int dump);
+
 #endif /* _NUSTER_CACHE_H */
@@ -48,6 +48,7 @@ typedef struct filter                   hpx_filter_t;
 typedef struct sample                   hpx_sample_t;
 typedef struct proxy                    hpx_proxy_t;
 typedef struct list                     hpx_list_t;
+typedef struct task                     hpx_task_t;
 typedef struct ist                      hpx_ist_t;
 typedef struct htx                      hpx_htx_t;
 typedef struct arg                      hpx_arg_t;
@@ -91,6 +92,10 @@ typedef struct nst_core                 nst_core_t;
 #define NST_DEFAULT_DISK_CLEANER        100
 #define NST_DEFAULT_DISK_LOADER         100
 #define NST_DEFAULT_DISK_SAVER          100
+#define NST_DEFAULT_DISK_SEGMENT_SIZE   64 * 1024 * 1024
+#define NST_DEFAULT_DISK_SCAN_THREADS   1
+#define NST_DEFAULT_WARM_CONCURRENCY    8
+#define NST_HOUSEKEEPING_INTERVAL       10
 #define NST_DEFAULT_KEY                "method.scheme.host.uri"
 #define NST_DEFAULT_CODE               "200"
 
@@ -159,16 +164,20 @@ enum nst_key_element_type {
     NST_KEY_ELEMENT_BODY,
 };
 
+/*
+ * An element of a compiled key, the elements of a key are contiguous and end
+ * with a zero type
+ */
 typedef struct nst_key_element {
     enum nst_key_element_type  type;
-    char                      *data;
+    hpx_ist_t                  name;           /* param, header or cookie name */
 } nst_key_element_t;
 
 typedef struct nst_rule_key {
     struct nst_rule_key       *next;
 
     char                      *name;
-    nst_key_element_t        **data;           /* parsed key */
+    nst_key_element_t         *data;           /* compiled key */
     int                        idx;
 } nst_rule_key_t;
 
@@ -189,8 +198,11 @@ typedef struct nst_rule_config {
     int                        ttl;           /* ttl: seconds, 0: not expire, -1: auto */
     int                        etag;          /* etag on|off */
     int                        last_modified; /* last_modified on|off */
+    int                        gzip;          /* keep a gzip encoded copy in memory, on|off */
     int                        wait;          /* -1: not wait, 0: wait forever, > 0, wait seconds */
     int                        inactive;      /* 0: disabled, > 0: inactive seconds */
+    int                        refresh;       /* 0: disabled, > 0: refresh hot N seconds before expire */
+    int                        admit;         /* 0: disabled, > 0: store once requested N times */
 
     /*
      *  -1: do not use stale
@@ -224,14 +236,18 @@ typedef struct nst_rule_config {
 typedef struct nst_rule_prop {
     hpx_ist_t                  pid;           /* proxy name */
     hpx_ist_t                  rid;           /* rule name */
+    int                        uuid;          /* rule uuid, -1 if the rule is gone */
     uint8_t                    store;
     int                        ttl;
     int                        etag;
     int                        last_modified;
+    int                        gzip;
     uint8_t                    extend[4];
     int                        wait;
     int                        inactive;
     int                        stale;
+    int                        refresh;
+    int                        admit;
     int                        status_code;
 } nst_rule_prop_t;
 
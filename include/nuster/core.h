@@ -42,7 +42,8 @@ enum {
     NST_CTX_STATE_DELETE,            /* delete */
     NST_CTX_STATE_DONE,              /* done */
     NST_CTX_STATE_INVALID,           /* invalid */
-    NST_CTX_STATE_CHECK_DISK,        /* check disk */
+    NST_CTX_STATE_CHECK_DISK,        /* check disk, or being checked by an io thread */
+    NST_CTX_STATE_VARY,              /* primary entry, check the variant */
 };
 
 typedef struct nst_proxy {
@@ -74,8 +75,40 @@ typedef struct nst_ctx {
         } disk;
     } store;
 
+    /* gzip encoded copy of store.memory.obj, see rule.gzip */
+    struct {
+        nst_memory_obj_t       *obj;
+        nst_memory_item_t      *item;
+        struct comp_ctx        *comp;
+        uint64_t                len;
+    } gzip;
+
     nst_rule_prop_t            *prop;
 
+    /* rule of the entry hit, the request is accounted to it, -1 if none */
+    int                         hit_uuid;
+
+    /* queued on the process waiters of the key while in NST_CTX_STATE_WAIT */
+    struct {
+        hpx_list_t              list;
+        hpx_task_t             *task;
+    } waiter;
+
+    /* background refresh of the entry being hit, see nst_cache_refresh */
+    struct {
+        int                     on;                 /* allowed for this request */
+        int                     state;              /* entry state before, 0 if none */
+        nst_dict_entry_t       *entry;
+    } refresh;
+
+    /* see nst_dict_entry.vary */
+    struct {
+        nst_key_t              *primary;            /* key of the primary entry */
+        nst_key_t               key;                /* key of the variant */
+        hpx_ist_t               suffix;
+        hpx_buffer_t           *headers;            /* request headers kept for the response */
+    } vary;
+
     int                         rule_cnt;
     int                         key_cnt;
     nst_rule_t                 *rule;
@@ -93,5 +126,6 @@ struct nst_core {
 
 
 int nst_test_rule(hpx_stream_t *s, nst_rule_t *rule, int res);
+int nst_rule_uuid(hpx_ist_t pid, hpx_ist_t rid);
 
 #endif /* _NUSTER_CORE_H */
@@ -27,6 +27,21 @@
 #include <nuster/key.h>
 
 
+#define NST_DICT_SHARDS             16      /* independently locked parts */
+#define NST_DICT_EVICT_SAMPLES      16      /* candidates compared per eviction */
+#define NST_DICT_EVICT_SCAN         1024    /* max buckets walked per eviction */
+#define NST_DICT_EVICT_TRIES        32      /* max evictions per allocation */
+#define NST_DICT_EVICT_IDLE         1000    /* ms, recently accessed entries are kept */
+#define NST_DICT_ENTRY_HOT          2       /* hits before an entry is refreshed early */
+#define NST_DICT_REHASH_GROW        2       /* grow if used > size * NST_DICT_REHASH_GROW */
+#define NST_DICT_REHASH_SHRINK      8       /* shrink if used < size / NST_DICT_REHASH_SHRINK */
+#define NST_DICT_REHASH_STEP        1000    /* max buckets moved per shard per call */
+#define NST_DICT_VARIANTS           32      /* max variants of a primary entry */
+#define NST_DICT_TAGS               32      /* max tags of an entry */
+#define NST_DICT_SKETCH_DEPTH       4       /* counter rows of the admission sketch */
+#define NST_DICT_SKETCH_SAMPLE      10      /* counters are halved every width * N adds */
+#define NST_DICT_SKETCH_AGE         16384   /* 8 bytes words halved per housekeeping */
+
 enum {
     NST_DICT_ENTRY_STATE_INIT      = 0,
     NST_DICT_ENTRY_STATE_VALID,
@@ -36,6 +51,39 @@ enum {
     NST_DICT_ENTRY_STATE_INVALID,
 };
 
+/*
+ * Secondary indexes of the entries of a shard, so that a purge by proxy, rule,
+ * host or path walks the matching entries only, see purge-index
+ */
+enum {
+    NST_DICT_INDEX_PROXY           = 0,
+    NST_DICT_INDEX_RULE,
+    NST_DICT_INDEX_HOST,
+    NST_DICT_INDEX_PATH,
+    NST_DICT_INDEX_SIZE,
+};
+
+/*
+ * A tag of an entry, linked in the tag index of its shard, see tag-header.
+ * The tags of an entry are allocated in one block, followed by their names.
+ */
+typedef struct nst_dict_tag {
+    struct nst_dict_tag        *next;
+    struct nst_dict_tag       **pprev;
+    struct nst_dict_entry      *entry;
+    hpx_ist_t                   name;
+} nst_dict_tag_t;
+
+/*
+ * The request values of the Vary headers of a variant, appended to the key of
+ * its primary entry to make the key of the variant
+ */
+typedef struct nst_dict_variant {
+    struct nst_dict_variant    *next;
+    uint32_t                    size;
+    char                        data[0];
+} nst_dict_variant_t;
+
 /*
  * A nst_dict_entry is an entry in nst_dict hash table
  */
@@ -52,6 +100,7 @@ typedef struct nst_dict_entry {
     hpx_ist_t                   path;
     hpx_ist_t                   etag;
     hpx_ist_t                   last_modified;
+    int                         validators;     /* see nst_http_res.validators */
 
     int                         header_len;
     uint64_t                    payload_len;
@@ -68,38 +117,187 @@ typedef struct nst_dict_entry {
     /* extended count  */
     int                         extended;
 
+    /*
+     * Vary of the response, set on a primary entry which stores no object,
+     * each variant is an entry of its own
+     */
+    hpx_ist_t                   vary;
+    nst_dict_variant_t         *variant;
+    int                         variant_cnt;
+
+    /* links of the secondary indexes, pprev is NULL if not indexed */
+    struct {
+        struct nst_dict_entry  *next;
+        struct nst_dict_entry **pprev;
+    } index[NST_DICT_INDEX_SIZE];
+
+    nst_dict_tag_t             *tag;
+    int                         tag_cnt;
+
     struct {
         struct {
             nst_memory_obj_t   *obj;
             nst_memory_item_t  *item;
+
+            /* object of an INIT entry being filled */
+            nst_memory_obj_t   *fill;
+
+            /* gzip encoded copy of obj, see rule.gzip */
+            nst_memory_obj_t   *gzip;
         } memory;
         struct {
             char               *file;
+            uint64_t            offset;   /* object offset in segment file */
         } disk;
     } store;
 } nst_dict_entry_t;
 
-typedef struct nst_dict {
-    nst_shmem_t                *shmem;
+/*
+ * A nst_dict_table is a bucket array split into segments of one shmem block,
+ * so that it can be allocated and resized at runtime
+ */
+typedef struct nst_dict_table {
+    nst_dict_entry_t         ***segment;
+    uint64_t                    size;           /* number of buckets */
+    int                         shift;          /* log2 of buckets per segment */
+} nst_dict_table_t;
 
-    nst_dict_entry_t          **entry;
-    uint64_t                    size;           /* number of entries */
+/*
+ * A nst_dict_shard is an independently locked part of nst_dict,
+ * keys are spread over shards by their hash.
+ * While rehashing, entries are moved bucket by bucket from table[0] to
+ * table[1], new entries go to table[1] and lookups check both tables.
+ */
+typedef struct nst_dict_shard {
+    nst_dict_table_t            table[2];
     uint64_t                    used;           /* number of used entries */
+    uint64_t                    min_size;       /* never shrink below */
+
+    uint64_t                    rehash_idx;
 
     uint64_t                    cleanup_idx;
 
     uint64_t                    sync_idx;
 
-    nst_store_t                *store;
+    uint64_t                    evict_idx;
+
+    /* bucket tables of the secondary indexes, hashed by value */
+    nst_dict_table_t            index[NST_DICT_INDEX_SIZE];
+
+    /* bucket table of the tag index, its buckets hold nst_dict_tag */
+    nst_dict_table_t            tags;
+
+    /* tags replaced while purging, chained by the pprev of their first tag */
+    nst_dict_tag_t             *tags_dead;
 
 #if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
     pthread_mutex_t             mutex;
 #else
     unsigned int                waiters;
 #endif
+} ALIGNED(64) nst_dict_shard_t;
+
+/*
+ * Count-min sketch of the key hashes of the rules with admit, each key
+ * increments one 8 bits counter per row and is estimated by the smallest.
+ * Counters are halved every sample adds so that estimates follow recent
+ * traffic, a slice at a time by the master housekeeping.
+ */
+typedef struct nst_dict_sketch {
+    uint8_t                    *counter;        /* NULL if no rule uses admit */
+    uint64_t                    width;          /* counters per row, power of 2 */
+    uint64_t                    added;
+    uint64_t                    sample;
+    int                         aging;          /* set when sample is reached */
+    uint64_t                    age_idx;        /* next word to halve */
+} nst_dict_sketch_t;
+
+typedef struct nst_dict {
+    nst_shmem_t                *shmem;
+
+    nst_dict_shard_t            shard[NST_DICT_SHARDS];
+
+    /* shard cursors, taken with an atomic increment, modulo NST_DICT_SHARDS */
+    uint64_t                    cleanup_idx;
+
+    uint64_t                    sync_idx;
+
+    uint64_t                    evict_idx;
+
+    /* number of running purgers, rehashing waits for them */
+    unsigned int                purging;
+
+    /* number of other walkers of both tables, like the warmer dump */
+    unsigned int                paused;
+
+    /* the secondary indexes are maintained */
+    int                         indexed;
+
+    /* the tag index is maintained */
+    int                         tagged;
+
+    /* see rule.admit */
+    nst_dict_sketch_t           sketch;
+
+    nst_store_t                *store;
 } nst_dict_t;
 
 
+static inline nst_dict_shard_t *
+nst_dict_shard(nst_dict_t *dict, uint64_t hash) {
+    return &dict->shard[hash % NST_DICT_SHARDS];
+}
+
+static inline uint64_t
+nst_dict_table_idx(nst_dict_table_t *table, uint64_t hash) {
+    return hash / NST_DICT_SHARDS % table->size;
+}
+
+static inline nst_dict_entry_t **
+nst_dict_bucket(nst_dict_table_t *table, uint64_t idx) {
+    return &table->segment[idx >> table->shift][idx & ((1ULL << table->shift) - 1)];
+}
+
+static inline int
+nst_dict_rehashing(nst_dict_shard_t *shard) {
+    return shard->table[1].size != 0;
+}
+
+static inline void
+nst_dict_lock(nst_dict_t *dict, nst_key_t *key) {
+    nst_shctx_lock(nst_dict_shard(dict, key->hash));
+}
+
+static inline void
+nst_dict_unlock(nst_dict_t *dict, nst_key_t *key) {
+    nst_shctx_unlock(nst_dict_shard(dict, key->hash));
+}
+
+static inline uint64_t
+nst_dict_size(nst_dict_t *dict) {
+    uint64_t  size = 0;
+    int       i;
+
+    for(i = 0; i < NST_DICT_SHARDS; i++) {
+        size += dict->shard[i].table[0].size;
+    }
+
+    return size;
+}
+
+static inline uint64_t
+nst_dict_used(nst_dict_t *dict) {
+    uint64_t  used = 0;
+    int       i;
+
+    for(i = 0; i < NST_DICT_SHARDS; i++) {
+        used += dict->shard[i].used;
+    }
+
+    return used;
+}
+
+
 static inline int
 nst_dict_entry_expired(nst_dict_entry_t *entry) {
 
@@ -116,6 +314,51 @@ nst_dict_entry_stale_valid(nst_dict_entry_t *entry) {
     return entry->expire + entry->prop.stale > nst_time_now_ms() / 1000;
 }
 
+/*
+ * An entry is hot once hit NST_DICT_ENTRY_HOT times
+ */
+static inline int
+nst_dict_entry_hot(nst_dict_entry_t *entry) {
+    uint64_t  hits;
+
+    hits = entry->access[0] + entry->access[1] + entry->access[2] + entry->access[3];
+
+    return hits >= NST_DICT_ENTRY_HOT;
+}
+
+/*
+ * A hot entry is refreshed in the background before it expires, see
+ * rule.refresh.
+ */
+static inline int
+nst_dict_entry_refresh(nst_dict_entry_t *entry) {
+
+    if(entry->prop.refresh == 0 || entry->expire == 0) {
+        return 0;
+    }
+
+    if(entry->expire > nst_time_now_ms() / 1000 + entry->prop.refresh) {
+        return 0;
+    }
+
+    return nst_dict_entry_hot(entry);
+}
+
+/*
+ * An expired entry of a use-stale rule is kept for the next request to
+ * refresh it, for use-stale TIME, or one more ttl if use-stale is on
+ */
+static inline int
+nst_dict_entry_refresh_window(nst_dict_entry_t *entry) {
+    int  window = entry->prop.stale > 0 ? entry->prop.stale : entry->prop.ttl;
+
+    if(entry->prop.stale < 0) {
+        return 0;
+    }
+
+    return entry->expire + window > nst_time_now_ms() / 1000;
+}
+
 static inline int
 nst_dict_entry_inactive(nst_dict_entry_t *entry) {
 
@@ -138,7 +381,7 @@ nst_dict_entry_invalid(nst_dict_entry_t *entry) {
     if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
 
         if(nst_dict_entry_expired(entry)) {
-            return 1;
+            return !nst_dict_entry_refresh_window(entry);
         } else {
             return nst_dict_entry_inactive(entry);
         }
@@ -162,16 +405,35 @@ nst_dict_entry_valid(nst_dict_entry_t *entry) {
     return 0;
 }
 
-int nst_dict_init(nst_dict_t *dict, nst_store_t *store, nst_shmem_t *shmem, uint64_t dict_size);
+int nst_dict_init(nst_dict_t *dict, nst_store_t *store, nst_shmem_t *shmem, uint64_t dict_size,
+        int indexed, int tagged);
 void nst_dict_cleanup(nst_dict_t *dict);
+void nst_dict_rehash(nst_dict_t *dict);
 
 nst_dict_entry_t *nst_dict_get(nst_dict_t *dict, nst_key_t *key);
+nst_dict_entry_t *nst_dict_lookup(nst_dict_t *dict, nst_key_t *key);
+nst_dict_entry_t *nst_dict_index_first(nst_dict_shard_t *shard, int type, hpx_ist_t value);
+nst_dict_tag_t *nst_dict_tag_first(nst_dict_shard_t *shard, hpx_ist_t name);
+int nst_dict_set_tags(nst_dict_t *dict, nst_dict_entry_t *entry, nst_http_txn_t *txn);
+void nst_dict_set_validators(nst_dict_entry_t *entry, nst_http_txn_t *txn);
 nst_dict_entry_t *nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn,
         nst_rule_prop_t *prop);
 
 int nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, nst_key_t *key, nst_http_txn_t *txn,
-        nst_rule_prop_t *prop, char *file, uint64_t expire);
+        nst_rule_prop_t *prop, char *file, uint64_t offset, uint64_t expire);
 
 void nst_dict_record_access(nst_dict_entry_t *entry);
+void nst_dict_drop_memory(nst_dict_t *dict, nst_dict_entry_t *entry);
+
+nst_dict_entry_t *nst_dict_set_vary(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn,
+        nst_rule_prop_t *prop);
+int nst_dict_add_variant(nst_dict_t *dict, nst_dict_entry_t *entry, hpx_ist_t suffix);
+
+void *nst_dict_alloc(nst_dict_t *dict, int size);
+
+int nst_dict_sketch_init(nst_dict_t *dict);
+int nst_dict_sketch_add(nst_dict_t *dict, uint64_t hash);
+void nst_dict_sketch_age(nst_dict_t *dict);
+int nst_dict_admit(nst_dict_t *dict, nst_key_t *key, int threshold);
 
 #endif /* _NUSTER_DICT_H */
@@ -22,6 +22,8 @@
 #ifndef _NUSTER_DISK_H
 #define _NUSTER_DISK_H
 
+#include <import/xxhash.h>
+
 #include <nuster/common.h>
 #include <nuster/key.h>
 
@@ -31,7 +33,7 @@
 /*
    Offset              Length(bytes)           Content
    0                   6                       NUSTER
-   6                   1                       mode: not used
+   6                   1                       flags: deleted
    7                   1                       version
    8 * 1               8                       hash
    8 * 2               20                      uuid
@@ -45,7 +47,8 @@
    8 * 11              8                       last-modified: on|off: 4, length: 4
    8 * 12              8                       ttl: 4, extend: 4
    8 * 13              8                       stale: 4, inactive: 4
-   8 * 14              20                      reserved
+   8 * 14              8                       record length
+   8 * 15              8                       reserved
    NST_DISK_META_SIZE  key_len                 key
    + key_len           proxy_len               proxy
    + proxy_len         rule_len                rule
@@ -58,6 +61,7 @@
    + payload_len       TLR/EOT                 [optional]
    */
 
+#define NST_DISK_META_POS_FLAGS                 6
 #define NST_DISK_META_POS_HASH                  8 * 1
 #define NST_DISK_META_POS_UUID                  8 * 2
 #define NST_DISK_META_POS_KEY_LEN               8 * 2  + 20
@@ -75,12 +79,64 @@
 #define NST_DISK_META_POS_TTL_EXTEND            8 * 12
 #define NST_DISK_META_POS_STALE                 8 * 13
 #define NST_DISK_META_POS_INACTIVE              8 * 13 + 4
+#define NST_DISK_META_POS_RECORD_LEN            8 * 14
 
 #define NST_DISK_META_SIZE                      8 * 16
 #define NST_DISK_POS_KEY                        NST_DISK_META_SIZE
 
 #define NST_DISK_FILE_LEN                       NST_KEY_UUID_LEN * 2
 
+#define NST_DISK_FLAG_DELETED                   0x01
+
+/*
+ * file:    one file per object, root/x/xx/<uuid>
+ * segment: objects appended to large segment files, root/seg/<id>, the dict
+ *          is the offset index and sparse segments are compacted by the cleaner
+ */
+enum {
+    NST_DISK_ENGINE_FILE     = 0,
+    NST_DISK_ENGINE_SEGMENT  = 1,
+};
+
+#define NST_DISK_SEGMENT_ID_LEN                 8
+
+/*
+   root/index, a snapshot of the dict entries stored on disk
+
+   Offset              Length(bytes)           Content
+   0                   8                       NSTINDEX
+   8                   4                       version
+   12                  4                       engine
+   16                  8                       time: ms, start of the snapshot
+   24                  8                       records
+   32                  4                       segments
+   36                  4                       reserved
+   40                  8                       body length
+   48                  8                       body XXH64
+   56                  8                       reserved
+   body
+   + 24 * segments                             id: 4, reserved: 4, size: 8, dead: 8
+   + records                                   meta: NST_DISK_META_SIZE, record length is
+                                               the length in index
+                                               offset: 8, file length: 4, reserved: 4
+                                               key, proxy, rule, host, path, etag,
+                                               last-modified, file relative to root
+   */
+
+#define NST_DISK_INDEX_VERSION                  1
+#define NST_DISK_INDEX_HEADER_SIZE              64
+#define NST_DISK_INDEX_SEGMENT_SIZE             24
+#define NST_DISK_INDEX_RECORD_SIZE              NST_DISK_META_SIZE + 16
+#define NST_DISK_INDEX_BUCKETS                  256     /* buckets walked per lock */
+
+enum {
+    NST_DISK_INDEX_INIT      = 0,
+    NST_DISK_INDEX_NONE,                    /* no valid index, scan everything */
+    NST_DISK_INDEX_OPEN,                    /* scan what changed since the index */
+    NST_DISK_INDEX_RECORDS,                 /* then load the index records */
+    NST_DISK_INDEX_DONE,
+};
+
 enum {
     NST_DISK_APPLET_ERROR    = -1,
     NST_DISK_APPLET_DONE     =  0,
@@ -93,21 +149,113 @@ enum {
 typedef struct nst_disk_object {
     char               *file;               /* disk file */
     int                 fd;
+    int                 seg;                /* segment slot, -1 for the file engine */
+    uint64_t            base;               /* offset of the object in file */
     uint64_t            offset;
     char                meta[NST_DISK_META_SIZE];
+    struct nst_disk_aio *aio;               /* io thread check or writes, NULL if none */
 } nst_disk_obj_t;
 
+/* shared by the master and the worker, a segment is opened by its user */
+typedef struct nst_disk_segment {
+    uint32_t            id;                 /* 0: unused slot */
+    uint8_t             sealed;             /* no longer appended to */
+    uint8_t             busy;               /* owned by a writer or the compactor */
+    uint64_t            size;               /* bytes written */
+    uint64_t            dead;               /* bytes of deleted or expired objects */
+    uint64_t            indexed;            /* bytes covered by the index on startup */
+} nst_disk_seg_t;
 
 typedef struct nst_disk {
     nst_shmem_t        *shmem;
     hpx_ist_t           root;               /* disk root directory */
+    int                 engine;
     int                 loaded;
     int                 idx;
     DIR                *dir;
     nst_dirent_t       *de;
     char               *file;
+    int                 loader;             /* load thread started */
+    int                 threads;            /* scan threads of the file engine */
+    int                 cleaner;            /* clean threads started */
+
+    struct {
+        nst_disk_seg_t *slot;
+        int             count;
+        int             init;               /* slots found on startup, to be loaded */
+        uint32_t        next;               /* next segment id */
+        uint64_t        size;               /* segment size to seal at */
+        int             compact;            /* slot being compacted, -1 if none */
+        int             fd;                 /* master read fd of the compacted segment */
+        uint64_t        pos;                /* load or compact position */
+
+#if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
+        pthread_mutex_t mutex;
+#else
+        unsigned int    waiters;
+#endif
+    } seg;
+
+    /* see root/index, saved by the master, loaded by the loader */
+    struct {
+        int             state;
+        char           *map;
+        uint64_t        len;
+        uint64_t        pos;
+        uint64_t        time;               /* start of the loaded snapshot */
+
+        int             saving;             /* 1 walking the dict, 2 syncing */
+        int             removed;
+        int             fd;
+        int             shard;
+        uint64_t        idx;
+        uint64_t        tsize;              /* table size of the shard being walked */
+        uint64_t        count;
+        uint32_t        nseg;
+        uint64_t        size;
+        uint64_t        start;
+        uint64_t        next;
+        XXH64_state_t   sum;
+    } index;
 } nst_disk_t;
 
+enum {
+    NST_DISK_AIO_READ,                      /* raw bytes, header and trailers */
+    NST_DISK_AIO_DATA,                      /* payload, into a DATA block of buf */
+    NST_DISK_AIO_WRITE,
+    NST_DISK_AIO_CHECK,                     /* open and read the head of an object */
+};
+
+/* returned while an io thread is still on it */
+#define NST_DISK_PENDING  -2
+
+/*
+ * A job of the io threads. Owned by the thread which created it, except while
+ * pending where the io thread works on buf and then wakes tl. The owner is an
+ * applet reading a disk hit, or the stream of a check or of writes.
+ */
+typedef struct nst_disk_aio {
+    struct nst_disk_aio  *next;
+    struct tasklet       *tl;
+    hpx_appctx_t         *appctx;           /* NULL once released */
+    hpx_task_t           *task;             /* NULL once released */
+    int                   op;
+    int                   fd;
+    int                   pending;
+    int                   ready;            /* done and not consumed yet */
+    int                   err;              /* a write failed */
+    uint64_t              offset;
+    int                   len;
+    int                   ret;              /* bytes done, -1 on error */
+    char                 *ptr;              /* into buf */
+    hpx_buffer_t          buf;              /* pool buffer, swapped with the channel's on reads */
+    hpx_buffer_t          stage;            /* writes appended while buf is written */
+    uint64_t              stage_offset;
+    uint64_t              hash;             /* key checked */
+    nst_disk_t           *disk;             /* set if the writes are aborted while pending */
+    nst_disk_obj_t        obj;              /* object checked, or aborted */
+} nst_disk_aio_t;
+
 
 /* /0/00: 5 */
 static inline int
@@ -124,6 +272,17 @@ nst_disk_path_file_len(hpx_ist_t root) {
     return root.len + 47;
 }
 
+static inline int
+nst_disk_segment_on(nst_disk_t *disk) {
+    return disk->engine == NST_DISK_ENGINE_SEGMENT;
+}
+
+/* /seg/0000002a */
+static inline void
+nst_disk_segment_path(nst_disk_t *disk, char *p, uint32_t id) {
+    sprintf(p, "%s/seg/%08"PRIx32, disk->root.ptr, id);
+}
+
 static inline int
 nst_disk_file_remove(const char *file) {
     return remove(file);
@@ -309,6 +468,21 @@ nst_disk_meta_get_inactive(char *p) {
     return *(int32_t *)(p + NST_DISK_META_POS_INACTIVE);
 }
 
+static inline void
+nst_disk_meta_set_record_len(char *p, uint64_t v) {
+    *(uint64_t *)(p + NST_DISK_META_POS_RECORD_LEN) = v;
+}
+
+static inline uint64_t
+nst_disk_meta_get_record_len(char *p) {
+    return *(uint64_t *)(p + NST_DISK_META_POS_RECORD_LEN);
+}
+
+static inline int
+nst_disk_meta_deleted(char *p) {
+    return p[NST_DISK_META_POS_FLAGS] & NST_DISK_FLAG_DELETED;
+}
+
 static inline int
 nst_disk_meta_check_expire(char *p) {
     uint64_t  expire = nst_disk_meta_get_expire(p);
@@ -404,9 +578,51 @@ nst_disk_pos_header(nst_disk_obj_t *obj) {
         + nst_disk_meta_get_last_modified_len(obj->meta);
 }
 
+/*
+ * The object is dead and can be removed: expired and not kept as stale
+ */
+static inline int
+nst_disk_meta_dead(char *p) {
+    int32_t  stale = nst_disk_meta_get_stale(p);
+
+    if(nst_disk_meta_check_expire(p) == NST_OK) {
+        return 0;
+    }
+
+    return stale <= 0 || nst_disk_meta_check_stale(p) != NST_OK;
+}
+
+int nst_disk_aio_init(int threads);
+int nst_disk_aio_on();
+nst_disk_aio_t *nst_disk_aio_create(hpx_task_t *task, int fd);
+void nst_disk_aio_attach(nst_disk_aio_t *aio, hpx_appctx_t *appctx, int fd);
+int nst_disk_aio_pread(nst_disk_aio_t *aio, uint64_t offset, int len, char **p);
+int nst_disk_aio_read(nst_disk_aio_t *aio, hpx_buffer_t *buf, uint64_t offset, uint64_t len);
+int nst_disk_aio_write(nst_disk_aio_t *aio, char *buf, int len, uint64_t offset);
+int nst_disk_aio_room(nst_disk_aio_t *aio);
+int nst_disk_aio_flush(nst_disk_aio_t *aio);
+int nst_disk_aio_close(nst_disk_aio_t *aio);
+int nst_disk_aio_abort(nst_disk_aio_t *aio, nst_disk_t *disk, nst_disk_obj_t *obj);
+int nst_disk_aio_check(nst_disk_aio_t *aio, char *file, uint64_t base, nst_key_t *key);
+int nst_disk_aio_checked(nst_disk_aio_t *aio, nst_disk_obj_t *obj, nst_key_t *key);
+void nst_disk_aio_release(nst_disk_aio_t *aio, int fd);
+
 static inline int
 nst_disk_write(nst_disk_obj_t *obj, char *buf, int len) {
-    ssize_t ret = pwrite(obj->fd, buf, len, obj->offset);
+    ssize_t  ret;
+
+    if(obj->aio) {
+
+        if(nst_disk_aio_write(obj->aio, buf, len, obj->offset) != NST_OK) {
+            return NST_ERR;
+        }
+
+        obj->offset += len;
+
+        return NST_OK;
+    }
+
+    ret = pwrite(obj->fd, buf, len, obj->offset);
 
     if(ret != len) {
         return NST_ERR;
@@ -419,60 +635,61 @@ nst_disk_write(nst_disk_obj_t *obj, char *buf, int len) {
 
 static inline int
 nst_disk_write_meta(nst_disk_obj_t *obj) {
-    obj->offset = 0;
+    obj->offset = obj->base;
 
     return nst_disk_write(obj, obj->meta, NST_DISK_META_SIZE);
 }
 
 static inline int
 nst_disk_write_key(nst_disk_obj_t *obj, nst_key_t *key) {
-    obj->offset = NST_DISK_POS_KEY;
+    obj->offset = obj->base + NST_DISK_POS_KEY;
 
     return nst_disk_write(obj, key->data, key->size);
 }
 
 static inline int
 nst_disk_write_proxy(nst_disk_obj_t *obj, hpx_ist_t proxy) {
-    obj->offset = nst_disk_pos_proxy(obj);
+    obj->offset = obj->base + nst_disk_pos_proxy(obj);
 
     return nst_disk_write(obj, proxy.ptr, proxy.len);
 }
 
 static inline int
 nst_disk_write_rule(nst_disk_obj_t *obj, hpx_ist_t rule) {
-    obj->offset = nst_disk_pos_rule(obj);
+    obj->offset = obj->base + nst_disk_pos_rule(obj);
 
     return nst_disk_write(obj, rule.ptr, rule.len);
 }
 
 static inline int
 nst_disk_write_host(nst_disk_obj_t *obj, hpx_ist_t host) {
-    obj->offset = nst_disk_pos_host(obj);
+    obj->offset = obj->base + nst_disk_pos_host(obj);
 
     return nst_disk_write(obj, host.ptr, host.len);
 }
 
 static inline int
 nst_disk_write_path(nst_disk_obj_t *obj, hpx_ist_t path) {
-    obj->offset = nst_disk_pos_path(obj);
+    obj->offset = obj->base + nst_disk_pos_path(obj);
 
     return nst_disk_write(obj, path.ptr, path.len);
 }
 
 static inline int
 nst_disk_write_etag(nst_disk_obj_t *obj, hpx_ist_t etag) {
-    obj->offset = nst_disk_pos_etag(obj);
+    obj->offset = obj->base + nst_disk_pos_etag(obj);
 
     return nst_disk_write(obj, etag.ptr, etag.len);
 }
 
 static inline int
 nst_disk_write_last_modified(nst_disk_obj_t *obj, hpx_ist_t lm) {
-    obj->offset = nst_disk_pos_last_modified(obj);
+    obj->offset = obj->base + nst_disk_pos_last_modified(obj);
 
     return nst_disk_write(obj, lm.ptr, lm.len);
 }
 
+int nst_disk_read_meta(nst_disk_obj_t *obj);
 int nst_disk_read_key(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key);
 int nst_disk_read_proxy(nst_disk_obj_t *obj, hpx_ist_t proxy);
 int nst_disk_read_rule(nst_disk_obj_t *obj, hpx_ist_t rule);
@@ -480,31 +697,32 @@ int nst_disk_read_host(nst_disk_obj_t *obj, hpx_ist_t host);
 int nst_disk_read_path(nst_disk_obj_t *obj, hpx_ist_t path);
 int nst_disk_read_etag(nst_disk_obj_t *obj, hpx_ist_t etag);
 int nst_disk_read_last_modified(nst_disk_obj_t *obj, hpx_ist_t last_modified);
+int nst_disk_read_data(int fd, hpx_htx_t *htx, uint64_t offset, uint32_t len);
 
-int nst_disk_init(nst_disk_t *disk, hpx_ist_t root, nst_shmem_t *shmem, int clean_temp, void *data);
+int nst_disk_init(nst_disk_t *disk, hpx_ist_t root, nst_shmem_t *shmem, int clean_temp, int engine,
+        uint64_t segment_size, int threads, void *data);
+void nst_disk_load_start(nst_disk_t *disk, void *data);
 void nst_disk_load(nst_core_t *core);
 void nst_disk_cleanup(nst_core_t *core);
+void nst_disk_index_save(nst_core_t *core, uint64_t interval);
 int nst_disk_purge_by_key(nst_disk_obj_t *disk, nst_key_t *key, hpx_ist_t root);
-int nst_disk_purge_by_path(char *path);
-void nst_disk_update_expire(char *file, uint64_t expire);
+int nst_disk_purge_by_path(nst_disk_t *disk, char *path, uint64_t offset);
+void nst_disk_update_expire(char *file, uint64_t offset, uint64_t expire);
 
 int nst_disk_obj_create(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key,
-        nst_http_txn_t *txn, nst_rule_prop_t *prop);
+        nst_http_txn_t *txn, nst_rule_prop_t *prop, hpx_task_t *task);
+
+int
+nst_disk_obj_finish(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, nst_http_txn_t *txn,
+        uint64_t expire);
+
+void nst_disk_obj_abort(nst_disk_t *disk, nst_disk_obj_t *obj);
 
 static inline int
 nst_disk_obj_append(nst_disk_t *disk, nst_disk_obj_t *obj, char *buf, int len) {
 
     if(nst_disk_write(obj, buf, len) != NST_OK) {
-        if(obj->fd != -1) {
-            close(obj->fd);
-            obj->fd = -1;
-        }
-
-        if(obj->file) {
-            remove(obj->file);
-            nst_shmem_free(disk->shmem, obj->file);
-            obj->file = NULL;
-        }
+        nst_disk_obj_abort(disk, obj);
 
         return NST_ERR;
     }
@@ -512,29 +730,37 @@ nst_disk_obj_append(nst_disk_t *disk, nst_disk_obj_t *obj, char *buf, int len) {
     return NST_OK;
 }
 
-int
-nst_disk_obj_finish(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, nst_http_txn_t *txn,
-        uint64_t expire);
+/*
+ * How many bytes can be appended to obj before the io threads catch up
+ */
+static inline int
+nst_disk_obj_room(nst_disk_obj_t *obj) {
+    return obj->aio ? nst_disk_aio_room(obj->aio) : INT_MAX;
+}
 
-static inline void
-nst_disk_obj_abort(nst_disk_t *disk, nst_disk_obj_t *obj) {
-    if(obj->fd != -1) {
-        close(obj->fd);
-        obj->fd = -1;
-    }
+/*
+ * Whether all the bytes appended to obj are written, the ones still staged
+ * are handed to an io thread otherwise
+ */
+static inline int
+nst_disk_obj_flushed(nst_disk_obj_t *obj) {
+    return !obj->aio || nst_disk_aio_flush(obj->aio);
+}
 
-    if(obj->file) {
-        remove(obj->file);
-        nst_shmem_free(disk->shmem, obj->file);
-        obj->file = NULL;
-    }
+/*
+ * Whether an io thread is checking obj, see nst_disk_obj_valid
+ */
+static inline int
+nst_disk_obj_checking(nst_disk_obj_t *obj) {
+    return obj->aio && obj->aio->pending;
 }
 
-int nst_disk_obj_valid(nst_disk_obj_t *disk, nst_key_t *key);
-int nst_disk_obj_exists(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key);
+int nst_disk_obj_valid(nst_disk_obj_t *obj, nst_key_t *key, hpx_task_t *task);
+int nst_disk_obj_exists(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, hpx_task_t *task);
 
 #ifdef USE_THREAD
 void *nst_disk_load_thread(void *core);
 #endif
 
+
 #endif /* _NUSTER_DISK_H */
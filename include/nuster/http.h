@@ -39,6 +39,12 @@ enum {
     NST_HTTP_SIZE
 };
 
+/* the validators of a response which come from the origin */
+enum {
+    NST_HTTP_VALIDATOR_ETAG          = 0x01,
+    NST_HTTP_VALIDATOR_LAST_MODIFIED = 0x02,
+};
+
 typedef struct nst_http_code {
     int                 status;
     hpx_ist_t           code;
@@ -55,6 +61,7 @@ typedef struct nst_http_req {
     hpx_ist_t           query;
     hpx_ist_t           cookie;
     hpx_ist_t           content_type;
+    int                 gzip;               /* a gzip encoded response can be sent */
 } nst_http_req_t;
 
 typedef struct nst_http_res {
@@ -63,6 +70,10 @@ typedef struct nst_http_res {
     int                 ttl;
     hpx_ist_t           etag;
     hpx_ist_t           last_modified;
+    int                 validators;         /* NST_HTTP_VALIDATOR_* */
+    hpx_ist_t           vary;               /* lowercase names separated by ',' */
+    hpx_ist_t           tags;               /* separated by ' ', see tag-header */
+    int                 tag_cnt;
 } nst_http_res_t;
 
 typedef struct nst_http_txn {
@@ -72,8 +83,10 @@ typedef struct nst_http_txn {
 
 int nst_http_parse_htx(hpx_stream_t *s, hpx_buffer_t *buf, nst_http_txn_t *txn);
 
-int nst_http_find_param(char *query_beg, char *query_end, char *name, char **val, int *val_len);
+int nst_http_find_param(char *query_beg, char *query_end, hpx_ist_t name, char **val, int *val_len);
 int nst_http_memory_item_to_htx(nst_memory_item_t *item, hpx_htx_t *htx);
+uint32_t nst_http_memory_data_to_htx(nst_memory_item_t *item, uint32_t offset, uint32_t len,
+        hpx_htx_t *htx);
 
 void nst_http_reply(hpx_stream_t *s, int idx);
 int nst_http_reply_100(hpx_stream_t *s);
@@ -88,6 +101,23 @@ void nst_http_build_last_modified(hpx_stream_t *s, hpx_buffer_t *buf, nst_http_t
         int last_modified_prop);
 
 int nst_http_parse_ttl(hpx_htx_t *htx, hpx_buffer_t *buf, nst_http_txn_t *txn);
+int nst_http_parse_vary(hpx_htx_t *htx, hpx_buffer_t *buf, nst_http_txn_t *txn);
+int nst_http_parse_tags(hpx_htx_t *htx, hpx_buffer_t *buf, nst_http_txn_t *txn, hpx_ist_t name);
+
+int nst_http_save_headers(hpx_htx_t *htx, hpx_buffer_t *buf);
+int nst_http_vary_suffix(hpx_htx_t *htx, hpx_ist_t vary, hpx_buffer_t *buf, hpx_ist_t *suffix);
+
+int nst_http_parse_range(hpx_htx_t *htx, nst_http_txn_t *txn, uint64_t total, uint64_t *beg,
+        uint64_t *len);
+int nst_http_range_allowed(hpx_htx_t *htx);
+int nst_http_range_headers(hpx_htx_t *htx, uint64_t beg, uint64_t len, uint64_t total);
+void nst_http_remove_range(hpx_htx_t *htx);
+
+int nst_http_vary_add(hpx_htx_t *htx, hpx_ist_t name);
+int nst_http_gzip_vary(hpx_htx_t *htx);
+int nst_http_gzip_headers(hpx_htx_t *htx, hpx_htx_t *dst);
+int nst_http_refresh_request(hpx_htx_t *htx, hpx_htx_t *dst, nst_http_txn_t *txn);
+int nst_http_warm_request(hpx_htx_t *htx, hpx_ist_t host, hpx_ist_t uri);
 
 
 #endif /* _NUSTER_HTTP_H */
@@ -68,15 +68,6 @@ nst_key_reset_flag(nst_key_t *key) {
     key->flags = 0;
 }
 
-static inline hpx_buffer_t *
-nst_key_init() {
-    hpx_buffer_t  *key = get_trash_chunk();
-
-    memset(key->area, 0, key->size);
-
-    return key;
-}
-
 static inline int
 nst_key_cat(hpx_buffer_t *key, const char *ptr, int len) {
 
@@ -98,7 +89,8 @@ nst_key_catist(hpx_buffer_t *key, hpx_ist_t v) {
     }
 
     memcpy(key->area + key->data, v.ptr, v.len);
-    key->data += v.len + 1;
+    key->data += v.len;
+    key->area[key->data++] = 0;
 
     return NST_OK;
 }
@@ -110,7 +102,7 @@ nst_key_catdel(hpx_buffer_t *key) {
         return NST_ERR;
     }
 
-    key->data += 1;
+    key->area[key->data++] = 0;
 
     return NST_OK;
 }
@@ -128,10 +120,11 @@ nst_key_uuid_stringify(nst_key_t *key, char *str){
 }
 
 void nst_key_hash(nst_key_t *key);
+int nst_key_build_variant(nst_key_t *key, hpx_ist_t suffix, nst_key_t *variant);
 
 void nst_key_debug(hpx_stream_t *s, nst_key_t *key);
 
 int nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_txn_t *txn,
-        nst_key_t *key, hpx_http_meth_t method);
+        nst_key_t *key, hpx_http_meth_t method, hpx_buffer_t *buf);
 
 #endif /* _NUSTER_KEY_H */
@@ -28,6 +28,12 @@
 #define NST_MANAGER_DEFAULT_PURGE_METHOD        "PURGE"
 #define NST_MANAGER_DEFAULT_URI                 "/nuster"
 
+/* time to first byte slots: <1ms, <2ms, <4ms ... <1024ms, >=1024ms */
+#define NST_STATS_TTFB_SLOTS                    12
+
+/* the per thread counters are kept on cache lines of their own */
+#define NST_STATS_ALIGN                         64
+
 enum {
     NST_MANAGER_ALL           = 0,
     NST_MANAGER_PROXY,
@@ -37,16 +43,23 @@ enum {
     NST_MANAGER_HOST,
     NST_MANAGER_PATH_HOST,
     NST_MANAGER_REGEX_HOST,
+    NST_MANAGER_TAG,
 };
 
 enum {
     NST_STATS_HEADER,
     NST_STATS_PAYLOAD,
     NST_STATS_PROXY,
+    NST_STATS_METRICS_HEADER,
+    NST_STATS_METRICS,
     NST_STATS_DONE,
 };
 
-typedef struct nst_stats {
+/*
+ * The counters of one thread, on cache lines of their own so that threads
+ * update them with plain increments and without a lock
+ */
+typedef struct nst_stats_counters {
     struct {
         uint64_t                total;
         uint64_t                fetch;
@@ -63,12 +76,46 @@ typedef struct nst_stats {
         uint64_t                delete;
         uint64_t                abort;
     } nosql;
+} ALIGNED(NST_STATS_ALIGN) nst_stats_counters_t;
+
+/*
+ * The cache counters of one rule in one thread, like nst_stats_counters
+ */
+typedef struct nst_stats_rule {
+    uint64_t                    hit_memory;
+    uint64_t                    hit_disk;
+    uint64_t                    miss;
+    uint64_t                    fetch;
+    uint64_t                    bypass;
+    uint64_t                    abort;
+    uint64_t                    bytes;          /* served by hits */
+    uint64_t                    stored;         /* stored by fetches */
 
-#if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
-    pthread_mutex_t             mutex;
-#else
-    unsigned int                waiters;
-#endif
+    uint64_t                    ttfb_hit[NST_STATS_TTFB_SLOTS];
+    uint64_t                    ttfb_miss[NST_STATS_TTFB_SLOTS];
+    uint64_t                    ttfb_hit_sum;   /* in ms */
+    uint64_t                    ttfb_miss_sum;
+} ALIGNED(NST_STATS_ALIGN) nst_stats_rule_t;
+
+/*
+ * The dict entries of one rule, changed by the master and the workers under
+ * different shard locks, hence atomically
+ */
+typedef struct nst_stats_entries {
+    int64_t                     entries;
+    uint64_t                    evicted;
+} nst_stats_entries_t;
+
+/*
+ * One nst_stats_counters per thread of each process, summed when the stats
+ * are rendered, same for the nst_stats_rule of each rule, rule[thread][uuid]
+ */
+typedef struct nst_stats {
+    int                         threads;
+    int                         rules;
+    nst_stats_counters_t       *counters;
+    nst_stats_rule_t           *rule;
+    nst_stats_entries_t        *entries;
 } nst_stats_t;
 
 
@@ -77,10 +124,13 @@ int nst_manager(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px);
 void nst_manager_init();
 
 /* stats */
+uint64_t nst_stats_size(int rules);
 int nst_stats_init();
 int nst_stats_applet(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px);
 void nst_stats_update_cache(int state, uint64_t bytes);
 void nst_stats_update_nosql(hpx_http_meth_t meth);
+void nst_stats_update_rule(int uuid, int state, uint64_t bytes, long ttfb);
+void nst_stats_update_entries(int uuid, int entries, int evicted);
 
 /* purger */
 void nst_purger_init();
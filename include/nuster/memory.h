@@ -22,8 +22,15 @@
 #ifndef _NUSTER_MEMORY_H
 #define _NUSTER_MEMORY_H
 
+#include <haproxy/htx-t.h>
+
 #include <nuster/common.h>
 
+/* capacity of the items coalescing the payload */
+#define NST_MEMORY_ITEM_SIZE            (256 * 1024)
+
+#define NST_MEMORY_READERS              64      /* lists of waiting readers */
+#define NST_MEMORY_WAIT_POLL            10      /* ms, see nst_memory_obj_wait */
 
 /*
  * A nst_memory_object contains a complete http response data
@@ -33,6 +40,7 @@ typedef struct nst_memory_item {
     struct nst_memory_item      *next;
 
     uint32_t                     info;
+    uint32_t                     size;
     char                         data[0];
 } nst_memory_item_t;
 
@@ -42,11 +50,15 @@ typedef struct nst_memory_object {
     int                          clients;
     int                          invalid;
 
+    /* set once all items are appended, the object can be read before */
+    int                          complete;
+
     nst_memory_item_t           *item;
 } nst_memory_obj_t;
 
 typedef struct nst_memory {
     nst_shmem_t                 *shmem;
+    nst_core_t                  *core;
 
     nst_memory_obj_t            *head;
     nst_memory_obj_t            *tail;
@@ -62,8 +74,9 @@ typedef struct nst_memory {
 } nst_memory_t;
 
 
-int nst_memory_init(nst_memory_t *mem, nst_shmem_t *shmem);
+int nst_memory_init(nst_memory_t *mem, nst_shmem_t *shmem, nst_core_t *core);
 void nst_memory_cleanup(nst_memory_t *mem);
+
 static inline void
 nst_memory_incr_invalid(nst_memory_t *mem) {
     nst_shctx_lock(mem);
@@ -72,31 +85,31 @@ nst_memory_incr_invalid(nst_memory_t *mem) {
 }
 
 
-static inline nst_memory_item_t *
-nst_memory_alloc_item(nst_memory_t *mem, uint32_t size) {
-    return nst_shmem_alloc(mem->shmem, sizeof(nst_memory_item_t) + size);
-}
+nst_memory_item_t *nst_memory_alloc_item(nst_memory_t *mem, uint32_t size);
 
 nst_memory_obj_t *nst_memory_obj_create(nst_memory_t *mem);
+void nst_memory_obj_release(nst_memory_t *mem, nst_memory_obj_t *obj);
 
 int nst_memory_obj_append(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_t **tail,
         const char *buf, uint32_t len, uint32_t info);
+int nst_memory_obj_append_data(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_t **tail,
+        const char *buf, uint32_t len);
 
-static inline int
-nst_memory_obj_finish(nst_memory_t *mem, nst_memory_obj_t *obj) {
-    obj->invalid = 0;
+int nst_memory_obj_finish(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_t *tail);
+void nst_memory_obj_abort(nst_memory_t *mem, nst_memory_obj_t *obj);
 
-    return NST_OK;
-}
+int nst_memory_obj_wait(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_t *item,
+        uint32_t offset, uint32_t *len, nst_memory_item_t **next, hpx_appctx_t *appctx);
+void nst_memory_obj_unwait(nst_memory_t *mem, hpx_appctx_t *appctx);
 
-static inline void
-nst_memory_obj_abort(nst_memory_t *mem, nst_memory_obj_t *obj) {
-
-    if(obj) {
-        obj->invalid = 1;
-    }
+static inline uint32_t
+nst_memory_item_len(nst_memory_item_t *item) {
+    uint32_t  info = item->info;
+    uint32_t  type = info >> 28;
 
-    nst_memory_incr_invalid(mem);
+    return (type == HTX_BLK_HDR || type == HTX_BLK_TLR)
+        ? (info & 0xff) + ((info >> 8) & 0xfffff)
+        : info & 0xfffffff;
 }
 
 static inline int
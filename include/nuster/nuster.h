@@ -45,12 +45,18 @@ typedef struct nuster {
 
     struct {
         hpx_applet_t            cache;
+        hpx_applet_t            refresh;
+        hpx_applet_t            warmer;
         hpx_applet_t            nosql;
         hpx_applet_t            purger;
         hpx_applet_t            stats;
     } applet;
 
     nst_proxy_t               **proxy;
+    int                         rule_cnt;
+
+    /* the compressor of rule.gzip */
+    struct comp_algo           *gzip;
 } nuster_t;
 
 extern nuster_t nuster;
@@ -75,5 +81,6 @@ nuster_check_applet(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
 }
 
 void nuster_handle_chroot();
+int nuster_housekeeping_expire(int next);
 
 #endif /* _NUSTER_H */
@@ -32,6 +32,8 @@
 #define NST_SHMEM_BLOCK_MAX_SIZE      1024 * 1024 * 2
 #define NST_SHMEM_BLOCK_MAX_SHIFT     21
 #define NST_SHMEM_INFO_BITMAP_BITS    32
+#define NST_SHMEM_TYPE_EXTENT         0xFF
+#define NST_SHMEM_TYPE_EXTENT_BODY    0xFE
 
 
 /* start                                 alignment                   stop
@@ -45,9 +47,13 @@
 
 /*
  * info:
- * | bitmap: 32 | reserved: 16 | 5 | full: 1 | bitmap: 1 | inited: 1 | type: 8 |
+ * | bitmap: 32 | reserved: 16 | 4 | empty: 1 | full: 1 | bitmap: 1 | inited: 1 | type: 8 |
  * bitmap: points to bitmap area, doesn't change once set
  * chunk size[n]: 1<<(NST_SHMEM_CHUNK_MIN_SHIFT + n)
+ *
+ * Allocations larger than block_size take an extent of contiguous blocks,
+ * the first one is NST_SHMEM_TYPE_EXTENT with the number of blocks in place
+ * of the bitmap, the others are NST_SHMEM_TYPE_EXTENT_BODY.
  */
 typedef struct nst_shmem_ctrl {
     uint64_t                     info;
@@ -85,6 +91,13 @@ typedef struct nst_shmem {
     nst_shmem_ctrl_t            *empty;
     nst_shmem_ctrl_t            *full;
 
+    /* a bit per block, set if the block is empty or unused, see extents */
+    uint64_t                    *freemap;
+    int                          free_blocks;
+
+    /* no extent of as many blocks was found since the last block freed */
+    int                          extent_fail;
+
     struct {
         uint8_t                 *begin;
         uint8_t                 *free;
@@ -133,10 +146,21 @@ _nst_shmem_block_clear_full(nst_shmem_ctrl_t *block) {
     bit_clear(block->info, 11);
 }
 
+static inline void
+_nst_shmem_block_set_empty(nst_shmem_ctrl_t *block) {
+    bit_set(block->info, 12);
+}
+
+static inline int
+_nst_shmem_block_is_empty(nst_shmem_ctrl_t *block) {
+    return bit_used(block->info, 12);
+}
+
 nst_shmem_t *
 nst_shmem_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk_size);
 
 void *nst_shmem_alloc(nst_shmem_t *shmem, int size);
 void nst_shmem_free(nst_shmem_t *shmem, void *p);
+void nst_shmem_shrink(nst_shmem_t *shmem, void *p, int size);
 
 #endif /* _NUSTER_SHMEM_H */
@@ -34,13 +34,15 @@ typedef struct nst_store {
 
 
 static inline int
-nst_store_init(nst_store_t *store, hpx_ist_t root, nst_shmem_t *shmem, int clean_temp, void *data) {
+nst_store_init(nst_store_t *store, hpx_ist_t root, nst_shmem_t *shmem, int clean_temp, int engine,
+        uint64_t segment_size, int threads, void *data) {
 
-    if(nst_memory_init(&store->memory, shmem) != NST_OK) {
+    if(nst_memory_init(&store->memory, shmem, data) != NST_OK) {
         return NST_ERR;
     }
 
-    if(nst_disk_init(&store->disk, root, shmem, clean_temp, data) != NST_OK) {
+    if(nst_disk_init(&store->disk, root, shmem, clean_temp, engine, segment_size, threads,
+                data) != NST_OK) {
         return NST_ERR;
     }
 
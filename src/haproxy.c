@@ -197,10 +197,18 @@ struct global global = {
 			.disk_saver        = NST_DEFAULT_DISK_SAVER,
 			.clean_temp        = NST_STATUS_OFF,
 			.always_check_disk = NST_STATUS_OFF,
+			.purge_index       = NST_STATUS_OFF,
+			.disk_engine       = NST_DISK_ENGINE_FILE,
+			.disk_segment_size = NST_DEFAULT_DISK_SEGMENT_SIZE,
+			.disk_scan_threads = NST_DEFAULT_DISK_SCAN_THREADS,
 			.root              = {
 				.ptr       = NULL,
 				.len       = 0,
 			},
+			.tag_header        = {
+				.ptr       = NULL,
+				.len       = 0,
+			},
 		},
 		.nosql = {
 			.status            = NST_STATUS_UNDEFINED,
@@ -213,6 +221,10 @@ struct global global = {
 			.disk_saver        = NST_DEFAULT_DISK_SAVER,
 			.clean_temp        = NST_STATUS_OFF,
 			.always_check_disk = NST_STATUS_OFF,
+			.purge_index       = NST_STATUS_OFF,
+			.disk_engine       = NST_DISK_ENGINE_FILE,
+			.disk_segment_size = NST_DEFAULT_DISK_SEGMENT_SIZE,
+			.disk_scan_threads = NST_DEFAULT_DISK_SCAN_THREADS,
 			.root              = {
 				.ptr       = NULL,
 				.len       = 0,
@@ -2943,6 +2955,7 @@ void run_poll_loop()
 
 		/* If we have to sleep, measure how long */
 		next = wake ? TICK_ETERNITY : next_timer_expiry();
+		next = nuster_housekeeping_expire(next);
 
 		/* The poller will ensure it returns around <next> */
 		cur_poller.poll(&cur_poller, next, wake);
@@ -11,6 +11,11 @@
  */
 
 #include <haproxy/stream_interface.h>
+#include <haproxy/compression.h>
+#include <haproxy/listener-t.h>
+#include <haproxy/session.h>
+#include <haproxy/stream.h>
+#include <haproxy/proxy.h>
 
 #include <nuster/nuster.h>
 
@@ -20,7 +25,15 @@ _nst_cache_memory_handler(hpx_appctx_t *appctx) {
     hpx_stream_interface_t  *si    = appctx->owner;
     hpx_channel_t           *req   = si_oc(si);
     hpx_channel_t           *res   = si_ic(si);
-    nst_memory_item_t       *item  = NULL;
+    nst_memory_t            *mem   = &nuster.cache->store.memory;
+    nst_memory_obj_t        *obj   = appctx->ctx.nuster.store.memory.obj;
+    nst_memory_item_t       *item  = appctx->ctx.nuster.store.memory.item;
+    nst_memory_item_t       *next;
+    unsigned int             off   = appctx->ctx.nuster.store.memory.offset;
+    uint64_t                 skip  = appctx->ctx.nuster.store.memory.range.beg;
+    uint64_t                 left  = appctx->ctx.nuster.store.memory.range.len;
+    uint64_t                 range = appctx->ctx.nuster.store.memory.range.total;
+    uint32_t                 len, end, max, n;
     int                      total = 0;
 
     res_htx = htxbuf(&res->buf);
@@ -37,26 +50,121 @@ _nst_cache_memory_handler(hpx_appctx_t *appctx) {
         goto out;
     }
 
+    if(appctx->st1 == NST_DISK_APPLET_ERROR) {
+        goto out;
+    }
+
     if(res->flags & (CF_SHUTW|CF_SHUTR|CF_SHUTW_NOW)) {
-        appctx->ctx.nuster.store.memory.item = NULL;
+        item = NULL;
     }
 
-    if(appctx->ctx.nuster.store.memory.item) {
-        item = appctx->ctx.nuster.store.memory.item;
+    while(item) {
 
-        while(item) {
+        /* items of an object being filled are read under the lock */
+        if(obj->complete) {
+            len  = nst_memory_item_len(item);
+            next = item->next;
+        } else if(nst_memory_obj_wait(mem, obj, item, off, &len, &next, appctx)) {
+            si_rx_endp_done(si);
 
-            if(nst_http_memory_item_to_htx(item, res_htx) != NST_OK) {
-                si_rx_room_blk(si);
+            goto out;
+        }
+
+        if(off < len) {
+
+            if((item->info >> 28) == HTX_BLK_DATA) {
+                end = len;
+
+                if(range) {
+                    /* skip the payload before the range, stop at its end */
+                    n     = len - off < skip ? len - off : skip;
+                    off  += n;
+                    skip -= n;
+                    end   = len - off < left ? len : off + left;
+                }
+
+                /* copy as much payload as possible, possibly part of the item */
+                max  = channel_htx_recv_max(res, res_htx);
+                n    = off < end
+                    ? nst_http_memory_data_to_htx(item, off, end - off < max ? end - off : max,
+                            res_htx)
+                    : 0;
+                off += n;
+
+                if(range) {
+                    left -= n;
+                }
+
+                if(off < end) {
+                    si_rx_room_blk(si);
+
+                    goto out;
+                }
+
+                if(range && !left) {
+                    item = NULL;
+
+                    break;
+                }
+            } else {
+
+                if(nst_http_memory_item_to_htx(item, res_htx) != NST_OK) {
+                    si_rx_room_blk(si);
+
+                    goto out;
+                }
+
+                off = len;
+
+                if(range && (item->info >> 28) == HTX_BLK_EOH) {
+
+                    if(!nst_http_range_allowed(res_htx)) {
+                        skip  = 0;
+                        left  = 0;
+                        range = 0;
+
+                        appctx->ctx.nuster.store.memory.range.total = 0;
+                    } else if(nst_http_range_headers(res_htx, skip, left, range) != NST_OK) {
+                        appctx->st1 = NST_DISK_APPLET_ERROR;
+
+                        si_shutr(si);
+                        res->flags |= CF_READ_NULL;
+
+                        goto out;
+                    }
+                }
+            }
+        }
+
+        if(next) {
+            item = next;
+            off  = 0;
+
+            continue;
+        }
+
+        if(!obj->complete) {
+
+            if(obj->invalid) {
+                /* the fill is aborted, truncate the response */
+                appctx->st1 = NST_DISK_APPLET_ERROR;
+
+                si_shutr(si);
+                res->flags |= CF_READ_NULL;
 
                 goto out;
             }
 
-            item = item->next;
+            continue;
+        }
 
+        /* the object is complete, check the final length */
+        if(off >= nst_memory_item_len(item)) {
+            item = NULL;
         }
+    }
 
-    } else {
+    if(!item) {
 
         if(!htx_add_endof(res_htx, HTX_BLK_EOM)) {
             si_rx_room_blk(si);
@@ -78,7 +186,10 @@ _nst_cache_memory_handler(hpx_appctx_t *appctx) {
     }
 
 out:
-    appctx->ctx.nuster.store.memory.item = item;
+    appctx->ctx.nuster.store.memory.item      = item;
+    appctx->ctx.nuster.store.memory.offset    = off;
+    appctx->ctx.nuster.store.memory.range.beg = skip;
+    appctx->ctx.nuster.store.memory.range.len = left;
     total = res_htx->data - total;
 
     if(total) {
@@ -103,12 +214,14 @@ _nst_cache_disk_handler(hpx_appctx_t *appctx) {
     char                    *p, *ptr;
     uint64_t                 offset, payload_len;
     uint32_t                 blksz, sz, info;
+    nst_disk_aio_t          *aio;
     int                      total, ret, max, fd, header_len;
 
     header_len  = appctx->ctx.nuster.store.disk.header_len;
     payload_len = appctx->ctx.nuster.store.disk.payload_len;
     offset      = appctx->ctx.nuster.store.disk.offset;
     fd          = appctx->ctx.nuster.store.disk.fd;
+    aio         = appctx->ctx.nuster.store.disk.aio;
     res_htx     = htxbuf(&res->buf);
     total       = res_htx->data;
 
@@ -130,10 +243,19 @@ _nst_cache_disk_handler(hpx_appctx_t *appctx) {
 
     switch(appctx->st1) {
         case NST_DISK_APPLET_HEADER:
-            buf = get_trash_chunk();
-            p   = buf->area;
 
-            ret = pread(fd, p, header_len, offset);
+            if(aio) {
+                ret = nst_disk_aio_pread(aio, offset, header_len, &p);
+
+                if(ret == NST_DISK_PENDING) {
+                    goto out;
+                }
+            } else {
+                buf = get_trash_chunk();
+                p   = buf->area;
+
+                ret = pread(fd, p, header_len, offset);
+            }
 
             if(ret != header_len) {
                 appctx->st1 = NST_DISK_APPLET_ERROR;
@@ -167,52 +289,67 @@ _nst_cache_disk_handler(hpx_appctx_t *appctx) {
             appctx->st1 = NST_DISK_APPLET_PAYLOAD;
             offset += ret;
 
+            if(appctx->ctx.nuster.store.disk.range.total) {
+
+                if(!nst_http_range_allowed(res_htx)) {
+                    payload_len = appctx->ctx.nuster.store.disk.range.total;
+
+                    appctx->ctx.nuster.store.disk.payload_len = payload_len;
+                    appctx->ctx.nuster.store.disk.range.total = 0;
+                } else if(nst_http_range_headers(res_htx, appctx->ctx.nuster.store.disk.range.beg,
+                            appctx->ctx.nuster.store.disk.range.len,
+                            appctx->ctx.nuster.store.disk.range.total) != NST_OK) {
+
+                    appctx->st1 = NST_DISK_APPLET_ERROR;
+
+                    break;
+                } else {
+                    /* payload_len is the length of the range */
+                    offset += appctx->ctx.nuster.store.disk.range.beg;
+                }
+            }
+
             appctx->ctx.nuster.store.disk.offset = offset;
 
             /* fall through */
         case NST_DISK_APPLET_PAYLOAD:
-            buf = get_trash_chunk();
-            p   = buf->area;
-            max = htx_get_max_blksz(res_htx, channel_htx_recv_max(res, res_htx));
-
-            if(max <= 0) {
-                goto out;
-            }
 
             if(appctx->ctx.nuster.store.disk.payload_len == 0) {
                 appctx->st1 = NST_DISK_APPLET_EOP;
             } else {
 
-                if(max < payload_len) {
-                    ret = pread(fd, p, max, offset);
-                } else {
-                    ret = pread(fd, p, payload_len, offset);
-                }
+                if(aio) {
+                    /* swaps res->buf with the buffer read into */
+                    ret = nst_disk_aio_read(aio, &res->buf, offset, payload_len);
 
-                if(ret <= 0) {
-                    appctx->st1 = NST_DISK_APPLET_ERROR;
+                    if(ret == 0) {
+                        si_rx_room_blk(si);
 
-                    break;
-                }
+                        goto out;
+                    }
 
-                appctx->ctx.nuster.store.disk.payload_len -= ret;
+                    res_htx = htxbuf(&res->buf);
+                } else {
+                    max = htx_get_max_blksz(res_htx, channel_htx_recv_max(res, res_htx));
 
-                type  = HTX_BLK_DATA;
-                info  = (type << 28) + ret;
-                blksz = info & 0xfffffff;
-                blk   = htx_add_blk(res_htx, type, blksz);
+                    if(max <= 0) {
+                        goto out;
+                    }
 
-                if(!blk) {
+                    if(max > payload_len) {
+                        max = payload_len;
+                    }
+
+                    ret = nst_disk_read_data(fd, res_htx, offset, max);
+                }
+
+                if(ret <= 0) {
                     appctx->st1 = NST_DISK_APPLET_ERROR;
 
                     break;
                 }
 
-                blk->info = info;
-
-                ptr = htx_get_blk_ptr(res_htx, blk);
-                sz  = htx_get_blksz(blk);
-                memcpy(ptr, p, sz);
+                appctx->ctx.nuster.store.disk.payload_len -= ret;
 
                 offset += ret;
                 appctx->ctx.nuster.store.disk.offset = offset;
@@ -228,11 +365,37 @@ _nst_cache_disk_handler(hpx_appctx_t *appctx) {
 
             /* fall through */
         case NST_DISK_APPLET_EOP:
-            buf = get_trash_chunk();
-            p   = buf->area;
+            /* no trailers after a range */
+            if(appctx->ctx.nuster.store.disk.range.total) {
+                appctx->st1 = NST_DISK_APPLET_END;
+
+                close(fd);
+
+                appctx->ctx.nuster.store.disk.fd = -1;
+
+                goto end;
+            }
+
             max = htx_get_max_blksz(res_htx, channel_htx_recv_max(res, res_htx));
 
-            ret = pread(fd, p, max, offset);
+            if(max <= 0) {
+                si_rx_room_blk(si);
+
+                goto out;
+            }
+
+            if(aio) {
+                ret = nst_disk_aio_pread(aio, offset, max, &p);
+
+                if(ret == NST_DISK_PENDING) {
+                    goto out;
+                }
+            } else {
+                buf = get_trash_chunk();
+                p   = buf->area;
+
+                ret = pread(fd, p, max, offset);
+            }
 
             if(ret < 0) {
                 appctx->st1 = NST_DISK_APPLET_ERROR;
@@ -277,8 +440,11 @@ _nst_cache_disk_handler(hpx_appctx_t *appctx) {
 
             close(fd);
 
+            appctx->ctx.nuster.store.disk.fd = -1;
+
             /* fall through */
         case NST_DISK_APPLET_END:
+end:
 
             if(!htx_add_endof(res_htx, HTX_BLK_EOM)) {
                 si_rx_room_blk(si);
@@ -306,7 +472,6 @@ _nst_cache_disk_handler(hpx_appctx_t *appctx) {
         case NST_DISK_APPLET_ERROR:
             si_shutr(si);
             res->flags |= CF_READ_NULL;
-            close(fd);
 
             return;
     }
@@ -324,6 +489,24 @@ out:
 /*
  * The cache applet acts like the backend to send cached http data
  */
+static void
+nst_cache_release_handler(hpx_appctx_t *appctx) {
+
+    if(appctx->st0 == NST_CTX_STATE_HIT_MEMORY) {
+        nst_memory_obj_unwait(&nuster.cache->store.memory, appctx);
+    }
+
+    if(appctx->st0 == NST_CTX_STATE_HIT_DISK) {
+        int  fd = appctx->ctx.nuster.store.disk.fd;
+
+        if(appctx->ctx.nuster.store.disk.aio) {
+            nst_disk_aio_release(appctx->ctx.nuster.store.disk.aio, fd);
+        } else if(fd != -1) {
+            close(fd);
+        }
+    }
+}
+
 static void
 nst_cache_handler(hpx_appctx_t *appctx) {
 
@@ -334,6 +517,325 @@ nst_cache_handler(hpx_appctx_t *appctx) {
     }
 }
 
+/*
+ * Process local, the streams of this process waiting for an INIT entry, one
+ * list per dict shard protected by the shard lock. The entry itself lives in
+ * shared memory and holds no pointer to them.
+ */
+static hpx_list_t  nst_cache_waiters[NST_DICT_SHARDS];
+
+/*
+ * The background refresh and warmer streams are not accepted by a listener
+ * but the http analysers need one, they come from this internal frontend.
+ * The second listener is flagged ssl so that a warmed https url gets the
+ * key of an https request.
+ */
+static struct {
+    hpx_proxy_t         fe;
+    struct listener     li[2];
+    struct bind_conf    bind[2];
+} nst_cache_refresher;
+
+static void
+_nst_cache_refresh_init() {
+    hpx_proxy_t      *fe = &nst_cache_refresher.fe;
+    struct listener  *li;
+    int               i;
+
+    init_new_proxy(fe);
+
+    fe->id             = "<NUSTER.CACHE.REFRESH>";
+    fe->cap            = PR_CAP_FE;
+    fe->mode           = PR_MODE_HTTP;
+    fe->last_change    = now.tv_sec;
+    fe->options2      |= PR_O2_INDEPSTR;
+    fe->timeout.client = TICK_ETERNITY;
+    fe->fe_req_ana     = AN_REQ_WAIT_HTTP;
+
+    for(i = 0; i < 2; i++) {
+        li = &nst_cache_refresher.li[i];
+
+        nst_cache_refresher.bind[i].frontend = fe;
+        nst_cache_refresher.bind[i].is_ssl   = i;
+
+        li->bind_conf = &nst_cache_refresher.bind[i];
+        li->options   = LI_O_UNLIMITED;
+        li->analysers = fe->fe_req_ana;
+    }
+}
+
+/*
+ * Put the entry back in its previous state if nobody is refreshing it
+ */
+static void
+_nst_cache_refresh_cancel(nst_key_t *key, nst_dict_entry_t *entry, int state) {
+    nst_dict_t  *dict = &nuster.cache->dict;
+
+    nst_dict_lock(dict, key);
+
+    if(nst_dict_lookup(dict, key) == entry && entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
+        entry->state = state;
+    }
+
+    nst_dict_unlock(dict, key);
+}
+
+/*
+ * The refresh and warmer applets act like the client of their stream, the
+ * request is given to the stream on creation and the response is dropped
+ * once the cache filter has stored it
+ */
+void
+nst_cache_discard_handler(hpx_appctx_t *appctx) {
+    hpx_stream_interface_t  *si  = appctx->owner;
+    hpx_stream_t            *s   = si_strm(si);
+    hpx_channel_t           *res = si_oc(si);
+    hpx_htx_t               *htx;
+
+    if(unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO)) {
+        return;
+    }
+
+    if(co_data(res)) {
+        htx = htx_from_buf(&res->buf);
+        co_htx_skip(res, htx, co_data(res));
+        htx_to_buf(htx, &res->buf);
+    }
+
+    if((s->txn && s->txn->rsp.msg_state >= HTTP_MSG_DONE && !co_data(res))
+            || (res->flags & (CF_SHUTW|CF_SHUTW_NOW))) {
+
+        si_shutw(si);
+        si_shutr(si);
+        si_ic(si)->flags |= CF_READ_NULL;
+    }
+}
+
+static void
+nst_cache_refresh_release_handler(hpx_appctx_t *appctx) {
+    nst_key_t  *key = appctx->ctx.nuster.refresh.key;
+
+    /* the stream ended before its cache filter took the entry over */
+    if(appctx->st0 == NST_CTX_STATE_INIT) {
+        _nst_cache_refresh_cancel(key, appctx->ctx.nuster.refresh.entry,
+                appctx->ctx.nuster.refresh.state);
+    }
+
+    free(key->data);
+    free(key);
+}
+
+/*
+ * Start an internal stream to be, with appctx as its client and the request
+ * in buf. On success the stream owns appctx and buf, the release handler of
+ * the applet cleans up. Otherwise both are left to the caller.
+ */
+int
+nst_cache_stream_new(hpx_appctx_t *appctx, hpx_proxy_t *be, hpx_buffer_t *buf, int ssl) {
+    hpx_proxy_t      *fe   = &nst_cache_refresher.fe;
+    struct listener  *li   = &nst_cache_refresher.li[!!ssl];
+    hpx_session_t    *sess = NULL;
+    hpx_stream_t     *strm = NULL;
+
+    /* released by session_free */
+    _HA_ATOMIC_ADD(&fe->feconn, 1);
+    _HA_ATOMIC_ADD(&li->nbconn, 1);
+    _HA_ATOMIC_ADD(&li->thr_conn[tid], 1);
+
+    sess = session_new(fe, li, &appctx->obj_type);
+
+    if(!sess) {
+        _HA_ATOMIC_SUB(&fe->feconn, 1);
+        _HA_ATOMIC_SUB(&li->nbconn, 1);
+        _HA_ATOMIC_SUB(&li->thr_conn[tid], 1);
+
+        return NST_ERR;
+    }
+
+    strm = stream_new(sess, &appctx->obj_type, buf);
+
+    if(!strm) {
+        session_free(sess);
+
+        return NST_ERR;
+    }
+
+    if(!stream_set_backend(strm, be)) {
+        stream_shutdown(strm, SF_ERR_RESOURCE);
+    }
+
+    si_cant_get(&strm->si[0]);
+
+    strm->res.flags |= CF_READ_DONTWAIT;
+
+    task_wakeup(strm->task, TASK_WOKEN_INIT);
+
+    return NST_OK;
+}
+
+/*
+ * Refresh the entry hit by ctx in the background: its request is replayed in
+ * an internal stream to the backend of s, whose cache filter updates the
+ * entry while clients are still served the current object.
+ */
+static int
+_nst_cache_refresh_spawn(hpx_stream_t *s, nst_ctx_t *ctx) {
+    hpx_appctx_t     *appctx = NULL;
+    nst_key_t        *key    = NULL;
+    hpx_buffer_t      buf    = BUF_NULL;
+    hpx_htx_t        *htx;
+
+    if(!b_alloc(&buf)) {
+        goto err;
+    }
+
+    htx = htx_from_buf(&buf);
+
+    if(nst_http_refresh_request(htxbuf(&s->req.buf), htx, &ctx->txn) != NST_OK) {
+        goto err;
+    }
+
+    htx_to_buf(htx, &buf);
+
+    key = malloc(sizeof(*key));
+
+    if(!key) {
+        goto err;
+    }
+
+    *key = *ctx->key;
+
+    key->data = malloc(key->size);
+
+    if(!key->data) {
+        goto err;
+    }
+
+    memcpy(key->data, ctx->key->data, key->size);
+
+    appctx = appctx_new(&nuster.applet.refresh, tid_bit);
+
+    if(!appctx) {
+        goto err;
+    }
+
+    appctx->st0 = NST_CTX_STATE_INIT;
+
+    appctx->ctx.nuster.refresh.entry = ctx->refresh.entry;
+    appctx->ctx.nuster.refresh.rule  = ctx->rule;
+    appctx->ctx.nuster.refresh.key   = key;
+    appctx->ctx.nuster.refresh.state = ctx->refresh.state;
+
+    /* from now on the release handler cleans up */
+    if(nst_cache_stream_new(appctx, s->be, &buf, 0) == NST_OK) {
+        return NST_OK;
+    }
+
+err:
+
+    if(appctx) {
+        appctx_free(appctx);
+    }
+
+    if(key) {
+        free(key->data);
+        free(key);
+    }
+
+    b_free(&buf);
+
+    return NST_ERR;
+}
+
+/*
+ * Called once nst_cache_exists has marked the entry for a background refresh,
+ * the entry is restored if it is not hit or cannot be refreshed
+ */
+void
+nst_cache_refresh(hpx_stream_t *s, nst_ctx_t *ctx) {
+    int  state = ctx->refresh.state;
+
+    ctx->refresh.state = 0;
+
+    if(ctx->state == NST_CTX_STATE_HIT_MEMORY || ctx->state == NST_CTX_STATE_HIT_DISK) {
+        ctx->refresh.state = state;
+
+        if(_nst_cache_refresh_spawn(s, ctx) == NST_OK) {
+            nst_debug(s, "[cache] Refresh in background");
+
+            ctx->refresh.state = 0;
+
+            return;
+        }
+    }
+
+    _nst_cache_refresh_cancel(ctx->key, ctx->refresh.entry, state);
+}
+
+/*
+ * Called by the cache filter of a refresh stream, it updates the entry the
+ * stream was created for if that one is still waiting for it
+ */
+int
+nst_cache_refresh_attach(hpx_stream_t *s, nst_ctx_t *ctx) {
+    hpx_appctx_t      *appctx = objt_appctx(s->si[0].end);
+    nst_dict_t        *dict   = &nuster.cache->dict;
+    nst_dict_entry_t  *entry;
+    nst_key_t         *key;
+    int                ret;
+
+    if(!appctx) {
+        return NST_CTX_STATE_BYPASS;
+    }
+
+    key       = appctx->ctx.nuster.refresh.key;
+    ctx->rule = appctx->ctx.nuster.refresh.rule;
+    ctx->key  = &ctx->keys[ctx->rule->key->idx];
+
+    if(b_room(ctx->buf) < key->size) {
+        return NST_CTX_STATE_BYPASS;
+    }
+
+    *ctx->key = *key;
+
+    ctx->key->data = ctx->buf->area + ctx->buf->data;
+    ctx->buf->data += key->size;
+
+    memcpy(ctx->key->data, key->data, key->size);
+
+    ret = NST_CTX_STATE_BYPASS;
+
+    nst_dict_lock(dict, ctx->key);
+
+    entry = nst_dict_lookup(dict, ctx->key);
+
+    if(entry && entry == appctx->ctx.nuster.refresh.entry
+            && entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
+
+        ret = NST_CTX_STATE_UPDATE;
+
+        ctx->entry = entry;
+        ctx->prop  = &entry->prop;
+
+        /* nst_cache_finish or nst_cache_abort restores it now */
+        appctx->st0 = NST_CTX_STATE_UPDATE;
+    }
+
+    nst_dict_unlock(dict, ctx->key);
+
+    return ret;
+}
+
+/*
+ * Whether s is a background refresh stream
+ */
+int
+nst_cache_refreshing(hpx_stream_t *s) {
+    hpx_appctx_t  *appctx = objt_appctx(s->si[0].end);
+
+    return appctx && appctx->applet == &nuster.applet.refresh;
+}
+
 void
 nst_cache_housekeeping() {
     nst_dict_t   *dict  = &nuster.cache->dict;
@@ -366,6 +868,10 @@ nst_cache_housekeeping() {
             }
         }
 
+        nst_dict_sketch_age(dict);
+
+        nst_dict_rehash(dict);
+
         start = nst_time_now_ms();
 
         if(data_cleaner > store->memory.count) {
@@ -407,79 +913,423 @@ nst_cache_housekeeping() {
         while(store->disk.loaded && disk_cleaner--) {
             nst_disk_cleanup(nuster.cache);
 
-            if(nst_time_now_ms() - start >= ms) {
-                break;
-            }
+            if(nst_time_now_ms() - start >= ms) {
+                break;
+            }
+        }
+
+        nst_disk_index_save(nuster.cache, global.nuster.cache.disk_index_interval * 1000ULL);
+
+#ifndef USE_THREAD
+        while(!store->disk.loaded && disk_loader--) {
+            nst_disk_load(nuster.cache);
+
+            if(nst_time_now_ms() - begin >= 500) {
+                break;
+            }
+        }
+#endif
+
+    }
+}
+
+/*
+ * Whether a cache rule uses admit, the sketch is only kept for them
+ */
+static int
+_nst_cache_admit_used() {
+    hpx_proxy_t  *p;
+    nst_rule_t   *rule;
+
+    for(p = proxies_list; p; p = p->next) {
+
+        if(p->nuster.mode != NST_MODE_CACHE) {
+            continue;
+        }
+
+        for(rule = nuster.proxy[p->uuid]->rule; rule; rule = rule->next) {
+
+            if(rule->prop.admit) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void
+nst_cache_init() {
+    hpx_ist_t     root;
+    nst_shmem_t  *shmem;
+    uint64_t      dict_size, data_size, size;
+    int           clean_temp, i;
+
+    root       = global.nuster.cache.root;
+    dict_size  = global.nuster.cache.dict_size;
+    data_size  = global.nuster.cache.data_size;
+    size       = dict_size + data_size;
+    clean_temp = global.nuster.cache.clean_temp;
+
+    nuster.applet.cache.fct       = nst_cache_handler;
+    nuster.applet.cache.release   = nst_cache_release_handler;
+    nuster.applet.refresh.fct     = nst_cache_discard_handler;
+    nuster.applet.refresh.release = nst_cache_refresh_release_handler;
+
+    _nst_cache_refresh_init();
+
+    for(i = 0; i < NST_DICT_SHARDS; i++) {
+        LIST_INIT(&nst_cache_waiters[i]);
+    }
+
+    if(global.nuster.cache.status == NST_STATUS_ON) {
+
+        shmem = nst_shmem_create("cache.shm", size, global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE);
+
+        if(!shmem) {
+            ha_alert("Failed to create nuster cache memory zone.\n");
+            exit(1);
+        }
+
+        global.nuster.cache.shmem = shmem;
+
+        if(nst_shctx_init(shmem) != NST_OK) {
+            ha_alert("Failed to init nuster cache memory.\n");
+            exit(1);
+        }
+
+        nuster.cache = nst_shmem_alloc(shmem, sizeof(nst_core_t));
+
+        if(!nuster.cache) {
+            ha_alert("Failed to init nuster cache core.\n");
+            exit(1);
+        }
+
+        memset(nuster.cache, 0, sizeof(*nuster.cache));
+
+        nuster.cache->shmem = shmem;
+        nuster.cache->root  = root;
+
+        if(nst_store_init(&nuster.cache->store, root, shmem, clean_temp,
+                    global.nuster.cache.disk_engine, global.nuster.cache.disk_segment_size,
+                    global.nuster.cache.disk_scan_threads, nuster.cache) != NST_OK) {
+
+            ha_alert("Failed to init nuster cache store.\n");
+            exit(1);
+        }
+
+        if(nst_dict_init(&nuster.cache->dict, &nuster.cache->store, shmem, dict_size,
+                    global.nuster.cache.purge_index == NST_STATUS_ON,
+                    global.nuster.cache.tag_header.len != 0) != NST_OK) {
+            ha_alert("Failed to init nuster cache dict.\n");
+            exit(1);
+        }
+
+        if(_nst_cache_admit_used() && nst_dict_sketch_init(&nuster.cache->dict) != NST_OK) {
+            ha_alert("Failed to init nuster cache admission sketch.\n");
+            exit(1);
+        }
+
+    }
+}
+
+/*
+ * Wake up the streams of this process waiting for key, must be called with the
+ * dict lock held. Waiters of other processes check again periodically, see
+ * NST_CACHE_WAIT_POLL.
+ */
+static void
+_nst_cache_wakeup(nst_key_t *key) {
+    nst_ctx_t  *ctx, *back;
+
+    list_for_each_entry_safe(ctx, back, &nst_cache_waiters[key->hash % NST_DICT_SHARDS],
+            waiter.list) {
+
+        if(ctx->key->hash != key->hash || ctx->key->size != key->size
+                || memcmp(ctx->key->data, key->data, key->size)) {
+
+            continue;
+        }
+
+        LIST_DEL_INIT(&ctx->waiter.list);
+        task_wakeup(ctx->waiter.task, TASK_WOKEN_MSG);
+    }
+}
+
+/*
+ * Let the readers of the INIT entry stream the object while it is being
+ * filled, the entry holds a client of the object until it is unpublished
+ */
+static void
+_nst_cache_publish(nst_ctx_t *ctx) {
+    nst_dict_t        *dict  = &nuster.cache->dict;
+    nst_dict_entry_t  *entry = ctx->entry;
+
+    nst_memory_obj_attach(&nuster.cache->store.memory, ctx->store.memory.obj);
+
+    nst_dict_lock(dict, ctx->key);
+
+    entry->store.memory.fill = ctx->store.memory.obj;
+
+    _nst_cache_wakeup(ctx->key);
+
+    nst_dict_unlock(dict, ctx->key);
+}
+
+static void
+_nst_cache_unpublish(nst_ctx_t *ctx, nst_memory_obj_t *obj) {
+    nst_dict_t        *dict  = &nuster.cache->dict;
+    nst_dict_entry_t  *entry = ctx->entry;
+    int                found = 0;
+
+    nst_dict_lock(dict, ctx->key);
+
+    if(entry->store.memory.fill == obj) {
+        entry->store.memory.fill = NULL;
+
+        found = 1;
+    }
+
+    nst_dict_unlock(dict, ctx->key);
+
+    if(found) {
+        nst_memory_obj_detach(&nuster.cache->store.memory, obj);
+    }
+}
+
+/*
+ * The response has a Vary, make ctx->key the key of the variant and record it
+ * under the primary entry, which is created on the first variant
+ */
+static int
+_nst_cache_vary(nst_ctx_t *ctx) {
+    nst_dict_t        *dict  = &nuster.cache->dict;
+    nst_dict_entry_t  *entry;
+    nst_key_t         *key;
+    uint64_t           expire;
+    int                ret   = NST_ERR;
+    int                stale = ctx->rule->prop.stale;
+
+    if(!ctx->vary.primary) {
+
+        /* an UPDATE keeps its key */
+        if(ctx->state != NST_CTX_STATE_CREATE || !ctx->vary.headers) {
+            return NST_ERR;
+        }
+
+        if(nst_http_vary_suffix(htxbuf(ctx->vary.headers), ctx->txn.res.vary, ctx->buf,
+                    &ctx->vary.suffix) != NST_OK) {
+
+            return NST_ERR;
+        }
+
+        if(nst_key_build_variant(ctx->key, ctx->vary.suffix, &ctx->vary.key) != NST_OK) {
+            return NST_ERR;
+        }
+
+        ctx->vary.primary = ctx->key;
+        ctx->key          = &ctx->vary.key;
+    }
+
+    key = ctx->vary.primary;
+
+    /* the primary entry outlives its variants, stale ones included */
+    expire = 0;
+
+    if(ctx->txn.res.ttl && stale != 0) {
+        expire = nst_time_now_ms() / 1000 + ctx->txn.res.ttl + (stale > 0 ? stale : 0);
+    }
+
+    nst_dict_lock(dict, key);
+
+    entry = nst_dict_get(dict, key);
+
+    /* an object without Vary is stored under the primary key */
+    if(entry && !entry->vary.len) {
+        goto out;
+    }
+
+    if(!entry) {
+        entry = nst_dict_set_vary(dict, key, &ctx->txn, &ctx->rule->prop);
+
+        if(!entry) {
+            goto out;
+        }
+
+        entry->expire = expire;
+    }
+
+    if(nst_dict_add_variant(dict, entry, ctx->vary.suffix) != NST_OK) {
+        goto out;
+    }
+
+    if(entry->expire && (expire == 0 || expire > entry->expire)) {
+        entry->expire = expire;
+    }
+
+    ret = NST_OK;
+
+out:
+    nst_dict_unlock(dict, key);
+
+    return ret;
+}
+
+static void
+_nst_cache_gzip_abort(nst_ctx_t *ctx) {
+
+    if(ctx->gzip.comp) {
+        nuster.gzip->end(&ctx->gzip.comp);
+
+        ctx->gzip.comp = NULL;
+    }
+
+    if(ctx->gzip.obj) {
+        nst_memory_obj_abort(&nuster.cache->store.memory, ctx->gzip.obj);
+
+        ctx->gzip.obj = NULL;
+    }
+}
+
+/*
+ * Start the gzip encoded copy of the response with the headers of htx
+ */
+static void
+_nst_cache_gzip_create(nst_ctx_t *ctx, hpx_htx_t *htx) {
+    nst_memory_t   *mem = &nuster.cache->store.memory;
+    hpx_htx_blk_t  *blk;
+    hpx_buffer_t   *buf;
+    hpx_htx_t      *tmp;
+
+    buf = alloc_trash_chunk();
+
+    if(!buf) {
+        return;
+    }
+
+    tmp = htx_from_buf(buf);
+
+    if(nst_http_gzip_headers(htx, tmp) != NST_OK) {
+        goto out;
+    }
+
+    ctx->gzip.obj  = nst_memory_obj_create(mem);
+    ctx->gzip.item = NULL;
+    ctx->gzip.len  = 0;
+
+    if(!ctx->gzip.obj) {
+        goto out;
+    }
+
+    for(blk = htx_get_first_blk(tmp); blk; blk = htx_get_next_blk(tmp, blk)) {
+
+        if(nst_memory_obj_append(mem, ctx->gzip.obj, &ctx->gzip.item, htx_get_blk_ptr(tmp, blk),
+                    htx_get_blksz(blk), blk->info) != NST_OK) {
+
+            goto out;
+        }
+    }
+
+    if(nuster.gzip->init(&ctx->gzip.comp, global.tune.comp_maxlevel) < 0) {
+        ctx->gzip.comp = NULL;
+
+        goto out;
+    }
+
+    free_trash_chunk(buf);
+
+    return;
+
+out:
+    _nst_cache_gzip_abort(ctx);
+
+    free_trash_chunk(buf);
+}
+
+/*
+ * Compress the payload into the gzip encoded copy, or finish it if finish is
+ * set. The input is flushed in pieces which always fit in the output buffer.
+ */
+static int
+_nst_cache_gzip_append(nst_ctx_t *ctx, const char *data, uint32_t len, int finish) {
+    nst_memory_t  *mem = &nuster.cache->store.memory;
+    hpx_buffer_t  *out = get_trash_chunk();
+    uint32_t       n;
+    int            ret;
+
+    do {
+        n = len > out->size / 2 ? out->size / 2 : len;
+
+        b_reset(out);
+
+        if(finish) {
+            ret = nuster.gzip->finish(ctx->gzip.comp, out);
+        } else if(nuster.gzip->add_data(ctx->gzip.comp, data, n, out) != n) {
+            ret = -1;
+        } else {
+            ret = nuster.gzip->flush(ctx->gzip.comp, out);
+        }
+
+        if(ret < 0) {
+            return NST_ERR;
         }
 
-#ifndef USE_THREAD
-        while(!store->disk.loaded && disk_loader--) {
-            nst_disk_load(nuster.cache);
+        if(b_data(out) && nst_memory_obj_append_data(mem, ctx->gzip.obj, &ctx->gzip.item,
+                    b_head(out), b_data(out)) != NST_OK) {
 
-            if(nst_time_now_ms() - begin >= 500) {
-                break;
-            }
+            return NST_ERR;
         }
-#endif
 
-    }
-}
+        ctx->gzip.len += b_data(out);
 
-void
-nst_cache_init() {
-    hpx_ist_t     root;
-    nst_shmem_t  *shmem;
-    uint64_t      dict_size, data_size, size;
-    int           clean_temp;
+        data += n;
+        len  -= n;
+    } while(len);
 
-    root       = global.nuster.cache.root;
-    dict_size  = global.nuster.cache.dict_size;
-    data_size  = global.nuster.cache.data_size;
-    size       = dict_size + data_size;
-    clean_temp = global.nuster.cache.clean_temp;
+    return NST_OK;
+}
 
-    nuster.applet.cache.fct = nst_cache_handler;
+/*
+ * The identity object is complete, keep the gzip encoded one along if it is
+ * smaller.
+ */
+static void
+_nst_cache_gzip_finish(nst_ctx_t *ctx, nst_dict_entry_t *entry) {
+    nst_memory_t  *mem  = &nuster.cache->store.memory;
+    nst_dict_t    *dict = &nuster.cache->dict;
 
-    if(global.nuster.cache.status == NST_STATUS_ON) {
+    if(_nst_cache_gzip_append(ctx, NULL, 0, 1) != NST_OK
+            || ctx->gzip.len >= ctx->txn.res.payload_len) {
 
-        shmem = nst_shmem_create("cache.shm", size, global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE);
+        _nst_cache_gzip_abort(ctx);
 
-        if(!shmem) {
-            ha_alert("Failed to create nuster cache memory zone.\n");
-            exit(1);
-        }
+        return;
+    }
 
-        global.nuster.cache.shmem = shmem;
+    nuster.gzip->end(&ctx->gzip.comp);
 
-        if(nst_shctx_init(shmem) != NST_OK) {
-            ha_alert("Failed to init nuster cache memory.\n");
-            exit(1);
-        }
+    ctx->gzip.comp = NULL;
 
-        nuster.cache = nst_shmem_alloc(shmem, sizeof(nst_core_t));
+    nst_memory_obj_finish(mem, ctx->gzip.obj, ctx->gzip.item);
 
-        if(!nuster.cache) {
-            ha_alert("Failed to init nuster cache core.\n");
-            exit(1);
-        }
+    nst_dict_lock(dict, ctx->key);
 
-        memset(nuster.cache, 0, sizeof(*nuster.cache));
+    if(entry->state == NST_DICT_ENTRY_STATE_VALID
+            && entry->store.memory.obj == ctx->store.memory.obj) {
 
-        nuster.cache->shmem = shmem;
-        nuster.cache->root  = root;
+        if(entry->store.memory.gzip) {
+            entry->store.memory.gzip->invalid = 1;
 
-        if(nst_store_init(&nuster.cache->store, root, shmem, clean_temp, nuster.cache) != NST_OK) {
-            ha_alert("Failed to init nuster cache store.\n");
-            exit(1);
+            nst_memory_incr_invalid(mem);
         }
 
-        if(nst_dict_init(&nuster.cache->dict, &nuster.cache->store, shmem, dict_size) != NST_OK) {
-            ha_alert("Failed to init nuster cache dict.\n");
-            exit(1);
-        }
+        entry->store.memory.gzip = ctx->gzip.obj;
+        ctx->gzip.obj            = NULL;
+    }
 
+    nst_dict_unlock(dict, ctx->key);
 
-    }
+    _nst_cache_gzip_abort(ctx);
 }
 
 void
@@ -493,14 +1343,23 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
     nst_disk_t         *disk;
     uint32_t            sz;
     int                 idx;
+    int                 gzip = 0;
 
     dict = &nuster.cache->dict;
     mem  = &nuster.cache->store.memory;
     disk = &nuster.cache->store.disk;
     htx  = htxbuf(&msg->chn->buf);
 
+    if(ctx->txn.res.vary.len) {
+
+        /* an UPDATE is a known variant, only its primary entry is extended */
+        if(_nst_cache_vary(ctx) != NST_OK && ctx->state == NST_CTX_STATE_CREATE) {
+            ctx->state = NST_CTX_STATE_BYPASS;
+        }
+    }
+
     if(ctx->state == NST_CTX_STATE_CREATE) {
-        nst_shctx_lock(dict);
+        nst_dict_lock(dict, ctx->key);
 
         entry = nst_dict_get(dict, ctx->key);
 
@@ -519,7 +1378,7 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
             }
         }
 
-        nst_shctx_unlock(dict);
+        nst_dict_unlock(dict, ctx->key);
     }
 
     /* init store data */
@@ -531,7 +1390,14 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
         }
 
         if(nst_store_disk_on(ctx->rule->prop.store)) {
-            nst_disk_obj_create(disk, &ctx->store.disk.obj, ctx->key, &ctx->txn, &ctx->rule->prop);
+            hpx_task_t  *task = NULL;
+
+            if(global.nuster.cache.disk_io_threads && nst_disk_aio_on()) {
+                task = chn_strm(msg->chn)->task;
+            }
+
+            nst_disk_obj_create(disk, &ctx->store.disk.obj, ctx->key, &ctx->txn,
+                    &ctx->rule->prop, task);
         }
     }
 
@@ -542,6 +1408,11 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
         ctx->txn.res.header_len  = 0;
         ctx->txn.res.payload_len = 0;
 
+        /* before the headers are stored, the response as is varies too */
+        if(ctx->rule->prop.gzip == NST_STATUS_ON && ctx->store.memory.obj) {
+            gzip = nst_http_gzip_vary(htx) == NST_OK;
+        }
+
         for(idx = htx_get_first(htx); idx != -1; idx = htx_get_next(htx, idx)) {
             blk  = htx_get_blk(htx, idx);
             sz   = htx_get_blksz(blk);
@@ -575,6 +1446,14 @@ nst_cache_create(hpx_http_msg_t *msg, nst_ctx_t *ctx) {
                 break;
             }
         }
+
+        if(gzip && ctx->store.memory.obj) {
+            _nst_cache_gzip_create(ctx, htx);
+        }
+    }
+
+    if(ctx->state == NST_CTX_STATE_CREATE && ctx->store.memory.obj) {
+        _nst_cache_publish(ctx);
     }
 
 err:
@@ -603,7 +1482,6 @@ nst_cache_append(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
 
     for(; blk && len; blk = htx_get_next_blk(htx, blk)) {
         hpx_ist_t  data;
-        uint32_t   info;
 
         type = htx_get_blk_type(blk);
 
@@ -616,7 +1494,19 @@ nst_cache_append(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
                 data.len = len;
             }
 
-            info = (type << 28) + data.len;
+            /* wait for the io thread to catch up with the disk writes */
+            if(nst_store_disk_on(ctx->rule->prop.store) && ctx->store.disk.obj.file) {
+                int  room = nst_disk_obj_room(&ctx->store.disk.obj);
+
+                if(room <= 0) {
+                    break;
+                }
+
+                if(data.len > room) {
+                    data.len = room;
+                    len      = data.len;
+                }
+            }
 
             ctx->txn.res.payload_len += data.len;
 
@@ -628,13 +1518,24 @@ nst_cache_append(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
                 nst_memory_item_t  **item = &ctx->store.memory.item;
                 int                  ret;
 
-                ret = nst_memory_obj_append(mem, obj, item, data.ptr, data.len, info);
+                ret = nst_memory_obj_append_data(mem, obj, item, data.ptr, data.len);
 
                 if(ret == NST_ERR) {
+                    _nst_cache_unpublish(ctx, obj);
+
                     ctx->store.memory.obj = NULL;
                 }
             }
 
+            if(ctx->gzip.obj) {
+
+                if(!ctx->store.memory.obj
+                        || _nst_cache_gzip_append(ctx, data.ptr, data.len, 0) != NST_OK) {
+
+                    _nst_cache_gzip_abort(ctx);
+                }
+            }
+
             if(nst_store_disk_on(ctx->rule->prop.store) && ctx->store.disk.obj.file) {
                 nst_disk_obj_append(disk, &ctx->store.disk.obj, data.ptr, data.len);
             }
@@ -643,6 +1544,12 @@ nst_cache_append(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
         if(type == HTX_BLK_TLR || type == HTX_BLK_EOT) {
             uint32_t  sz = htx_get_blksz(blk);
 
+            if(nst_store_disk_on(ctx->rule->prop.store) && ctx->store.disk.obj.file
+                    && nst_disk_obj_room(&ctx->store.disk.obj) < 4 + sz) {
+
+                break;
+            }
+
             forward += sz;
             len     -= sz;
 
@@ -655,6 +1562,8 @@ nst_cache_append(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
                 ret = nst_memory_obj_append(mem, obj, item, ptr, sz, blk->info);
 
                 if(ret == NST_ERR) {
+                    _nst_cache_unpublish(ctx, obj);
+
                     ctx->store.memory.obj = NULL;
                 }
             }
@@ -687,6 +1596,7 @@ nst_cache_finish(nst_ctx_t *ctx) {
     nst_dict_t        *dict  = &nuster.cache->dict;
     nst_disk_t        *disk  = &nuster.cache->store.disk;
     nst_dict_entry_t  *entry = ctx->entry;
+    int                ret   = NST_OK;
 
     ctx->state = NST_CTX_STATE_DONE;
 
@@ -702,50 +1612,141 @@ nst_cache_finish(nst_ctx_t *ctx) {
     entry->payload_len = ctx->txn.res.payload_len;
 
     if(nst_store_memory_on(ctx->rule->prop.store) && ctx->store.memory.obj) {
-        nst_shctx_lock(dict);
-
-        if(entry && entry->state != NST_DICT_ENTRY_STATE_INVALID && entry->store.memory.obj) {
-            entry->store.memory.obj->invalid = 1;
+        nst_dict_lock(dict, ctx->key);
 
-            nst_memory_incr_invalid(&nuster.cache->store.memory);
+        if(entry && entry->state != NST_DICT_ENTRY_STATE_INVALID) {
+            nst_dict_drop_memory(dict, entry);
         }
 
         entry->state = NST_DICT_ENTRY_STATE_VALID;
         entry->store.memory.obj = ctx->store.memory.obj;
 
-        nst_shctx_unlock(dict);
+        nst_dict_unlock(dict, ctx->key);
+
+        nst_memory_obj_finish(&nuster.cache->store.memory, ctx->store.memory.obj,
+                ctx->store.memory.item);
+
+        _nst_cache_unpublish(ctx, ctx->store.memory.obj);
+
+        if(ctx->gzip.obj) {
+            _nst_cache_gzip_finish(ctx, entry);
+        }
     }
 
+    _nst_cache_gzip_abort(ctx);
+
     if(nst_store_disk_on(ctx->rule->prop.store) && ctx->store.disk.obj.file) {
         nst_disk_obj_t  *obj  = &ctx->store.disk.obj;
 
         if(nst_disk_obj_finish(disk, obj, ctx->key, &ctx->txn, entry->expire) == NST_OK) {
+            nst_dict_lock(dict, ctx->key);
+
+            /* the segment engine does not overwrite the previous object */
+            if(entry->store.disk.file && nst_disk_segment_on(disk)) {
+                nst_disk_purge_by_path(disk, entry->store.disk.file, entry->store.disk.offset);
+                nst_shmem_free(nuster.cache->shmem, entry->store.disk.file);
+            }
+
             entry->state = NST_DICT_ENTRY_STATE_VALID;
-            entry->store.disk.file = ctx->store.disk.obj.file;
+            entry->store.disk.file   = obj->file;
+            entry->store.disk.offset = obj->base;
+
+            nst_dict_unlock(dict, ctx->key);
         }
     }
 
+    nst_dict_lock(dict, ctx->key);
+
+    /* an untagged entry would survive the purge of its tags */
+    if(entry->state == NST_DICT_ENTRY_STATE_VALID
+            && nst_dict_set_tags(dict, entry, &ctx->txn) != NST_OK) {
+
+        entry->state = NST_DICT_ENTRY_STATE_INVALID;
+    }
+
     if(entry->state != NST_DICT_ENTRY_STATE_VALID) {
         entry->state = NST_DICT_ENTRY_STATE_INVALID;
 
-        return NST_ERR;
+        ret = NST_ERR;
+    } else {
+        nst_dict_set_validators(entry, &ctx->txn);
     }
 
-    return NST_OK;
+    _nst_cache_wakeup(ctx->key);
+
+    nst_dict_unlock(dict, ctx->key);
+
+    return ret;
+}
+
+/*
+ * The origin answered the conditional refresh request of ctx with 304, the
+ * object is still fresh: extend the entry in place, the stored object is kept.
+ */
+void
+nst_cache_revalidate(nst_ctx_t *ctx) {
+    nst_dict_t        *dict  = &nuster.cache->dict;
+    nst_dict_entry_t  *entry = ctx->entry;
+
+    ctx->state = NST_CTX_STATE_DONE;
+
+    nst_dict_lock(dict, ctx->key);
+
+    if(entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
+        entry->ctime = nst_time_now_ms();
+
+        if(entry->prop.ttl == 0) {
+            entry->expire = 0;
+        } else {
+            entry->expire = entry->ctime / 1000 + entry->prop.ttl;
+        }
+
+        entry->state = NST_DICT_ENTRY_STATE_VALID;
+
+        if(entry->store.disk.file) {
+            nst_disk_update_expire(entry->store.disk.file, entry->store.disk.offset,
+                    entry->expire);
+        }
+    }
+
+    _nst_cache_wakeup(ctx->key);
+
+    nst_dict_unlock(dict, ctx->key);
+}
+
+/*
+ * The disk object of ctx is being checked by an io thread, the stream is woken
+ * up once it is done and checks the keys again from scratch
+ */
+static int
+_nst_cache_exists_pending(nst_ctx_t *ctx) {
+
+    nst_key_reset_flag(ctx->key);
+
+    if(ctx->vary.primary) {
+        nst_key_reset_flag(ctx->vary.primary);
+    }
+
+    return NST_CTX_STATE_CHECK_DISK;
 }
 
 /*
  * Check if valid cache exists
  */
 int
-nst_cache_exists(nst_ctx_t *ctx) {
+nst_cache_exists(hpx_stream_t *s, nst_ctx_t *ctx) {
     nst_dict_entry_t  *entry = NULL;
     nst_dict_t        *dict  = &nuster.cache->dict;
     nst_disk_t        *disk  = &nuster.cache->store.disk;
+    hpx_task_t        *task  = NULL;
     int                ret;
 
     ret = NST_CTX_STATE_INIT;
 
+    if(global.nuster.cache.disk_io_threads && nst_disk_aio_on()) {
+        task = s->task;
+    }
+
     if(!ctx->key) {
         return ret;
     }
@@ -753,10 +1754,36 @@ nst_cache_exists(nst_ctx_t *ctx) {
     if(!nst_key_memory_checked(ctx->key)) {
         nst_key_memory_set_checked(ctx->key);
 
-        nst_shctx_lock(dict);
+        nst_dict_lock(dict, ctx->key);
 
         entry = nst_dict_get(dict, ctx->key);
 
+        if(entry && entry->vary.len) {
+            /* the primary entry of variants, see nst_cache_exists_variant */
+            ctx->txn.res.vary.ptr = ctx->buf->area + ctx->buf->data;
+            ctx->txn.res.vary.len = entry->vary.len;
+
+            if(chunk_istcat(ctx->buf, entry->vary)) {
+                ret = NST_CTX_STATE_VARY;
+            }
+
+            entry = NULL;
+        }
+
+        if(entry && ctx->refresh.on && (entry->store.memory.obj || entry->store.disk.file)) {
+
+            /* serve the current object while it is refreshed, see nst_cache_refresh */
+            if(entry->state == NST_DICT_ENTRY_STATE_REFRESH
+                    || (entry->state == NST_DICT_ENTRY_STATE_VALID
+                        && nst_dict_entry_refresh(entry))) {
+
+                ctx->refresh.state = entry->state;
+                ctx->refresh.entry = entry;
+
+                entry->state = NST_DICT_ENTRY_STATE_UPDATE;
+            }
+        }
+
         if(entry) {
 
             if(entry->state == NST_DICT_ENTRY_STATE_VALID
@@ -767,25 +1794,47 @@ nst_cache_exists(nst_ctx_t *ctx) {
                     ret = NST_CTX_STATE_HIT_MEMORY;
 
                     ctx->store.memory.obj = entry->store.memory.obj;
+
+                    if(ctx->txn.req.gzip && entry->store.memory.gzip) {
+                        ctx->store.memory.obj = entry->store.memory.gzip;
+                    }
+
+                    nst_memory_obj_attach(&nuster.cache->store.memory, ctx->store.memory.obj);
                 } else if(entry->store.disk.file) {
                     ret = NST_CTX_STATE_HIT_DISK;
 
                     ctx->store.disk.obj.file = entry->store.disk.file;
+                    ctx->store.disk.obj.base = entry->store.disk.offset;
                 }
 
                 ctx->txn.res.header_len    = entry->header_len;
                 ctx->txn.res.payload_len   = entry->payload_len;
                 ctx->txn.res.etag          = entry->etag;
                 ctx->txn.res.last_modified = entry->last_modified;
+                ctx->txn.res.validators    = entry->validators;
                 ctx->prop                  = &entry->prop;
 
                 nst_dict_record_access(entry);
+
+                /* hits keep the object ahead of admission candidates */
+                nst_dict_sketch_add(dict, entry->key.hash);
             }
 
             if(entry->state == NST_DICT_ENTRY_STATE_INIT) {
                 ret = NST_CTX_STATE_WAIT;
 
                 ctx->prop = &entry->prop;
+
+                /* stream the object while it is being filled */
+                if(entry->prop.wait >= 0 && entry->store.memory.fill) {
+                    ret = NST_CTX_STATE_HIT_MEMORY;
+
+                    ctx->store.memory.obj      = entry->store.memory.fill;
+                    ctx->txn.res.etag          = entry->etag;
+                    ctx->txn.res.last_modified = entry->last_modified;
+
+                    nst_memory_obj_attach(&nuster.cache->store.memory, ctx->store.memory.obj);
+                }
             }
 
             if(entry->state == NST_DICT_ENTRY_STATE_REFRESH) {
@@ -798,7 +1847,7 @@ nst_cache_exists(nst_ctx_t *ctx) {
 
         }
 
-        nst_shctx_unlock(dict);
+        nst_dict_unlock(dict, ctx->key);
     }
 
     if(ret == NST_CTX_STATE_INIT) {
@@ -812,7 +1861,7 @@ nst_cache_exists(nst_ctx_t *ctx) {
     }
 
 
-    if(ret == NST_CTX_STATE_HIT_MEMORY) {
+    if(ret == NST_CTX_STATE_HIT_MEMORY || ret == NST_CTX_STATE_VARY) {
         return ret;
     }
 
@@ -822,8 +1871,13 @@ nst_cache_exists(nst_ctx_t *ctx) {
             nst_key_disk_set_checked(ctx->key);
 
             if(ctx->store.disk.obj.file) {
+                int  valid = nst_disk_obj_valid(&ctx->store.disk.obj, ctx->key, task);
+
+                if(valid == NST_DISK_PENDING) {
+                    return _nst_cache_exists_pending(ctx);
+                }
 
-                if(nst_disk_obj_valid(&ctx->store.disk.obj, ctx->key) != NST_OK) {
+                if(valid != NST_OK) {
 
                     ret = NST_CTX_STATE_INIT;
 
@@ -859,10 +1913,17 @@ nst_cache_exists(nst_ctx_t *ctx) {
 
         if(!nst_key_disk_checked(ctx->key)) {
             nst_disk_obj_t  *obj = &ctx->store.disk.obj;
+            int              exists;
 
             nst_key_disk_set_checked(ctx->key);
 
-            if(nst_disk_obj_exists(disk, obj, ctx->key) == NST_OK) {
+            exists = nst_disk_obj_exists(disk, obj, ctx->key, task);
+
+            if(exists == NST_DISK_PENDING) {
+                return _nst_cache_exists_pending(ctx);
+            }
+
+            if(exists == NST_OK) {
                 char *meta      = ctx->store.disk.obj.meta;
                 int  stale_prop = nst_disk_meta_get_stale(meta);
                 int  stale      = nst_disk_meta_check_stale(meta) != NST_OK;
@@ -874,6 +1935,7 @@ nst_cache_exists(nst_ctx_t *ctx) {
                     ctx->prop = (nst_rule_prop_t *)(ctx->buf->area + ctx->buf->data);
                     ctx->buf->data += sizeof(nst_rule_prop_t);
 
+                    ctx->prop->uuid = ctx->rule->uuid;
                     ctx->prop->etag = nst_disk_meta_get_etag_prop(meta);
 
                     if(ctx->prop->etag == NST_STATUS_ON) {
@@ -909,13 +1971,41 @@ nst_cache_exists(nst_ctx_t *ctx) {
     return ret;
 }
 
+/*
+ * ctx->key is the primary entry of variants, check the variant of the request
+ * built from its Vary headers instead
+ */
+int
+nst_cache_exists_variant(hpx_stream_t *s, nst_ctx_t *ctx) {
+    hpx_htx_t  *htx = htxbuf(&s->req.buf);
+
+    if(nst_http_vary_suffix(htx, ctx->txn.res.vary, ctx->buf, &ctx->vary.suffix) != NST_OK) {
+        return NST_CTX_STATE_INIT;
+    }
+
+    if(nst_key_build_variant(ctx->key, ctx->vary.suffix, &ctx->vary.key) != NST_OK) {
+        return NST_CTX_STATE_INIT;
+    }
+
+    ctx->vary.primary = ctx->key;
+    ctx->key          = &ctx->vary.key;
+
+    nst_key_debug(s, ctx->key);
+
+    return nst_cache_exists(s, ctx);
+}
+
 void
 nst_cache_abort(nst_ctx_t *ctx) {
     nst_dict_entry_t   *entry = ctx->entry;
 
+    _nst_cache_gzip_abort(ctx);
+
     if(entry->state == NST_DICT_ENTRY_STATE_INIT || entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
 
         if(ctx->store.memory.obj) {
+            _nst_cache_unpublish(ctx, ctx->store.memory.obj);
+
             nst_memory_obj_abort(&nuster.cache->store.memory, ctx->store.memory.obj);
         }
 
@@ -924,13 +2014,83 @@ nst_cache_abort(nst_ctx_t *ctx) {
         }
     }
 
+    nst_dict_lock(&nuster.cache->dict, ctx->key);
+
     if(entry->state == NST_DICT_ENTRY_STATE_INIT) {
         entry->state = NST_DICT_ENTRY_STATE_INVALID;
     }
 
+    /* an entry refreshed before it expires is still valid */
     if(entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
-        entry->state = NST_DICT_ENTRY_STATE_STALE;
+
+        if(nst_dict_entry_expired(entry)) {
+            entry->state = NST_DICT_ENTRY_STATE_STALE;
+        } else {
+            entry->state = NST_DICT_ENTRY_STATE_VALID;
+        }
+    }
+
+    _nst_cache_wakeup(ctx->key);
+
+    nst_dict_unlock(&nuster.cache->dict, ctx->key);
+}
+
+/*
+ * Queue the stream on the INIT entry of ctx->key, it will be woken up by
+ * nst_cache_finish or nst_cache_abort of the stream filling the entry.
+ * Returns NST_ERR if the entry is no longer INIT, the caller should check again.
+ */
+int
+nst_cache_wait(nst_ctx_t *ctx, hpx_task_t *task) {
+    nst_dict_t        *dict = &nuster.cache->dict;
+    nst_dict_entry_t  *entry;
+    int                ret  = NST_ERR;
+
+    nst_dict_lock(dict, ctx->key);
+
+    entry = nst_dict_get(dict, ctx->key);
+
+    if(entry && entry->state == NST_DICT_ENTRY_STATE_INIT) {
+        ctx->waiter.task = task;
+
+        LIST_ADDQ(&nst_cache_waiters[ctx->key->hash % NST_DICT_SHARDS], &ctx->waiter.list);
+
+        ret = NST_OK;
+    }
+
+    nst_dict_unlock(dict, ctx->key);
+
+    return ret;
+}
+
+/*
+ * Returns 1 if the stream is still queued, 0 if it has been woken up
+ */
+int
+nst_cache_waiting(nst_ctx_t *ctx) {
+    nst_dict_t  *dict = &nuster.cache->dict;
+    int          ret;
+
+    nst_dict_lock(dict, ctx->key);
+
+    ret = LIST_ADDED(&ctx->waiter.list);
+
+    nst_dict_unlock(dict, ctx->key);
+
+    return ret;
+}
+
+void
+nst_cache_unwait(nst_ctx_t *ctx) {
+    nst_dict_t  *dict = &nuster.cache->dict;
+
+    nst_dict_lock(dict, ctx->key);
+
+    if(LIST_ADDED(&ctx->waiter.list)) {
+        LIST_DEL_INIT(&ctx->waiter.list);
     }
+
+    nst_dict_unlock(dict, ctx->key);
 }
 
 /*
@@ -940,15 +2100,32 @@ nst_cache_abort(nst_ctx_t *ctx) {
  */
 int
 nst_cache_delete(nst_key_t *key) {
-    nst_dict_t        *dict  = &nuster.cache->dict;
-    nst_dict_entry_t  *entry = NULL;
-    int                ret   = 1;
+    nst_dict_t          *dict    = &nuster.cache->dict;
+    nst_dict_entry_t    *entry   = NULL;
+    nst_dict_variant_t  *variant;
+    hpx_buffer_t        *suffix  = NULL;
+    int                  ret     = 1;
 
-    nst_shctx_lock(dict);
+    nst_dict_lock(dict, key);
 
     entry = nst_dict_get(dict, key);
 
-    if(entry) {
+    if(entry && entry->vary.len) {
+        /* purge the variants once unlocked */
+        suffix = alloc_trash_chunk();
+
+        for(variant = entry->variant; suffix && variant; variant = variant->next) {
+
+            if(!chunk_memcat(suffix, (char *)&variant->size, sizeof(variant->size))
+                    || !chunk_memcat(suffix, variant->data, variant->size)) {
+
+                break;
+            }
+        }
+
+        entry->state  = NST_DICT_ENTRY_STATE_INVALID;
+        entry->expire = 0;
+    } else if(entry) {
 
         if(entry->state == NST_DICT_ENTRY_STATE_VALID
                 || entry->state == NST_DICT_ENTRY_STATE_UPDATE
@@ -957,15 +2134,12 @@ nst_cache_delete(nst_key_t *key) {
             entry->state  = NST_DICT_ENTRY_STATE_INVALID;
             entry->expire = 0;
 
-            if(entry->store.memory.obj) {
-                entry->store.memory.obj->invalid = 1;
-                entry->store.memory.obj          = NULL;
-
-                nst_memory_incr_invalid(&nuster.cache->store.memory);
-            }
+            nst_dict_drop_memory(dict, entry);
 
             if(entry->store.disk.file) {
-                nst_disk_file_remove(entry->store.disk.file);
+                nst_disk_purge_by_path(&nuster.cache->store.disk, entry->store.disk.file,
+                        entry->store.disk.offset);
+
                 nst_shmem_free(nuster.cache->shmem, entry->store.disk.file);
                 entry->store.disk.file = NULL;
             }
@@ -977,9 +2151,31 @@ nst_cache_delete(nst_key_t *key) {
         ret = 0;
     }
 
-    nst_shctx_unlock(dict);
+    nst_dict_unlock(dict, key);
+
+    if(suffix) {
+        nst_key_t  vkey = { .data = NULL };
+        uint32_t   size;
+        char      *p    = suffix->area;
+
+        while(p < suffix->area + suffix->data) {
+            size = *(uint32_t *)p;
+            p   += sizeof(size);
+
+            if(nst_key_build_variant(key, ist2(p, size), &vkey) == NST_OK) {
+                nst_cache_delete(&vkey);
+            }
+
+            p += size;
+        }
+
+        free(vkey.data);
+        free_trash_chunk(suffix);
+    }
+
+    if(!nuster.cache->store.disk.loaded && global.nuster.cache.root.len
+            && !nst_disk_segment_on(&nuster.cache->store.disk)) {
 
-    if(!nuster.cache->store.disk.loaded && global.nuster.cache.root.len){
         nst_disk_obj_t  disk;
         hpx_buffer_t    *buf = get_trash_chunk();
 
@@ -1000,6 +2196,7 @@ nst_cache_hit(hpx_stream_t *s, hpx_stream_interface_t *si, hpx_channel_t *req, h
         nst_ctx_t *ctx) {
 
     hpx_appctx_t  *appctx = NULL;
+    uint64_t       total, beg, len;
 
     /*
      * set backend to nuster.applet.cache
@@ -1016,16 +2213,52 @@ nst_cache_hit(hpx_stream_t *s, hpx_stream_interface_t *si, hpx_channel_t *req, h
         appctx->st0 = ctx->state;
 
         if(ctx->state == NST_CTX_STATE_HIT_MEMORY) {
-            nst_memory_obj_attach(&nuster.cache->store.memory, ctx->store.memory.obj);
             appctx->ctx.nuster.store.memory.obj  = ctx->store.memory.obj;
             appctx->ctx.nuster.store.memory.item = ctx->store.memory.obj->item;
+
+            /* the length of an object being filled is unknown */
+            total = ctx->store.memory.obj->complete ? ctx->txn.res.payload_len : 0;
+
+            if(nst_http_parse_range(htxbuf(&req->buf), &ctx->txn, total, &beg, &len) == NST_OK) {
+                appctx->ctx.nuster.store.memory.range.beg   = beg;
+                appctx->ctx.nuster.store.memory.range.len   = len;
+                appctx->ctx.nuster.store.memory.range.total = total;
+            }
         } else {
             char  *meta = ctx->store.disk.obj.meta;
 
             appctx->ctx.nuster.store.disk.fd          = ctx->store.disk.obj.fd;
-            appctx->ctx.nuster.store.disk.offset      = nst_disk_pos_header(&ctx->store.disk.obj);
+            appctx->ctx.nuster.store.disk.offset      = ctx->store.disk.obj.base
+                + nst_disk_pos_header(&ctx->store.disk.obj);
             appctx->ctx.nuster.store.disk.header_len  = nst_disk_meta_get_header_len(meta);
             appctx->ctx.nuster.store.disk.payload_len = nst_disk_meta_get_payload_len(meta);
+            appctx->ctx.nuster.store.disk.aio         = NULL;
+
+            total = appctx->ctx.nuster.store.disk.payload_len;
+
+            if(nst_http_parse_range(htxbuf(&req->buf), &ctx->txn, total, &beg, &len) == NST_OK) {
+                appctx->ctx.nuster.store.disk.payload_len = len;
+                appctx->ctx.nuster.store.disk.range.beg   = beg;
+                appctx->ctx.nuster.store.disk.range.len   = len;
+                appctx->ctx.nuster.store.disk.range.total = total;
+            }
+
+            if(global.nuster.cache.disk_io_threads && nst_disk_aio_on()) {
+                /* the aio which checked the object, see nst_cache_exists */
+                nst_disk_aio_t  *aio = ctx->store.disk.obj.aio;
+
+                ctx->store.disk.obj.aio = NULL;
+
+                if(!aio) {
+                    aio = nst_disk_aio_create(NULL, -1);
+                }
+
+                if(aio) {
+                    nst_disk_aio_attach(aio, appctx, ctx->store.disk.obj.fd);
+                }
+
+                appctx->ctx.nuster.store.disk.aio = aio;
+            }
         }
 
         appctx->st1 = NST_DISK_APPLET_HEADER;
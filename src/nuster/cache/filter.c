@@ -72,11 +72,14 @@ _nst_cache_filter_attach(hpx_stream_t *s, hpx_filter_t *filter) {
         }
 
         ctx->state    = NST_CTX_STATE_INIT;
+        ctx->hit_uuid = -1;
         ctx->ctime    = nst_time_now_ms();
         ctx->rule_cnt = rule_cnt;
         ctx->key_cnt  = key_cnt;
         ctx->buf      = alloc_trash_chunk();
 
+        LIST_INIT(&ctx->waiter.list);
+
         if(!ctx->buf) {
             free(ctx);
 
@@ -96,10 +99,18 @@ static void
 _nst_cache_filter_detach(hpx_stream_t *s, hpx_filter_t *filter) {
 
     if(filter->ctx) {
-        nst_ctx_t  *ctx = filter->ctx;
-        int         i;
+        nst_ctx_t  *ctx   = filter->ctx;
+        uint64_t    bytes = ctx->txn.res.payload_len + ctx->txn.res.header_len;
+        int         uuid;
+
+        uuid = ctx->rule ? ctx->rule->uuid : -1;
+
+        if(ctx->hit_uuid >= 0) {
+            uuid = ctx->hit_uuid;
+        }
 
-        nst_stats_update_cache(ctx->state, ctx->txn.res.payload_len + ctx->txn.res.header_len);
+        nst_stats_update_cache(ctx->state, bytes);
+        nst_stats_update_rule(uuid, ctx->state, bytes, s->logs.t_data);
 
         if(ctx->state == NST_CTX_STATE_HIT_MEMORY) {
             nst_memory_obj_detach(&nuster.cache->store.memory, ctx->store.memory.obj);
@@ -109,12 +120,19 @@ _nst_cache_filter_detach(hpx_stream_t *s, hpx_filter_t *filter) {
             nst_cache_abort(ctx);
         }
 
-        for(i = 0; i < ctx->key_cnt; i++) {
-            ctx->key = &ctx->keys[i];
+        if(ctx->state == NST_CTX_STATE_WAIT) {
+            nst_cache_unwait(ctx);
+        }
 
-            if(ctx->key->data) {
-                free(ctx->key->data);
-            }
+        /* a disk check not handed over to the applet */
+        if(ctx->store.disk.obj.aio) {
+            nst_disk_aio_release(ctx->store.disk.obj.aio, ctx->store.disk.obj.fd);
+        }
+
+        free(ctx->vary.key.data);
+
+        if(ctx->vary.headers) {
+            free_trash_chunk(ctx->vary.headers);
         }
 
         free_trash_chunk(ctx->buf);
@@ -143,6 +161,47 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
             ctx->state = NST_CTX_STATE_BYPASS;
         }
 
+        if(ctx->state == NST_CTX_STATE_WAIT) {
+            /* woken up by nst_cache_finish/abort, or wait timed out */
+            if(nst_cache_waiting(ctx) && !tick_is_expired(req->analyse_exp, now_ms)) {
+                return 0;
+            }
+
+            nst_cache_unwait(ctx);
+
+            req->analyse_exp = TICK_ETERNITY;
+            ctx->state       = NST_CTX_STATE_INIT;
+        }
+
+        if(ctx->state == NST_CTX_STATE_CHECK_DISK) {
+            /* woken up by the io thread */
+            if(nst_disk_obj_checking(&ctx->store.disk.obj)) {
+                return 0;
+            }
+
+            ctx->state = NST_CTX_STATE_INIT;
+        }
+
+        /* a background refresh updates the entry it was created for */
+        if(ctx->state == NST_CTX_STATE_INIT && nst_cache_refreshing(s)) {
+
+            if(nst_http_parse_htx(s, ctx->buf, &ctx->txn) != NST_OK) {
+                ctx->state = NST_CTX_STATE_BYPASS;
+
+                return 1;
+            }
+
+            nst_debug_beg(s, "[cache] Check refresh: ");
+
+            ctx->state = nst_cache_refresh_attach(s, ctx);
+
+            if(ctx->state == NST_CTX_STATE_UPDATE) {
+                nst_debug_end("UPDATE");
+            } else {
+                nst_debug_end("BYPASS");
+            }
+        }
+
         if(ctx->state == NST_CTX_STATE_INIT) {
             int  i = 0;
 
@@ -152,12 +211,14 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
                 return 1;
             }
 
-            ctx->rule = nuster.proxy[px->uuid]->rule;
+            ctx->rule       = nuster.proxy[px->uuid]->rule;
+            ctx->refresh.on = meth == HTTP_METH_GET;
 
             for(i = 0; i < ctx->rule_cnt; i++) {
                 int  idx = ctx->rule->key->idx;
 
-                ctx->key = &(ctx->keys[idx]);
+                ctx->key          = &(ctx->keys[idx]);
+                ctx->vary.primary = NULL;
 
                 nst_debug(s, "[rule ] ----- %s", ctx->rule->prop.rid.ptr);
 
@@ -179,7 +240,7 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
                 if(!ctx->key->data) {
                     /* build key */
-                    if(nst_key_build(s, msg, ctx->rule, &ctx->txn, ctx->key, meth) != NST_OK) {
+                    if(nst_key_build(s, msg, ctx->rule, &ctx->txn, ctx->key, meth, ctx->buf) != NST_OK) {
                         ctx->state = NST_CTX_STATE_BYPASS;
 
                         return 1;
@@ -193,11 +254,31 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
                 /* check if cache exists  */
                 nst_debug_beg(s, "[cache] Check key existence: ");
 
-                ctx->state = nst_cache_exists(ctx);
+                ctx->state = nst_cache_exists(s, ctx);
+
+                if(ctx->state == NST_CTX_STATE_VARY) {
+                    nst_debug_end("VARY");
+                    nst_debug_beg(s, "[cache] Check variant existence: ");
+
+                    ctx->state = nst_cache_exists_variant(s, ctx);
+                }
+
+                if(ctx->refresh.state) {
+                    nst_cache_refresh(s, ctx);
+                }
+
+                if(ctx->state == NST_CTX_STATE_CHECK_DISK) {
+                    nst_debug_end("CHECK disk");
+
+                    return 0;
+                }
 
                 if(ctx->state == NST_CTX_STATE_HIT_MEMORY || ctx->state == NST_CTX_STATE_HIT_DISK) {
                     /* OK, cache exists */
 
+                    /* keys are shared by rules, the entry tells which stored it */
+                    ctx->hit_uuid = ctx->prop->uuid;
+
                     if(ctx->state == NST_CTX_STATE_HIT_MEMORY) {
                         nst_debug_end("HIT memory");
                     } else {
@@ -232,6 +313,14 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
                     nst_debug_end("PASS");
                     ctx->state = NST_CTX_STATE_PASS;
 
+                    /* variants of an admitted primary are admitted too */
+                    if(ctx->rule->prop.admit && !ctx->vary.primary
+                            && !nst_dict_admit(&nuster.cache->dict, ctx->key, ctx->rule->prop.admit)) {
+
+                        nst_debug(s, "[cache] Not admitted, bypass");
+                        ctx->state = NST_CTX_STATE_BYPASS;
+                    }
+
                     break;
                 }
 
@@ -239,6 +328,28 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
                 ctx->rule = ctx->rule->next;
             }
+
+            /* fill the whole object, ranges are served from the cache */
+            if(ctx->state == NST_CTX_STATE_PASS || ctx->state == NST_CTX_STATE_UPDATE) {
+                nst_http_remove_range(htxbuf(&req->buf));
+            }
+
+            /* the variant is unknown until the response tells its Vary */
+            if(ctx->state == NST_CTX_STATE_PASS && !ctx->vary.primary) {
+
+                if(ctx->vary.headers) {
+                    b_reset(ctx->vary.headers);
+                } else {
+                    ctx->vary.headers = alloc_trash_chunk();
+                }
+
+                if(ctx->vary.headers
+                        && nst_http_save_headers(htxbuf(&req->buf), ctx->vary.headers) != NST_OK) {
+
+                    free_trash_chunk(ctx->vary.headers);
+                    ctx->vary.headers = NULL;
+                }
+            }
         }
 
         if(ctx->state == NST_CTX_STATE_HIT_MEMORY || ctx->state == NST_CTX_STATE_HIT_DISK) {
@@ -253,12 +364,28 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
         if(ctx->state == NST_CTX_STATE_WAIT) {
             int  t = nst_time_now_ms() - ctx->ctime;
+            int  w = ctx->prop->wait;
+
+            if(w == 0 || (w > 0 && t < w * 1000)) {
 
-            if(ctx->prop->wait == 0 || (ctx->prop->wait > 0 && t < ctx->prop->wait * 1000)) {
-                usleep(1000);
-                ctx->state = NST_CTX_STATE_INIT;
+                if(nst_cache_wait(ctx, s->task) != NST_OK) {
+                    /* the entry has been filled meanwhile, check again */
+                    ctx->state = NST_CTX_STATE_INIT;
 
-                task_wakeup(s->task, TASK_WOKEN_MSG);
+                    task_wakeup(s->task, TASK_WOKEN_MSG);
+
+                    return 0;
+                }
+
+                if(w > 0) {
+                    req->analyse_exp = tick_add(now_ms, w * 1000 - t);
+                }
+
+                /* another process filling the entry cannot wake us up */
+                if(global.nbproc > 1) {
+                    req->analyse_exp = tick_first(req->analyse_exp,
+                            tick_add(now_ms, NST_CACHE_WAIT_POLL));
+                }
 
                 return 0;
             }
@@ -275,7 +402,8 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
             for(i = 0; i < ctx->rule_cnt; i++) {
                 int  idx = ctx->rule->key->idx;
 
-                ctx->key = &(ctx->keys[idx]);
+                ctx->key          = &(ctx->keys[idx]);
+                ctx->vary.primary = NULL;
 
                 nst_debug(s, "[cache] ==== Check rule: %s ====", ctx->rule->prop.rid.ptr);
                 nst_debug_beg(s, "[cache] Test rule ACL (res): ");
@@ -285,6 +413,14 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
                     nst_debug_end("PASS");
                     ctx->state = NST_CTX_STATE_PASS;
 
+                    /* variants of an admitted primary are admitted too */
+                    if(ctx->rule->prop.admit && !ctx->vary.primary
+                            && !nst_dict_admit(&nuster.cache->dict, ctx->key, ctx->rule->prop.admit)) {
+
+                        nst_debug(s, "[cache] Not admitted, bypass");
+                        ctx->state = NST_CTX_STATE_BYPASS;
+                    }
+
                     break;
                 }
 
@@ -294,7 +430,18 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
         }
 
-        if(ctx->state == NST_CTX_STATE_PASS) {
+        /* the conditional refresh request was answered by the origin */
+        if(ctx->state == NST_CTX_STATE_UPDATE && s->txn->status == 304
+                && nst_cache_refreshing(s)) {
+
+            nst_debug(s, "[cache] Revalidated");
+
+            nst_cache_revalidate(ctx);
+
+            return 1;
+        }
+
+        if(ctx->state == NST_CTX_STATE_PASS || ctx->state == NST_CTX_STATE_UPDATE) {
             nst_rule_code_t  *cc    = ctx->rule->code;
             int               valid = 0;
 
@@ -305,6 +452,12 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
                 valid = 1;
             }
 
+            /* a part of the object, or none of it, is not the object */
+            if(s->txn->status == 206 || s->txn->status == 304) {
+                valid = 0;
+                cc    = NULL;
+            }
+
             while(cc) {
 
                 if(cc->code == s->txn->status) {
@@ -319,13 +472,22 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
             if(!valid) {
                 nst_debug_end("FAIL");
 
+                /* keep the current object, see use-stale */
+                if(ctx->state == NST_CTX_STATE_UPDATE) {
+                    nst_cache_abort(ctx);
+
+                    ctx->state = NST_CTX_STATE_BYPASS;
+                }
+
                 return 1;
             }
 
             nst_debug_end("PASS");
 
-            ctx->state = NST_CTX_STATE_CREATE;
-            ctx->prop  = &ctx->rule->prop;
+            if(ctx->state == NST_CTX_STATE_PASS) {
+                ctx->state = NST_CTX_STATE_CREATE;
+                ctx->prop  = &ctx->rule->prop;
+            }
         }
 
         if(ctx->state == NST_CTX_STATE_CREATE || ctx->state == NST_CTX_STATE_UPDATE) {
@@ -347,6 +509,31 @@ _nst_cache_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
             nst_debug_end("PASS");
 
+            nst_debug_beg(s, "[cache] Check vary: ");
+
+            if(nst_http_parse_vary(htxbuf(&s->res.buf), ctx->buf, &ctx->txn) != NST_OK
+                    || (ctx->vary.primary && !ctx->txn.res.vary.len)) {
+
+                nst_debug_end("FAIL");
+
+                ctx->state = NST_CTX_STATE_BYPASS;
+
+                return 1;
+            }
+
+            nst_debug_end("PASS");
+
+            if(global.nuster.cache.tag_header.len
+                    && nst_http_parse_tags(htxbuf(&s->res.buf), ctx->buf, &ctx->txn,
+                        global.nuster.cache.tag_header) != NST_OK) {
+
+                nst_debug(s, "[cache] Too many tags");
+
+                ctx->state = NST_CTX_STATE_BYPASS;
+
+                return 1;
+            }
+
             nst_http_build_etag(s, ctx->buf, &ctx->txn, ctx->prop->etag);
 
             nst_http_build_last_modified(s, ctx->buf, &ctx->txn, ctx->prop->last_modified);
@@ -394,6 +581,11 @@ _nst_cache_filter_http_end(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_msg_t
 
         if(ctx->state == NST_CTX_STATE_CREATE || ctx->state == NST_CTX_STATE_UPDATE) {
 
+            /* woken up by the io thread once the staged writes are done */
+            if(ctx->store.disk.obj.file && !nst_disk_obj_flushed(&ctx->store.disk.obj)) {
+                return 0;
+            }
+
             if(nst_cache_finish(ctx) == NST_OK) {
                 nst_debug(s, "[cache] Create OK");
             } else {
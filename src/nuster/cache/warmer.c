@@ -0,0 +1,453 @@
+/*
+ * nuster cache warmer functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <haproxy/stream_interface.h>
+#include <haproxy/freq_ctr.h>
+#include <haproxy/applet.h>
+#include <haproxy/tools.h>
+#include <haproxy/http.h>
+#include <haproxy/proxy.h>
+#include <haproxy/task.h>
+#include <haproxy/log.h>
+
+#include <nuster/nuster.h>
+
+/*
+ * Process local, a warmer replays the url list of a cache backend through
+ * its rules before traffic is sent to it, see nuster warm. Its task runs on
+ * the first thread.
+ */
+typedef struct nst_warmer {
+    struct nst_warmer  *next;
+
+    hpx_proxy_t        *px;
+    hpx_task_t         *task;
+    FILE               *fp;
+    struct freq_ctr     freq;
+    int                 running;
+
+    /* set by the manager, handled by the task */
+    unsigned int        restart;
+    unsigned int        dump;
+
+    /* hot entries written to file.tmp then renamed to file */
+    struct {
+        char           *file;
+        FILE           *fp;
+        int             shard;
+        uint64_t        idx;
+    } dumper;
+} nst_warmer_t;
+
+static nst_warmer_t  *nst_warmers;
+
+/*
+ * A line is an absolute url, or a path which is then requested without Host.
+ * Returns NST_ERR for blank lines, comments and lines not understood.
+ */
+static int
+_nst_warmer_parse(char *line, hpx_ist_t *host, hpx_ist_t *uri, int *ssl) {
+    char  *end = line + strlen(line);
+    char  *ptr;
+
+    while(line < end && HTTP_IS_SPHT(*line)) {
+        line++;
+    }
+
+    while(end > line && (HTTP_IS_SPHT(end[-1]) || HTTP_IS_CRLF(end[-1]))) {
+        end--;
+    }
+
+    *host = IST_NULL;
+    *ssl  = 0;
+
+    if(line == end || *line == '#') {
+        return NST_ERR;
+    }
+
+    if(end - line > 7 && !strncasecmp(line, "http://", 7)) {
+        line += 7;
+    } else if(end - line > 8 && !strncasecmp(line, "https://", 8)) {
+        line += 8;
+        *ssl  = 1;
+    } else if(*line != '/') {
+        return NST_ERR;
+    }
+
+    if(*line != '/') {
+        ptr = memchr(line, '/', end - line);
+
+        if(!ptr) {
+            ptr = end;
+        }
+
+        *host = ist2(line, ptr - line);
+        line  = ptr;
+    }
+
+    *uri = line == end ? ist("/") : ist2(line, end - line);
+
+    return NST_OK;
+}
+
+static int
+_nst_warmer_spawn(nst_warmer_t *warmer, hpx_ist_t host, hpx_ist_t uri, int ssl) {
+    hpx_appctx_t  *appctx;
+    hpx_buffer_t   buf = BUF_NULL;
+    hpx_htx_t     *htx;
+
+    if(!b_alloc(&buf)) {
+        return NST_ERR;
+    }
+
+    htx = htx_from_buf(&buf);
+
+    if(nst_http_warm_request(htx, host, uri) != NST_OK) {
+        goto err;
+    }
+
+    htx_to_buf(htx, &buf);
+
+    appctx = appctx_new(&nuster.applet.warmer, tid_bit);
+
+    if(!appctx) {
+        goto err;
+    }
+
+    appctx->ctx.nuster.warm.warmer = warmer;
+
+    if(nst_cache_stream_new(appctx, warmer->px, &buf, ssl) != NST_OK) {
+        appctx_free(appctx);
+
+        goto err;
+    }
+
+    return NST_OK;
+
+err:
+    b_free(&buf);
+
+    return NST_ERR;
+}
+
+static void
+_nst_warmer_dump_start(nst_warmer_t *warmer) {
+    nst_dict_t  *dict = &nuster.cache->dict;
+
+    warmer->dumper.fp = fopen(warmer->dumper.file, "w");
+
+    if(!warmer->dumper.fp) {
+        send_log(warmer->px, LOG_WARNING, "[nuster] Failed to open %s: %s.\n",
+                warmer->dumper.file, strerror(errno));
+
+        return;
+    }
+
+    warmer->dumper.shard = 0;
+    warmer->dumper.idx   = 0;
+
+    /* pauses rehashing, so both tables can be walked */
+    __sync_add_and_fetch(&dict->paused, 1);
+}
+
+static void
+_nst_warmer_dump_end(nst_warmer_t *warmer) {
+    nst_dict_t  *dict = &nuster.cache->dict;
+    int          err;
+
+    __sync_sub_and_fetch(&dict->paused, 1);
+
+    err = ferror(warmer->dumper.fp);
+    err = fclose(warmer->dumper.fp) || err;
+
+    warmer->dumper.fp = NULL;
+
+    if(err || rename(warmer->dumper.file, warmer->px->nuster.warm.file)) {
+        send_log(warmer->px, LOG_WARNING, "[nuster] Failed to dump %s.\n",
+                warmer->px->nuster.warm.file);
+
+        unlink(warmer->dumper.file);
+    }
+}
+
+/*
+ * Write the hot entries of the proxy as urls, in slices like the purger.
+ * Returns 1 once the dict has been walked.
+ */
+static int
+_nst_warmer_dump(nst_warmer_t *warmer) {
+    nst_dict_t        *dict  = &nuster.cache->dict;
+    nst_dict_shard_t  *shard;
+    nst_dict_entry_t  *entry;
+    hpx_ist_t          pid   = ist(warmer->px->id);
+    uint64_t           start = nst_time_now_ms();
+    uint64_t           size, idx;
+
+    while(warmer->dumper.shard < NST_DICT_SHARDS) {
+        shard = &dict->shard[warmer->dumper.shard];
+
+        nst_shctx_lock(shard);
+
+        size = shard->table[0].size + shard->table[1].size;
+
+        while(warmer->dumper.idx < size) {
+            idx = warmer->dumper.idx++;
+
+            if(idx < shard->table[0].size) {
+                entry = *nst_dict_bucket(&shard->table[0], idx);
+            } else {
+                entry = *nst_dict_bucket(&shard->table[1], idx - shard->table[0].size);
+            }
+
+            while(entry) {
+
+                if(entry->state != NST_DICT_ENTRY_STATE_INIT
+                        && !nst_dict_entry_invalid(entry)
+                        && nst_dict_entry_hot(entry)
+                        && isteq(entry->prop.pid, pid) && entry->path.len) {
+
+                    fprintf(warmer->dumper.fp, "http://%.*s%.*s\n",
+                            (int)entry->host.len, entry->host.ptr,
+                            (int)entry->path.len, entry->path.ptr);
+                }
+
+                entry = entry->next;
+            }
+
+            if(nst_time_now_ms() - start > 10) {
+                break;
+            }
+        }
+
+        nst_shctx_unlock(shard);
+
+        if(warmer->dumper.idx == size) {
+            warmer->dumper.shard++;
+            warmer->dumper.idx = 0;
+        }
+
+        if(nst_time_now_ms() - start > 10) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static struct task *
+_nst_warmer_task(struct task *t, void *context, unsigned short state) {
+    nst_warmer_t  *warmer = context;
+    hpx_buffer_t  *chunk  = get_trash_chunk();
+    hpx_ist_t      host, uri;
+    int            rate   = warmer->px->nuster.warm.rate;
+    int            max    = 100;
+    int            ssl;
+
+    t->expire = TICK_ETERNITY;
+
+    if(_HA_ATOMIC_XCHG(&warmer->dump, 0) && !warmer->dumper.fp) {
+        _nst_warmer_dump_start(warmer);
+    }
+
+    if(warmer->dumper.fp) {
+
+        if(_nst_warmer_dump(warmer)) {
+            _nst_warmer_dump_end(warmer);
+        } else {
+            task_wakeup(t, TASK_WOKEN_OTHER);
+        }
+    }
+
+    if(_HA_ATOMIC_XCHG(&warmer->restart, 0)) {
+
+        if(warmer->fp) {
+            fclose(warmer->fp);
+        }
+
+        warmer->fp = fopen(warmer->px->nuster.warm.file, "r");
+    }
+
+    while(warmer->fp && warmer->running < warmer->px->nuster.warm.concurrency) {
+
+        if(max-- == 0) {
+            task_wakeup(t, TASK_WOKEN_OTHER);
+
+            break;
+        }
+
+        if(rate && !freq_ctr_remain(&warmer->freq, rate, 0)) {
+            t->expire = tick_add(now_ms, MS_TO_TICKS(next_event_delay(&warmer->freq, rate, 0)));
+
+            break;
+        }
+
+        if(!fgets(chunk->area, chunk->size, warmer->fp)) {
+            fclose(warmer->fp);
+            warmer->fp = NULL;
+
+            break;
+        }
+
+        /* too long, skip the rest of it */
+        if(!strchr(chunk->area, '\n') && !feof(warmer->fp)) {
+
+            while(fgets(chunk->area, chunk->size, warmer->fp) && !strchr(chunk->area, '\n'));
+
+            continue;
+        }
+
+        if(_nst_warmer_parse(chunk->area, &host, &uri, &ssl) != NST_OK) {
+            continue;
+        }
+
+        /* retried later, unless a release wakes the task up first */
+        if(_nst_warmer_spawn(warmer, host, uri, ssl) != NST_OK) {
+            t->expire = tick_add(now_ms, MS_TO_TICKS(1000));
+
+            break;
+        }
+
+        _HA_ATOMIC_ADD(&warmer->running, 1);
+
+        update_freq_ctr(&warmer->freq, 1);
+    }
+
+    return t;
+}
+
+static void
+nst_warmer_release_handler(hpx_appctx_t *appctx) {
+    nst_warmer_t  *warmer = appctx->ctx.nuster.warm.warmer;
+
+    _HA_ATOMIC_SUB(&warmer->running, 1);
+
+    task_wakeup(warmer->task, TASK_WOKEN_MSG);
+}
+
+/*
+ * Called by the manager, replays the url list of proxy name, or replaces it
+ * with the hot entries of the proxy if dump is set.
+ */
+int
+nst_cache_warm(hpx_ist_t name, int dump) {
+    nst_warmer_t  *warmer = nst_warmers;
+
+    while(warmer) {
+
+        if(isteq(ist(warmer->px->id), name)) {
+            break;
+        }
+
+        warmer = warmer->next;
+    }
+
+    if(!warmer) {
+        return NST_HTTP_404;
+    }
+
+    if(dump) {
+        _HA_ATOMIC_STORE(&warmer->dump, 1);
+    } else {
+
+        if(access(warmer->px->nuster.warm.file, R_OK)) {
+            return NST_HTTP_404;
+        }
+
+        _HA_ATOMIC_STORE(&warmer->restart, 1);
+    }
+
+    task_wakeup(warmer->task, TASK_WOKEN_MSG);
+
+    return NST_HTTP_200;
+}
+
+/*
+ * Called in the worker, after chroot, the url lists are read from there
+ */
+void
+nst_cache_warm_init() {
+    nst_warmer_t  *warmer;
+    hpx_proxy_t   *p;
+
+    nuster.applet.warmer.fct     = nst_cache_discard_handler;
+    nuster.applet.warmer.release = nst_warmer_release_handler;
+
+    if(global.nuster.cache.status != NST_STATUS_ON) {
+        return;
+    }
+
+    for(p = proxies_list; p; p = p->next) {
+
+        if(!p->nuster.warm.file || p->nuster.mode != NST_MODE_CACHE) {
+            continue;
+        }
+
+        warmer = calloc(1, sizeof(*warmer));
+
+        if(!warmer) {
+            goto err;
+        }
+
+        warmer->px   = p;
+        warmer->task = task_new(1UL);
+
+        memprintf(&warmer->dumper.file, "%s.tmp", p->nuster.warm.file);
+
+        if(!warmer->task || !warmer->dumper.file) {
+            goto err;
+        }
+
+        warmer->task->process = _nst_warmer_task;
+        warmer->task->context = warmer;
+
+        warmer->next = nst_warmers;
+        nst_warmers  = warmer;
+
+        /* the list may not exist yet, e.g. before the first dump */
+        if(!access(p->nuster.warm.file, R_OK)) {
+            warmer->restart = 1;
+
+            task_wakeup(warmer->task, TASK_WOKEN_INIT);
+        }
+    }
+
+    return;
+
+err:
+    ha_alert("Out of memory when initializing nuster cache warmer.\n");
+
+    exit(1);
+}
+
+/*
+ * A dump cut short by the exit of the worker must not keep rehashing paused,
+ * the dict is shared with the master and the next workers
+ */
+static void
+_nst_warmer_deinit() {
+    nst_warmer_t  *warmer;
+
+    for(warmer = nst_warmers; warmer; warmer = warmer->next) {
+
+        if(warmer->dumper.fp) {
+            __sync_sub_and_fetch(&nuster.cache->dict.paused, 1);
+
+            fclose(warmer->dumper.fp);
+
+            warmer->dumper.fp = NULL;
+
+            unlink(warmer->dumper.file);
+        }
+    }
+}
+
+REGISTER_POST_DEINIT(_nst_warmer_deinit);
@@ -10,79 +10,338 @@
  *
  */
 
+#include <import/xxhash.h>
+
 #include <nuster/nuster.h>
 
+static int
+_nst_dict_table_init(nst_dict_t *dict, nst_dict_table_t *table, uint64_t size) {
+    uint64_t  segments, i;
+    int       block_size = dict->shmem->block_size;
+
+    table->shift   = 0;
+    table->size    = size;
+    table->segment = NULL;
+
+    while((1ULL << table->shift) * sizeof(nst_dict_entry_t *) < block_size) {
+        table->shift++;
+    }
+
+    segments = size >> table->shift;
+
+    table->segment = nst_shmem_alloc(dict->shmem, segments * sizeof(nst_dict_entry_t **));
+
+    if(!table->segment) {
+        goto err;
+    }
+
+    memset(table->segment, 0, segments * sizeof(nst_dict_entry_t **));
+
+    for(i = 0; i < segments; i++) {
+        table->segment[i] = nst_shmem_alloc(dict->shmem, block_size);
+
+        if(!table->segment[i]) {
+            goto err;
+        }
+
+        memset(table->segment[i], 0, block_size);
+    }
+
+    return NST_OK;
+
+err:
+
+    if(table->segment) {
+
+        for(i = 0; i < segments; i++) {
+            nst_shmem_free(dict->shmem, table->segment[i]);
+        }
+
+        nst_shmem_free(dict->shmem, table->segment);
+    }
+
+    table->size    = 0;
+    table->segment = NULL;
+
+    return NST_ERR;
+}
+
+static void
+_nst_dict_table_free(nst_dict_t *dict, nst_dict_table_t *table) {
+    uint64_t  i;
+
+    for(i = 0; i < table->size >> table->shift; i++) {
+        nst_shmem_free(dict->shmem, table->segment[i]);
+    }
+
+    nst_shmem_free(dict->shmem, table->segment);
+
+    table->size    = 0;
+    table->segment = NULL;
+}
+
+/*
+ * max buckets of a table, its segment array has to fit in one block
+ */
+static uint64_t
+_nst_dict_table_max_size(nst_dict_t *dict) {
+    uint64_t  n = dict->shmem->block_size / sizeof(nst_dict_entry_t *);
+
+    return n * n;
+}
+
 int
-nst_dict_init(nst_dict_t *dict, nst_store_t *store, nst_shmem_t *shmem, uint64_t dict_size) {
+nst_dict_init(nst_dict_t *dict, nst_store_t *store, nst_shmem_t *shmem, uint64_t dict_size,
+        int indexed, int tagged) {
 
-    int  block_size = shmem->block_size;
-    int  entry_size = sizeof(nst_dict_entry_t *);
-    int  size       = (block_size + dict_size - 1) / block_size * block_size;
-    int  i;
+    nst_dict_shard_t  *shard;
+    uint64_t           block_size = shmem->block_size;
+    uint64_t           entry_size = sizeof(nst_dict_entry_t *);
+    uint64_t           size;
+    int                i, j;
 
-    dict->shmem = shmem;
-    dict->size  = size / entry_size;
-    dict->used  = 0;
-    dict->entry = nst_shmem_alloc(shmem, block_size);
-    dict->store = store;
+    dict->shmem   = shmem;
+    dict->store   = store;
+    dict->indexed = indexed;
+    dict->tagged  = tagged;
 
-    if(!dict->entry) {
-        return NST_ERR;
+    /* split dict_size evenly between shards, at least one block each */
+    size = (dict_size / NST_DICT_SHARDS + block_size - 1) / block_size * block_size;
+
+    if(size < block_size) {
+        size = block_size;
+    }
+
+    size /= entry_size;
+
+    if(size > _nst_dict_table_max_size(dict)) {
+        size = _nst_dict_table_max_size(dict);
     }
 
-    for(i = 1; i < size / block_size; i++) {
+    for(i = 0; i < NST_DICT_SHARDS; i++) {
+        shard = &dict->shard[i];
+
+        shard->used      = 0;
+        shard->min_size  = size;
+        shard->tags_dead = NULL;
 
-        if(!nst_shmem_alloc(shmem, block_size)) {
+        if(_nst_dict_table_init(dict, &shard->table[0], size) != NST_OK) {
+            return NST_ERR;
+        }
+
+        /* paths are about as many as keys, the other values are few */
+        for(j = 0; indexed && j < NST_DICT_INDEX_SIZE; j++) {
+            uint64_t  n = j == NST_DICT_INDEX_PATH ? size : block_size / entry_size;
+
+            if(_nst_dict_table_init(dict, &shard->index[j], n) != NST_OK) {
+                return NST_ERR;
+            }
+        }
+
+        if(tagged && _nst_dict_table_init(dict, &shard->tags, size) != NST_OK) {
+            return NST_ERR;
+        }
+
+        if(nst_shctx_init(shard) != NST_OK) {
             return NST_ERR;
         }
     }
 
-    for(i = 0; i < dict->size; i++) {
-        dict->entry[i] = NULL;
+    return NST_OK;
+}
+
+static hpx_ist_t
+_nst_dict_index_value(nst_dict_entry_t *entry, int type) {
+
+    switch(type) {
+        case NST_DICT_INDEX_PROXY:
+            return entry->prop.pid;
+        case NST_DICT_INDEX_RULE:
+            return entry->prop.rid;
+        case NST_DICT_INDEX_HOST:
+            return entry->host;
+        default:
+            return entry->path;
     }
+}
 
-    return nst_shctx_init(dict);
+static nst_dict_entry_t **
+_nst_dict_index_bucket(nst_dict_shard_t *shard, int type, hpx_ist_t value) {
+    nst_dict_table_t  *table = &shard->index[type];
+
+    return nst_dict_bucket(table, XXH3(value.ptr, value.len, 0) % table->size);
+}
+
+/*
+ * prepend entry to the secondary indexes of its shard, the shard must be locked
+ */
+static void
+_nst_dict_index_add(nst_dict_t *dict, nst_dict_shard_t *shard, nst_dict_entry_t *entry) {
+    nst_dict_entry_t  **bucket;
+    int                 i;
+
+    if(!dict->indexed) {
+        return;
+    }
+
+    for(i = 0; i < NST_DICT_INDEX_SIZE; i++) {
+        bucket = _nst_dict_index_bucket(shard, i, _nst_dict_index_value(entry, i));
+
+        entry->index[i].next  = *bucket;
+        entry->index[i].pprev = bucket;
+
+        if(*bucket) {
+            (*bucket)->index[i].pprev = &entry->index[i].next;
+        }
+
+        *bucket = entry;
+    }
+}
+
+static void
+_nst_dict_index_del(nst_dict_entry_t *entry) {
+    int  i;
+
+    for(i = 0; i < NST_DICT_INDEX_SIZE; i++) {
+
+        if(!entry->index[i].pprev) {
+            continue;
+        }
+
+        *entry->index[i].pprev = entry->index[i].next;
+
+        if(entry->index[i].next) {
+            entry->index[i].next->index[i].pprev = entry->index[i].pprev;
+        }
+
+        entry->index[i].pprev = NULL;
+    }
+}
+
+/*
+ * return the first entry of shard in the index bucket of value, the following
+ * ones are chained by entry->index[type].next and may have another value.
+ * The dict must be indexed and the shard locked.
+ */
+nst_dict_entry_t *
+nst_dict_index_first(nst_dict_shard_t *shard, int type, hpx_ist_t value) {
+    return *_nst_dict_index_bucket(shard, type, value);
+}
+
+static nst_dict_tag_t **
+_nst_dict_tag_bucket(nst_dict_shard_t *shard, hpx_ist_t name) {
+    nst_dict_table_t  *table = &shard->tags;
+
+    return (nst_dict_tag_t **)nst_dict_bucket(table, XXH3(name.ptr, name.len, 0) % table->size);
+}
+
+/*
+ * Unlink the tags of entry from the tag index. A paused purger may hold one of
+ * them as its cursor, so while purging they are only freed once the purgers
+ * are done, see nst_dict_cleanup. Their next still leads back to the index.
+ */
+static void
+_nst_dict_tags_del(nst_dict_t *dict, nst_dict_entry_t *entry) {
+    nst_dict_shard_t  *shard;
+    nst_dict_tag_t    *tag;
+    int                i;
+
+    for(i = 0; i < entry->tag_cnt; i++) {
+        tag = &entry->tag[i];
+
+        *tag->pprev = tag->next;
+
+        if(tag->next) {
+            tag->next->pprev = tag->pprev;
+        }
+    }
+
+    if(entry->tag && dict->purging) {
+        shard = nst_dict_shard(dict, entry->key.hash);
+
+        /* pprev is not walked by the purgers */
+        entry->tag->pprev = (nst_dict_tag_t **)shard->tags_dead;
+        shard->tags_dead  = entry->tag;
+    } else {
+        nst_shmem_free(dict->shmem, entry->tag);
+    }
+
+    entry->tag     = NULL;
+    entry->tag_cnt = 0;
+}
+
+/*
+ * return the first tag of shard in the tag index bucket of name, the following
+ * ones are chained by tag->next and may have another name.
+ * The dict must be tagged and the shard locked.
+ */
+nst_dict_tag_t *
+nst_dict_tag_first(nst_dict_shard_t *shard, hpx_ist_t name) {
+    return *_nst_dict_tag_bucket(shard, name);
 }
 
 /*
  * Check entry validity, free the entry if its invalid,
+ * one bucket of one shard is checked per call
  */
 void
 nst_dict_cleanup(nst_dict_t *dict) {
+    nst_dict_shard_t  *shard;
     nst_dict_entry_t  *entry;
     nst_dict_entry_t  *prev;
+    nst_dict_entry_t **bucket;
     uint64_t           start;
 
-    if(!dict->used) {
+    shard = &dict->shard[__sync_fetch_and_add(&dict->cleanup_idx, 1) % NST_DICT_SHARDS];
+
+    if(!shard->used && !shard->tags_dead) {
         return;
     }
 
     start = nst_time_now_ms();
 
-    nst_shctx_lock(dict);
+    nst_shctx_lock(shard);
+
+    /* the purgers keep a cursor in the indexes between two calls */
+    if((dict->indexed || dict->tagged) && dict->purging) {
+        nst_shctx_unlock(shard);
+
+        return;
+    }
 
-    entry = dict->entry[dict->cleanup_idx];
-    prev  = entry;
+    while(shard->tags_dead) {
+        nst_dict_tag_t  *tag = shard->tags_dead;
+
+        shard->tags_dead = (nst_dict_tag_t *)tag->pprev;
+
+        nst_shmem_free(dict->shmem, tag);
+    }
+
+    bucket = nst_dict_bucket(&shard->table[0], shard->cleanup_idx);
+    entry  = *bucket;
+    prev   = entry;
 
     while(entry) {
 
         if(nst_dict_entry_invalid(entry)) {
             nst_dict_entry_t  *tmp = entry;
 
-            if(entry->store.memory.obj) {
-                entry->store.memory.obj->invalid = 1;
-                entry->store.memory.obj          = NULL;
-
-                nst_memory_incr_invalid(&dict->store->memory);
-            }
+            nst_dict_drop_memory(dict, entry);
 
             if(entry->store.disk.file) {
+
+                /* account the dead object for compaction */
+                if(nst_disk_segment_on(&dict->store->disk)) {
+                    nst_disk_purge_by_path(&dict->store->disk, entry->store.disk.file,
+                            entry->store.disk.offset);
+                }
+
                 nst_shmem_free(dict->shmem, entry->store.disk.file);
                 entry->store.disk.file = NULL;
             }
 
             if(prev == entry) {
-                dict->entry[dict->cleanup_idx] = entry->next;
+                *bucket = entry->next;
                 prev = entry->next;
             } else {
                 prev->next = entry->next;
@@ -90,11 +349,25 @@ nst_dict_cleanup(nst_dict_t *dict) {
 
             entry = entry->next;
 
+            nst_stats_update_entries(tmp->prop.uuid, -1, 0);
+
+            _nst_dict_index_del(tmp);
+            _nst_dict_tags_del(dict, tmp);
+
+            while(tmp->variant) {
+                nst_dict_variant_t  *variant = tmp->variant;
+
+                tmp->variant = variant->next;
+
+                nst_shmem_free(dict->shmem, variant);
+            }
+
+            nst_shmem_free(dict->shmem, tmp->vary.ptr);
             nst_shmem_free(dict->shmem, tmp->buf.area);
             nst_shmem_free(dict->shmem, tmp->key.data);
             nst_shmem_free(dict->shmem, tmp);
 
-            dict->used--;
+            shard->used--;
         } else {
             prev  = entry;
             entry = entry->next;
@@ -106,23 +379,468 @@ nst_dict_cleanup(nst_dict_t *dict) {
     }
 
     if(entry == NULL) {
-        dict->cleanup_idx++;
+        shard->cleanup_idx++;
+    }
+
+    /* if we have checked the whole shard */
+    if(shard->cleanup_idx >= shard->table[0].size) {
+        shard->cleanup_idx = 0;
+    }
+
+    nst_shctx_unlock(shard);
+}
+
+/*
+ * Grow or shrink the bucket tables incrementally, at most
+ * NST_DICT_REHASH_STEP buckets of each shard are moved per call.
+ * Rehashing is paused while a purger or another walker is walking the dict.
+ */
+void
+nst_dict_rehash(nst_dict_t *dict) {
+    nst_dict_shard_t   *shard;
+    nst_dict_table_t    table, old;
+    nst_dict_entry_t   *entry, *next, **bucket;
+    uint64_t            size;
+    int                 i, n;
+
+    for(i = 0; i < NST_DICT_SHARDS; i++) {
+        shard = &dict->shard[i];
+
+        if(dict->purging || dict->paused) {
+            return;
+        }
+
+        if(!nst_dict_rehashing(shard)) {
+            size = shard->table[0].size;
+
+            if(shard->used > size * NST_DICT_REHASH_GROW
+                    && size * 2 <= _nst_dict_table_max_size(dict)) {
+
+                size *= 2;
+            } else if(shard->used < size / NST_DICT_REHASH_SHRINK
+                    && size / 2 >= shard->min_size
+                    && (size >> shard->table[0].shift) % 2 == 0) {
+
+                size /= 2;
+            } else {
+                continue;
+            }
+
+            /* the new table is not visible yet, allocate it without lock */
+            if(_nst_dict_table_init(dict, &table, size) != NST_OK) {
+                continue;
+            }
+
+            nst_shctx_lock(shard);
+
+            shard->table[1]   = table;
+            shard->rehash_idx = 0;
+
+            nst_shctx_unlock(shard);
+        }
+
+        old.segment = NULL;
+
+        nst_shctx_lock(shard);
+
+        for(n = 0; n < NST_DICT_REHASH_STEP && !dict->purging && !dict->paused; n++) {
+
+            if(shard->rehash_idx == shard->table[0].size) {
+                old = shard->table[0];
+
+                shard->table[0]         = shard->table[1];
+                shard->table[1].size    = 0;
+                shard->table[1].segment = NULL;
+                shard->cleanup_idx      = 0;
+                shard->sync_idx         = 0;
+                shard->evict_idx        = 0;
+
+                break;
+            }
+
+            bucket  = nst_dict_bucket(&shard->table[0], shard->rehash_idx);
+            entry   = *bucket;
+            *bucket = NULL;
+
+            while(entry) {
+                next   = entry->next;
+                bucket = nst_dict_bucket(&shard->table[1],
+                        nst_dict_table_idx(&shard->table[1], entry->key.hash));
+
+                entry->next = *bucket;
+                *bucket     = entry;
+
+                entry = next;
+            }
+
+            shard->rehash_idx++;
+        }
+
+        nst_shctx_unlock(shard);
+
+        if(old.segment) {
+            _nst_dict_table_free(dict, &old);
+        }
+    }
+}
+
+/*
+ * Pick the next cold memory object of shard to evict.
+ *
+ * A clock hand (*idx, shard->evict_idx to evict) walks the buckets and samples
+ * up to NST_DICT_EVICT_SAMPLES entries stored in memory, the one with the
+ * highest idle time weighted by its size is picked. Entries accessed within the
+ * last NST_DICT_EVICT_IDLE ms are skipped as they may be being served.
+ *
+ * shard must be locked.
+ */
+static nst_dict_entry_t *
+_nst_dict_evict_victim(nst_dict_shard_t *shard, uint64_t *idx) {
+    nst_dict_entry_t  *entry, *victim;
+    uint64_t           now, idle, score, max;
+    int                samples, scan;
+
+    victim  = NULL;
+    max     = 0;
+    samples = 0;
+    now     = nst_time_now_ms();
+
+    for(scan = 0; scan < NST_DICT_EVICT_SCAN && samples < NST_DICT_EVICT_SAMPLES; scan++) {
+        entry = *nst_dict_bucket(&shard->table[0], *idx);
+
+        while(entry) {
+
+            if((entry->state == NST_DICT_ENTRY_STATE_VALID
+                        || entry->state == NST_DICT_ENTRY_STATE_STALE)
+                    && entry->store.memory.obj
+                    && now - entry->atime >= NST_DICT_EVICT_IDLE) {
+
+                idle  = now - entry->atime;
+                score = idle * (1 + (entry->header_len + entry->payload_len) / 1024);
+
+                if(score > max || victim == NULL) {
+                    victim = entry;
+                    max    = score;
+                }
+
+                samples++;
+            }
+
+            entry = entry->next;
+        }
+
+        (*idx)++;
+
+        if(*idx >= shard->table[0].size) {
+            *idx = 0;
+        }
+    }
+
+    return victim;
+}
+
+/*
+ * Evict one cold memory object of shard to make room in the memory zone.
+ * An evicted entry which is also stored on disk stays valid and is served from
+ * disk afterwards, otherwise it is invalidated and freed by cleanup.
+ *
+ * shard must be locked.
+ */
+static int
+_nst_dict_evict(nst_dict_t *dict, nst_dict_shard_t *shard) {
+    nst_dict_entry_t  *victim = _nst_dict_evict_victim(shard, &shard->evict_idx);
+    nst_memory_obj_t  *obj;
+
+    if(!victim) {
+        return NST_ERR;
+    }
+
+    obj = victim->store.memory.obj;
+
+    victim->store.memory.obj = NULL;
+
+    if(victim->store.memory.gzip) {
+        nst_memory_obj_release(&dict->store->memory, victim->store.memory.gzip);
+
+        victim->store.memory.gzip = NULL;
+    }
+
+    if(!victim->store.disk.file) {
+        victim->state  = NST_DICT_ENTRY_STATE_INVALID;
+        victim->expire = 0;
+    }
+
+    nst_memory_obj_release(&dict->store->memory, obj);
+
+    nst_stats_update_entries(victim->prop.uuid, 0, 1);
+
+    return NST_OK;
+}
+
+/*
+ * Allocate from the dict memory zone, evict cold memory objects of shard
+ * until the allocation succeeds or nothing can be evicted.
+ *
+ * shard must be locked.
+ */
+static void *
+_nst_dict_shard_alloc(nst_dict_t *dict, nst_dict_shard_t *shard, int size) {
+    void  *p;
+    int    tries = NST_DICT_EVICT_TRIES;
+
+    p = nst_shmem_alloc(dict->shmem, size);
+
+    while(!p && tries-- && shard->used) {
+
+        if(_nst_dict_evict(dict, shard) != NST_OK) {
+            break;
+        }
+
+        p = nst_shmem_alloc(dict->shmem, size);
+    }
+
+    return p;
+}
+
+/*
+ * Allocate from the dict memory zone, evict cold memory objects from the
+ * shards in turn if it is full.
+ *
+ * no shard must be locked by the caller.
+ */
+void *
+nst_dict_alloc(nst_dict_t *dict, int size) {
+    nst_dict_shard_t  *shard;
+    void              *p;
+    int                i;
+
+    p = nst_shmem_alloc(dict->shmem, size);
+
+    for(i = 0; !p && i < NST_DICT_SHARDS; i++) {
+        shard = &dict->shard[__sync_fetch_and_add(&dict->evict_idx, 1) % NST_DICT_SHARDS];
+
+        nst_shctx_lock(shard);
+        p = _nst_dict_shard_alloc(dict, shard, size);
+        nst_shctx_unlock(shard);
+    }
+
+    return p;
+}
+
+/*
+ * Allocate the admission sketch, about one counter per entry the dict can grow
+ * to: the tables rehashed to their max size, or as many entries as shmem holds
+ */
+int
+nst_dict_sketch_init(nst_dict_t *dict) {
+    nst_dict_sketch_t  *sketch = &dict->sketch;
+    uint64_t            size;
+
+    size = NST_DICT_SHARDS * _nst_dict_table_max_size(dict);
+
+    if(size > dict->shmem->size / sizeof(nst_dict_entry_t)) {
+        size = dict->shmem->size / sizeof(nst_dict_entry_t);
+    }
+
+    sketch->width = 1024;
+
+    while(sketch->width * NST_DICT_SKETCH_DEPTH < size) {
+        sketch->width <<= 1;
+    }
+
+    sketch->added   = 0;
+    sketch->aging   = 0;
+    sketch->age_idx = 0;
+    sketch->sample  = sketch->width * NST_DICT_SKETCH_SAMPLE;
+    sketch->counter = nst_shmem_alloc(dict->shmem, sketch->width * NST_DICT_SKETCH_DEPTH);
+
+    if(!sketch->counter) {
+        return NST_ERR;
+    }
+
+    memset(sketch->counter, 0, sketch->width * NST_DICT_SKETCH_DEPTH);
+
+    return NST_OK;
+}
+
+static inline uint8_t *
+_nst_dict_sketch_counter(nst_dict_sketch_t *sketch, uint64_t hash, int row) {
+    uint32_t  a = hash;
+    uint32_t  b = (hash >> 32) | 1;
+
+    return &sketch->counter[row * sketch->width + ((a + row * b) & (sketch->width - 1))];
+}
+
+static int
+_nst_dict_sketch_estimate(nst_dict_sketch_t *sketch, uint64_t hash) {
+    int  min = UINT8_MAX;
+    int  i;
+
+    for(i = 0; i < NST_DICT_SKETCH_DEPTH; i++) {
+        uint8_t  *c = _nst_dict_sketch_counter(sketch, hash, i);
+
+        if(*c < min) {
+            min = *c;
+        }
+    }
+
+    return min;
+}
+
+/*
+ * Count hash and return its new estimate. Only the smallest counters are
+ * incremented, concurrent adds may be lost which the estimate tolerates.
+ */
+int
+nst_dict_sketch_add(nst_dict_t *dict, uint64_t hash) {
+    nst_dict_sketch_t  *sketch = &dict->sketch;
+    uint64_t            i;
+    int                 min;
+
+    if(!sketch->counter) {
+        return 0;
+    }
+
+    min = _nst_dict_sketch_estimate(sketch, hash);
+
+    if(min < UINT8_MAX) {
+
+        for(i = 0; i < NST_DICT_SKETCH_DEPTH; i++) {
+            uint8_t  *c = _nst_dict_sketch_counter(sketch, hash, i);
+
+            if(*c == min) {
+                (*c)++;
+            }
+        }
+
+        min++;
     }
 
-    /* if we have checked the whole dict */
-    if(dict->cleanup_idx == dict->size) {
-        dict->cleanup_idx = 0;
+    /* aged by the master, see nst_dict_sketch_age */
+    if(__sync_add_and_fetch(&sketch->added, 1) % sketch->sample == 0) {
+        sketch->aging = 1;
     }
 
-    nst_shctx_unlock(dict);
+    return min;
+}
+
+/*
+ * Halve the counters once sample adds were reached, NST_DICT_SKETCH_AGE words
+ * per call so that housekeeping is not held by a large sketch
+ */
+void
+nst_dict_sketch_age(nst_dict_t *dict) {
+    nst_dict_sketch_t  *sketch = &dict->sketch;
+    uint64_t           *word;
+    uint64_t            words, end;
+
+    if(!sketch->counter || !sketch->aging) {
+        return;
+    }
+
+    word  = (uint64_t *)sketch->counter;
+    words = sketch->width * NST_DICT_SKETCH_DEPTH / sizeof(*word);
+    end   = sketch->age_idx + NST_DICT_SKETCH_AGE;
+
+    if(end > words) {
+        end = words;
+    }
+
+    while(sketch->age_idx < end) {
+        word[sketch->age_idx] = (word[sketch->age_idx] >> 1) & 0x7F7F7F7F7F7F7F7FULL;
+        sketch->age_idx++;
+    }
+
+    if(sketch->age_idx >= words) {
+        sketch->age_idx = 0;
+        sketch->aging   = 0;
+    }
+}
+
+/*
+ * TinyLFU admission, see rule.admit. Count key and tell whether its object
+ * is worth storing: it has been counted threshold times lately, or more
+ * often than the memory object the next eviction of its shard would drop.
+ */
+int
+nst_dict_admit(nst_dict_t *dict, nst_key_t *key, int threshold) {
+    nst_dict_shard_t  *shard = nst_dict_shard(dict, key->hash);
+    nst_dict_entry_t  *victim;
+    uint64_t           idx;
+    int                freq, ret;
+
+    if(!dict->sketch.counter) {
+        return 1;
+    }
+
+    freq = nst_dict_sketch_add(dict, key->hash);
+
+    if(freq >= threshold) {
+        return 1;
+    }
+
+    nst_shctx_lock(shard);
+
+    /* a peek, the clock hand is only moved by evictions */
+    idx    = shard->evict_idx;
+    victim = _nst_dict_evict_victim(shard, &idx);
+
+    ret = victim && freq > _nst_dict_sketch_estimate(&dict->sketch, victim->key.hash);
+
+    nst_shctx_unlock(shard);
+
+    return ret;
+}
+
+/*
+ * find the entry of key in shard, both tables are checked while rehashing
+ */
+static nst_dict_entry_t *
+_nst_dict_lookup(nst_dict_shard_t *shard, nst_key_t *key) {
+    nst_dict_table_t  *table;
+    nst_dict_entry_t  *entry;
+    int                i;
+
+    for(i = 0; i < 2 && shard->table[i].size; i++) {
+        table = &shard->table[i];
+        entry = *nst_dict_bucket(table, nst_dict_table_idx(table, key->hash));
+
+        while(entry) {
+
+            if(entry->key.hash == key->hash && entry->key.size == key->size
+                    && !memcmp(entry->key.uuid, key->uuid, NST_KEY_UUID_LEN)
+                    && !memcmp(entry->key.data, key->data, key->size)) {
+
+                return entry;
+            }
+
+            entry = entry->next;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * prepend entry to its bucket, new entries go to table[1] while rehashing
+ */
+static void
+_nst_dict_insert(nst_dict_shard_t *shard, nst_dict_entry_t *entry) {
+    nst_dict_table_t   *table  = &shard->table[nst_dict_rehashing(shard)];
+    nst_dict_entry_t  **bucket = nst_dict_bucket(table, nst_dict_table_idx(table, entry->key.hash));
+
+    entry->next = *bucket;
+    *bucket     = entry;
+
+    shard->used++;
 }
 
 nst_dict_entry_t *
 nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_prop_t *prop) {
+    nst_dict_shard_t  *shard = nst_dict_shard(dict, key->hash);
     nst_dict_entry_t  *entry = NULL;
-    int                idx;
 
-    entry = nst_shmem_alloc(dict->shmem, sizeof(*entry));
+    entry = _nst_dict_shard_alloc(dict, shard, sizeof(*entry));
 
     if(!entry) {
         goto err;
@@ -130,20 +848,19 @@ nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_pro
 
     memset(entry, 0, sizeof(*entry));
 
-    idx = key->hash % dict->size;
+    entry->key.hash  = key->hash;
+    entry->prop.uuid = prop->uuid;
 
-    /* prepend entry to dict->entry[idx] */
-    entry->next      = dict->entry[idx];
-    dict->entry[idx] = entry;
-    dict->used++;
+    _nst_dict_insert(shard, entry);
+
+    nst_stats_update_entries(entry->prop.uuid, 1, 0);
 
     /* init entry */
     entry->state = NST_DICT_ENTRY_STATE_INIT;
 
     /* set key */
     entry->key.size = key->size;
-    entry->key.hash = key->hash;
-    entry->key.data = nst_shmem_alloc(dict->shmem, key->size);
+    entry->key.data = _nst_dict_shard_alloc(dict, shard, key->size);
 
     if(!entry->key.data) {
         goto err;
@@ -157,7 +874,7 @@ nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_pro
         + txn->res.last_modified.len + prop->pid.len + prop->rid.len;
 
     entry->buf.data = 0;
-    entry->buf.area = nst_shmem_alloc(dict->shmem, entry->buf.size);
+    entry->buf.area = _nst_dict_shard_alloc(dict, shard, entry->buf.size);
 
     if(!entry->buf.area) {
         goto err;
@@ -181,6 +898,8 @@ nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_pro
     entry->prop.rid = ist2(entry->buf.area + entry->buf.data, prop->rid.len);
     chunk_istcat(&entry->buf, prop->rid);
 
+    entry->validators = txn->res.validators;
+
     entry->prop.ttl           = txn->res.ttl;
 
     entry->prop.extend[0]     = prop->extend[0];
@@ -191,11 +910,14 @@ nst_dict_set(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_pro
     entry->prop.last_modified = prop->last_modified;
     entry->prop.wait          = prop->wait;
     entry->prop.stale         = prop->stale;
+    entry->prop.refresh       = prop->refresh;
     entry->prop.inactive      = prop->inactive;
     entry->prop.store         = prop->store;
     entry->expire             = 0;
     entry->atime              = nst_time_now_ms();
 
+    _nst_dict_index_add(dict, shard, entry);
+
     return entry;
 
 err:
@@ -207,113 +929,208 @@ err:
     return NULL;
 }
 
+/*
+ * return entry of key in any state, without checking expiration
+ */
+nst_dict_entry_t *
+nst_dict_lookup(nst_dict_t *dict, nst_key_t *key) {
+    return _nst_dict_lookup(nst_dict_shard(dict, key->hash), key);
+}
+
+/*
+ * Replace the validators of entry with the ones of the refetched response in
+ * txn. entry->buf is not resized, a validator of another length is dropped.
+ * Must be called with the dict lock held.
+ */
+void
+nst_dict_set_validators(nst_dict_entry_t *entry, nst_http_txn_t *txn) {
+
+    if(txn->res.etag.len == entry->etag.len) {
+        memcpy(entry->etag.ptr, txn->res.etag.ptr, entry->etag.len);
+    } else {
+        entry->etag.len = 0;
+    }
+
+    if(txn->res.last_modified.len == entry->last_modified.len) {
+        memcpy(entry->last_modified.ptr, txn->res.last_modified.ptr, entry->last_modified.len);
+    } else {
+        entry->last_modified.len = 0;
+    }
+
+    entry->validators = txn->res.validators;
+
+    if(!entry->etag.len) {
+        entry->validators &= ~NST_HTTP_VALIDATOR_ETAG;
+    }
+
+    if(!entry->last_modified.len) {
+        entry->validators &= ~NST_HTTP_VALIDATOR_LAST_MODIFIED;
+    }
+}
+
+/*
+ * Replace the tags of entry with the ones of the response in txn and link them
+ * in the tag index. Must be called with the dict lock held.
+ */
+int
+nst_dict_set_tags(nst_dict_t *dict, nst_dict_entry_t *entry, nst_http_txn_t *txn) {
+    nst_dict_shard_t   *shard = nst_dict_shard(dict, entry->key.hash);
+    nst_dict_tag_t     *tag, **bucket;
+    char               *p, *end;
+    int                 i;
+
+    if(!dict->tagged) {
+        return NST_OK;
+    }
+
+    _nst_dict_tags_del(dict, entry);
+
+    if(!txn->res.tag_cnt) {
+        return NST_OK;
+    }
+
+    tag = _nst_dict_shard_alloc(dict, shard,
+            txn->res.tag_cnt * sizeof(*tag) + txn->res.tags.len);
+
+    if(!tag) {
+        return NST_ERR;
+    }
+
+    p   = (char *)(tag + txn->res.tag_cnt);
+    end = p + txn->res.tags.len;
+
+    memcpy(p, txn->res.tags.ptr, txn->res.tags.len);
+
+    entry->tag     = tag;
+    entry->tag_cnt = txn->res.tag_cnt;
+
+    for(i = 0; i < entry->tag_cnt; i++) {
+        tag = &entry->tag[i];
+
+        tag->entry    = entry;
+        tag->name.ptr = p;
+
+        while(p < end && *p != ' ') {
+            p++;
+        }
+
+        tag->name.len = p - tag->name.ptr;
+
+        p++;
+
+        bucket = _nst_dict_tag_bucket(shard, tag->name);
+
+        tag->next  = *bucket;
+        tag->pprev = bucket;
+
+        if(*bucket) {
+            (*bucket)->pprev = &tag->next;
+        }
+
+        *bucket = tag;
+    }
+
+    return NST_OK;
+}
+
 /*
  * return NULL if invalid;
  * return entry if init and valid
  */
 nst_dict_entry_t *
 nst_dict_get(nst_dict_t *dict, nst_key_t *key) {
+    nst_dict_shard_t  *shard = nst_dict_shard(dict, key->hash);
     nst_dict_entry_t  *entry = NULL;
     uint64_t           max;
-    int                idx, expired;
+    int                expired;
 
-    if(dict->used == 0) {
+    if(shard->used == 0) {
         return NULL;
     }
 
-    idx   = key->hash % dict->size;
-    entry = dict->entry[idx];
+    entry = _nst_dict_lookup(shard, key);
 
-    while(entry) {
+    if(entry) {
 
-        if(entry->key.hash == key->hash && entry->key.size == key->size
-                && !memcmp(entry->key.uuid, key->uuid, NST_KEY_UUID_LEN)
-                && !memcmp(entry->key.data, key->data, key->size)) {
+        if(entry->state == NST_DICT_ENTRY_STATE_INVALID) {
+            return NULL;
+        }
 
-            if(entry->state == NST_DICT_ENTRY_STATE_INVALID) {
-                return NULL;
-            }
+        if(entry->state == NST_DICT_ENTRY_STATE_INIT
+                || entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
 
-            if(entry->state == NST_DICT_ENTRY_STATE_INIT
-                    || entry->state == NST_DICT_ENTRY_STATE_UPDATE) {
+            return entry;
+        }
 
-                return entry;
-            }
+        if(entry->state == NST_DICT_ENTRY_STATE_STALE) {
 
-            if(entry->state == NST_DICT_ENTRY_STATE_STALE) {
+            if(nst_dict_entry_stale_valid(entry)) {
+                entry->atime = nst_time_now_ms();
 
-                if(nst_dict_entry_stale_valid(entry)) {
-                    return entry;
-                } else {
-                    return NULL;
-                }
+                return entry;
+            } else {
+                return NULL;
             }
+        }
 
-            /*
-             * check extend
-             */
-            expired = nst_dict_entry_expired(entry);
-
-            max = 1000 * entry->expire + 1000 * entry->prop.ttl * entry->prop.extend[3] / 100;
+        /*
+         * check extend
+         */
+        expired = nst_dict_entry_expired(entry);
 
-            entry->atime = nst_time_now_ms();
+        max = 1000 * entry->expire + 1000 * entry->prop.ttl * entry->prop.extend[3] / 100;
 
-            if(expired && entry->prop.extend[0] != 0xFF && entry->atime <= max
-                    && entry->access[3] > entry->access[2]
-                    && entry->access[2] > entry->access[1]) {
+        entry->atime = nst_time_now_ms();
 
-                entry->expire    += entry->prop.ttl;
+        if(expired && entry->prop.extend[0] != 0xFF && entry->atime <= max
+                && entry->access[3] > entry->access[2]
+                && entry->access[2] > entry->access[1]) {
 
-                entry->access[0] += entry->access[1];
-                entry->access[0] += entry->access[2];
-                entry->access[0] += entry->access[3];
-                entry->access[1]  = 0;
-                entry->access[2]  = 0;
-                entry->access[3]  = 0;
-                entry->extended  += 1;
+            entry->expire    += entry->prop.ttl;
 
-                if(entry->store.disk.file) {
-                    nst_disk_update_expire(entry->store.disk.file, entry->expire);
-                }
+            entry->access[0] += entry->access[1];
+            entry->access[0] += entry->access[2];
+            entry->access[0] += entry->access[3];
+            entry->access[1]  = 0;
+            entry->access[2]  = 0;
+            entry->access[3]  = 0;
+            entry->extended  += 1;
 
-                expired = 0;
+            if(entry->store.disk.file) {
+                nst_disk_update_expire(entry->store.disk.file, entry->store.disk.offset,
+                        entry->expire);
             }
 
-            /*
-             * check stale
-             */
-            if(expired && entry->prop.stale >= 0) {
-                entry->state = NST_DICT_ENTRY_STATE_REFRESH;
-
-                expired = 0;
-            }
+            expired = 0;
+        }
 
-            /* check expire
-             * change state only, leave the free stuff to cleanup
-             * */
-            if(expired) {
-                entry->state     = NST_DICT_ENTRY_STATE_INVALID;
-                entry->expire    = 0;
-                entry->access[0] = 0;
-                entry->access[1] = 0;
-                entry->access[2] = 0;
-                entry->access[3] = 0;
-                entry->extended  = 0;
-
-                if(entry->store.memory.obj) {
-                    entry->store.memory.obj->invalid = 1;
-                    entry->store.memory.obj          = NULL;
-
-                    nst_memory_incr_invalid(&dict->store->memory);
-                }
+        /*
+         * check stale
+         */
+        if(expired && nst_dict_entry_refresh_window(entry)) {
+            entry->state = NST_DICT_ENTRY_STATE_REFRESH;
 
-                return NULL;
-            }
+            expired = 0;
+        }
 
-            return entry;
+        /* check expire
+         * change state only, leave the free stuff to cleanup
+         * */
+        if(expired) {
+            entry->state     = NST_DICT_ENTRY_STATE_INVALID;
+            entry->expire    = 0;
+            entry->access[0] = 0;
+            entry->access[1] = 0;
+            entry->access[2] = 0;
+            entry->access[3] = 0;
+            entry->extended  = 0;
+
+            nst_dict_drop_memory(dict, entry);
+
+            return NULL;
         }
 
-        entry = entry->next;
+        return entry;
     }
 
     return NULL;
@@ -321,26 +1138,12 @@ nst_dict_get(nst_dict_t *dict, nst_key_t *key) {
 
 int
 nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, nst_key_t *key, nst_http_txn_t *txn,
-        nst_rule_prop_t *prop, char *file, uint64_t expire) {
+        nst_rule_prop_t *prop, char *file, uint64_t offset, uint64_t expire) {
 
+    nst_dict_shard_t  *shard = nst_dict_shard(dict, key->hash);
     nst_dict_entry_t  *entry = NULL;
-    int                idx;
-
-    idx = key->hash % dict->size;
-
-    entry = dict->entry[idx];
-
-    while(entry) {
-
-        if(entry->key.hash == key->hash && entry->key.size == key->size
-                && !memcmp(entry->key.uuid, key->uuid, NST_KEY_UUID_LEN)
-                && !memcmp(entry->key.data, key->data, key->size)) {
 
-            break;
-        }
-
-        entry = entry->next;
-    }
+    entry = _nst_dict_lookup(shard, key);
 
     if(entry) {
         nst_shmem_free(dict->shmem, key->data);
@@ -357,10 +1160,24 @@ nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, nst_key_t *key, nst_
 
     memset(entry, 0, sizeof(*entry));
 
-    /* prepend entry to dict->entry[idx] */
-    entry->next      = dict->entry[idx];
-    dict->entry[idx] = entry;
-    dict->used++;
+    entry->store.disk.file = nst_shmem_alloc(dict->shmem, strlen(file) + 1);
+
+    if(!entry->store.disk.file) {
+        nst_shmem_free(dict->shmem, entry);
+
+        return NST_ERR;
+    }
+
+    memcpy(entry->store.disk.file, file, strlen(file) + 1);
+
+    entry->store.disk.offset = offset;
+
+    entry->key.hash  = key->hash;
+    entry->prop.uuid = prop->uuid;
+
+    _nst_dict_insert(shard, entry);
+
+    nst_stats_update_entries(entry->prop.uuid, 1, 0);
 
     /* init entry */
     if(expire == 0 || expire * 1000 > nst_time_now_ms()) {
@@ -373,16 +1190,6 @@ nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, nst_key_t *key, nst_
     entry->expire = expire;
     entry->atime  = nst_time_now_ms();
 
-    entry->store.disk.file = nst_shmem_alloc(dict->shmem, strlen(file));
-
-    if(!entry->store.disk.file) {
-        nst_shmem_free(dict->shmem, entry);
-
-        return NST_ERR;
-    }
-
-    memcpy(entry->store.disk.file, file, strlen(file));
-
     entry->header_len         = txn->res.header_len;
     entry->payload_len        = txn->res.payload_len;
     entry->buf                = *buf;
@@ -400,8 +1207,11 @@ nst_dict_set_from_disk(nst_dict_t *dict, hpx_buffer_t *buf, nst_key_t *key, nst_
     entry->prop.etag          = prop->etag;
     entry->prop.last_modified = prop->last_modified;
     entry->prop.stale         = prop->stale;
+    entry->prop.refresh       = prop->refresh;
     entry->prop.inactive      = prop->inactive;
 
+    _nst_dict_index_add(dict, shard, entry);
+
     return NST_OK;
 }
 
@@ -431,3 +1241,103 @@ nst_dict_record_access(nst_dict_entry_t *entry) {
     }
 
 }
+
+/*
+ * Drop the memory objects of entry, they are freed by the memory cleaner once
+ * nobody reads them.
+ *
+ * the shard of entry must be locked.
+ */
+void
+nst_dict_drop_memory(nst_dict_t *dict, nst_dict_entry_t *entry) {
+
+    if(entry->store.memory.obj) {
+        entry->store.memory.obj->invalid = 1;
+        entry->store.memory.obj          = NULL;
+
+        nst_memory_incr_invalid(&dict->store->memory);
+    }
+
+    if(entry->store.memory.gzip) {
+        entry->store.memory.gzip->invalid = 1;
+        entry->store.memory.gzip          = NULL;
+
+        nst_memory_incr_invalid(&dict->store->memory);
+    }
+}
+
+/*
+ * Set the primary entry of key for the variants of a response with Vary,
+ * txn->res.vary holds the normalized header names. The entry stores no object
+ * and lives as long as its variants, it expires without stale nor extend.
+ *
+ * the shard of key must be locked.
+ */
+nst_dict_entry_t *
+nst_dict_set_vary(nst_dict_t *dict, nst_key_t *key, nst_http_txn_t *txn, nst_rule_prop_t *prop) {
+    nst_dict_shard_t  *shard = nst_dict_shard(dict, key->hash);
+    nst_dict_entry_t  *entry;
+
+    entry = nst_dict_set(dict, key, txn, prop);
+
+    if(!entry) {
+        return NULL;
+    }
+
+    entry->vary.ptr = _nst_dict_shard_alloc(dict, shard, txn->res.vary.len);
+
+    if(!entry->vary.ptr) {
+        entry->state = NST_DICT_ENTRY_STATE_INVALID;
+
+        return NULL;
+    }
+
+    memcpy(entry->vary.ptr, txn->res.vary.ptr, txn->res.vary.len);
+
+    entry->vary.len       = txn->res.vary.len;
+    entry->prop.extend[0] = 0xFF;
+    entry->prop.stale     = -1;
+    entry->prop.inactive  = 0;
+    entry->ctime          = nst_time_now_ms();
+    entry->state          = NST_DICT_ENTRY_STATE_VALID;
+
+    return entry;
+}
+
+/*
+ * Record the variant of suffix under the primary entry, so that it can be
+ * purged along. Returns NST_ERR if entry has too many variants.
+ *
+ * the shard of entry must be locked.
+ */
+int
+nst_dict_add_variant(nst_dict_t *dict, nst_dict_entry_t *entry, hpx_ist_t suffix) {
+    nst_dict_shard_t    *shard = nst_dict_shard(dict, entry->key.hash);
+    nst_dict_variant_t  *variant;
+
+    for(variant = entry->variant; variant; variant = variant->next) {
+
+        if(variant->size == suffix.len && !memcmp(variant->data, suffix.ptr, suffix.len)) {
+            return NST_OK;
+        }
+    }
+
+    if(entry->variant_cnt >= NST_DICT_VARIANTS) {
+        return NST_ERR;
+    }
+
+    variant = _nst_dict_shard_alloc(dict, shard, sizeof(*variant) + suffix.len);
+
+    if(!variant) {
+        return NST_ERR;
+    }
+
+    variant->size = suffix.len;
+    memcpy(variant->data, suffix.ptr, suffix.len);
+
+    variant->next  = entry->variant;
+    entry->variant = variant;
+    entry->variant_cnt++;
+
+    return NST_OK;
+}
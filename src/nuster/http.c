@@ -76,15 +76,15 @@ struct nst_http_code nst_http_codes[NST_HTTP_SIZE] = {
 };
 
 int
-nst_http_find_param(char *query_beg, char *query_end, char *name, char **val, int *val_len) {
+nst_http_find_param(char *query_beg, char *query_end, hpx_ist_t name, char **val, int *val_len) {
     char   equal    = '=';
     char   and      = '&';
     char  *ptr      = query_beg;
-    int    name_len = strlen(name);
+    int    name_len = name.len;
 
     while(ptr + name_len + 1 < query_end) {
 
-        if(!memcmp(ptr, name, name_len) && *(ptr + name_len) == equal) {
+        if(!memcmp(ptr, name.ptr, name_len) && *(ptr + name_len) == equal) {
 
             if(ptr == query_beg || *(ptr - 1) == and) {
                 ptr  = ptr + name_len + 1;
@@ -134,6 +134,19 @@ nst_http_memory_item_to_htx(nst_memory_item_t *item, hpx_htx_t *htx) {
     return NST_OK;
 }
 
+/*
+ * Append len bytes of a DATA item from offset to the tail DATA block of htx,
+ * so that a buffer filled with payload holds a single DATA block and can be
+ * handed over to the mux without another copy.
+ * Returns the number of bytes appended, less than len if htx is full.
+ */
+uint32_t
+nst_http_memory_data_to_htx(nst_memory_item_t *item, uint32_t offset, uint32_t len,
+        hpx_htx_t *htx) {
+
+    return htx_add_data(htx, ist2(item->data + offset, len));
+}
+
 void
 nst_http_reply(hpx_stream_t *s, int idx) {
     hpx_stream_interface_t  *si  = &s->si[1];
@@ -385,6 +398,79 @@ code412:
     return 1;
 }
 
+/*
+ * Check if gzip is acceptable by Accept-Encoding, ranges are only served
+ * from the identity encoded response.
+ */
+static int
+_nst_http_accept_gzip(hpx_htx_t *htx) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    hpx_ist_t           name, q;
+    char               *p, *end;
+    int                 any = 0;
+
+    if(http_find_header(htx, ist("Range"), &hdr, 1)) {
+        return 0;
+    }
+
+    hdr.blk = NULL;
+
+    while(http_find_header(htx, ist("Accept-Encoding"), &hdr, 0)) {
+        p   = hdr.value.ptr;
+        end = hdr.value.ptr + hdr.value.len;
+
+        name.ptr = p;
+
+        while(p < end && *p != ';' && !HTTP_IS_SPHT(*p)) {
+            p++;
+        }
+
+        name.len = p - name.ptr;
+
+        /* q=0 means not acceptable */
+        q = ist2(NULL, 0);
+
+        while(p < end) {
+
+            if(*p == 'q' && p + 1 < end && *(p + 1) == '=') {
+                q.ptr = p + 2;
+                q.len = end - q.ptr;
+
+                break;
+            }
+
+            p++;
+        }
+
+        if(q.ptr) {
+
+            while(q.len && (*q.ptr == '0' || *q.ptr == '.')) {
+                q.ptr++;
+                q.len--;
+            }
+
+            if(!q.len || HTTP_IS_SPHT(*q.ptr)) {
+
+                if(isteqi(name, ist("gzip"))) {
+                    return 0;
+                }
+
+                continue;
+            }
+        }
+
+        if(isteqi(name, ist("gzip")) || isteqi(name, ist("x-gzip"))) {
+            return 1;
+        }
+
+        if(isteq(name, ist("*"))) {
+            any = 1;
+        }
+    }
+
+    return any;
+}
+
 int
 nst_http_parse_htx(hpx_stream_t *s, hpx_buffer_t *buf, nst_http_txn_t *txn) {
     hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
@@ -468,6 +554,8 @@ nst_http_parse_htx(hpx_stream_t *s, hpx_buffer_t *buf, nst_http_txn_t *txn) {
         chunk_istcat(buf, hdr.value);
     }
 
+    txn->req.gzip = _nst_http_accept_gzip(htx);
+
     return NST_OK;
 }
 
@@ -480,10 +568,13 @@ nst_http_build_etag(hpx_stream_t *s, hpx_buffer_t *buf, nst_http_txn_t *txn, int
     txn->res.etag.ptr = buf->area + buf->data;
     txn->res.etag.len = 0;
 
+    txn->res.validators &= ~NST_HTTP_VALIDATOR_ETAG;
+
     htx = htxbuf(&s->res.buf);
 
     if(http_find_header(htx, ist("ETag"), &hdr, 1)) {
-        txn->res.etag.len = hdr.value.len;
+        txn->res.etag.len    = hdr.value.len;
+        txn->res.validators |= NST_HTTP_VALIDATOR_ETAG;
 
         chunk_istcat(buf, hdr.value);
     } else {
@@ -512,10 +603,14 @@ nst_http_build_last_modified(hpx_stream_t *s, hpx_buffer_t *buf, nst_http_txn_t
     txn->res.last_modified.ptr = buf->area + buf->data;
     txn->res.last_modified.len = len;
 
+    txn->res.validators &= ~NST_HTTP_VALIDATOR_LAST_MODIFIED;
+
     if(http_find_header(htx, ist("Last-Modified"), &hdr, 1)) {
 
         if(hdr.value.len == len) {
             chunk_istcat(buf, hdr.value);
+
+            txn->res.validators |= NST_HTTP_VALIDATOR_LAST_MODIFIED;
         }
 
     } else {
@@ -605,3 +700,622 @@ nst_http_parse_ttl(hpx_htx_t *htx, hpx_buffer_t *buf, nst_http_txn_t *txn) {
     return NST_ERR;
 }
 
+
+/*
+ * Collect the header names of Vary, lowercased and separated by ','.
+ * Returns NST_ERR if the response varies on everything or buf is full.
+ */
+int
+nst_http_parse_vary(hpx_htx_t *htx, hpx_buffer_t *buf, nst_http_txn_t *txn) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    int                 i;
+
+    txn->res.vary.ptr = buf->area + buf->data;
+    txn->res.vary.len = 0;
+
+    while(http_find_header(htx, ist("Vary"), &hdr, 0)) {
+
+        if(!hdr.value.len) {
+            continue;
+        }
+
+        if(isteq(hdr.value, ist("*"))) {
+            return NST_ERR;
+        }
+
+        if(b_room(buf) < hdr.value.len + 1) {
+            return NST_ERR;
+        }
+
+        if(txn->res.vary.len) {
+            buf->area[buf->data++] = ',';
+            txn->res.vary.len++;
+        }
+
+        for(i = 0; i < hdr.value.len; i++) {
+            buf->area[buf->data++] = tolower((unsigned char)hdr.value.ptr[i]);
+        }
+
+        txn->res.vary.len += hdr.value.len;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Collect the tags of the name headers of the response, like Surrogate-Key or
+ * Cache-Tag, separated by ' ' in txn->res.tags. Values are split on ',' and
+ * white spaces, at most NST_DICT_TAGS tags are kept.
+ */
+int
+nst_http_parse_tags(hpx_htx_t *htx, hpx_buffer_t *buf, nst_http_txn_t *txn, hpx_ist_t name) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    hpx_ist_t           tag;
+    char               *p, *end;
+
+    txn->res.tags.ptr = buf->area + buf->data;
+    txn->res.tags.len = 0;
+    txn->res.tag_cnt  = 0;
+
+    while(http_find_header(htx, name, &hdr, 0)) {
+        p   = hdr.value.ptr;
+        end = hdr.value.ptr + hdr.value.len;
+
+        while(p < end && txn->res.tag_cnt < NST_DICT_TAGS) {
+
+            while(p < end && HTTP_IS_SPHT(*p)) {
+                p++;
+            }
+
+            tag.ptr = p;
+
+            while(p < end && !HTTP_IS_SPHT(*p)) {
+                p++;
+            }
+
+            tag.len = p - tag.ptr;
+
+            if(!tag.len) {
+                continue;
+            }
+
+            if(b_room(buf) < tag.len + 1) {
+                return NST_ERR;
+            }
+
+            if(txn->res.tags.len) {
+                buf->area[buf->data++] = ' ';
+                txn->res.tags.len++;
+            }
+
+            chunk_istcat(buf, tag);
+
+            txn->res.tags.len += tag.len;
+            txn->res.tag_cnt++;
+        }
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Keep a copy of the request headers of htx in buf, so that the values of the
+ * Vary headers of the response can be looked up
+ */
+int
+nst_http_save_headers(hpx_htx_t *htx, hpx_buffer_t *buf) {
+    hpx_htx_t      *dst = htx_from_buf(buf);
+    hpx_htx_blk_t  *blk;
+
+    for(blk = htx_get_first_blk(htx); blk; blk = htx_get_next_blk(htx, blk)) {
+        hpx_htx_blk_type_t  type = htx_get_blk_type(blk);
+
+        if(type == HTX_BLK_EOH) {
+            break;
+        }
+
+        if(type != HTX_BLK_HDR) {
+            continue;
+        }
+
+        if(!htx_add_header(dst, htx_get_blk_name(htx, blk), htx_get_blk_value(htx, blk))) {
+            return NST_ERR;
+        }
+    }
+
+    if(!htx_add_endof(dst, HTX_BLK_EOH)) {
+        return NST_ERR;
+    }
+
+    htx_to_buf(dst, buf);
+
+    return NST_OK;
+}
+
+/*
+ * Append to buf the request values of the headers of vary, which identify the
+ * variant of the response: name, then the values separated by ','
+ */
+int
+nst_http_vary_suffix(hpx_htx_t *htx, hpx_ist_t vary, hpx_buffer_t *buf, hpx_ist_t *suffix) {
+    hpx_http_hdr_ctx_t  hdr;
+    hpx_ist_t           name;
+    char               *p, *end;
+
+    suffix->ptr = buf->area + buf->data;
+    suffix->len = 0;
+
+    p   = vary.ptr;
+    end = vary.ptr + vary.len;
+
+    while(p < end) {
+        name.ptr = p;
+
+        while(p < end && *p != ',') {
+            p++;
+        }
+
+        name.len = p - name.ptr;
+
+        p++;
+
+        if(!name.len) {
+            continue;
+        }
+
+        if(!chunk_istcat(buf, name) || !chunk_memcat(buf, "", 1)) {
+            return NST_ERR;
+        }
+
+        hdr.blk = NULL;
+
+        while(http_find_header(htx, name, &hdr, 0)) {
+
+            if(!chunk_istcat(buf, hdr.value) || !chunk_memcat(buf, ",", 1)) {
+                return NST_ERR;
+            }
+        }
+
+        if(!chunk_memcat(buf, "", 1)) {
+            return NST_ERR;
+        }
+    }
+
+    suffix->len = buf->area + buf->data - suffix->ptr;
+
+    return NST_OK;
+}
+
+static int
+_nst_http_parse_uint(char *p, char *end, uint64_t *v) {
+
+    if(p == end) {
+        return NST_ERR;
+    }
+
+    *v = 0;
+
+    while(p < end) {
+
+        if(*p < '0' || *p > '9' || *v > (UINT64_MAX - 9) / 10) {
+            return NST_ERR;
+        }
+
+        *v = *v * 10 + (*p - '0');
+        p++;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Parse the Range of a request for an object of total payload bytes.
+ * Only a single satisfiable byte range is served, if If-Range matches the
+ * ETag or Last-Modified of the object. The whole object is served otherwise,
+ * which is allowed by RFC7233.
+ * Returns NST_OK and sets beg and len if the range should be served.
+ */
+int
+nst_http_parse_range(hpx_htx_t *htx, nst_http_txn_t *txn, uint64_t total, uint64_t *beg,
+        uint64_t *len) {
+
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    uint64_t            first, last;
+    char               *p, *end, *dash;
+
+    if(!total) {
+        return NST_ERR;
+    }
+
+    if(http_find_header(htx, ist("If-Range"), &hdr, 1)) {
+
+        if(!isteq(hdr.value, txn->res.etag) && !isteq(hdr.value, txn->res.last_modified)) {
+            return NST_ERR;
+        }
+
+        /* weak validators can not be used */
+        if(hdr.value.len > 1 && hdr.value.ptr[0] == 'W' && hdr.value.ptr[1] == '/') {
+            return NST_ERR;
+        }
+    }
+
+    hdr.blk = NULL;
+
+    if(!http_find_header(htx, ist("Range"), &hdr, 1)) {
+        return NST_ERR;
+    }
+
+    p   = hdr.value.ptr;
+    end = hdr.value.ptr + hdr.value.len;
+
+    if(end - p < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+        return NST_ERR;
+    }
+
+    p += 6;
+
+    while(p < end && HTTP_IS_SPHT(*p)) {
+        p++;
+    }
+
+    while(end > p && HTTP_IS_SPHT(*(end - 1))) {
+        end--;
+    }
+
+    dash = memchr(p, '-', end - p);
+
+    /* multiple ranges are not supported */
+    if(!dash || memchr(p, ',', end - p)) {
+        return NST_ERR;
+    }
+
+    if(dash == p) {
+        /* suffix range, the last bytes */
+        if(_nst_http_parse_uint(dash + 1, end, &last) != NST_OK || !last) {
+            return NST_ERR;
+        }
+
+        first = last < total ? total - last : 0;
+        last  = total - 1;
+    } else {
+
+        if(_nst_http_parse_uint(p, dash, &first) != NST_OK || first >= total) {
+            return NST_ERR;
+        }
+
+        if(dash + 1 == end) {
+            last = total - 1;
+        } else if(_nst_http_parse_uint(dash + 1, end, &last) != NST_OK || last < first) {
+            return NST_ERR;
+        }
+
+        if(last >= total) {
+            last = total - 1;
+        }
+    }
+
+    *beg = first;
+    *len = last - first + 1;
+
+    return NST_OK;
+}
+
+/*
+ * A range is only taken from a cached 200, any other status is served whole.
+ * The If-Range check of nst_http_parse_range only matters in that case.
+ */
+int
+nst_http_range_allowed(hpx_htx_t *htx) {
+    hpx_htx_sl_t  *sl = http_get_stline(htx);
+
+    return sl && isteq(htx_sl_res_code(sl), ist("200"));
+}
+
+/*
+ * Turn the cached response headers of htx into the headers of a 206 Partial
+ * Content of len bytes from beg
+ */
+int
+nst_http_range_headers(hpx_htx_t *htx, uint64_t beg, uint64_t len, uint64_t total) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    hpx_htx_sl_t       *sl;
+    char                buf[128];
+
+    sl = http_get_stline(htx);
+
+    if(!sl || !http_replace_res_status(htx, ist("206"), ist("Partial Content"))) {
+        return NST_ERR;
+    }
+
+    while(http_find_header(htx, ist("Content-Length"), &hdr, 1)) {
+        http_remove_header(htx, &hdr);
+    }
+
+    hdr.blk = NULL;
+
+    while(http_find_header(htx, ist("Transfer-Encoding"), &hdr, 1)) {
+        http_remove_header(htx, &hdr);
+    }
+
+    sl = http_get_stline(htx);
+
+    sl->flags &= ~HTX_SL_F_CHNK;
+    sl->flags |= HTX_SL_F_CLEN | HTX_SL_F_XFER_LEN;
+
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)len);
+
+    if(!http_add_header(htx, ist("Content-Length"), ist(buf))) {
+        return NST_ERR;
+    }
+
+    snprintf(buf, sizeof(buf), "bytes %llu-%llu/%llu", (unsigned long long)beg,
+            (unsigned long long)(beg + len - 1), (unsigned long long)total);
+
+    if(!http_add_header(htx, ist("Content-Range"), ist(buf))) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * A miss is filled with the whole object, the client gets all of it
+ */
+void
+nst_http_remove_range(hpx_htx_t *htx) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+
+    while(http_find_header(htx, ist("Range"), &hdr, 1)) {
+        http_remove_header(htx, &hdr);
+    }
+
+    hdr.blk = NULL;
+
+    while(http_find_header(htx, ist("If-Range"), &hdr, 1)) {
+        http_remove_header(htx, &hdr);
+    }
+}
+
+/*
+ * Add name to the Vary of htx, appended to the first Vary header if any.
+ * Nothing is done if it is listed already.
+ */
+int
+nst_http_vary_add(hpx_htx_t *htx, hpx_ist_t name) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    hpx_buffer_t       *vary;
+
+    while(http_find_header(htx, ist("Vary"), &hdr, 0)) {
+
+        if(isteq(hdr.value, ist("*")) || isteqi(hdr.value, name)) {
+            return NST_OK;
+        }
+    }
+
+    hdr.blk = NULL;
+
+    if(!http_find_header(htx, ist("Vary"), &hdr, 1)) {
+        return http_add_header(htx, ist("Vary"), name) ? NST_OK : NST_ERR;
+    }
+
+    vary = get_trash_chunk();
+
+    if(!chunk_istcat(vary, hdr.value)
+            || (hdr.value.len && !chunk_istcat(vary, ist(", ")))
+            || !chunk_istcat(vary, name)
+            || !http_replace_header_value(htx, &hdr, ist2(vary->area, vary->data))) {
+
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * A response of a gzip rule is served as is or encoded depending on the
+ * Accept-Encoding of the request, both representations say so in their Vary.
+ * Returns NST_ERR if the response is already encoded.
+ */
+int
+nst_http_gzip_vary(hpx_htx_t *htx) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+
+    if(http_find_header(htx, ist("Content-Encoding"), &hdr, 0)) {
+        return NST_ERR;
+    }
+
+    return nst_http_vary_add(htx, ist("Accept-Encoding"));
+}
+
+/*
+ * Copy the response headers of htx to dst as flt_http_comp would send them
+ * gzip encoded. Returns NST_ERR if the response is already encoded.
+ */
+int
+nst_http_gzip_headers(hpx_htx_t *htx, hpx_htx_t *dst) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    hpx_htx_blk_type_t  type;
+    hpx_htx_blk_t      *blk, *tail;
+    hpx_htx_sl_t       *sl;
+    hpx_buffer_t       *etag;
+    uint32_t            sz;
+
+    if(http_find_header(htx, ist("Content-Encoding"), &hdr, 0)) {
+        return NST_ERR;
+    }
+
+    for(blk = htx_get_first_blk(htx); blk; blk = htx_get_next_blk(htx, blk)) {
+        type = htx_get_blk_type(blk);
+        sz   = htx_get_blksz(blk);
+
+        if(type == HTX_BLK_UNUSED) {
+            continue;
+        }
+
+        tail = htx_add_blk(dst, type, sz);
+
+        if(!tail) {
+            return NST_ERR;
+        }
+
+        tail->info = blk->info;
+
+        memcpy(htx_get_blk_ptr(dst, tail), htx_get_blk_ptr(htx, blk), sz);
+
+        if(type == HTX_BLK_EOH) {
+            break;
+        }
+    }
+
+    sl = http_get_stline(dst);
+
+    if(!sl || !http_add_header(dst, ist("Content-Encoding"), ist("gzip"))) {
+        return NST_ERR;
+    }
+
+    hdr.blk = NULL;
+
+    while(http_find_header(dst, ist("Content-Length"), &hdr, 1)) {
+        http_remove_header(dst, &hdr);
+    }
+
+    hdr.blk = NULL;
+
+    if(!http_find_header(dst, ist("Transfer-Encoding"), &hdr, 1)
+            && !http_add_header(dst, ist("Transfer-Encoding"), ist("chunked"))) {
+
+        return NST_ERR;
+    }
+
+    sl = http_get_stline(dst);
+
+    sl->flags &= ~HTX_SL_F_CLEN;
+    sl->flags |= HTX_SL_F_CHNK;
+
+    /* the encoded response is not byte identical */
+    hdr.blk = NULL;
+
+    if(http_find_header(dst, ist("ETag"), &hdr, 1) && hdr.value.len && *hdr.value.ptr == '"') {
+        etag = get_trash_chunk();
+
+        if(!chunk_istcat(etag, ist("W/")) || !chunk_istcat(etag, hdr.value)
+                || !http_replace_header_value(dst, &hdr, ist2(etag->area, etag->data))) {
+
+            return NST_ERR;
+        }
+    }
+
+    return nst_http_vary_add(dst, ist("Accept-Encoding"));
+}
+
+/*
+ * Copy the request headers of htx to dst as a bodyless GET to refresh the
+ * cached object, without the headers which would not return it in full. The
+ * request is made conditional on the validators of the origin in txn.
+ */
+int
+nst_http_refresh_request(hpx_htx_t *htx, hpx_htx_t *dst, nst_http_txn_t *txn) {
+    hpx_http_hdr_ctx_t  hdr;
+    hpx_htx_blk_type_t  type;
+    hpx_htx_blk_t      *blk, *tail;
+    hpx_htx_sl_t       *sl;
+    uint32_t            sz;
+    int                 i;
+
+    const char  *names[] = {
+        "Range", "If-Range", "If-None-Match", "If-Modified-Since",
+        "Content-Length", "Transfer-Encoding",
+    };
+
+    for(blk = htx_get_first_blk(htx); blk; blk = htx_get_next_blk(htx, blk)) {
+        type = htx_get_blk_type(blk);
+        sz   = htx_get_blksz(blk);
+
+        if(type == HTX_BLK_UNUSED) {
+            continue;
+        }
+
+        tail = htx_add_blk(dst, type, sz);
+
+        if(!tail) {
+            return NST_ERR;
+        }
+
+        tail->info = blk->info;
+
+        memcpy(htx_get_blk_ptr(dst, tail), htx_get_blk_ptr(htx, blk), sz);
+
+        if(type == HTX_BLK_EOH) {
+            break;
+        }
+    }
+
+    sl   = http_get_stline(dst);
+    tail = htx_get_tail_blk(dst);
+
+    if(!sl || !tail || htx_get_blk_type(tail) != HTX_BLK_EOH) {
+        return NST_ERR;
+    }
+
+    for(i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        hdr.blk = NULL;
+
+        while(http_find_header(dst, ist(names[i]), &hdr, 1)) {
+            http_remove_header(dst, &hdr);
+        }
+    }
+
+    if(txn->res.validators & NST_HTTP_VALIDATOR_ETAG) {
+
+        if(!http_add_header(dst, ist("If-None-Match"), txn->res.etag)) {
+            return NST_ERR;
+        }
+    }
+
+    if(txn->res.validators & NST_HTTP_VALIDATOR_LAST_MODIFIED) {
+
+        if(!http_add_header(dst, ist("If-Modified-Since"), txn->res.last_modified)) {
+            return NST_ERR;
+        }
+    }
+
+    sl = http_get_stline(dst);
+
+    sl->flags &= ~(HTX_SL_F_CLEN|HTX_SL_F_CHNK);
+    sl->flags |= HTX_SL_F_XFER_LEN|HTX_SL_F_BODYLESS;
+
+    if(!htx_add_endof(dst, HTX_BLK_EOM)) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Build the GET request of a cache warmer url, see nuster warm
+ */
+int
+nst_http_warm_request(hpx_htx_t *htx, hpx_ist_t host, hpx_ist_t uri) {
+    hpx_htx_sl_t  *sl;
+    unsigned int   flags;
+
+    flags = HTX_SL_F_VER_11|HTX_SL_F_XFER_LEN|HTX_SL_F_BODYLESS;
+
+    sl = htx_add_stline(htx, HTX_BLK_REQ_SL, flags, ist("GET"), uri, ist("HTTP/1.1"));
+
+    if(!sl) {
+        return NST_ERR;
+    }
+
+    sl->info.req.meth = HTTP_METH_GET;
+
+    if(host.len && !htx_add_header(htx, ist("host"), host)) {
+        return NST_ERR;
+    }
+
+    if(!htx_add_endof(htx, HTX_BLK_EOH) || !htx_add_endof(htx, HTX_BLK_EOM)) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
@@ -23,17 +23,20 @@
 
 #include <nuster/nuster.h>
 
+/*
+ * Build the key of rule at the end of buf, key->data points into buf then and
+ * lives as long as it.
+ */
 int
 nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_txn_t *txn,
-        nst_key_t *key, hpx_http_meth_t method) {
+        nst_key_t *key, hpx_http_meth_t method, hpx_buffer_t *buf) {
 
-    nst_key_element_t  **pck = rule->key->data;
-    nst_key_element_t   *ck  = NULL;
-    hpx_buffer_t        *buf = nst_key_init();
+    nst_key_element_t  *ck  = rule->key->data;
+    size_t              beg = buf->data;
 
     nst_debug_beg(s, "[rule ] key:  ");
 
-    while((ck = *pck++)) {
+    for(; ck->type; ck++) {
         int  ret = NST_ERR;
 
         switch(ck->type) {
@@ -103,7 +106,7 @@ nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_t
 
                 break;
             case NST_KEY_ELEMENT_PARAM:
-                nst_debug_add("param_%s.", ck->data);
+                nst_debug_add("param_%s.", ck->name.ptr);
 
                 if(txn->req.query.ptr && txn->req.query.len) {
                     char  *v   = NULL;
@@ -111,7 +114,7 @@ nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_t
 
                     if(nst_http_find_param(txn->req.query.ptr,
                                 txn->req.query.ptr + txn->req.query.len,
-                                ck->data, &v, &v_l) == NST_OK) {
+                                ck->name, &v, &v_l) == NST_OK) {
 
                         ret = nst_key_catist(buf, ist2(v, v_l));
                         break;
@@ -124,14 +127,10 @@ nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_t
                 {
                     hpx_htx_t          *htx = htxbuf(&s->req.buf);
                     hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
-                    hpx_ist_t           h   = {
-                        .ptr = ck->data,
-                        .len = strlen(ck->data),
-                    };
 
-                    nst_debug_add("header_%s.", ck->data);
+                    nst_debug_add("header_%s.", ck->name.ptr);
 
-                    while(http_find_header(htx, h, &hdr, 0)) {
+                    while(http_find_header(htx, ck->name, &hdr, 0)) {
                         ret = nst_key_catist(buf, hdr.value);
 
                         if(ret == NST_ERR) {
@@ -143,7 +142,7 @@ nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_t
                 ret = nst_key_catdel(buf);
                 break;
             case NST_KEY_ELEMENT_COOKIE:
-                nst_debug_add("cookie_%s.", ck->data);
+                nst_debug_add("cookie_%s.", ck->name.ptr);
 
                 if(txn->req.cookie.ptr && txn->req.cookie.len) {
                     char   *v   = NULL;
@@ -151,7 +150,7 @@ nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_t
 
                     if(http_extract_cookie_value(txn->req.cookie.ptr,
                                 txn->req.cookie.ptr + txn->req.cookie.len,
-                                ck->data, strlen(ck->data), 1, &v, &v_l)) {
+                                ck->name.ptr, ck->name.len, 1, &v, &v_l)) {
 
                         ret = nst_key_catist(buf, ist2(v, v_l));
                         break;
@@ -194,20 +193,16 @@ nst_key_build(hpx_stream_t *s, hpx_http_msg_t *msg, nst_rule_t *rule, nst_http_t
         }
 
         if(ret != NST_OK) {
+            buf->data = beg;
+
             return NST_ERR;
         }
     }
 
     nst_debug_end("");
 
-    key->size = buf->data;
-    key->data = malloc(key->size);
-
-    if(!key->data) {
-        return NST_ERR;
-    }
-
-    memcpy(key->data, buf->area, buf->data);
+    key->size = buf->data - beg;
+    key->data = buf->area + beg;
 
     return NST_OK;
 }
@@ -223,6 +218,31 @@ nst_key_hash(nst_key_t *key) {
     blk_SHA1_Final(key->uuid, &ctx);
 }
 
+/*
+ * The key of a variant is the key of its primary entry followed by the request
+ * values of the Vary headers, see nst_http_vary_suffix
+ */
+int
+nst_key_build_variant(nst_key_t *key, hpx_ist_t suffix, nst_key_t *variant) {
+
+    free(variant->data);
+
+    variant->flags = 0;
+    variant->size  = key->size + suffix.len;
+    variant->data  = malloc(variant->size);
+
+    if(!variant->data) {
+        return NST_ERR;
+    }
+
+    memcpy(variant->data, key->data, key->size);
+    memcpy(variant->data + key->size, suffix.ptr, suffix.len);
+
+    nst_key_hash(variant);
+
+    return NST_OK;
+}
+
 void
 nst_key_debug(hpx_stream_t *s, nst_key_t *key) {
 
@@ -161,6 +161,19 @@ nst_manager(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
                 int  state = -1;
                 int  ttl   = -1;
 
+                /* cache warmer */
+                if(http_find_header(htx, ist("warm"), &hdr, 0)) {
+                    nst_http_reply(s, nst_cache_warm(hdr.value, 0));
+
+                    return 1;
+                }
+
+                if(http_find_header(htx, ist("warm-dump"), &hdr, 0)) {
+                    nst_http_reply(s, nst_cache_warm(hdr.value, 1));
+
+                    return 1;
+                }
+
                 /* manager */
                 if(http_find_header(htx, ist("state"), &hdr, 0)) {
 
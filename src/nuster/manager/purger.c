@@ -13,6 +13,7 @@
 #include <haproxy/regex.h>
 #include <haproxy/proxy.h>
 #include <haproxy/http_htx.h>
+#include <haproxy/http.h>
 #include <haproxy/stream_interface.h>
 
 #include <nuster/nuster.h>
@@ -33,6 +34,9 @@ nst_purger_basic(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
         goto err;
     }
 
+    /* only the values found are set */
+    memset(&txn, 0, sizeof(txn));
+
     if(nst_http_parse_htx(s, buf, &txn) != NST_OK) {
         goto err;
     }
@@ -46,11 +50,7 @@ nst_purger_basic(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
             while(rule) {
                 nst_debug(s, "[rule ] ----- %s", rule->prop.rid.ptr);
 
-                if(key.data) {
-                    free(key.data);
-                }
-
-                if(nst_key_build(s, msg, rule, &txn, &key, HTTP_METH_GET) != NST_OK) {
+                if(nst_key_build(s, msg, rule, &txn, &key, HTTP_METH_GET, buf) != NST_OK) {
                     goto err;
                 }
 
@@ -93,10 +93,6 @@ err:
 end:
     free_trash_chunk(buf);
 
-    if(key.data) {
-        free(key.data);
-    }
-
     return 1;
 }
 
@@ -111,6 +107,7 @@ nst_purger_advanced(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
     hpx_ist_t                name = { .len = 0 };
     hpx_ist_t                host = { .len = 0 };
     hpx_ist_t                path = { .len = 0 };
+    hpx_ist_t                tag  = { .len = 0 };
     char                    *regex_str, *error;
     int                      method, mode;
 
@@ -176,6 +173,20 @@ nst_purger_advanced(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
         }
 
         goto notfound;
+    } else if(http_find_header(htx, ist("tag"), &hdr, 1)) {
+
+        /* only the cache tags its entries, see tag-header */
+        if(global.nuster.cache.status != NST_STATUS_ON || !nuster.cache->dict.tagged) {
+            goto badreq;
+        }
+
+        method = NST_MANAGER_TAG;
+        mode   = NST_MODE_CACHE;
+
+        /* the tags of all tag headers, separated by ',' */
+        do {
+            tag.len += hdr.value.len + 1;
+        } while(http_find_header(htx, ist("tag"), &hdr, 1));
     } else if(http_find_header(htx, ist("path"), &hdr, 0)) {
         path   = hdr.value;
         method = host.len ? NST_MANAGER_PATH_HOST : NST_MANAGER_PATH;
@@ -235,6 +246,8 @@ purge:
             appctx->ctx.nuster.manager.dict = &nuster.nosql->dict;
         }
 
+        __sync_add_and_fetch(&appctx->ctx.nuster.manager.dict->purging, 1);
+
         switch(method) {
             case NST_MANAGER_PROXY:
             case NST_MANAGER_RULE:
@@ -250,6 +263,9 @@ purge:
             case NST_MANAGER_PATH_HOST:
                 buf.size = path.len + host.len;
                 break;
+            case NST_MANAGER_TAG:
+                buf.size = tag.len;
+                break;
         }
 
         if(buf.size) {
@@ -285,6 +301,16 @@ purge:
                 appctx->ctx.nuster.manager.path = ist2(buf.area + buf.data, path.len);
                 chunk_istcat(&buf, path);
                 break;
+            case NST_MANAGER_TAG:
+                hdr.blk = NULL;
+
+                while(http_find_header(htx, ist("tag"), &hdr, 1)) {
+                    chunk_istcat(&buf, hdr.value);
+                    chunk_memcat(&buf, ",", 1);
+                }
+
+                appctx->ctx.nuster.manager.name = ist2(buf.area, buf.data);
+                break;
         }
 
         appctx->ctx.nuster.manager.buf = buf;
@@ -365,42 +391,231 @@ nst_purger_check(hpx_appctx_t *appctx, nst_dict_entry_t *entry) {
     return ret;
 }
 
+static void
+_nst_purger_purge(nst_dict_t *dict, nst_dict_entry_t *entry) {
+
+    if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
+
+        entry->state  = NST_DICT_ENTRY_STATE_INVALID;
+        entry->expire = 0;
+
+        nst_dict_drop_memory(dict, entry);
+
+        if(entry->store.disk.file) {
+            nst_disk_purge_by_path(&dict->store->disk, entry->store.disk.file,
+                    entry->store.disk.offset);
+        }
+    }
+}
+
+/*
+ * Walk the index bucket of the purged value in each shard instead of the whole
+ * dict. The walk resumes from manager.entry, entries are not freed while
+ * purging, see nst_dict_cleanup.
+ * Returns 1 once all shards are done.
+ */
+static int
+_nst_purger_walk_index(hpx_appctx_t *appctx, uint64_t start) {
+    nst_dict_shard_t  *shard;
+    nst_dict_entry_t  *entry;
+    nst_dict_t        *dict = appctx->ctx.nuster.manager.dict;
+    hpx_ist_t          value;
+    int                type;
+
+    switch(appctx->st0) {
+        case NST_MANAGER_PROXY:
+            type  = NST_DICT_INDEX_PROXY;
+            value = appctx->ctx.nuster.manager.name;
+
+            break;
+        case NST_MANAGER_RULE:
+            type  = NST_DICT_INDEX_RULE;
+            value = appctx->ctx.nuster.manager.name;
+
+            break;
+        case NST_MANAGER_HOST:
+        case NST_MANAGER_REGEX_HOST:
+            type  = NST_DICT_INDEX_HOST;
+            value = appctx->ctx.nuster.manager.host;
+
+            break;
+        default:
+            type  = NST_DICT_INDEX_PATH;
+            value = appctx->ctx.nuster.manager.path;
+
+            break;
+    }
+
+    while(appctx->ctx.nuster.manager.shard < NST_DICT_SHARDS) {
+        shard = &dict->shard[appctx->ctx.nuster.manager.shard];
+
+        nst_shctx_lock(shard);
+
+        entry = appctx->ctx.nuster.manager.entry;
+
+        if(!entry) {
+            entry = nst_dict_index_first(shard, type, value);
+        }
+
+        while(entry) {
+
+            if(entry->state == NST_DICT_ENTRY_STATE_VALID && nst_purger_check(appctx, entry)) {
+                _nst_purger_purge(dict, entry);
+            }
+
+            entry = entry->index[type].next;
+
+            if(nst_time_now_ms() - start > 10) {
+                break;
+            }
+        }
+
+        appctx->ctx.nuster.manager.entry = entry;
+
+        nst_shctx_unlock(shard);
+
+        if(entry) {
+            return 0;
+        }
+
+        appctx->ctx.nuster.manager.shard++;
+    }
+
+    return 1;
+}
+
+/*
+ * Walk the tag index bucket of each tag of manager.name in each shard, tags
+ * are separated by ',' or white spaces. manager.idx is the offset of the tag
+ * being purged. The walk resumes from manager.tag, tags replaced meanwhile are
+ * not freed while purging, see _nst_dict_tags_del.
+ * Returns 1 once all tags are done.
+ */
+static int
+_nst_purger_walk_tags(hpx_appctx_t *appctx, uint64_t start) {
+    nst_dict_shard_t  *shard;
+    nst_dict_tag_t    *tag;
+    nst_dict_t        *dict = appctx->ctx.nuster.manager.dict;
+    hpx_ist_t          tags = appctx->ctx.nuster.manager.name;
+    hpx_ist_t          name;
+    uint64_t           idx;
+
+    while(1) {
+        idx = appctx->ctx.nuster.manager.idx;
+
+        while(idx < tags.len && (HTTP_IS_SPHT(tags.ptr[idx]) || tags.ptr[idx] == ',')) {
+            idx++;
+        }
+
+        if(idx == tags.len) {
+            return 1;
+        }
+
+        name.ptr = tags.ptr + idx;
+
+        while(idx < tags.len && !HTTP_IS_SPHT(tags.ptr[idx]) && tags.ptr[idx] != ',') {
+            idx++;
+        }
+
+        name.len = tags.ptr + idx - name.ptr;
+
+        while(appctx->ctx.nuster.manager.shard < NST_DICT_SHARDS) {
+            shard = &dict->shard[appctx->ctx.nuster.manager.shard];
+
+            nst_shctx_lock(shard);
+
+            tag = appctx->ctx.nuster.manager.tag;
+
+            if(!tag) {
+                tag = nst_dict_tag_first(shard, name);
+            }
+
+            while(tag) {
+
+                if(isteq(tag->name, name)) {
+                    _nst_purger_purge(dict, tag->entry);
+                }
+
+                tag = tag->next;
+
+                if(nst_time_now_ms() - start > 10) {
+                    break;
+                }
+            }
+
+            appctx->ctx.nuster.manager.tag = tag;
+
+            nst_shctx_unlock(shard);
+
+            if(tag) {
+                return 0;
+            }
+
+            appctx->ctx.nuster.manager.shard++;
+        }
+
+        appctx->ctx.nuster.manager.shard = 0;
+        appctx->ctx.nuster.manager.idx   = idx;
+    }
+}
+
 static void
 nst_purger_handler(hpx_appctx_t *appctx) {
+    nst_dict_shard_t        *shard  = NULL;
     nst_dict_entry_t        *entry  = NULL;
     hpx_stream_interface_t  *si     = appctx->owner;
     hpx_stream_t            *s      = si_strm(si);
     nst_dict_t              *dict   = appctx->ctx.nuster.manager.dict;
     uint64_t                 start  = nst_time_now_ms();
+    uint64_t                 size, idx;
     int                      max    = 1000;
 
-    while(1) {
+    if(appctx->st0 == NST_MANAGER_TAG) {
+
+        if(_nst_purger_walk_tags(appctx, start)) {
+            nst_http_reply(s, NST_HTTP_200);
+        } else {
+            task_wakeup(s->task, TASK_WOKEN_OTHER);
+        }
 
-        while(appctx->ctx.nuster.manager.idx < dict->size && max--) {
-            nst_shctx_lock(dict);
+        return;
+    }
 
-            entry = dict->entry[appctx->ctx.nuster.manager.idx];
+    /* a path regex cannot be looked up, the dict is scanned */
+    if(dict->indexed && appctx->st0 != NST_MANAGER_REGEX) {
 
-            while(entry) {
+        if(_nst_purger_walk_index(appctx, start)) {
+            nst_http_reply(s, NST_HTTP_200);
+        } else {
+            task_wakeup(s->task, TASK_WOKEN_OTHER);
+        }
 
-                if(nst_purger_check(appctx, entry)) {
+        return;
+    }
 
-                    if(entry->state == NST_DICT_ENTRY_STATE_VALID) {
+    /* rehashing is paused while purging, so both tables can be walked */
+    while(appctx->ctx.nuster.manager.shard < NST_DICT_SHARDS) {
+        shard = &dict->shard[appctx->ctx.nuster.manager.shard];
 
-                        entry->state  = NST_DICT_ENTRY_STATE_INVALID;
-                        entry->expire = 0;
+        nst_shctx_lock(shard);
+        size = shard->table[0].size + shard->table[1].size;
+        nst_shctx_unlock(shard);
 
-                        if(entry->store.memory.obj) {
-                            entry->store.memory.obj->invalid = 1;
-                            entry->store.memory.obj          = NULL;
+        while(appctx->ctx.nuster.manager.idx < size && max--) {
+            nst_shctx_lock(shard);
 
-                            nst_memory_incr_invalid(&dict->store->memory);
-                        }
+            idx = appctx->ctx.nuster.manager.idx;
 
-                        if(entry->store.disk.file) {
-                            nst_disk_purge_by_path(entry->store.disk.file);
-                        }
-                    }
+            if(idx < shard->table[0].size) {
+                entry = *nst_dict_bucket(&shard->table[0], idx);
+            } else {
+                entry = *nst_dict_bucket(&shard->table[1], idx - shard->table[0].size);
+            }
+
+            while(entry) {
+
+                if(nst_purger_check(appctx, entry)) {
+                    _nst_purger_purge(dict, entry);
                 }
 
                 entry = entry->next;
@@ -414,7 +629,12 @@ nst_purger_handler(hpx_appctx_t *appctx) {
                 appctx->ctx.nuster.manager.idx++;
             }
 
-            nst_shctx_unlock(dict);
+            nst_shctx_unlock(shard);
+        }
+
+        if(appctx->ctx.nuster.manager.idx == size) {
+            appctx->ctx.nuster.manager.shard++;
+            appctx->ctx.nuster.manager.idx = 0;
         }
 
         if(nst_time_now_ms() - start > 20) {
@@ -426,7 +646,7 @@ nst_purger_handler(hpx_appctx_t *appctx) {
 
     task_wakeup(s->task, TASK_WOKEN_OTHER);
 
-    if(appctx->ctx.nuster.manager.idx == dict->size) {
+    if(appctx->ctx.nuster.manager.shard == NST_DICT_SHARDS) {
         nst_http_reply(s, NST_HTTP_200);
     }
 }
@@ -439,6 +659,8 @@ nst_purger_release_handler(hpx_appctx_t *appctx) {
     }
 
     nst_shmem_free(appctx->ctx.nuster.manager.dict->shmem, appctx->ctx.nuster.manager.buf.area);
+
+    __sync_sub_and_fetch(&appctx->ctx.nuster.manager.dict->purging, 1);
 }
 
 void
@@ -11,78 +11,264 @@
  */
 
 #include <haproxy/proxy.h>
+#include <haproxy/http_htx.h>
+#include <haproxy/tools.h>
 #include <haproxy/stream_interface.h>
 
 #include <nuster/nuster.h>
 
+/*
+ * the counters slot of the calling thread, nbproc and nbthread are final by
+ * the time the slots are allocated so each thread of each process owns one
+ */
+static inline int
+_nst_stats_thread() {
+    int  slot = (relative_pid - 1) * global.nbthread + tid;
+
+    BUG_ON(slot >= global.nuster.stats->threads);
+
+    return slot;
+}
+
+static inline nst_stats_counters_t *
+_nst_stats_counters() {
+    return &global.nuster.stats->counters[_nst_stats_thread()];
+}
+
+/*
+ * slot of a time to first byte of ttfb ms, see NST_STATS_TTFB_SLOTS
+ */
+static inline int
+_nst_stats_ttfb_slot(long ttfb) {
+    int  slot = 0;
+
+    while(ttfb > 0 && slot < NST_STATS_TTFB_SLOTS - 1) {
+        ttfb >>= 1;
+        slot++;
+    }
+
+    return slot;
+}
+
+static void
+_nst_stats_sum(nst_stats_counters_t *sum) {
+    nst_stats_t           *stats = global.nuster.stats;
+    nst_stats_counters_t  *c;
+    int                    i;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for(i = 0; i < stats->threads; i++) {
+        c = &stats->counters[i];
+
+        sum->cache.total  += c->cache.total;
+        sum->cache.fetch  += c->cache.fetch;
+        sum->cache.hit    += c->cache.hit;
+        sum->cache.abort  += c->cache.abort;
+        sum->cache.bypass += c->cache.bypass;
+        sum->cache.bytes  += c->cache.bytes;
+
+        sum->nosql.total  += c->nosql.total;
+        sum->nosql.get    += c->nosql.get;
+        sum->nosql.post   += c->nosql.post;
+        sum->nosql.delete += c->nosql.delete;
+        sum->nosql.abort  += c->nosql.abort;
+    }
+}
+
 void
 nst_stats_update_cache(int state, uint64_t bytes) {
-    nst_shctx_lock(global.nuster.stats);
+    nst_stats_counters_t  *c = _nst_stats_counters();
 
-    global.nuster.stats->cache.total++;
+    c->cache.total++;
 
     switch(state) {
         case NST_CTX_STATE_HIT_MEMORY:
         case NST_CTX_STATE_HIT_DISK:
-            global.nuster.stats->cache.hit++;
-            global.nuster.stats->cache.bytes += bytes;
+            c->cache.hit++;
+            c->cache.bytes += bytes;
             break;
         case NST_CTX_STATE_CREATE:
-            global.nuster.stats->cache.abort++;
+            c->cache.abort++;
             break;
         case NST_CTX_STATE_DONE:
-            global.nuster.stats->cache.fetch++;
+            c->cache.fetch++;
             break;
         case NST_CTX_STATE_BYPASS:
-            global.nuster.stats->cache.bypass++;
+            c->cache.bypass++;
             break;
         default:
             break;
     }
+}
 
-    nst_shctx_unlock(global.nuster.stats);
+/*
+ * the sum over the threads of the counters of rule uuid
+ */
+static void
+_nst_stats_rule_sum(int uuid, nst_stats_rule_t *sum) {
+    nst_stats_t       *stats = global.nuster.stats;
+    nst_stats_rule_t  *r;
+    int                i, j;
+
+    for(i = 0; i < stats->threads; i++) {
+        r = &stats->rule[i * stats->rules + uuid];
+
+        sum->hit_memory += r->hit_memory;
+        sum->hit_disk   += r->hit_disk;
+        sum->miss       += r->miss;
+        sum->fetch      += r->fetch;
+        sum->bypass     += r->bypass;
+        sum->abort      += r->abort;
+        sum->bytes      += r->bytes;
+        sum->stored     += r->stored;
+
+        for(j = 0; j < NST_STATS_TTFB_SLOTS; j++) {
+            sum->ttfb_hit[j]  += r->ttfb_hit[j];
+            sum->ttfb_miss[j] += r->ttfb_miss[j];
+        }
+
+        sum->ttfb_hit_sum  += r->ttfb_hit_sum;
+        sum->ttfb_miss_sum += r->ttfb_miss_sum;
+    }
+}
+
+/*
+ * Called on detach of a request handled by rule uuid, ttfb is the time to the
+ * response headers in ms, -1 if there was no response
+ */
+void
+nst_stats_update_rule(int uuid, int state, uint64_t bytes, long ttfb) {
+    nst_stats_t       *stats = global.nuster.stats;
+    nst_stats_rule_t  *r;
+    uint64_t          *ttfb_slots, *ttfb_sum;
+
+    if(uuid < 0 || uuid >= stats->rules) {
+        return;
+    }
+
+    r = &stats->rule[_nst_stats_thread() * stats->rules + uuid];
+
+    switch(state) {
+        case NST_CTX_STATE_HIT_MEMORY:
+            r->hit_memory++;
+            r->bytes   += bytes;
+            ttfb_slots  = r->ttfb_hit;
+            ttfb_sum    = &r->ttfb_hit_sum;
+            break;
+        case NST_CTX_STATE_HIT_DISK:
+            r->hit_disk++;
+            r->bytes   += bytes;
+            ttfb_slots  = r->ttfb_hit;
+            ttfb_sum    = &r->ttfb_hit_sum;
+            break;
+        case NST_CTX_STATE_BYPASS:
+            r->bypass++;
+            return;
+        case NST_CTX_STATE_CREATE:
+            r->miss++;
+            r->abort++;
+            ttfb_slots  = r->ttfb_miss;
+            ttfb_sum    = &r->ttfb_miss_sum;
+            break;
+        case NST_CTX_STATE_DONE:
+            r->miss++;
+            r->fetch++;
+            r->stored  += bytes;
+            ttfb_slots  = r->ttfb_miss;
+            ttfb_sum    = &r->ttfb_miss_sum;
+            break;
+        default:
+            r->miss++;
+            ttfb_slots  = r->ttfb_miss;
+            ttfb_sum    = &r->ttfb_miss_sum;
+            break;
+    }
+
+    if(ttfb >= 0) {
+        ttfb_slots[_nst_stats_ttfb_slot(ttfb)]++;
+        *ttfb_sum += ttfb;
+    }
+}
+
+/*
+ * Called by the dict with the shard of the entry locked, in the master as well
+ */
+void
+nst_stats_update_entries(int uuid, int entries, int evicted) {
+    nst_stats_t  *stats = global.nuster.stats;
+
+    if(uuid < 0 || uuid >= stats->rules) {
+        return;
+    }
+
+    if(entries) {
+        __sync_add_and_fetch(&stats->entries[uuid].entries, entries);
+    }
+
+    if(evicted) {
+        __sync_add_and_fetch(&stats->entries[uuid].evicted, evicted);
+    }
 }
 
 void
 nst_stats_update_nosql(hpx_http_meth_t meth) {
-    nst_shctx_lock(global.nuster.stats);
+    nst_stats_counters_t  *c = _nst_stats_counters();
 
-    global.nuster.stats->nosql.total++;
+    c->nosql.total++;
 
     switch(meth) {
         case HTTP_METH_GET:
-            global.nuster.stats->nosql.get++;
+            c->nosql.get++;
             break;
         case HTTP_METH_POST:
-            global.nuster.stats->nosql.post++;
+            c->nosql.post++;
             break;
         case HTTP_METH_DELETE:
-            global.nuster.stats->nosql.delete++;
+            c->nosql.delete++;
             break;
         default:
             break;
     }
-
-    nst_shctx_unlock(global.nuster.stats);
 }
 
 /*
  * return 1 if the req is done, otherwise 0
  */
 
+/*
+ * Prometheus asks for its text format with Accept: text/plain; version=0.0.4
+ */
+static int
+_nst_stats_want_metrics(hpx_stream_t *s) {
+    hpx_http_hdr_ctx_t  hdr = { .blk = NULL };
+    hpx_htx_t          *htx = htxbuf(&s->req.buf);
+
+    while(http_find_header(htx, ist("Accept"), &hdr, 0)) {
+
+        if(my_memmem(hdr.value.ptr, hdr.value.len, "version=0.0.4", 13)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 int
 nst_stats_applet(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
     hpx_stream_interface_t  *si = &s->si[1];
     hpx_appctx_t            *appctx;
+    int                      metrics;
 
+    metrics   = _nst_stats_want_metrics(s);
     s->target = &nuster.applet.stats.obj_type;
 
     if(unlikely(!si_register_handler(si, objt_applet(s->target)))) {
         return 1;
     } else {
         appctx      = si_appctx(si);
-        appctx->st0 = NST_STATS_HEADER;
-        appctx->st1 = px->uuid;
+        appctx->st0 = metrics ? NST_STATS_METRICS_HEADER : NST_STATS_HEADER;
+        appctx->st1 = metrics ? 0 : px->uuid;
         appctx->st2 = 0;
 
         req->analysers &= (AN_REQ_HTTP_BODY | AN_REQ_FLT_HTTP_HDRS | AN_REQ_FLT_END);
@@ -95,7 +281,9 @@ nst_stats_applet(hpx_stream_t *s, hpx_channel_t *req, hpx_proxy_t *px) {
 }
 
 static int
-_nst_stats_header(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *htx) {
+_nst_stats_header(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *htx,
+        hpx_ist_t type) {
+
     hpx_stream_t  *s = si_strm(si);
     hpx_htx_sl_t  *sl;
     unsigned int  flags;
@@ -113,7 +301,7 @@ _nst_stats_header(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *h
         goto full;
     }
 
-    if(!htx_add_header(htx, ist("Content-Type"), ist("text/plain"))) {
+    if(!htx_add_header(htx, ist("Content-Type"), type)) {
         goto full;
     }
 
@@ -167,7 +355,7 @@ _getMaxPaddingLen() {
             rule = nuster.proxy[p->uuid]->rule;
 
             while(rule) {
-                int  s2 = s1 + 8 + rule->prop.rid.len;
+                int  s2 = s1 + 8 + rule->prop.rid.len + strlen(".stats.hit.memory");
 
                 if(s2 > max) {
                     max = s2;
@@ -185,8 +373,9 @@ _getMaxPaddingLen() {
 
 static int
 _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *htx) {
-    hpx_channel_t  *res = si_ic(si);
-    int             len = _getMaxPaddingLen();
+    hpx_channel_t         *res = si_ic(si);
+    nst_stats_counters_t   sum;
+    int                    len = _getMaxPaddingLen();
 
     chunk_reset(&trash);
 
@@ -218,16 +407,18 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
                     global.nuster.cache.dict_size);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.length:",
-                    nuster.cache->dict.size);
+                    nst_dict_size(&nuster.cache->dict));
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.used:",
-                    nuster.cache->dict.used);
+                    nst_dict_used(&nuster.cache->dict));
+
+            chunk_appendf(&trash, "%-*s%d\n", len, "dict.cache.shards:", NST_DICT_SHARDS);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.cleanup_idx:",
-                    nuster.cache->dict.cleanup_idx);
+                    nuster.cache->dict.cleanup_idx % NST_DICT_SHARDS);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.cache.sync_idx:",
-                    nuster.cache->dict.sync_idx);
+                    nuster.cache->dict.sync_idx % NST_DICT_SHARDS);
         }
 
         if(global.nuster.nosql.status == NST_STATUS_ON) {
@@ -235,16 +426,18 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
                     global.nuster.nosql.dict_size);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.length:",
-                    nuster.nosql->dict.size);
+                    nst_dict_size(&nuster.nosql->dict));
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.used:",
-                    nuster.nosql->dict.used);
+                    nst_dict_used(&nuster.nosql->dict));
+
+            chunk_appendf(&trash, "%-*s%d\n", len, "dict.nosql.shards:", NST_DICT_SHARDS);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.cleanup_idx:",
-                    nuster.nosql->dict.cleanup_idx);
+                    nuster.nosql->dict.cleanup_idx % NST_DICT_SHARDS);
 
             chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "dict.nosql.sync_idx:",
-                    nuster.nosql->dict.sync_idx);
+                    nuster.nosql->dict.sync_idx % NST_DICT_SHARDS);
         }
     }
 
@@ -293,6 +486,9 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
 
         chunk_appendf(&trash, "%-*s%s\n", len, "store.disk.cache.loaded:",
                 nuster.cache->store.disk.loaded ? "yes" : "no");
+
+        chunk_appendf(&trash, "%-*s%s\n", len, "store.disk.cache.engine:",
+                nst_disk_segment_on(&nuster.cache->store.disk) ? "segment" : "file");
     }
 
     if(global.nuster.nosql.status == NST_STATUS_ON && global.nuster.nosql.root.len) {
@@ -301,44 +497,49 @@ _nst_stats_payload(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *
 
         chunk_appendf(&trash, "%-*s%s\n", len, "store.disk.nosql.loaded:",
                 nuster.nosql->store.disk.loaded ? "yes" : "no");
+
+        chunk_appendf(&trash, "%-*s%s\n", len, "store.disk.nosql.engine:",
+                nst_disk_segment_on(&nuster.nosql->store.disk) ? "segment" : "file");
     }
 
     if(global.nuster.cache.status == NST_STATUS_ON || global.nuster.nosql.status == NST_STATUS_ON) {
         chunk_appendf(&trash, "\n**STATS**\n");
     }
 
+    _nst_stats_sum(&sum);
+
     if(global.nuster.cache.status == NST_STATUS_ON) {
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.total:",
-                global.nuster.stats->cache.total);
+                sum.cache.total);
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.hit:",
-                global.nuster.stats->cache.hit);
+                sum.cache.hit);
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.fetch:",
-                global.nuster.stats->cache.fetch);
+                sum.cache.fetch);
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.bypass:",
-                global.nuster.stats->cache.bypass);
+                sum.cache.bypass);
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.abort:",
-                global.nuster.stats->cache.abort);
+                sum.cache.abort);
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.cache.bytes:",
-                global.nuster.stats->cache.bytes);
+                sum.cache.bytes);
     }
 
     if(global.nuster.nosql.status == NST_STATUS_ON) {
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.nosql.total:",
-                global.nuster.stats->nosql.total);
+                sum.nosql.total);
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.nosql.get:",
-                global.nuster.stats->nosql.get);
+                sum.nosql.get);
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.nosql.post:",
-                global.nuster.stats->nosql.post);
+                sum.nosql.post);
 
         chunk_appendf(&trash, "%-*s%"PRIu64"\n", len, "stats.nosql.delete:",
-                global.nuster.stats->nosql.delete);
+                sum.nosql.delete);
     }
 
     if(!_nst_stats_putdata(res, htx, &trash)) {
@@ -353,6 +554,93 @@ full:
     return 0;
 }
 
+static void
+_nst_stats_append(hpx_buffer_t *chk, int len, const char *prefix, const char *name, uint64_t v) {
+    int  pad = len - strlen(prefix) - strlen(name) - 8;
+
+    chunk_appendf(chk, "%s.stats.%s:%*s%"PRIu64"\n", prefix, name, pad > 0 ? pad : 1, "", v);
+}
+
+static void
+_nst_stats_append_ttfb(hpx_buffer_t *chk, int len, const char *prefix, const char *name,
+        uint64_t *slots) {
+
+    int  pad = len - strlen(prefix) - strlen(name) - 8;
+    int  i;
+
+    chunk_appendf(chk, "%s.stats.%s:%*s", prefix, name, pad > 0 ? pad : 1, "");
+
+    for(i = 0; i < NST_STATS_TTFB_SLOTS - 1; i++) {
+        chunk_appendf(chk, "<%dms=%"PRIu64" ", 1 << i, slots[i]);
+    }
+
+    chunk_appendf(chk, ">=%dms=%"PRIu64"\n", 1 << (i - 1), slots[i]);
+}
+
+/*
+ * the counters of a rule, or the sums of the rules of a proxy
+ */
+static void
+_nst_stats_append_rule(hpx_buffer_t *chk, int len, const char *prefix, int mode,
+        nst_stats_rule_t *r, nst_stats_entries_t *e) {
+
+    if(mode == NST_MODE_CACHE) {
+        _nst_stats_append(chk, len, prefix, "hit.memory", r->hit_memory);
+        _nst_stats_append(chk, len, prefix, "hit.disk",   r->hit_disk);
+        _nst_stats_append(chk, len, prefix, "miss",       r->miss);
+        _nst_stats_append(chk, len, prefix, "fetch",      r->fetch);
+        _nst_stats_append(chk, len, prefix, "bypass",     r->bypass);
+        _nst_stats_append(chk, len, prefix, "abort",      r->abort);
+        _nst_stats_append(chk, len, prefix, "bytes",      r->bytes);
+        _nst_stats_append(chk, len, prefix, "stored",     r->stored);
+    }
+
+    _nst_stats_append(chk, len, prefix, "entries", e->entries > 0 ? e->entries : 0);
+    _nst_stats_append(chk, len, prefix, "evicted", e->evicted);
+
+    if(mode == NST_MODE_CACHE) {
+        _nst_stats_append_ttfb(chk, len, prefix, "ttfb.hit",  r->ttfb_hit);
+        _nst_stats_append_ttfb(chk, len, prefix, "ttfb.miss", r->ttfb_miss);
+    }
+}
+
+/*
+ * the counters of rule of proxy p, followed by the sums of p after its last rule
+ */
+static void
+_nst_stats_proxy_rule(hpx_buffer_t *chk, int len, hpx_proxy_t *p, nst_rule_t *rule) {
+    nst_stats_t          *stats  = global.nuster.stats;
+    hpx_buffer_t         *prefix = get_trash_chunk();
+    nst_stats_rule_t      sum;
+    nst_stats_entries_t   entries;
+
+    memset(&sum, 0, sizeof(sum));
+
+    _nst_stats_rule_sum(rule->uuid, &sum);
+
+    entries = stats->entries[rule->uuid];
+
+    chunk_printf(prefix, "%s.rule.%s", p->id, rule->prop.rid.ptr);
+
+    _nst_stats_append_rule(chk, len, prefix->area, p->nuster.mode, &sum, &entries);
+
+    if(rule->next) {
+        return;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    memset(&entries, 0, sizeof(entries));
+
+    for(rule = nuster.proxy[p->uuid]->rule; rule; rule = rule->next) {
+        _nst_stats_rule_sum(rule->uuid, &sum);
+
+        entries.entries += stats->entries[rule->uuid].entries;
+        entries.evicted += stats->entries[rule->uuid].evicted;
+    }
+
+    _nst_stats_append_rule(chk, len, p->id, p->nuster.mode, &sum, &entries);
+}
+
 static int
 _nst_stats_proxy(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *htx) {
     hpx_channel_t  *res = si_ic(si);
@@ -413,6 +701,8 @@ _nst_stats_proxy(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *ht
                             rule->prop.ttl
                             );
 
+                    _nst_stats_proxy_rule(&trash, len, p, rule);
+
                     if(!_nst_stats_putdata(res, htx, &trash)) {
                         goto full;
                     }
@@ -438,6 +728,427 @@ full:
     return 0;
 }
 
+/*
+ * The metric families of the Prometheus text format, the ones of rules are
+ * streamed rule by rule.
+ */
+enum {
+    NST_METRIC_DICT_SIZE = 0,
+    NST_METRIC_DICT_LENGTH,
+    NST_METRIC_DICT_ENTRIES,
+    NST_METRIC_MEMORY_SIZE,
+    NST_METRIC_MEMORY_USED,
+    NST_METRIC_MEMORY_FRAG,
+    NST_METRIC_MEMORY_OBJECTS,
+    NST_METRIC_MEMORY_INVALID,
+    NST_METRIC_DISK_LOADED,
+    NST_METRIC_DISK_SEGMENT_BYTES,
+    NST_METRIC_DISK_SEGMENT_DEAD,
+    NST_METRIC_CACHE_REQUESTS,
+    NST_METRIC_CACHE_BYTES,
+    NST_METRIC_NOSQL_REQUESTS,
+
+    NST_METRIC_RULE_ENABLED,
+    NST_METRIC_RULE_REQUESTS,
+    NST_METRIC_RULE_SERVED_BYTES,
+    NST_METRIC_RULE_STORED_BYTES,
+    NST_METRIC_RULE_ENTRIES,
+    NST_METRIC_RULE_EVICTIONS,
+    NST_METRIC_RULE_TTFB,
+
+    NST_METRIC_CNT,
+};
+
+static const struct {
+    const char  *name;
+    const char  *type;
+    const char  *help;
+    int          cache;     /* cache rules only */
+} nst_stats_metrics[NST_METRIC_CNT] = {
+    [NST_METRIC_DICT_SIZE]          = { "dict_size_bytes", "gauge",
+        "Memory of the dict in bytes, see dict-size." },
+    [NST_METRIC_DICT_LENGTH]        = { "dict_buckets", "gauge",
+        "Number of buckets of the dict." },
+    [NST_METRIC_DICT_ENTRIES]       = { "dict_entries", "gauge",
+        "Number of entries of the dict." },
+    [NST_METRIC_MEMORY_SIZE]        = { "memory_size_bytes", "gauge",
+        "Size of the memory store in bytes." },
+    [NST_METRIC_MEMORY_USED]        = { "memory_used_bytes", "gauge",
+        "Bytes allocated from the memory store." },
+    [NST_METRIC_MEMORY_FRAG]        = { "memory_fragmentation_ratio", "gauge",
+        "Share of the free bytes of the memory store not in a free block." },
+    [NST_METRIC_MEMORY_OBJECTS]     = { "memory_objects", "gauge",
+        "Number of objects in the memory store." },
+    [NST_METRIC_MEMORY_INVALID]     = { "memory_invalid_objects", "gauge",
+        "Number of dropped objects not freed yet." },
+    [NST_METRIC_DISK_LOADED]        = { "disk_loaded", "gauge",
+        "Whether the disk store has been loaded." },
+    [NST_METRIC_DISK_SEGMENT_BYTES] = { "disk_segment_bytes", "gauge",
+        "Bytes written to the segments of the disk store." },
+    [NST_METRIC_DISK_SEGMENT_DEAD]  = { "disk_segment_dead_bytes", "gauge",
+        "Bytes of deleted or expired objects in the segments, reclaimed by compaction." },
+    [NST_METRIC_CACHE_REQUESTS]     = { "cache_requests_total", "counter",
+        "Requests handled by the cache, by result." },
+    [NST_METRIC_CACHE_BYTES]        = { "cache_served_bytes_total", "counter",
+        "Response bytes served by cache hits." },
+    [NST_METRIC_NOSQL_REQUESTS]     = { "nosql_requests_total", "counter",
+        "Requests handled by the nosql, by method." },
+    [NST_METRIC_RULE_ENABLED]       = { "rule_enabled", "gauge",
+        "Whether the rule is enabled." },
+    [NST_METRIC_RULE_REQUESTS]      = { "rule_requests_total", "counter",
+        "Requests handled by the rule, by result.", 1 },
+    [NST_METRIC_RULE_SERVED_BYTES]  = { "rule_served_bytes_total", "counter",
+        "Response bytes served by hits of the rule.", 1 },
+    [NST_METRIC_RULE_STORED_BYTES]  = { "rule_stored_bytes_total", "counter",
+        "Response bytes stored by the rule.", 1 },
+    [NST_METRIC_RULE_ENTRIES]       = { "rule_entries", "gauge",
+        "Number of dict entries of the rule." },
+    [NST_METRIC_RULE_EVICTIONS]     = { "rule_evictions_total", "counter",
+        "Memory objects of the rule evicted to make room." },
+    [NST_METRIC_RULE_TTFB]          = { "rule_ttfb_seconds", "histogram",
+        "Time to first byte of the requests of the rule, by hit or miss.", 1 },
+};
+
+static void
+_nst_stats_metric_head(hpx_buffer_t *chk, int idx) {
+
+    chunk_appendf(chk, "# HELP nuster_%s %s\n# TYPE nuster_%s %s\n",
+            nst_stats_metrics[idx].name, nst_stats_metrics[idx].help,
+            nst_stats_metrics[idx].name, nst_stats_metrics[idx].type);
+}
+
+/*
+ * free bytes left in partially used blocks over all the free bytes, these
+ * only fit allocations smaller than a block
+ */
+static double
+_nst_stats_fragmentation(nst_shmem_t *shmem) {
+    uint64_t  total = (uint64_t)shmem->blocks * shmem->block_size;
+    uint64_t  whole = (uint64_t)shmem->free_blocks * shmem->block_size;
+    uint64_t  free  = total > shmem->used ? total - shmem->used : 0;
+
+    if(free == 0 || whole >= free) {
+        return 0;
+    }
+
+    return (double)(free - whole) / free;
+}
+
+static void
+_nst_stats_metric_core(hpx_buffer_t *chk, int idx, const char *engine, nst_core_t *core,
+        uint64_t dict_size) {
+
+    nst_disk_t  *disk = &core->store.disk;
+    uint64_t     v    = 0;
+    int          i;
+
+    switch(idx) {
+        case NST_METRIC_DICT_SIZE:
+            v = dict_size;
+            break;
+        case NST_METRIC_DICT_LENGTH:
+            v = nst_dict_size(&core->dict);
+            break;
+        case NST_METRIC_DICT_ENTRIES:
+            v = nst_dict_used(&core->dict);
+            break;
+        case NST_METRIC_MEMORY_SIZE:
+            v = core->shmem->size;
+            break;
+        case NST_METRIC_MEMORY_USED:
+            v = core->shmem->used;
+            break;
+        case NST_METRIC_MEMORY_FRAG:
+            chunk_appendf(chk, "nuster_%s{engine=\"%s\"} %.6f\n",
+                    nst_stats_metrics[idx].name, engine, _nst_stats_fragmentation(core->shmem));
+
+            return;
+        case NST_METRIC_MEMORY_OBJECTS:
+            v = core->store.memory.count;
+            break;
+        case NST_METRIC_MEMORY_INVALID:
+            v = core->store.memory.invalid;
+            break;
+        case NST_METRIC_DISK_LOADED:
+
+            if(!core->root.len) {
+                return;
+            }
+
+            v = disk->loaded;
+            break;
+        case NST_METRIC_DISK_SEGMENT_BYTES:
+        case NST_METRIC_DISK_SEGMENT_DEAD:
+
+            if(!core->root.len || !nst_disk_segment_on(disk)) {
+                return;
+            }
+
+            for(i = 0; i < disk->seg.count; i++) {
+
+                if(disk->seg.slot[i].id) {
+                    v += idx == NST_METRIC_DISK_SEGMENT_BYTES
+                        ? disk->seg.slot[i].size : disk->seg.slot[i].dead;
+                }
+            }
+
+            break;
+        default:
+            return;
+    }
+
+    chunk_appendf(chk, "nuster_%s{engine=\"%s\"} %"PRIu64"\n",
+            nst_stats_metrics[idx].name, engine, v);
+}
+
+/*
+ * the samples of the process wide family idx
+ */
+static void
+_nst_stats_metric(hpx_buffer_t *chk, int idx) {
+    nst_stats_counters_t  sum;
+    const char           *name = nst_stats_metrics[idx].name;
+    size_t                head;
+
+    _nst_stats_metric_head(chk, idx);
+
+    head = chk->data;
+
+    _nst_stats_sum(&sum);
+
+    switch(idx) {
+        case NST_METRIC_CACHE_REQUESTS:
+
+            if(global.nuster.cache.status != NST_STATUS_ON) {
+                break;
+            }
+
+            chunk_appendf(chk, "nuster_%s{result=\"hit\"} %"PRIu64"\n", name, sum.cache.hit);
+            chunk_appendf(chk, "nuster_%s{result=\"fetch\"} %"PRIu64"\n", name, sum.cache.fetch);
+            chunk_appendf(chk, "nuster_%s{result=\"bypass\"} %"PRIu64"\n", name, sum.cache.bypass);
+            chunk_appendf(chk, "nuster_%s{result=\"abort\"} %"PRIu64"\n", name, sum.cache.abort);
+            chunk_appendf(chk, "nuster_%s{result=\"other\"} %"PRIu64"\n", name, sum.cache.total
+                    - sum.cache.hit - sum.cache.fetch - sum.cache.bypass - sum.cache.abort);
+            break;
+        case NST_METRIC_CACHE_BYTES:
+
+            if(global.nuster.cache.status != NST_STATUS_ON) {
+                break;
+            }
+
+            chunk_appendf(chk, "nuster_%s %"PRIu64"\n", name, sum.cache.bytes);
+            break;
+        case NST_METRIC_NOSQL_REQUESTS:
+
+            if(global.nuster.nosql.status != NST_STATUS_ON) {
+                break;
+            }
+
+            chunk_appendf(chk, "nuster_%s{method=\"GET\"} %"PRIu64"\n", name, sum.nosql.get);
+            chunk_appendf(chk, "nuster_%s{method=\"POST\"} %"PRIu64"\n", name, sum.nosql.post);
+            chunk_appendf(chk, "nuster_%s{method=\"DELETE\"} %"PRIu64"\n", name, sum.nosql.delete);
+            chunk_appendf(chk, "nuster_%s{method=\"other\"} %"PRIu64"\n", name, sum.nosql.total
+                    - sum.nosql.get - sum.nosql.post - sum.nosql.delete);
+            break;
+        default:
+
+            if(global.nuster.cache.status == NST_STATUS_ON) {
+                _nst_stats_metric_core(chk, idx, "cache", nuster.cache, global.nuster.cache.dict_size);
+            }
+
+            if(global.nuster.nosql.status == NST_STATUS_ON) {
+                _nst_stats_metric_core(chk, idx, "nosql", nuster.nosql, global.nuster.nosql.dict_size);
+            }
+
+            break;
+    }
+
+    /* no family without samples */
+    if(chk->data == head) {
+        chk->data = 0;
+    }
+}
+
+static void
+_nst_stats_metric_ttfb(hpx_buffer_t *chk, const char *labels, const char *result,
+        uint64_t *slots, uint64_t sum) {
+
+    const char  *name  = nst_stats_metrics[NST_METRIC_RULE_TTFB].name;
+    uint64_t     count = 0;
+    int          i;
+
+    for(i = 0; i < NST_STATS_TTFB_SLOTS - 1; i++) {
+        count += slots[i];
+
+        chunk_appendf(chk, "nuster_%s_bucket{%s,result=\"%s\",le=\"%d.%03d\"} %"PRIu64"\n",
+                name, labels, result, (1 << i) / 1000, (1 << i) % 1000, count);
+    }
+
+    count += slots[i];
+
+    chunk_appendf(chk, "nuster_%s_bucket{%s,result=\"%s\",le=\"+Inf\"} %"PRIu64"\n",
+            name, labels, result, count);
+
+    chunk_appendf(chk, "nuster_%s_sum{%s,result=\"%s\"} %"PRIu64".%03"PRIu64"\n",
+            name, labels, result, sum / 1000, sum % 1000);
+
+    chunk_appendf(chk, "nuster_%s_count{%s,result=\"%s\"} %"PRIu64"\n",
+            name, labels, result, count);
+}
+
+/*
+ * the samples of rule of proxy p in the rule family idx
+ */
+static void
+_nst_stats_metric_rule(hpx_buffer_t *chk, int idx, hpx_proxy_t *p, nst_rule_t *rule) {
+    nst_stats_t       *stats  = global.nuster.stats;
+    hpx_buffer_t      *labels = get_trash_chunk();
+    const char        *name   = nst_stats_metrics[idx].name;
+    nst_stats_rule_t   sum;
+
+    if(nst_stats_metrics[idx].cache && p->nuster.mode != NST_MODE_CACHE) {
+        return;
+    }
+
+    chunk_printf(labels, "proxy=\"%s\",rule=\"%s\"", p->id, rule->prop.rid.ptr);
+
+    memset(&sum, 0, sizeof(sum));
+
+    if(nst_stats_metrics[idx].cache) {
+        _nst_stats_rule_sum(rule->uuid, &sum);
+    }
+
+    switch(idx) {
+        case NST_METRIC_RULE_ENABLED:
+            chunk_appendf(chk, "nuster_%s{%s} %d\n", name, labels->area,
+                    rule->state == NST_RULE_ENABLED);
+            break;
+        case NST_METRIC_RULE_REQUESTS:
+            chunk_appendf(chk, "nuster_%s{%s,result=\"hit_memory\"} %"PRIu64"\n",
+                    name, labels->area, sum.hit_memory);
+            chunk_appendf(chk, "nuster_%s{%s,result=\"hit_disk\"} %"PRIu64"\n",
+                    name, labels->area, sum.hit_disk);
+            chunk_appendf(chk, "nuster_%s{%s,result=\"fetch\"} %"PRIu64"\n",
+                    name, labels->area, sum.fetch);
+            chunk_appendf(chk, "nuster_%s{%s,result=\"bypass\"} %"PRIu64"\n",
+                    name, labels->area, sum.bypass);
+            chunk_appendf(chk, "nuster_%s{%s,result=\"abort\"} %"PRIu64"\n",
+                    name, labels->area, sum.abort);
+            chunk_appendf(chk, "nuster_%s{%s,result=\"other\"} %"PRIu64"\n",
+                    name, labels->area, sum.miss - sum.fetch - sum.abort);
+            break;
+        case NST_METRIC_RULE_SERVED_BYTES:
+            chunk_appendf(chk, "nuster_%s{%s} %"PRIu64"\n", name, labels->area, sum.bytes);
+            break;
+        case NST_METRIC_RULE_STORED_BYTES:
+            chunk_appendf(chk, "nuster_%s{%s} %"PRIu64"\n", name, labels->area, sum.stored);
+            break;
+        case NST_METRIC_RULE_ENTRIES:
+            chunk_appendf(chk, "nuster_%s{%s} %"PRId64"\n", name, labels->area,
+                    stats->entries[rule->uuid].entries > 0 ? stats->entries[rule->uuid].entries : 0);
+            break;
+        case NST_METRIC_RULE_EVICTIONS:
+            chunk_appendf(chk, "nuster_%s{%s} %"PRIu64"\n", name, labels->area,
+                    stats->entries[rule->uuid].evicted);
+            break;
+        case NST_METRIC_RULE_TTFB:
+            _nst_stats_metric_ttfb(chk, labels->area, "hit", sum.ttfb_hit, sum.ttfb_hit_sum);
+            _nst_stats_metric_ttfb(chk, labels->area, "miss", sum.ttfb_miss, sum.ttfb_miss_sum);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Stream the rule family appctx->st1, appctx->st2 is 0 before its header,
+ * then the uuid of the next rule plus 1.
+ * Returns 0 if the buffer is full.
+ */
+static int
+_nst_stats_metric_rules(hpx_appctx_t *appctx, hpx_channel_t *res, hpx_htx_t *htx) {
+    hpx_proxy_t  *p;
+    nst_rule_t   *rule;
+
+    if(!nuster.rule_cnt) {
+        return 1;
+    }
+
+    if(nst_stats_metrics[appctx->st1].cache && global.nuster.cache.status != NST_STATUS_ON) {
+        return 1;
+    }
+
+    if(appctx->st2 == 0) {
+        chunk_reset(&trash);
+
+        _nst_stats_metric_head(&trash, appctx->st1);
+
+        if(!_nst_stats_putdata(res, htx, &trash)) {
+            return 0;
+        }
+
+        appctx->st2 = 1;
+    }
+
+    for(p = proxies_list; p; p = p->next) {
+
+        if(!(p->cap & PR_CAP_BE)
+                || (p->nuster.mode != NST_MODE_CACHE && p->nuster.mode != NST_MODE_NOSQL)) {
+
+            continue;
+        }
+
+        for(rule = nuster.proxy[p->uuid]->rule; rule; rule = rule->next) {
+
+            if(rule->uuid + 1 < appctx->st2) {
+                continue;
+            }
+
+            chunk_reset(&trash);
+
+            _nst_stats_metric_rule(&trash, appctx->st1, p, rule);
+
+            if(trash.data && !_nst_stats_putdata(res, htx, &trash)) {
+                return 0;
+            }
+
+            appctx->st2 = rule->uuid + 2;
+        }
+    }
+
+    return 1;
+}
+
+static int
+_nst_stats_metrics(hpx_appctx_t *appctx, hpx_stream_interface_t *si, hpx_htx_t *htx) {
+    hpx_channel_t  *res = si_ic(si);
+
+    while(appctx->st1 < NST_METRIC_CNT) {
+
+        if(appctx->st1 < NST_METRIC_RULE_ENABLED) {
+            chunk_reset(&trash);
+
+            _nst_stats_metric(&trash, appctx->st1);
+
+            if(trash.data && !_nst_stats_putdata(res, htx, &trash)) {
+                goto full;
+            }
+        } else if(!_nst_stats_metric_rules(appctx, res, htx)) {
+            goto full;
+        }
+
+        appctx->st1++;
+        appctx->st2 = 0;
+    }
+
+    return 1;
+
+full:
+    si_rx_room_blk(si);
+
+    return 0;
+}
+
 static void
 nst_stats_handler(hpx_appctx_t *appctx) {
     hpx_stream_interface_t  *si  = appctx->owner;
@@ -451,7 +1162,7 @@ nst_stats_handler(hpx_appctx_t *appctx) {
 
     if(appctx->st0 == NST_STATS_HEADER) {
 
-        if(_nst_stats_header(appctx, si, res_htx)) {
+        if(_nst_stats_header(appctx, si, res_htx, ist("text/plain"))) {
             appctx->st0 = NST_STATS_PAYLOAD;
         }
     }
@@ -470,6 +1181,20 @@ nst_stats_handler(hpx_appctx_t *appctx) {
         }
     }
 
+    if(appctx->st0 == NST_STATS_METRICS_HEADER) {
+
+        if(_nst_stats_header(appctx, si, res_htx, ist("text/plain; version=0.0.4"))) {
+            appctx->st0 = NST_STATS_METRICS;
+        }
+    }
+
+    if(appctx->st0 == NST_STATS_METRICS) {
+
+        if(_nst_stats_metrics(appctx, si, res_htx)) {
+            appctx->st0 = NST_STATS_DONE;
+        }
+    }
+
     if(appctx->st0 == NST_STATS_DONE) {
 
         if(!htx_add_endof(res_htx, HTX_BLK_EOM)) {
@@ -500,20 +1225,78 @@ out:
     }
 }
 
+/*
+ * size of the counters allocated by nst_stats_init from global.nuster.shmem
+ */
+uint64_t
+nst_stats_size(int rules) {
+    uint64_t  threads = global.nbproc * global.nbthread;
+
+    return sizeof(nst_stats_t) + threads * sizeof(nst_stats_counters_t)
+        + threads * rules * sizeof(nst_stats_rule_t) + rules * sizeof(nst_stats_entries_t)
+        + 2 * NST_STATS_ALIGN;
+}
+
+/*
+ * chunks of the memory zone are not cache line aligned, over allocate to put the
+ * per thread counters on their own cache lines, they are never freed
+ */
+static void *
+_nst_stats_alloc_aligned(int size) {
+    char  *p = nst_shmem_alloc(global.nuster.shmem, size + NST_STATS_ALIGN);
+
+    if(!p) {
+        return NULL;
+    }
+
+    return (void *)(((uintptr_t)p + NST_STATS_ALIGN - 1) & ~(uintptr_t)(NST_STATS_ALIGN - 1));
+}
+
 int
 nst_stats_init() {
-    global.nuster.stats = nst_shmem_alloc(global.nuster.shmem, sizeof(nst_stats_t));
+    nst_stats_t  *stats;
+    int           size;
+
+    stats = nst_shmem_alloc(global.nuster.shmem, sizeof(nst_stats_t));
 
-    if(!global.nuster.stats) {
+    if(!stats) {
         return NST_ERR;
     }
 
-    memset(global.nuster.stats, 0, sizeof(nst_stats_t));
+    memset(stats, 0, sizeof(*stats));
+
+    stats->threads  = global.nbproc * global.nbthread;
+    stats->rules    = nuster.rule_cnt;
+    stats->counters = _nst_stats_alloc_aligned(stats->threads * sizeof(nst_stats_counters_t));
 
-    if(nst_shctx_init(global.nuster.stats) != NST_OK) {
+    if(!stats->counters) {
         return NST_ERR;
     }
 
+    memset(stats->counters, 0, stats->threads * sizeof(nst_stats_counters_t));
+
+    if(stats->rules) {
+        size        = stats->threads * stats->rules * sizeof(nst_stats_rule_t);
+        stats->rule = _nst_stats_alloc_aligned(size);
+
+        if(!stats->rule) {
+            return NST_ERR;
+        }
+
+        memset(stats->rule, 0, size);
+
+        size           = stats->rules * sizeof(nst_stats_entries_t);
+        stats->entries = nst_shmem_alloc(global.nuster.shmem, size);
+
+        if(!stats->entries) {
+            return NST_ERR;
+        }
+
+        memset(stats->entries, 0, size);
+    }
+
+    global.nuster.stats = stats;
+
     nuster.applet.stats.fct = nst_stats_handler;
 
     return NST_OK;
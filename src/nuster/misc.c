@@ -12,6 +12,7 @@
 
 #include <haproxy/global.h>
 #include <haproxy/stream.h>
+#include <haproxy/proxy.h>
 #include <haproxy/acl.h>
 
 #include <nuster/nuster.h>
@@ -45,6 +46,36 @@ nst_test_rule(hpx_stream_t *s, nst_rule_t *rule, int res) {
     return NST_ERR;
 }
 
+/*
+ * uuid of the rule rid of proxy pid, for objects loaded from disk, or -1 if
+ * the config has changed since they were stored
+ */
+int
+nst_rule_uuid(hpx_ist_t pid, hpx_ist_t rid) {
+    hpx_proxy_t  *p;
+    nst_rule_t   *rule;
+
+    for(p = proxies_list; p; p = p->next) {
+
+        if(p->nuster.mode != NST_MODE_CACHE && p->nuster.mode != NST_MODE_NOSQL) {
+            continue;
+        }
+
+        if(!nuster.proxy[p->uuid] || !isteq(ist(p->id), pid)) {
+            continue;
+        }
+
+        for(rule = nuster.proxy[p->uuid]->rule; rule; rule = rule->next) {
+
+            if(isteq(rule->prop.rid, rid)) {
+                return rule->uuid;
+            }
+        }
+    }
+
+    return -1;
+}
+
 void
 nst_debug(hpx_stream_t *s, const char *fmt, ...) {
 
@@ -23,11 +23,9 @@ nst_nosql_handler(hpx_appctx_t *appctx) {
     nst_memory_item_t       *item = NULL;
     hpx_buffer_t            *buf;
     hpx_htx_t               *req_htx, *res_htx;
-    hpx_htx_blk_type_t       type;
-    hpx_htx_blk_t           *blk;
-    char                    *p, *ptr;
+    nst_disk_aio_t          *aio;
+    char                    *p;
     uint64_t                 offset, payload_len;
-    uint32_t                 blksz, sz, info;
     int                      ret, max, fd, header_len, total;
 
     res_htx = htxbuf(&res->buf);
@@ -114,13 +112,23 @@ out:
                 payload_len = appctx->ctx.nuster.store.disk.payload_len;
                 offset      = appctx->ctx.nuster.store.disk.offset;
                 fd          = appctx->ctx.nuster.store.disk.fd;
+                aio         = appctx->ctx.nuster.store.disk.aio;
 
                 switch(appctx->st1) {
                     case NST_DISK_APPLET_HEADER:
-                        buf = get_trash_chunk();
-                        p   = buf->area;
 
-                        ret = pread(fd, p, header_len, offset);
+                        if(aio) {
+                            ret = nst_disk_aio_pread(aio, offset, header_len, &p);
+
+                            if(ret == NST_DISK_PENDING) {
+                                goto end;
+                            }
+                        } else {
+                            buf = get_trash_chunk();
+                            p   = buf->area;
+
+                            ret = pread(fd, p, header_len, offset);
+                        }
 
                         if(ret != header_len) {
                             appctx->st1 = NST_DISK_APPLET_ERROR;
@@ -162,44 +170,39 @@ out:
 
                         break;
                     case NST_DISK_APPLET_PAYLOAD:
-                        buf = get_trash_chunk();
-                        p   = buf->area;
-                        max = htx_get_max_blksz(res_htx, channel_htx_recv_max(res, res_htx));
 
-                        if(max <= 0) {
-                            goto end;
-                        }
+                        if(aio) {
+                            /* swaps res->buf with the buffer read into */
+                            ret = nst_disk_aio_read(aio, &res->buf, offset, payload_len);
 
-                        if(max < payload_len) {
-                            ret = pread(fd, p, max, offset);
-                        } else {
-                            ret = pread(fd, p, payload_len, offset);
-                        }
+                            if(ret == 0) {
+                                si_rx_room_blk(si);
 
-                        if(ret <= 0) {
-                            appctx->st1 = NST_DISK_APPLET_ERROR;
+                                goto end;
+                            }
 
-                            break;
-                        }
+                            res_htx = htxbuf(&res->buf);
+                        } else {
+                            max = htx_get_max_blksz(res_htx, channel_htx_recv_max(res, res_htx));
 
-                        appctx->ctx.nuster.store.disk.payload_len -= ret;
+                            if(max <= 0) {
+                                goto end;
+                            }
 
-                        type  = HTX_BLK_DATA;
-                        info  = (type << 28) + ret;
-                        blksz = info & 0xfffffff;
-                        blk   = htx_add_blk(res_htx, type, blksz);
+                            if(max > payload_len) {
+                                max = payload_len;
+                            }
+
+                            ret = nst_disk_read_data(fd, res_htx, offset, max);
+                        }
 
-                        if(!blk) {
+                        if(ret <= 0) {
                             appctx->st1 = NST_DISK_APPLET_ERROR;
 
                             break;
                         }
 
-                        blk->info = info;
-
-                        ptr = htx_get_blk_ptr(res_htx, blk);
-                        sz  = htx_get_blksz(blk);
-                        memcpy(ptr, p, sz);
+                        appctx->ctx.nuster.store.disk.payload_len -= ret;
 
                         offset += ret;
                         appctx->ctx.nuster.store.disk.offset = offset;
@@ -232,7 +235,11 @@ out:
                         /* fall through */
                     case NST_DISK_APPLET_DONE:
 
-                        close(fd);
+                        if(fd != -1) {
+                            close(fd);
+
+                            appctx->ctx.nuster.store.disk.fd = -1;
+                        }
 
                         if(!(res->flags & CF_SHUTR) ) {
                             res->flags |= CF_READ_NULL;
@@ -249,7 +256,6 @@ out:
                     case NST_DISK_APPLET_ERROR:
                         si_shutr(si);
                         res->flags |= CF_READ_NULL;
-                        close(fd);
 
                         break;
                 }
@@ -294,6 +300,20 @@ end:
     return;
 }
 
+static void
+nst_nosql_release_handler(hpx_appctx_t *appctx) {
+
+    if(appctx->st0 == NST_NOSQL_APPCTX_STATE_HIT_DISK) {
+        int  fd = appctx->ctx.nuster.store.disk.fd;
+
+        if(appctx->ctx.nuster.store.disk.aio) {
+            nst_disk_aio_release(appctx->ctx.nuster.store.disk.aio, fd);
+        } else if(fd != -1) {
+            close(fd);
+        }
+    }
+}
+
 void
 nst_nosql_housekeeping() {
     nst_dict_t   *dict  = &nuster.nosql->dict;
@@ -326,6 +346,8 @@ nst_nosql_housekeeping() {
             }
         }
 
+        nst_dict_rehash(dict);
+
         start = nst_time_now_ms();
 
         if(data_cleaner > store->memory.count) {
@@ -372,6 +394,8 @@ nst_nosql_housekeeping() {
             }
         }
 
+        nst_disk_index_save(nuster.nosql, global.nuster.nosql.disk_index_interval * 1000ULL);
+
 #ifndef USE_THREAD
         while(!store->disk.loaded && disk_loader--) {
             nst_disk_load(nuster.nosql);
@@ -398,7 +422,8 @@ nst_nosql_init() {
     size       = dict_size + data_size;
     clean_temp = global.nuster.nosql.clean_temp;
 
-    nuster.applet.nosql.fct = nst_nosql_handler;
+    nuster.applet.nosql.fct     = nst_nosql_handler;
+    nuster.applet.nosql.release = nst_nosql_release_handler;
 
     if(global.nuster.nosql.status == NST_STATUS_ON) {
 
@@ -428,12 +453,16 @@ nst_nosql_init() {
         nuster.nosql->shmem = shmem;
         nuster.nosql->root  = root;
 
-        if(nst_store_init(&nuster.nosql->store, root, shmem, clean_temp, nuster.nosql) != NST_OK) {
+        if(nst_store_init(&nuster.nosql->store, root, shmem, clean_temp,
+                    global.nuster.nosql.disk_engine, global.nuster.nosql.disk_segment_size,
+                    global.nuster.nosql.disk_scan_threads, nuster.nosql) != NST_OK) {
+
             ha_alert("Failed to init nuster nosql store.\n");
             exit(1);
         }
 
-        if(nst_dict_init(&nuster.nosql->dict, &nuster.nosql->store, shmem, dict_size) != NST_OK) {
+        if(nst_dict_init(&nuster.nosql->dict, &nuster.nosql->store, shmem, dict_size,
+                    global.nuster.nosql.purge_index == NST_STATUS_ON, 0) != NST_OK) {
             ha_alert("Failed to init nuster nosql dict.\n");
             exit(1);
         }
@@ -687,7 +716,7 @@ nst_nosql_create(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
 
     ctx->state = NST_CTX_STATE_CREATE;
 
-    nst_shctx_lock(dict);
+    nst_dict_lock(dict, ctx->key);
 
     entry = nst_dict_get(dict, ctx->key);
 
@@ -715,7 +744,7 @@ nst_nosql_create(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
         }
     }
 
-    nst_shctx_unlock(dict);
+    nst_dict_unlock(dict, ctx->key);
 
     /* init store data */
 
@@ -725,7 +754,14 @@ nst_nosql_create(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
         }
 
         if(nst_store_disk_on(ctx->rule->prop.store)) {
-            nst_disk_obj_create(disk, &ctx->store.disk.obj, ctx->key, &ctx->txn, &ctx->rule->prop);
+            hpx_task_t  *task = NULL;
+
+            if(global.nuster.nosql.disk_io_threads && nst_disk_aio_on()) {
+                task = s->task;
+            }
+
+            nst_disk_obj_create(disk, &ctx->store.disk.obj, ctx->key, &ctx->txn,
+                    &ctx->rule->prop, task);
         }
     }
 
@@ -807,6 +843,20 @@ nst_nosql_append(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
                 data.len = len;
             }
 
+            /* wait for the io thread to catch up with the disk writes */
+            if(nst_store_disk_on(ctx->rule->prop.store) && ctx->store.disk.obj.file) {
+                int  room = nst_disk_obj_room(&ctx->store.disk.obj);
+
+                if(room <= 0) {
+                    break;
+                }
+
+                if(data.len > room) {
+                    data.len = room;
+                    len      = data.len;
+                }
+            }
+
             info = (type << 28) + data.len;
 
             ctx->txn.res.payload_len += data.len;
@@ -833,6 +883,12 @@ nst_nosql_append(hpx_http_msg_t *msg, nst_ctx_t *ctx, unsigned int offset, unsig
         if(type == HTX_BLK_TLR || type == HTX_BLK_EOT) {
             uint32_t  sz = htx_get_blksz(blk);
 
+            if(nst_store_disk_on(ctx->rule->prop.store) && ctx->store.disk.obj.file
+                    && nst_disk_obj_room(&ctx->store.disk.obj) < 4 + sz) {
+
+                break;
+            }
+
             forward += sz;
             len     -= sz;
 
@@ -913,7 +969,7 @@ nst_nosql_finish(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
 
     if(nst_store_memory_on(ctx->rule->prop.store) && ctx->store.memory.obj) {
 
-        nst_shctx_lock(dict);
+        nst_dict_lock(dict, ctx->key);
 
         if(entry && entry->state != NST_DICT_ENTRY_STATE_INVALID && entry->store.memory.obj) {
             entry->store.memory.obj->invalid = 1;
@@ -924,7 +980,7 @@ nst_nosql_finish(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
         entry->state = NST_DICT_ENTRY_STATE_VALID;
         entry->store.memory.obj = ctx->store.memory.obj;
 
-        nst_shctx_unlock(dict);
+        nst_dict_unlock(dict, ctx->key);
     }
 
     if(nst_store_disk_on(ctx->rule->prop.store) && ctx->store.disk.obj.file) {
@@ -939,9 +995,20 @@ nst_nosql_finish(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
         nst_disk_obj_t  *obj = &ctx->store.disk.obj;
 
         if(nst_disk_obj_finish(disk, obj, ctx->key, &ctx->txn, entry->expire) == NST_OK) {
+            nst_dict_lock(dict, ctx->key);
+
+            /* the segment engine does not overwrite the previous object */
+            if(entry->store.disk.file && nst_disk_segment_on(disk)) {
+                nst_disk_purge_by_path(disk, entry->store.disk.file, entry->store.disk.offset);
+                nst_shmem_free(nuster.nosql->shmem, entry->store.disk.file);
+            }
+
             entry->state = NST_DICT_ENTRY_STATE_VALID;
 
-            entry->store.disk.file = ctx->store.disk.obj.file;
+            entry->store.disk.file   = obj->file;
+            entry->store.disk.offset = obj->base;
+
+            nst_dict_unlock(dict, ctx->key);
         }
     }
 
@@ -954,11 +1021,12 @@ nst_nosql_finish(hpx_stream_t *s, hpx_http_msg_t *msg, nst_ctx_t *ctx) {
 }
 
 int
-nst_nosql_exists(nst_ctx_t *ctx) {
+nst_nosql_exists(hpx_stream_t *s, nst_ctx_t *ctx) {
     nst_dict_entry_t  *entry = NULL;
     nst_dict_t        *dict  = &nuster.nosql->dict;
     nst_memory_t      *mem   = &nuster.nosql->store.memory;
     nst_disk_t        *disk  = &nuster.nosql->store.disk;
+    hpx_task_t        *task  = NULL;
     int                ret;
 
     ret = NST_CTX_STATE_INIT;
@@ -967,10 +1035,14 @@ nst_nosql_exists(nst_ctx_t *ctx) {
         return ret;
     }
 
+    if(global.nuster.nosql.disk_io_threads && nst_disk_aio_on()) {
+        task = s->task;
+    }
+
     if(!nst_key_memory_checked(ctx->key)) {
         nst_key_memory_set_checked(ctx->key);
 
-        nst_shctx_lock(dict);
+        nst_dict_lock(dict, ctx->key);
 
         entry = nst_dict_get(dict, ctx->key);
 
@@ -985,6 +1057,7 @@ nst_nosql_exists(nst_ctx_t *ctx) {
                     ret = NST_CTX_STATE_HIT_MEMORY;
                 } else if(entry->store.disk.file) {
                     ctx->store.disk.obj.file = entry->store.disk.file;
+                    ctx->store.disk.obj.base = entry->store.disk.offset;
                     ret = NST_CTX_STATE_HIT_DISK;
                 }
 
@@ -1002,7 +1075,7 @@ nst_nosql_exists(nst_ctx_t *ctx) {
             }
         }
 
-        nst_shctx_unlock(dict);
+        nst_dict_unlock(dict, ctx->key);
     }
 
     if(ret == NST_CTX_STATE_INIT) {
@@ -1025,8 +1098,17 @@ nst_nosql_exists(nst_ctx_t *ctx) {
             nst_key_disk_set_checked(ctx->key);
 
             if(ctx->store.disk.obj.file) {
-                int  valid  = nst_disk_obj_valid(&ctx->store.disk.obj, ctx->key);
-                int  expire = nst_disk_meta_check_expire(ctx->store.disk.obj.meta);
+                int  valid  = nst_disk_obj_valid(&ctx->store.disk.obj, ctx->key, task);
+                int  expire;
+
+                if(valid == NST_DISK_PENDING) {
+                    /* checked again once woken up, see the nosql filter */
+                    nst_key_reset_flag(ctx->key);
+
+                    return NST_CTX_STATE_CHECK_DISK;
+                }
+
+                expire = nst_disk_meta_check_expire(ctx->store.disk.obj.meta);
 
                 if(valid != NST_OK && expire != NST_OK) {
                     ret = NST_CTX_STATE_INIT;
@@ -1045,7 +1127,13 @@ nst_nosql_exists(nst_ctx_t *ctx) {
 
         if(!nst_key_disk_checked(ctx->key)) {
             char  *meta   = ctx->store.disk.obj.meta;
-            int    exists = nst_disk_obj_exists(disk, &ctx->store.disk.obj, ctx->key);
+            int    exists = nst_disk_obj_exists(disk, &ctx->store.disk.obj, ctx->key, task);
+
+            if(exists == NST_DISK_PENDING) {
+                nst_key_reset_flag(ctx->key);
+
+                return NST_CTX_STATE_CHECK_DISK;
+            }
 
             nst_key_disk_set_checked(ctx->key);
 
@@ -1117,7 +1205,7 @@ nst_nosql_delete(nst_key_t *key) {
     nst_dict_entry_t  *entry = NULL;
     int                ret   = 0;
 
-    nst_shctx_lock(dict);
+    nst_dict_lock(dict, key);
 
     entry = nst_dict_get(dict, key);
 
@@ -1137,7 +1225,9 @@ nst_nosql_delete(nst_key_t *key) {
             }
 
             if(entry->store.disk.file) {
-                nst_disk_file_remove(entry->store.disk.file);
+                nst_disk_purge_by_path(&nuster.nosql->store.disk, entry->store.disk.file,
+                        entry->store.disk.offset);
+
                 nst_shmem_free(nuster.nosql->shmem, entry->store.disk.file);
                 entry->store.disk.file = NULL;
             }
@@ -1149,9 +1239,11 @@ nst_nosql_delete(nst_key_t *key) {
         ret = 0;
     }
 
-    nst_shctx_unlock(dict);
+    nst_dict_unlock(dict, key);
+
+    if(!nuster.nosql->store.disk.loaded && global.nuster.nosql.root.len
+            && !nst_disk_segment_on(&nuster.nosql->store.disk)) {
 
-    if(!nuster.nosql->store.disk.loaded && global.nuster.nosql.root.len){
         nst_disk_obj_t  disk;
         hpx_buffer_t    *buf = get_trash_chunk();
 
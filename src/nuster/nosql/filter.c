@@ -95,18 +95,14 @@ _nst_nosql_filter_detach(hpx_stream_t *s, hpx_filter_t *filter) {
 
     if(filter->ctx) {
         nst_ctx_t  *ctx = filter->ctx;
-        int         i;
 
         if(ctx->state == NST_CTX_STATE_CREATE || ctx->state == NST_CTX_STATE_UPDATE) {
             nst_nosql_abort(ctx);
         }
 
-        for(i = 0; i < ctx->key_cnt; i++) {
-            ctx->key = &ctx->keys[i];
-
-            if(ctx->key->data) {
-                free(ctx->key->data);
-            }
+        /* a disk check not handed over to the applet */
+        if(ctx->store.disk.obj.aio) {
+            nst_disk_aio_release(ctx->store.disk.obj.aio, ctx->store.disk.obj.fd);
         }
 
         free_trash_chunk(ctx->buf);
@@ -132,7 +128,16 @@ _nst_nosql_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
         return 1;
     }
 
-    nst_stats_update_nosql(s->txn->meth);
+    if(ctx->state == NST_CTX_STATE_CHECK_DISK) {
+        /* woken up by the io thread */
+        if(nst_disk_obj_checking(&ctx->store.disk.obj)) {
+            return 0;
+        }
+
+        ctx->state = NST_CTX_STATE_INIT;
+    } else {
+        nst_stats_update_nosql(s->txn->meth);
+    }
 
     if(ctx->state == NST_CTX_STATE_INIT) {
         int  i = 0;
@@ -170,7 +175,7 @@ _nst_nosql_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
 
             if(!ctx->key->data) {
                 /* build key */
-                if(nst_key_build(s, msg, ctx->rule, &ctx->txn, ctx->key, HTTP_METH_GET) != NST_OK) {
+                if(nst_key_build(s, msg, ctx->rule, &ctx->txn, ctx->key, HTTP_METH_GET, ctx->buf) != NST_OK) {
                     ctx->state = NST_CTX_STATE_FULL;
 
                     break;
@@ -184,7 +189,13 @@ _nst_nosql_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
             if(s->txn->meth == HTTP_METH_GET) {
                 nst_debug_beg(s, "[nosql] Check key existence: ");
 
-                ctx->state = nst_nosql_exists(ctx);
+                ctx->state = nst_nosql_exists(s, ctx);
+
+                if(ctx->state == NST_CTX_STATE_CHECK_DISK) {
+                    nst_debug_end("CHECK disk");
+
+                    return 0;
+                }
 
                 if(ctx->state == NST_CTX_STATE_HIT_MEMORY) {
                     /* OK, nosql exists */
@@ -273,9 +284,28 @@ _nst_nosql_filter_http_headers(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_m
         appctx->st1 = NST_DISK_APPLET_HEADER;
 
         appctx->ctx.nuster.store.disk.fd          = ctx->store.disk.obj.fd;
-        appctx->ctx.nuster.store.disk.offset      = nst_disk_pos_header(&ctx->store.disk.obj);
+        appctx->ctx.nuster.store.disk.offset      = ctx->store.disk.obj.base
+            + nst_disk_pos_header(&ctx->store.disk.obj);
         appctx->ctx.nuster.store.disk.header_len  = nst_disk_meta_get_header_len(meta);
         appctx->ctx.nuster.store.disk.payload_len = nst_disk_meta_get_payload_len(meta);
+        appctx->ctx.nuster.store.disk.aio         = NULL;
+
+        if(global.nuster.nosql.disk_io_threads && nst_disk_aio_on()) {
+            /* the aio which checked the object, see nst_nosql_exists */
+            nst_disk_aio_t  *aio = ctx->store.disk.obj.aio;
+
+            ctx->store.disk.obj.aio = NULL;
+
+            if(!aio) {
+                aio = nst_disk_aio_create(NULL, -1);
+            }
+
+            if(aio) {
+                nst_disk_aio_attach(aio, appctx, ctx->store.disk.obj.fd);
+            }
+
+            appctx->ctx.nuster.store.disk.aio = aio;
+        }
 
         req->analysers &= ~AN_REQ_FLT_HTTP_HDRS;
         req->analysers &= ~AN_REQ_FLT_XFER_DATA;
@@ -361,6 +391,11 @@ _nst_nosql_filter_http_end(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_msg_t
 
         if(ctx->state == NST_CTX_STATE_CREATE || ctx->state == NST_CTX_STATE_UPDATE) {
 
+            /* woken up by the io thread once the staged writes are done */
+            if(ctx->store.disk.obj.file && !nst_disk_obj_flushed(&ctx->store.disk.obj)) {
+                return 0;
+            }
+
             nst_nosql_finish(s, msg, ctx);
 
             if(ctx->state == NST_CTX_STATE_DONE) {
@@ -371,6 +406,9 @@ _nst_nosql_filter_http_end(hpx_stream_t *s, hpx_filter_t *filter, hpx_http_msg_t
                 appctx->st0 = NST_NOSQL_APPCTX_STATE_ERROR;
             }
 
+            /* the request may be all consumed while the writes were pending */
+            appctx_wakeup(appctx);
+
         }
     }
 
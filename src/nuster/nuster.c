@@ -13,6 +13,8 @@
 #include <haproxy/global.h>
 #include <haproxy/proxy.h>
 #include <haproxy/errors.h>
+#include <haproxy/ticks.h>
+#include <haproxy/time.h>
 
 #include <nuster/nuster.h>
 
@@ -24,6 +26,10 @@ nuster_t  nuster = {
             .obj_type = OBJ_TYPE_APPLET,
             .name     = "<NUSTER.CACHE.ENGINE>",
         },
+        .refresh = {
+            .obj_type = OBJ_TYPE_APPLET,
+            .name     = "<NUSTER.CACHE.REFRESH>",
+        },
         .purger = {
             .obj_type = OBJ_TYPE_APPLET,
             .name     = "<NUSTER.MANAGER.PURGER>",
@@ -44,23 +50,10 @@ static void
 _nst_proxy_init() {
     hpx_proxy_t  *px1;
     nst_shmem_t  *shmem;
-    int           uuid, proxy_cnt;
-
-    /* new rule init */
-    global.nuster.shmem = nst_shmem_create("nuster.shm", NST_DEFAULT_SIZE,
-            global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE);
-
-    if(!global.nuster.shmem) {
-        goto err;
-    }
-
-    if(nst_shctx_init(global.nuster.shmem) != NST_OK) {
-        goto err;
-    }
-
-    shmem = global.nuster.shmem;
+    int           uuid, proxy_cnt, rule_cnt;
 
     proxy_cnt = 0;
+    rule_cnt  = 0;
 
     px1 = proxies_list;
 
@@ -90,12 +83,28 @@ _nst_proxy_init() {
 
                 px2 = px2->next;
             }
+
+            rule_cnt++;
         }
 
         proxy_cnt = MAX(proxy_cnt, px1->uuid + 1);
         px1 = px1->next;
     }
 
+    /* new rule init, the per rule stats are allocated from there too */
+    global.nuster.shmem = nst_shmem_create("nuster.shm",
+            NST_DEFAULT_SIZE + nst_stats_size(rule_cnt), global.tune.bufsize, NST_DEFAULT_CHUNK_SIZE);
+
+    if(!global.nuster.shmem) {
+        goto err;
+    }
+
+    if(nst_shctx_init(global.nuster.shmem) != NST_OK) {
+        goto err;
+    }
+
+    shmem = global.nuster.shmem;
+
     nuster.proxy = nst_shmem_alloc(shmem, proxy_cnt * sizeof(nst_proxy_t *));
 
     if(!nuster.proxy) {
@@ -177,10 +186,12 @@ _nst_proxy_init() {
 
                 rule->prop.pid           = ist2(rc->proxy, strlen(rc->proxy));
                 rule->prop.rid           = ist2(rc->name, strlen(rc->name));
+                rule->prop.uuid          = rule->uuid;
                 rule->prop.ttl           = rc->ttl;
                 rule->prop.store         = rc->store;
                 rule->prop.etag          = rc->etag;
                 rule->prop.last_modified = rc->last_modified;
+                rule->prop.gzip          = rc->gzip;
                 rule->prop.extend[0]     = rc->extend[0];
                 rule->prop.extend[1]     = rc->extend[1];
                 rule->prop.extend[2]     = rc->extend[2];
@@ -188,6 +199,8 @@ _nst_proxy_init() {
                 rule->prop.wait          = rc->wait;
                 rule->prop.stale         = rc->stale;
                 rule->prop.inactive      = rc->inactive;
+                rule->prop.refresh       = rc->refresh;
+                rule->prop.admit         = rc->admit;
 
                 rule->cond = rc->cond;
 
@@ -204,6 +217,8 @@ _nst_proxy_init() {
         px1 = px1->next;
     }
 
+    nuster.rule_cnt = uuid;
+
     return;
 
 err:
@@ -235,26 +250,56 @@ nuster_handle_chroot() {
     hpx_ist_t     root;
     nst_shmem_t  *shmem;
     nst_disk_t   *disk;
-    int           clean_temp;
+    int           clean_temp, threads;
 
     root       = global.nuster.cache.root;
     clean_temp = global.nuster.cache.clean_temp;
     shmem      = global.nuster.cache.shmem;
     disk       = &nuster.cache->store.disk;
 
-    if(nst_disk_init(disk, root, shmem, clean_temp, nuster.cache) != NST_OK) {
+    if(nst_disk_init(disk, root, shmem, clean_temp, global.nuster.cache.disk_engine,
+                global.nuster.cache.disk_segment_size,
+                global.nuster.cache.disk_scan_threads, nuster.cache) != NST_OK) {
+
         goto err;
     }
 
+    if(root.len) {
+        nst_disk_load_start(disk, nuster.cache);
+    }
+
     root       = global.nuster.nosql.root;
     clean_temp = global.nuster.nosql.clean_temp;
     shmem      = global.nuster.nosql.shmem;
     disk       = &nuster.nosql->store.disk;
 
-    if(nst_disk_init(disk, root, shmem, clean_temp, nuster.nosql) != NST_OK) {
+    if(nst_disk_init(disk, root, shmem, clean_temp, global.nuster.nosql.disk_engine,
+                global.nuster.nosql.disk_segment_size,
+                global.nuster.nosql.disk_scan_threads, nuster.nosql) != NST_OK) {
+
+        goto err;
+    }
+
+    if(root.len) {
+        nst_disk_load_start(disk, nuster.nosql);
+    }
+
+    threads = 0;
+
+    if(global.nuster.cache.root.len) {
+        threads = global.nuster.cache.disk_io_threads;
+    }
+
+    if(global.nuster.nosql.root.len && global.nuster.nosql.disk_io_threads > threads) {
+        threads = global.nuster.nosql.disk_io_threads;
+    }
+
+    if(nst_disk_aio_init(threads) != NST_OK) {
         goto err;
     }
 
+    nst_cache_warm_init();
+
     return;
 
 err:
@@ -263,3 +308,18 @@ err:
     exit(1);
 }
 
+/*
+ * The master process has no timer of its own, bound its poll timeout so
+ * that housekeeping runs regularly.
+ */
+int
+nuster_housekeeping_expire(int next) {
+
+    if(master == 1 && (global.nuster.cache.status == NST_STATUS_ON
+                || global.nuster.nosql.status == NST_STATUS_ON)) {
+
+        return tick_first(next, tick_add(now_ms, NST_HOUSEKEEPING_INTERVAL));
+    }
+
+    return next;
+}
@@ -15,83 +15,91 @@
 #include <haproxy/global.h>
 #include <haproxy/acl.h>
 #include <haproxy/tools.h>
+#include <haproxy/compression.h>
 
 #include <nuster/nuster.h>
 
 const char *nst_cache_flt_id = "nuster cache id";
 const char *nst_nosql_flt_id = "nuster nosql id";
 
-static nst_key_element_t *
-_nst_parse_rule_key_cast(char *str) {
-    nst_key_element_t  *key = NULL;
+static int
+_nst_parse_rule_key_cast(char *str, nst_key_element_t *key) {
+
+    key->name = IST_NULL;
 
     if(!strcmp(str, "method")) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_METHOD;
-        key->data = NULL;
     } else if(!strcmp(str, "scheme")) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_SCHEME;
-        key->data = NULL;
     } else if(!strcmp(str, "host")) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_HOST;
-        key->data = NULL;
     } else if(!strcmp(str, "uri")) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_URI;
-        key->data = NULL;
     } else if(!strcmp(str, "path")) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_PATH;
-        key->data = NULL;
     } else if(!strcmp(str, "delimiter")) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_DELIMITER;
-        key->data = NULL;
     } else if(!strcmp(str, "query")) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_QUERY;
-        key->data = NULL;
     } else if(!strncmp(str, "param_", 6) && strlen(str) > 6) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_PARAM;
-        key->data = strdup(str + 6);
+        key->name = ist2(strdup(str + 6), strlen(str + 6));
     } else if(!strncmp(str, "header_", 7) && strlen(str) > 7) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_HEADER;
-        key->data = strdup(str + 7);
+        key->name = ist2(strdup(str + 7), strlen(str + 7));
+
+        /* as stored in htx */
+        if(key->name.ptr) {
+            ist2bin_lc(key->name.ptr, key->name);
+        }
     } else if(!strncmp(str, "cookie_", 7) && strlen(str) > 7) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_COOKIE;
-        key->data = strdup(str + 7);
+        key->name = ist2(strdup(str + 7), strlen(str + 7));
     } else if(!strcmp(str, "body")) {
-        key       = malloc(sizeof(*key));
         key->type = NST_KEY_ELEMENT_BODY;
-        key->data = NULL;
+    } else {
+        return NST_ERR;
+    }
+
+    if(key->name.len && !key->name.ptr) {
+        return NST_ERR;
     }
 
-    return key;
+    return NST_OK;
 }
 
-static nst_key_element_t **
+/*
+ * Compile the key definition str to the array of its elements, resolved once
+ * here rather than on every request
+ */
+static nst_key_element_t *
 _nst_parse_rule_key(char *str) {
-    nst_key_element_t  **pk  = NULL;
-    char                *tmp = strdup(str);
-    int                  i   = 0;
-    char                *m;
+    nst_key_element_t  *pk  = NULL;
+    nst_key_element_t  *tmp_pk;
+    char               *tmp = strdup(str);
+    int                 i   = 0;
+    char               *m;
+
+    if(!tmp) {
+        return NULL;
+    }
 
     m = strtok(tmp, ".");
 
     while(m) {
-        nst_key_element_t  *key = _nst_parse_rule_key_cast(m);
+        tmp_pk = realloc(pk, (i + 2) * sizeof(nst_key_element_t));
 
-        if(!key) {
+        if(!tmp_pk) {
             goto err;
         }
 
-        pk = realloc(pk, (i + 1) * sizeof(nst_key_element_t *));
-        pk[i++] = key;
+        pk = tmp_pk;
+
+        if(_nst_parse_rule_key_cast(m, &pk[i]) != NST_OK) {
+            goto err;
+        }
+
+        i++;
         m = strtok(NULL, ".");
     }
 
@@ -99,8 +107,8 @@ _nst_parse_rule_key(char *str) {
         goto err;
     }
 
-    pk = realloc(pk, (i + 1) * sizeof(nst_key_element_t *));
-    pk[i] = NULL;
+    pk[i].type = 0;
+    pk[i].name = IST_NULL;
 
     free(tmp);
 
@@ -110,7 +118,7 @@ err:
     if(pk) {
 
         while(i--) {
-            free(pk[i]);
+            free(pk[i].name.ptr);
         }
 
         free(pk);
@@ -524,6 +532,26 @@ nuster_parse_global_cache(const char *file, int line, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "tag-header")) {
+            cur_arg++;
+
+            if(*(args[cur_arg]) == 0) {
+                ha_alert("parsing [%s:%d]: [%s]: tag-header expects a header name as argument.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.cache.tag_header.ptr = strdup(args[cur_arg]);
+            global.nuster.cache.tag_header.len = strlen(args[cur_arg]);
+
+            cur_arg++;
+
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "dict-cleaner")) {
             cur_arg++;
 
@@ -699,6 +727,170 @@ nuster_parse_global_cache(const char *file, int line, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "purge-index")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] expects 'on' or 'off' as argument.\n", file, line,
+                        args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.cache.purge_index = NST_STATUS_OFF;
+            } else if(!strcmp(args[cur_arg], "on")) {
+                global.nuster.cache.purge_index = NST_STATUS_ON;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] only supports 'on' and 'off'.\n", file, line,
+                        args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-engine")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] expects 'file' or 'segment' as argument.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "file")) {
+                global.nuster.cache.disk_engine = NST_DISK_ENGINE_FILE;
+            } else if(!strcmp(args[cur_arg], "segment")) {
+                global.nuster.cache.disk_engine = NST_DISK_ENGINE_SEGMENT;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] only supports 'file' and 'segment'.\n", file,
+                        line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-segment-size")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] disk-segment-size expects a size.\n", file, line,
+                        args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(nst_parse_size(args[cur_arg], &global.nuster.cache.disk_segment_size)
+                    || global.nuster.cache.disk_segment_size == 0) {
+
+                ha_alert("parsing [%s:%d]: [%s] invalid disk-segment-size, expects [m|M|g|G].\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-io-threads")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] disk-io-threads expects a number.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.cache.disk_io_threads = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.disk_io_threads < 0) {
+                global.nuster.cache.disk_io_threads = 0;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-scan-threads")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] disk-scan-threads expects a number.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.cache.disk_scan_threads = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.disk_scan_threads <= 0) {
+                global.nuster.cache.disk_scan_threads = NST_DEFAULT_DISK_SCAN_THREADS;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-index-interval")) {
+            uint32_t  interval;
+
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] disk-index-interval expects a time.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(nst_parse_time(args[cur_arg], strlen(args[cur_arg]), &interval) != NST_TIME_OK) {
+                ha_alert("parsing [%s:%d]: [%s] invalid disk-index-interval, expects [d|h|m|s].\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.cache.disk_index_interval = interval;
+
+            cur_arg++;
+
+            continue;
+        }
+
 
         ha_alert("parsing [%s:%d]: [%s] Unrecognized '%s'.\n", file, line, args[0], args[cur_arg]);
 
@@ -995,6 +1187,170 @@ nuster_parse_global_nosql(const char *file, int line, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "purge-index")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] expects 'on' or 'off' as argument.\n", file, line,
+                        args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.nosql.purge_index = NST_STATUS_OFF;
+            } else if(!strcmp(args[cur_arg], "on")) {
+                global.nuster.nosql.purge_index = NST_STATUS_ON;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] only supports 'on' and 'off'.\n", file, line,
+                        args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-engine")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] expects 'file' or 'segment' as argument.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "file")) {
+                global.nuster.nosql.disk_engine = NST_DISK_ENGINE_FILE;
+            } else if(!strcmp(args[cur_arg], "segment")) {
+                global.nuster.nosql.disk_engine = NST_DISK_ENGINE_SEGMENT;
+            } else {
+                ha_alert("parsing [%s:%d]: [%s] only supports 'file' and 'segment'.\n", file,
+                        line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-segment-size")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] disk-segment-size expects a size.\n", file, line,
+                        args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(nst_parse_size(args[cur_arg], &global.nuster.nosql.disk_segment_size)
+                    || global.nuster.nosql.disk_segment_size == 0) {
+
+                ha_alert("parsing [%s:%d]: [%s] invalid disk-segment-size, expects [m|M|g|G].\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-io-threads")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] disk-io-threads expects a number.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.nosql.disk_io_threads = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.disk_io_threads < 0) {
+                global.nuster.nosql.disk_io_threads = 0;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-scan-threads")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] disk-scan-threads expects a number.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.nosql.disk_scan_threads = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.disk_scan_threads <= 0) {
+                global.nuster.nosql.disk_scan_threads = NST_DEFAULT_DISK_SCAN_THREADS;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "disk-index-interval")) {
+            uint32_t  interval;
+
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: [%s] disk-index-interval expects a time.\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            if(nst_parse_time(args[cur_arg], strlen(args[cur_arg]), &interval) != NST_TIME_OK) {
+                ha_alert("parsing [%s:%d]: [%s] invalid disk-index-interval, expects [d|h|m|s].\n",
+                        file, line, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+
+                goto out;
+            }
+
+            global.nuster.nosql.disk_index_interval = interval;
+
+            cur_arg++;
+
+            continue;
+        }
+
 
         ha_alert("parsing [%s:%d]: [%s] Unrecognized '%s'.\n", file, line, args[0], args[cur_arg]);
 
@@ -1135,12 +1491,12 @@ nst_parse_proxy_rule(char **args, int section, hpx_proxy_t *proxy, hpx_proxy_t *
     char               *key  = NULL;
     char               *code = NULL;
 
-    int      memory, disk, ttl, etag, last_modified, wait, stale, inactive;
+    int      memory, disk, ttl, etag, last_modified, gzip, wait, stale, inactive, refresh, admit;
     uint8_t  extend[4] = { -1 };
     int      cur_arg   = 2;
     int      ret;
 
-    memory = disk = etag = last_modified = wait = stale = inactive = -1;
+    memory = disk = etag = last_modified = gzip = wait = stale = inactive = refresh = admit = -1;
     ttl = -2;
 
     if(proxy == defpx || !(proxy->cap & PR_CAP_BE)) {
@@ -1342,6 +1698,43 @@ nst_parse_proxy_rule(char **args, int section, hpx_proxy_t *proxy, hpx_proxy_t *
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "gzip")) {
+
+            if(gzip != -1) {
+                memprintf(err, "[%s.%s]: gzip already specified.", args[1], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "on")) {
+                gzip = NST_STATUS_ON;
+            } else if(!strcmp(args[cur_arg], "off")) {
+                gzip = NST_STATUS_OFF;
+            } else {
+                memprintf(err, "[%s.%s]: gzip expects [on|off], default off.", args[1], name);
+
+                goto out;
+            }
+
+            if(gzip == NST_STATUS_ON && !nuster.gzip) {
+                struct comp  comp = { .algos = NULL };
+
+                if(comp_append_algo(&comp, "gzip") < 0) {
+                    memprintf(err, "[%s.%s]: gzip requires USE_ZLIB or USE_SLZ.", args[1], name);
+
+                    goto out;
+                }
+
+                nuster.gzip = comp.algos;
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "last-modified")) {
 
             if(last_modified != -1) {
@@ -1568,6 +1961,80 @@ nst_parse_proxy_rule(char **args, int section, hpx_proxy_t *proxy, hpx_proxy_t *
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "refresh")) {
+
+            if(refresh != -1) {
+                memprintf(err, "[%s.%s]: refresh already specified.", args[1], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "[%s.%s]: refresh expects [off|TIME], default off.",
+                        args[1], name);
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "off")) {
+                refresh = 0;
+            } else {
+                ret = nst_parse_time(args[cur_arg], strlen(args[cur_arg]), (unsigned *)&refresh);
+
+                if(ret == NST_TIME_ERR) {
+                    memprintf(err, "[%s.%s]: invalid refresh.", args[1], name);
+
+                    goto out;
+                } else if(ret == NST_TIME_OVER) {
+                    refresh = INT_MAX;
+
+                    ha_warning("[%s.%s]: Set refresh to max %d.\n", args[1], name, INT_MAX);
+                }
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "admit")) {
+
+            if(admit != -1) {
+                memprintf(err, "[%s.%s]: admit already specified.", args[1], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "[%s.%s]: admit expects [off|N], default off.", args[1], name);
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "off")) {
+                admit = 0;
+            } else {
+                char  *end;
+
+                admit = strtol(args[cur_arg], &end, 10);
+
+                if(*end || admit <= 0 || admit > UINT8_MAX) {
+                    memprintf(err, "[%s.%s]: admit expects [off|N], N between 1 and %d.",
+                            args[1], name, UINT8_MAX);
+
+                    goto out;
+                }
+            }
+
+            cur_arg++;
+
+            continue;
+        }
+
         memprintf(err, "[%s.%s]: Unrecognized '%s'.", args[1], name, args[cur_arg]);
 
         goto out;
@@ -1651,6 +2118,7 @@ nst_parse_proxy_rule(char **args, int section, hpx_proxy_t *proxy, hpx_proxy_t *
 
     rule->etag          = etag          == -1 ? NST_STATUS_OFF      : etag;
     rule->last_modified = last_modified == -1 ? NST_STATUS_OFF      : last_modified;
+    rule->gzip          = gzip          == -1 ? NST_STATUS_OFF      : gzip;
 
     if(extend[0] == 0xFF) {
         rule->extend[0] = rule->extend[1] = 0;
@@ -1665,6 +2133,8 @@ nst_parse_proxy_rule(char **args, int section, hpx_proxy_t *proxy, hpx_proxy_t *
     rule->wait     = wait;
     rule->stale    = stale;
     rule->inactive = inactive == -1 ? 0 : inactive;
+    rule->refresh  = refresh  == -1 ? 0 : refresh;
+    rule->admit    = admit    == -1 ? 0 : admit;
 
     rule->cond = cond;
 
@@ -1677,6 +2147,72 @@ out:
     return -1;
 }
 
+/*
+ * nuster warm FILE [concurrency N] [rate N]
+ */
+int
+nst_parse_proxy_warm(char **args, int section, hpx_proxy_t *px, hpx_proxy_t *defpx,
+        const char *file, int line, char **err) {
+
+    int  concurrency = NST_DEFAULT_WARM_CONCURRENCY;
+    int  rate        = 0;
+    int  cur_arg     = 2;
+
+    if(px->nuster.warm.file) {
+        memprintf(err, "%s: warm already specified.", px->id);
+
+        return -1;
+    }
+
+    if(*args[cur_arg] == 0) {
+        memprintf(err, "[%s] expects a file.", args[1]);
+
+        return -1;
+    }
+
+    cur_arg++;
+
+    while(*args[cur_arg]) {
+
+        if(!strcmp(args[cur_arg], "concurrency")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0 || (concurrency = atoi(args[cur_arg])) <= 0) {
+                memprintf(err, "[%s] concurrency expects a positive number.", args[1]);
+
+                return -1;
+            }
+        } else if(!strcmp(args[cur_arg], "rate")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0 || (rate = atoi(args[cur_arg])) < 0) {
+                memprintf(err, "[%s] rate expects a number, default 0(no limit).", args[1]);
+
+                return -1;
+            }
+        } else {
+            memprintf(err, "[%s] unrecognized option '%s'.", args[1], args[cur_arg]);
+
+            return -1;
+        }
+
+        cur_arg++;
+    }
+
+    px->nuster.warm.file = strdup(args[2]);
+
+    if(!px->nuster.warm.file) {
+        memprintf(err, "out of memory");
+
+        return -1;
+    }
+
+    px->nuster.warm.concurrency = concurrency;
+    px->nuster.warm.rate        = rate;
+
+    return 0;
+}
+
 int
 nst_parse_proxy(char **args, int section, hpx_proxy_t *px, hpx_proxy_t *defpx,
         const char *file, int line, char **err) {
@@ -1695,8 +2231,10 @@ nst_parse_proxy(char **args, int section, hpx_proxy_t *px, hpx_proxy_t *defpx,
             return nst_parse_proxy_nosql(args, section, px, defpx, file, line, err);
         } else if(!strcmp(args[1], "rule")) {
             return nst_parse_proxy_rule(args, section, px, defpx, file, line, err);
+        } else if(!strcmp(args[1], "warm")) {
+            return nst_parse_proxy_warm(args, section, px, defpx, file, line, err);
         } else {
-            memprintf(err, "%s: expects [cache|rule]", args[0]);
+            memprintf(err, "%s: expects [cache|nosql|rule|warm]", args[0]);
 
             return -1;
         }
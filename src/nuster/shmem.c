@@ -17,12 +17,35 @@
 #include <nuster/shctx.h>
 #include <nuster/shmem.h>
 
+/* bytes of the freemap of n blocks, plus its alignment */
+static inline uint64_t
+_nst_shmem_freemap_size(uint64_t n) {
+    return (n + 63) / 64 * 8 + 8;
+}
+
+static inline void
+_nst_shmem_freemap_set(nst_shmem_t *shmem, nst_shmem_ctrl_t *block) {
+    int  idx = block - shmem->block;
+
+    shmem->freemap[idx / 64] |= 1ULL << (idx % 64);
+    shmem->free_blocks++;
+    shmem->extent_fail = 0;
+}
+
+static inline void
+_nst_shmem_freemap_clear(nst_shmem_t *shmem, nst_shmem_ctrl_t *block) {
+    int  idx = block - shmem->block;
+
+    shmem->freemap[idx / 64] &= ~(1ULL << (idx % 64));
+    shmem->free_blocks--;
+}
+
 nst_shmem_t *
 nst_shmem_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk_size) {
     uint8_t      *p;
     nst_shmem_t  *shmem;
     uint64_t      n;
-    uint8_t      *begin, *end;
+    uint8_t      *begin = NULL, *end;
     uint32_t      bitmap_size;
 
     if(block_size < NST_SHMEM_BLOCK_MIN_SIZE) {
@@ -111,25 +134,28 @@ nst_shmem_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk_
 
     bitmap_size = block_size / chunk_size / 8;
 
-    /* set data begin */
-    n = (shmem->stop - p) / (sizeof(nst_shmem_ctrl_t) + block_size + bitmap_size);
+    /* set data begin, a block takes one more byte for its bit in freemap */
+    n = (shmem->stop - p) / (sizeof(nst_shmem_ctrl_t) + block_size + bitmap_size + 1);
 
-    begin = (uint8_t *) (((uintptr_t)(p)
-                + n * sizeof(nst_shmem_ctrl_t) + n * bitmap_size
-                + ((uintptr_t) NST_SHMEM_BLOCK_MIN_SIZE - 1))
-            & ~((uintptr_t) NST_SHMEM_BLOCK_MIN_SIZE - 1));
+    while(n) {
+        begin = (uint8_t *) (((uintptr_t)(p) + n * sizeof(nst_shmem_ctrl_t)
+                    + n * bitmap_size + _nst_shmem_freemap_size(n)
+                    + ((uintptr_t) NST_SHMEM_BLOCK_MIN_SIZE - 1))
+                & ~((uintptr_t) NST_SHMEM_BLOCK_MIN_SIZE - 1));
 
-    end = begin + block_size * n;
+        end = begin + block_size * n;
+
+        if(end <= shmem->stop) {
+            break;
+        }
 
-    if(shmem->stop < end) {
         n--;
-        begin = (uint8_t *) (((uintptr_t)(p) + n * sizeof(nst_shmem_ctrl_t)
-                    + n * bitmap_size + ((uintptr_t) NST_SHMEM_BLOCK_MIN_SIZE - 1))
-                & ~((uintptr_t) NST_SHMEM_BLOCK_MIN_SIZE - 1));
     }
 
     shmem->blocks     = n;
     shmem->bitmap     = (uint8_t *)(shmem->block + n);
+    shmem->freemap    = (uint64_t *)(((uintptr_t)(shmem->bitmap + n * bitmap_size) + 7)
+            & ~(uintptr_t)7);
     shmem->data.begin = begin;
     shmem->data.free  = begin;
     shmem->data.end   = begin + block_size * (n - 1);
@@ -154,6 +180,16 @@ nst_shmem_create(char *name, uint64_t size, uint32_t block_size, uint32_t chunk_
         shmem->block[n].next   = NULL;
     }
 
+    /* all blocks are unused */
+    memset(shmem->freemap, 0, _nst_shmem_freemap_size(shmem->blocks) - 8);
+
+    for(n = 0; n < shmem->blocks; n++) {
+        shmem->freemap[n / 64] |= 1ULL << (n % 64);
+    }
+
+    shmem->free_blocks = shmem->blocks;
+    shmem->extent_fail = 0;
+
     return shmem;
 }
 
@@ -265,15 +301,156 @@ _nst_shmem_block_init(nst_shmem_t * shmem, nst_shmem_ctrl_t *block, int chunk_id
     shmem->chunk[chunk_idx] = block;
 }
 
+/*
+ * take n contiguous blocks from the empty list or the unused blocks, the runs
+ * of free blocks are looked up in freemap a word at a time
+ */
+static void *
+_nst_shmem_extent_alloc(nst_shmem_t *shmem, int n) {
+    nst_shmem_ctrl_t  *block;
+    uint64_t           word;
+    int                unused, run, idx, i, w, bit;
+
+    if(shmem->free_blocks < n || (shmem->extent_fail && n >= shmem->extent_fail)) {
+        return NULL;
+    }
+
+    unused = (shmem->data.free - shmem->data.begin) / shmem->block_size;
+
+    idx = -1;
+    run = 0;
+
+    for(w = 0; idx == -1 && w * 64 < shmem->blocks; w++) {
+        word = shmem->freemap[w];
+
+        if(word == 0) {
+            run = 0;
+
+            continue;
+        }
+
+        if(word == ~0ULL && w * 64 + 64 <= shmem->blocks) {
+            run += 64;
+
+            if(run >= n) {
+                idx = w * 64 + 64 - run;
+            }
+
+            continue;
+        }
+
+        for(bit = 0; bit < 64 && w * 64 + bit < shmem->blocks; bit++) {
+
+            if(!((word >> bit) & 1)) {
+                run = 0;
+
+                continue;
+            }
+
+            if(++run == n) {
+                idx = w * 64 + bit - n + 1;
+
+                break;
+            }
+        }
+    }
+
+    if(idx == -1) {
+        /* until a block is freed */
+        shmem->extent_fail = n;
+
+        return NULL;
+    }
+
+    for(i = idx; i < idx + n; i++) {
+        block = &shmem->block[i];
+
+        /* remove from empty list */
+        if(i < unused) {
+
+            if(block->prev) {
+                block->prev->next = block->next;
+            } else {
+                shmem->empty = block->next;
+            }
+
+            if(block->next) {
+                block->next->prev = block->prev;
+            }
+        }
+
+        _nst_shmem_freemap_clear(shmem, block);
+
+        block->info = 0;
+        block->prev = NULL;
+        block->next = NULL;
+
+        _nst_shmem_block_set_type(block,
+                i == idx ? NST_SHMEM_TYPE_EXTENT : NST_SHMEM_TYPE_EXTENT_BODY);
+
+        _nst_shmem_block_set_inited(block);
+    }
+
+    *((uint32_t *)(&shmem->block[idx].info) + 1) = n;
+
+    if(idx + n > unused) {
+        shmem->data.free = shmem->data.begin + 1ULL * shmem->block_size * (idx + n);
+    }
+
+    shmem->used += 1ULL * shmem->block_size * n;
+
+    return (void *)(shmem->data.begin + 1ULL * shmem->block_size * idx);
+}
+
+/*
+ * move the blocks of an extent from the from-th one to the empty list
+ */
+static void
+_nst_shmem_extent_release(nst_shmem_t *shmem, nst_shmem_ctrl_t *extent, int from) {
+    nst_shmem_ctrl_t  *block;
+    int                n, i;
+
+    n = *((uint32_t *)(&extent->info) + 1);
+
+    for(i = from; i < n; i++) {
+        block       = extent + i;
+        block->info = 0;
+
+        _nst_shmem_block_set_inited(block);
+        _nst_shmem_block_set_empty(block);
+
+        /* add to empty list */
+        block->prev  = NULL;
+        block->next  = shmem->empty;
+        shmem->empty = block;
+
+        if(block->next) {
+            block->next->prev = block;
+        }
+
+        _nst_shmem_freemap_set(shmem, block);
+    }
+
+    shmem->used -= 1ULL * shmem->block_size * (n - from);
+
+    if(from) {
+        *((uint32_t *)(&extent->info) + 1) = from;
+    }
+}
+
 void *
 nst_shmem_alloc_locked(nst_shmem_t *shmem, int size) {
     nst_shmem_ctrl_t  *chunk, *block;
     int                 i, chunk_idx = 0;
 
-    if(!size || size > shmem->block_size) {
+    if(size <= 0) {
         return NULL;
     }
 
+    if(size > shmem->block_size) {
+        return _nst_shmem_extent_alloc(shmem, (size + shmem->block_size - 1) / shmem->block_size);
+    }
+
     for(i = (size - 1) >> (shmem->chunk_shift - 1); i >>= 1; chunk_idx++) {}
 
     chunk = shmem->chunk[chunk_idx];
@@ -292,6 +469,7 @@ nst_shmem_alloc_locked(nst_shmem_t *shmem, int size) {
             shmem->empty->prev = NULL;
         }
 
+        _nst_shmem_freemap_clear(shmem, block);
         _nst_shmem_block_init(shmem, block, chunk_idx);
     }
     /* require new block from unused */
@@ -304,6 +482,7 @@ nst_shmem_alloc_locked(nst_shmem_t *shmem, int size) {
         if(_nst_shmem_block_is_inited(block)) {
             return NULL;
         } else {
+            _nst_shmem_freemap_clear(shmem, block);
             _nst_shmem_block_init(shmem, block, chunk_idx);
         }
     }
@@ -338,6 +517,13 @@ nst_shmem_free_locked(nst_shmem_t *shmem, void *p) {
     block_idx  = ((uint8_t *)p - shmem->data.begin) / shmem->block_size;
     block      = &shmem->block[block_idx];
     chunk_idx  = block->info & 0xFF;
+
+    if(chunk_idx == NST_SHMEM_TYPE_EXTENT) {
+        _nst_shmem_extent_release(shmem, block, 0);
+
+        return;
+    }
+
     chunk      = shmem->chunk[chunk_idx];
     chunk_size = 1<<(shmem->chunk_shift + chunk_idx);
     bits       = shmem->block_size / chunk_size;
@@ -412,6 +598,8 @@ nst_shmem_free_locked(nst_shmem_t *shmem, void *p) {
         }
 
         /* add to empty list */
+        _nst_shmem_block_set_empty(block);
+
         block->prev  = NULL;
         block->next  = shmem->empty;
         shmem->empty = block;
@@ -419,6 +607,8 @@ nst_shmem_free_locked(nst_shmem_t *shmem, void *p) {
         if(block->next) {
             block->next->prev = block;
         }
+
+        _nst_shmem_freemap_set(shmem, block);
     } else {
 
         if(full) {
@@ -456,6 +646,8 @@ nst_shmem_free_locked(nst_shmem_t *shmem, void *p) {
             }
 
             /* add to empty list */
+            _nst_shmem_block_set_empty(block);
+
             block->prev  = NULL;
             block->next  = shmem->empty;
             shmem->empty = block;
@@ -463,6 +655,8 @@ nst_shmem_free_locked(nst_shmem_t *shmem, void *p) {
             if(block->next) {
                 block->next->prev = block;
             }
+
+            _nst_shmem_freemap_set(shmem, block);
         }
     }
 }
@@ -479,3 +673,31 @@ nst_shmem_free(nst_shmem_t *shmem, void *p) {
     nst_shctx_unlock(shmem);
 }
 
+
+/*
+ * give back the blocks of an extent beyond size
+ */
+void
+nst_shmem_shrink(nst_shmem_t *shmem, void *p, int size) {
+    nst_shmem_ctrl_t  *block;
+    int                n, keep;
+
+    if((uint8_t *)p < shmem->data.begin || (uint8_t *)p >= shmem->data.free) {
+        return;
+    }
+
+    nst_shctx_lock(shmem);
+
+    block = &shmem->block[((uint8_t *)p - shmem->data.begin) / shmem->block_size];
+
+    if((block->info & 0xFF) == NST_SHMEM_TYPE_EXTENT) {
+        n    = *((uint32_t *)(&block->info) + 1);
+        keep = (size + shmem->block_size - 1) / shmem->block_size;
+
+        if(keep > 0 && keep < n) {
+            _nst_shmem_extent_release(shmem, block, keep);
+        }
+    }
+
+    nst_shctx_unlock(shmem);
+}
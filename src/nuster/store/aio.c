@@ -0,0 +1,770 @@
+/*
+ * nuster store disk asynchronous io functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <haproxy/dynbuf.h>
+#include <haproxy/global.h>
+#include <haproxy/htx.h>
+#include <haproxy/task.h>
+#include <haproxy/applet.h>
+
+#include <nuster/nuster.h>
+
+#ifdef USE_THREAD
+
+/*
+ * Process local, the io threads do the disk io of the streams and applets of
+ * this process only.
+ */
+static struct {
+    int              threads;
+    nst_disk_aio_t  *head;
+    nst_disk_aio_t  *tail;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+} nst_disk_aio_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Open the object and read its head, from the key up to the header
+ */
+static int
+_nst_disk_aio_check_io(nst_disk_aio_t *aio) {
+    nst_disk_obj_t  *obj = &aio->obj;
+    uint64_t         len;
+
+    obj->fd = nst_disk_file_open(obj->file);
+
+    if(obj->fd == -1) {
+        return -1;
+    }
+
+    if(nst_disk_read_meta(obj) != NST_OK || nst_disk_meta_deleted(obj->meta)) {
+        goto err;
+    }
+
+    if(nst_disk_meta_get_hash(obj->meta) != aio->hash
+            || nst_disk_meta_get_key_len(obj->meta) != aio->len) {
+
+        goto err;
+    }
+
+    len = nst_disk_pos_header(obj) - NST_DISK_POS_KEY;
+
+    if(len > aio->buf.size - (aio->ptr - aio->buf.area)) {
+        goto err;
+    }
+
+    if(pread(obj->fd, aio->ptr, len, obj->base + NST_DISK_POS_KEY) != len) {
+        goto err;
+    }
+
+    /* hits are read front to back, let the kernel read ahead */
+    posix_fadvise(obj->fd, obj->base, nst_disk_meta_get_record_len(obj->meta),
+            POSIX_FADV_SEQUENTIAL);
+
+    return len;
+
+err:
+    close(obj->fd);
+    obj->fd = -1;
+
+    return -1;
+}
+
+static void *
+_nst_disk_aio_thread(void *data) {
+    nst_disk_aio_t  *aio;
+
+    while(1) {
+        pthread_mutex_lock(&nst_disk_aio_pool.mutex);
+
+        while(!nst_disk_aio_pool.head) {
+            pthread_cond_wait(&nst_disk_aio_pool.cond, &nst_disk_aio_pool.mutex);
+        }
+
+        aio = nst_disk_aio_pool.head;
+
+        nst_disk_aio_pool.head = aio->next;
+
+        if(!nst_disk_aio_pool.head) {
+            nst_disk_aio_pool.tail = NULL;
+        }
+
+        pthread_mutex_unlock(&nst_disk_aio_pool.mutex);
+
+        switch(aio->op) {
+            case NST_DISK_AIO_READ:
+                aio->ret = pread(aio->fd, aio->ptr, aio->len, aio->offset);
+
+                break;
+            case NST_DISK_AIO_DATA:
+                aio->ret = pread(aio->fd, aio->ptr, aio->len, aio->offset);
+
+                if(aio->ret == 0) {
+                    aio->ret = -1;
+                }
+
+                break;
+            case NST_DISK_AIO_WRITE:
+                aio->ret = pwrite(aio->fd, aio->ptr, aio->len, aio->offset);
+
+                if(aio->ret != aio->len) {
+                    aio->ret = -1;
+                }
+
+                break;
+            case NST_DISK_AIO_CHECK:
+                aio->ret = _nst_disk_aio_check_io(aio);
+
+                break;
+        }
+
+        if(aio->ret < 0) {
+            aio->ret = -1;
+        }
+
+        /* last access, aio belongs to its owner thread again */
+        tasklet_wakeup_on(aio->tl, aio->tl->tid);
+    }
+
+    return NULL;
+}
+
+static void
+_nst_disk_aio_free(nst_disk_aio_t *aio) {
+
+    /* opened by a check and not consumed */
+    if(aio->obj.fd != -1) {
+        close(aio->obj.fd);
+    }
+
+    tasklet_free(aio->tl);
+    b_free(&aio->buf);
+    b_free(&aio->stage);
+    free(aio);
+}
+
+/*
+ * Runs on the owner thread once the io is done
+ */
+static struct task *
+_nst_disk_aio_done(struct task *t, void *ctx, unsigned short state) {
+    nst_disk_aio_t  *aio = ctx;
+
+    aio->pending = 0;
+    aio->ready   = 1;
+
+    if(aio->op == NST_DISK_AIO_WRITE) {
+        aio->err     |= aio->ret < 0;
+        aio->buf.data = 0;
+    }
+
+    if(aio->appctx) {
+        appctx_wakeup(aio->appctx);
+
+        return t;
+    }
+
+    if(aio->task) {
+        task_wakeup(aio->task, TASK_WOKEN_MSG);
+
+        return t;
+    }
+
+    /* the owner is gone */
+    if(aio->disk) {
+        nst_disk_obj_abort(aio->disk, &aio->obj);
+    } else if(aio->fd != -1) {
+        close(aio->fd);
+    }
+
+    _nst_disk_aio_free(aio);
+
+    return NULL;
+}
+
+static void
+_nst_disk_aio_submit(nst_disk_aio_t *aio, int op, uint64_t offset, int len) {
+
+    aio->op      = op;
+    aio->offset  = offset;
+    aio->len     = len;
+    aio->ret     = 0;
+    aio->pending = 1;
+    aio->ready   = 0;
+    aio->next    = NULL;
+
+    pthread_mutex_lock(&nst_disk_aio_pool.mutex);
+
+    if(nst_disk_aio_pool.tail) {
+        nst_disk_aio_pool.tail->next = aio;
+    } else {
+        nst_disk_aio_pool.head = aio;
+    }
+
+    nst_disk_aio_pool.tail = aio;
+
+    pthread_cond_signal(&nst_disk_aio_pool.cond);
+    pthread_mutex_unlock(&nst_disk_aio_pool.mutex);
+}
+
+/*
+ * Reserve a DATA block for up to len bytes in the own buffer of aio and read
+ * the payload at offset into it
+ */
+static void
+_nst_disk_aio_read_data(nst_disk_aio_t *aio, uint64_t offset, uint64_t len) {
+    hpx_htx_blk_t  *blk;
+    hpx_htx_t      *htx;
+    uint32_t        n;
+
+    htx = htx_from_buf(&aio->buf);
+    n   = htx_free_data_space(htx);
+
+    /* as much as the channel takes in */
+    if(n > global.tune.maxrewrite) {
+        n -= global.tune.maxrewrite;
+    }
+
+    if(n > len) {
+        n = len;
+    }
+
+    blk = htx_add_blk(htx, HTX_BLK_DATA, n);
+
+    blk->info += n;
+    aio->ptr   = htx_get_blk_ptr(htx, blk);
+
+    _nst_disk_aio_submit(aio, NST_DISK_AIO_DATA, offset, n);
+}
+
+/*
+ * Hand the staged bytes to an io thread, or write them in place if it is
+ * still on the previous ones.
+ */
+static int
+_nst_disk_aio_stage_flush(nst_disk_aio_t *aio) {
+    hpx_buffer_t  buf;
+
+    if(aio->pending) {
+        int  len = b_data(&aio->stage);
+
+        if(pwrite(aio->fd, b_orig(&aio->stage), len, aio->stage_offset) != len) {
+            aio->err = 1;
+
+            return NST_ERR;
+        }
+
+        b_reset(&aio->stage);
+
+        return NST_OK;
+    }
+
+    buf        = aio->buf;
+    aio->buf   = aio->stage;
+    aio->stage = buf;
+    aio->ptr   = b_orig(&aio->buf);
+
+    b_reset(&aio->stage);
+
+    _nst_disk_aio_submit(aio, NST_DISK_AIO_WRITE, aio->stage_offset, b_data(&aio->buf));
+
+    return NST_OK;
+}
+
+/*
+ * Start the io threads of the worker
+ */
+int
+nst_disk_aio_init(int threads) {
+    pthread_t  t;
+
+    while(nst_disk_aio_pool.threads < threads) {
+
+        if(pthread_create(&t, NULL, _nst_disk_aio_thread, NULL) != 0) {
+            return NST_ERR;
+        }
+
+        pthread_detach(t);
+
+        nst_disk_aio_pool.threads++;
+    }
+
+    return NST_OK;
+}
+
+int
+nst_disk_aio_on() {
+    return nst_disk_aio_pool.threads > 0;
+}
+
+/*
+ * task is woken up as the io completes, fd is the file read or written
+ */
+nst_disk_aio_t *
+nst_disk_aio_create(hpx_task_t *task, int fd) {
+    nst_disk_aio_t  *aio;
+
+    aio = calloc(1, sizeof(*aio));
+
+    if(!aio) {
+        return NULL;
+    }
+
+    aio->tl = tasklet_new();
+
+    if(!aio->tl || !b_alloc(&aio->buf)) {
+        goto err;
+    }
+
+    aio->tl->process = _nst_disk_aio_done;
+    aio->tl->context = aio;
+
+    tasklet_set_tid(aio->tl, tid);
+
+    aio->task   = task;
+    aio->fd     = fd;
+    aio->obj.fd = -1;
+
+    return aio;
+
+err:
+
+    if(aio->tl) {
+        tasklet_free(aio->tl);
+    }
+
+    free(aio);
+
+    return NULL;
+}
+
+/*
+ * The aio is now owned by appctx, which reads fd
+ */
+void
+nst_disk_aio_attach(nst_disk_aio_t *aio, hpx_appctx_t *appctx, int fd) {
+    aio->appctx = appctx;
+    aio->task   = NULL;
+    aio->fd     = fd;
+    aio->ready  = 0;
+}
+
+/*
+ * Read len bytes at offset, *p points to them once read.
+ * Returns the number of bytes read, NST_DISK_PENDING while the read is pending,
+ * or -1 on error.
+ */
+int
+nst_disk_aio_pread(nst_disk_aio_t *aio, uint64_t offset, int len, char **p) {
+
+    if(aio->pending) {
+        return NST_DISK_PENDING;
+    }
+
+    if(aio->ready && aio->op == NST_DISK_AIO_READ && aio->offset == offset) {
+        aio->ready = 0;
+        *p         = aio->ptr;
+
+        return aio->ret;
+    }
+
+    if(len > aio->buf.size) {
+        len = aio->buf.size;
+    }
+
+    aio->ptr = b_orig(&aio->buf);
+
+    _nst_disk_aio_submit(aio, NST_DISK_AIO_READ, offset, len);
+
+    return NST_DISK_PENDING;
+}
+
+/*
+ * The payload is read into a DATA block of the own buffer of aio, which is
+ * swapped with buf, the channel buffer, if buf is empty, or copied into it as
+ * room allows otherwise. Once the block is moved, the next chunk of the len
+ * bytes left at offset is read into the buffer swapped out.
+ * Returns the number of bytes moved to buf, 0 if the read is pending or buf
+ * is full, or -1 on error.
+ */
+int
+nst_disk_aio_read(nst_disk_aio_t *aio, hpx_buffer_t *buf, uint64_t offset, uint64_t len) {
+    hpx_buffer_t   tmp;
+    hpx_htx_t     *htx;
+    uint32_t       flags;
+    int            n;
+
+    if(aio->pending) {
+        return 0;
+    }
+
+    if(!aio->ready || aio->op != NST_DISK_AIO_DATA || aio->offset != offset) {
+        _nst_disk_aio_read_data(aio, offset, len);
+
+        return 0;
+    }
+
+    if(aio->ret < 0) {
+        return -1;
+    }
+
+    htx = htxbuf(buf);
+
+    /* the headers are only forwarded along with the payload, copy */
+    if(!htx_is_empty(htx)) {
+        hpx_htx_t      *own = htxbuf(&aio->buf);
+        hpx_htx_blk_t  *blk = htx_get_head_blk(own);
+
+        n = htx_free_data_space(htx);
+
+        if(n <= global.tune.maxrewrite) {
+            return 0;
+        }
+
+        n -= global.tune.maxrewrite;
+
+        if(n > aio->ret) {
+            n = aio->ret;
+        }
+
+        n = htx_add_data(htx, ist2(htx_get_blk_ptr(own, blk), n));
+
+        if(n == 0) {
+            return 0;
+        }
+
+        if(n < aio->ret) {
+            htx_cut_data_blk(own, blk, n);
+
+            aio->offset += n;
+            aio->len    -= n;
+            aio->ret    -= n;
+
+            return n;
+        }
+
+        b_reset(&aio->buf);
+
+        aio->ready = 0;
+
+        if(len > n) {
+            _nst_disk_aio_read_data(aio, offset + n, len - n);
+        }
+
+        return n;
+    }
+
+    flags = htx->flags;
+    n     = aio->ret;
+    htx   = htxbuf(&aio->buf);
+
+    if(n < aio->len) {
+        htx_change_blk_value_len(htx, htx_get_head_blk(htx), n);
+    }
+
+    htx->flags |= flags;
+
+    tmp      = *buf;
+    *buf     = aio->buf;
+    aio->buf = tmp;
+
+    b_reset(&aio->buf);
+
+    aio->ready = 0;
+
+    if(len > n) {
+        _nst_disk_aio_read_data(aio, offset + n, len - n);
+    }
+
+    return n;
+}
+
+/*
+ * Stage len bytes of buf to be written at offset, they are handed to an io
+ * thread once the stage is full or flushed.
+ */
+int
+nst_disk_aio_write(nst_disk_aio_t *aio, char *buf, int len, uint64_t offset) {
+    int  n;
+
+    if(aio->err) {
+        return NST_ERR;
+    }
+
+    if(b_data(&aio->stage) && offset != aio->stage_offset + b_data(&aio->stage)) {
+
+        if(_nst_disk_aio_stage_flush(aio) != NST_OK) {
+            return NST_ERR;
+        }
+    }
+
+    while(len) {
+
+        if(!b_size(&aio->stage) && !b_alloc(&aio->stage)) {
+
+            if(pwrite(aio->fd, buf, len, offset) != len) {
+                aio->err = 1;
+
+                return NST_ERR;
+            }
+
+            return NST_OK;
+        }
+
+        if(!b_data(&aio->stage)) {
+            aio->stage_offset = offset;
+        }
+
+        n = b_room(&aio->stage);
+
+        if(n > len) {
+            n = len;
+        }
+
+        memcpy(b_tail(&aio->stage), buf, n);
+        b_add(&aio->stage, n);
+
+        buf    += n;
+        len    -= n;
+        offset += n;
+
+        if(!b_room(&aio->stage) && _nst_disk_aio_stage_flush(aio) != NST_OK) {
+            return NST_ERR;
+        }
+    }
+
+    return NST_OK;
+}
+
+/*
+ * How many bytes can be staged without being written in place
+ */
+int
+nst_disk_aio_room(nst_disk_aio_t *aio) {
+    int  room = b_size(&aio->stage) ? b_room(&aio->stage) : aio->buf.size;
+
+    if(!aio->pending) {
+        room += aio->buf.size;
+    }
+
+    return room;
+}
+
+/*
+ * Returns 1 once all the staged bytes are written, or failed to
+ */
+int
+nst_disk_aio_flush(nst_disk_aio_t *aio) {
+
+    if(!aio->pending && !aio->err && b_data(&aio->stage)) {
+        _nst_disk_aio_stage_flush(aio);
+    }
+
+    return !aio->pending;
+}
+
+/*
+ * Write what was staged since the flush and free aio, which is kept on error.
+ */
+int
+nst_disk_aio_close(nst_disk_aio_t *aio) {
+    int  len = b_data(&aio->stage);
+
+    if(aio->pending) {
+        return NST_ERR;
+    }
+
+    if(!aio->err && len && pwrite(aio->fd, b_orig(&aio->stage), len, aio->stage_offset) != len) {
+        aio->err = 1;
+    }
+
+    if(aio->err) {
+        return NST_ERR;
+    }
+
+    _nst_disk_aio_free(aio);
+
+    return NST_OK;
+}
+
+/*
+ * The writes of obj are aborted. Returns NST_OK if aio aborts obj once the
+ * pending write is done, otherwise aio is freed and obj is left to the caller.
+ */
+int
+nst_disk_aio_abort(nst_disk_aio_t *aio, nst_disk_t *disk, nst_disk_obj_t *obj) {
+
+    if(!aio->pending) {
+        _nst_disk_aio_free(aio);
+
+        return NST_ERR;
+    }
+
+    aio->task = NULL;
+    aio->disk = disk;
+    aio->obj  = *obj;
+
+    return NST_OK;
+}
+
+/*
+ * Check in an io thread that the object at base of file is the one of key
+ */
+int
+nst_disk_aio_check(nst_disk_aio_t *aio, char *file, uint64_t base, nst_key_t *key) {
+    int  n = strlen(file) + 1;
+
+    if(aio->pending || n + key->size > aio->buf.size) {
+        return NST_ERR;
+    }
+
+    if(aio->obj.fd != -1) {
+        close(aio->obj.fd);
+    }
+
+    memcpy(b_orig(&aio->buf), file, n);
+
+    aio->obj.file = b_orig(&aio->buf);
+    aio->obj.fd   = -1;
+    aio->obj.seg  = -1;
+    aio->obj.base = base;
+    aio->obj.aio  = NULL;
+    aio->hash     = key->hash;
+    aio->ptr      = b_orig(&aio->buf) + n;
+
+    _nst_disk_aio_submit(aio, NST_DISK_AIO_CHECK, base, key->size);
+
+    return NST_OK;
+}
+
+/*
+ * Returns NST_OK if the object checked is the one of key, its fd and meta are
+ * moved to obj, NST_DISK_PENDING while the check is pending, or NST_ERR.
+ */
+int
+nst_disk_aio_checked(nst_disk_aio_t *aio, nst_disk_obj_t *obj, nst_key_t *key) {
+
+    if(aio->pending) {
+        return NST_DISK_PENDING;
+    }
+
+    aio->ready = 0;
+
+    if(aio->ret < 0 || memcmp(aio->ptr, key->data, key->size) != 0) {
+        return NST_ERR;
+    }
+
+    obj->fd = aio->obj.fd;
+
+    aio->obj.fd = -1;
+
+    memcpy(obj->meta, aio->obj.meta, NST_DISK_META_SIZE);
+
+    return NST_OK;
+}
+
+/*
+ * Called once the owner is done with aio, fd is closed here or once the
+ * pending io is done.
+ */
+void
+nst_disk_aio_release(nst_disk_aio_t *aio, int fd) {
+
+    /* aio->fd is fd */
+    if(aio->pending) {
+        aio->appctx = NULL;
+        aio->task   = NULL;
+
+        return;
+    }
+
+    if(fd != -1) {
+        close(fd);
+    }
+
+    _nst_disk_aio_free(aio);
+}
+
+#else
+
+int
+nst_disk_aio_init(int threads) {
+    return NST_OK;
+}
+
+int
+nst_disk_aio_on() {
+    return 0;
+}
+
+nst_disk_aio_t *
+nst_disk_aio_create(hpx_task_t *task, int fd) {
+    return NULL;
+}
+
+void
+nst_disk_aio_attach(nst_disk_aio_t *aio, hpx_appctx_t *appctx, int fd) {
+}
+
+int
+nst_disk_aio_pread(nst_disk_aio_t *aio, uint64_t offset, int len, char **p) {
+    return -1;
+}
+
+int
+nst_disk_aio_read(nst_disk_aio_t *aio, hpx_buffer_t *buf, uint64_t offset, uint64_t len) {
+    return -1;
+}
+
+int
+nst_disk_aio_write(nst_disk_aio_t *aio, char *buf, int len, uint64_t offset) {
+    return NST_ERR;
+}
+
+int
+nst_disk_aio_room(nst_disk_aio_t *aio) {
+    return 0;
+}
+
+int
+nst_disk_aio_flush(nst_disk_aio_t *aio) {
+    return 1;
+}
+
+int
+nst_disk_aio_close(nst_disk_aio_t *aio) {
+    return NST_ERR;
+}
+
+int
+nst_disk_aio_abort(nst_disk_aio_t *aio, nst_disk_t *disk, nst_disk_obj_t *obj) {
+    return NST_ERR;
+}
+
+int
+nst_disk_aio_check(nst_disk_aio_t *aio, char *file, uint64_t base, nst_key_t *key) {
+    return NST_ERR;
+}
+
+int
+nst_disk_aio_checked(nst_disk_aio_t *aio, nst_disk_obj_t *obj, nst_key_t *key) {
+    return NST_ERR;
+}
+
+void
+nst_disk_aio_release(nst_disk_aio_t *aio, int fd) {
+}
+
+#endif
@@ -10,8 +10,12 @@
  *
  */
 
+#include <sys/mman.h>
+#include <sys/uio.h>
+
 #include <haproxy/tools.h>
 #include <haproxy/global.h>
+#include <haproxy/htx.h>
 
 #include <nuster/nuster.h>
 
@@ -63,7 +67,7 @@ int
 nst_disk_read_meta(nst_disk_obj_t *obj) {
     int  ret;
 
-    ret = pread(obj->fd, obj->meta, NST_DISK_META_SIZE, 0);
+    ret = pread(obj->fd, obj->meta, NST_DISK_META_SIZE, obj->base);
 
     if(ret != NST_DISK_META_SIZE) {
         return NST_ERR;
@@ -92,10 +96,11 @@ nst_disk_read_key(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key) {
         return NST_ERR;
     }
 
-    ret = pread(obj->fd, key->data, key->size, NST_DISK_POS_KEY);
+    ret = pread(obj->fd, key->data, key->size, obj->base + NST_DISK_POS_KEY);
 
     if(ret != key->size) {
         nst_shmem_free(disk->shmem, key->data);
+        key->data = NULL;
 
         return NST_ERR;
     }
@@ -109,9 +114,10 @@ nst_disk_read_key(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key) {
 
 int
 nst_disk_read_proxy(nst_disk_obj_t *obj, hpx_ist_t proxy) {
-    int  ret, offset;
+    uint64_t  offset;
+    int       ret;
 
-    offset = nst_disk_pos_proxy(obj);
+    offset = obj->base + nst_disk_pos_proxy(obj);
 
     ret = pread(obj->fd, proxy.ptr, proxy.len, offset);
 
@@ -124,9 +130,10 @@ nst_disk_read_proxy(nst_disk_obj_t *obj, hpx_ist_t proxy) {
 
 int
 nst_disk_read_rule(nst_disk_obj_t *obj, hpx_ist_t rule) {
-    int  ret, offset;
+    uint64_t  offset;
+    int       ret;
 
-    offset = nst_disk_pos_rule(obj);
+    offset = obj->base + nst_disk_pos_rule(obj);
 
     ret = pread(obj->fd, rule.ptr, rule.len, offset);
 
@@ -139,9 +146,10 @@ nst_disk_read_rule(nst_disk_obj_t *obj, hpx_ist_t rule) {
 
 int
 nst_disk_read_host(nst_disk_obj_t *obj, hpx_ist_t host) {
-    int  ret, offset;
+    uint64_t  offset;
+    int       ret;
 
-    offset = nst_disk_pos_host(obj);
+    offset = obj->base + nst_disk_pos_host(obj);
 
     ret = pread(obj->fd, host.ptr, host.len, offset);
 
@@ -154,9 +162,10 @@ nst_disk_read_host(nst_disk_obj_t *obj, hpx_ist_t host) {
 
 int
 nst_disk_read_path(nst_disk_obj_t *obj, hpx_ist_t path) {
-    int  ret, offset;
+    uint64_t  offset;
+    int       ret;
 
-    offset = nst_disk_pos_path(obj);
+    offset = obj->base + nst_disk_pos_path(obj);
 
     ret = pread(obj->fd, path.ptr, path.len, offset);
 
@@ -167,11 +176,34 @@ nst_disk_read_path(nst_disk_obj_t *obj, hpx_ist_t path) {
     return NST_OK;
 }
 
+/*
+ * The head of obj read by the io thread which checked it, NULL if none
+ */
+static char *
+_nst_disk_obj_head(nst_disk_obj_t *obj, uint64_t pos) {
+
+    if(!obj->aio || obj->aio->op != NST_DISK_AIO_CHECK || obj->aio->ret <= 0) {
+        return NULL;
+    }
+
+    return obj->aio->ptr + pos - NST_DISK_POS_KEY;
+}
+
 int
 nst_disk_read_etag(nst_disk_obj_t *obj, hpx_ist_t etag) {
-    int  ret, offset;
+    uint64_t  offset;
+    char     *head;
+    int       ret;
+
+    head = _nst_disk_obj_head(obj, nst_disk_pos_etag(obj));
+
+    if(head) {
+        memcpy(etag.ptr, head, etag.len);
+
+        return NST_OK;
+    }
 
-    offset = nst_disk_pos_etag(obj);
+    offset = obj->base + nst_disk_pos_etag(obj);
 
     ret = pread(obj->fd, etag.ptr, etag.len, offset);
 
@@ -184,9 +216,19 @@ nst_disk_read_etag(nst_disk_obj_t *obj, hpx_ist_t etag) {
 
 int
 nst_disk_read_last_modified(nst_disk_obj_t *obj, hpx_ist_t last_modified) {
-    int  ret, offset;
+    uint64_t  offset;
+    char     *head;
+    int       ret;
+
+    head = _nst_disk_obj_head(obj, nst_disk_pos_last_modified(obj));
+
+    if(head) {
+        memcpy(last_modified.ptr, head, last_modified.len);
 
-    offset = nst_disk_pos_last_modified(obj);
+        return NST_OK;
+    }
+
+    offset = obj->base + nst_disk_pos_last_modified(obj);
 
     ret = pread(obj->fd, last_modified.ptr, last_modified.len, offset);
 
@@ -197,369 +239,1524 @@ nst_disk_read_last_modified(nst_disk_obj_t *obj, hpx_ist_t last_modified) {
     return NST_OK;
 }
 
+/*
+ * Read up to len bytes of payload at offset straight into a new DATA block
+ * of htx, saving the copy through a trash chunk.
+ * Returns the number of bytes read, or -1 on error.
+ */
 int
-nst_disk_init(nst_disk_t *disk, hpx_ist_t root, nst_shmem_t *shmem, int clean_temp, void *data) {
+nst_disk_read_data(int fd, hpx_htx_t *htx, uint64_t offset, uint32_t len) {
+    hpx_htx_blk_t  *blk;
+    ssize_t         ret;
 
-    if(global.chroot != NULL) {
-        return NST_OK;
+    blk = htx_add_blk(htx, HTX_BLK_DATA, len);
+
+    if(!blk) {
+        return -1;
     }
 
-    if(root.len) {
+    blk->info += len;
 
-#ifdef USE_THREAD
-        pthread_t  tid;
-#endif
+    ret = pread(fd, htx_get_blk_ptr(htx, blk), len, offset);
 
-        disk->shmem = shmem;
-        disk->root  = root;
-        disk->file  = nst_shmem_alloc(shmem, nst_disk_path_file_len(root));
+    if(ret <= 0) {
+        htx_remove_blk(htx, blk);
 
-        if(!disk->file) {
-            return NST_ERR;
-        }
+        return -1;
+    }
 
-        sprintf(disk->file, "%s/.tmp", root.ptr);
+    if(ret < len) {
+        htx_change_blk_value_len(htx, blk, ret);
+    }
 
-        if(nst_disk_mkdir(disk->file) == NST_ERR) {
-            fprintf(stderr, "Create `%s` failed\n", disk->file);
+    return ret;
+}
 
-            return NST_ERR;
-        }
+static int
+_nst_disk_segment_cmp(const void *a, const void *b) {
+    const nst_disk_seg_t  *x = a;
+    const nst_disk_seg_t  *y = b;
 
-        if(clean_temp == NST_STATUS_ON) {
-            /* remove files of tmp dir */
-            nst_dirent_t  *de;
-            DIR           *tmp;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
 
-            tmp = opendir(disk->file);
+static int
+_nst_disk_segment_grow(nst_disk_t *disk) {
+    nst_disk_seg_t  *slot;
+    int              count = disk->seg.count + 64;
 
-            if(!tmp) {
-                fprintf(stderr, "Open `%s` failed\n", disk->file);
+    slot = nst_shmem_alloc(disk->shmem, count * sizeof(*slot));
 
-                return NST_ERR;
-            }
+    if(!slot) {
+        return NST_ERR;
+    }
 
-            while((de = readdir(tmp)) != NULL) {
+    memset(slot, 0, count * sizeof(*slot));
 
-                if(de->d_name[0] == '.') {
-                    continue;
-                }
+    if(disk->seg.slot) {
+        memcpy(slot, disk->seg.slot, disk->seg.count * sizeof(*slot));
+        nst_shmem_free(disk->shmem, disk->seg.slot);
+    }
 
-                chunk_reset(&trash);
-                chunk_memcat(&trash, disk->file, nst_disk_path_base_len(root));
-                chunk_memcat(&trash, "/", 1);
-                chunk_memcat(&trash, de->d_name, strlen(de->d_name));
-                trash.area[trash.data++] = '\0';
+    disk->seg.slot  = slot;
+    disk->seg.count = count;
 
-                remove(trash.area);
-            }
+    return NST_OK;
+}
 
-            closedir(tmp);
-        }
+/*
+ * Register the segments left by the previous run, they are sealed and loaded
+ * by nst_disk_load, newest first.
+ */
+static int
+_nst_disk_segment_init(nst_disk_t *disk, uint64_t segment_size) {
+    nst_dirent_t  *de;
+    struct stat    st;
+    DIR           *dir;
+    char          *end;
+    uint32_t       id;
+    int            n = 0;
+
+    if(nst_shctx_init(&disk->seg) != NST_OK) {
+        return NST_ERR;
+    }
 
-#ifdef USE_THREAD
-        pthread_create(&tid, NULL, nst_disk_load_thread, data);
-#endif
+    disk->seg.size    = segment_size;
+    disk->seg.next    = 1;
+    disk->seg.compact = -1;
+    disk->seg.fd      = -1;
+
+    sprintf(disk->file, "%s/seg", disk->root.ptr);
 
+    if(nst_disk_mkdir(disk->file) == NST_ERR) {
+        fprintf(stderr, "Create `%s` failed\n", disk->file);
+
+        return NST_ERR;
     }
 
-    return NST_OK;
-}
+    dir = opendir(disk->file);
 
-#ifdef USE_THREAD
-void *nst_disk_load_thread(void *data) {
-    nst_core_t  *core = (nst_core_t *)data;
+    if(!dir) {
+        fprintf(stderr, "Open `%s` failed\n", disk->file);
 
-    if(core->root.len == 0) {
-        return NULL;
+        return NST_ERR;
     }
 
-    while(!core->store.disk.loaded) {
-        nst_disk_load(core);
-    }
+    while((de = readdir(dir)) != NULL) {
 
-    return NULL;
-}
-#endif
+        if(de->d_name[0] == '.') {
+            continue;
+        }
 
-void
-nst_disk_load(nst_core_t *core) {
+        chunk_reset(&trash);
+        chunk_appendf(&trash, "%s/seg/%s", disk->root.ptr, de->d_name);
 
-    if(core->root.len && !core->store.disk.loaded) {
-        hpx_ist_t        root;
-        nst_disk_obj_t   obj;
-        nst_dirent_t     *de;
-        nst_key_t        key = { .data = NULL };
-        hpx_buffer_t     buf = { .area = NULL };
-        nst_http_txn_t   txn;
-        nst_rule_prop_t  prop;
-        uint64_t         start, ttl_extend, expire;
-        char            *file;
-        int              len, ret, stale_prop, stale, expired;
+        id = strtoul(de->d_name, &end, 16);
 
-        root = core->root;
-        file = core->store.disk.file;
+        if(strlen(de->d_name) != NST_DISK_SEGMENT_ID_LEN || *end != '\0' || id == 0
+                || stat(trash.area, &st) != 0) {
 
-        start  = nst_time_now_ms();
+            remove(trash.area);
 
-        if(core->store.disk.dir) {
+            continue;
+        }
 
-            while((de = readdir(core->store.disk.dir)) != NULL) {
+        if(n == disk->seg.count && _nst_disk_segment_grow(disk) != NST_OK) {
+            closedir(dir);
 
-                if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
-                    continue;
-                }
+            return NST_ERR;
+        }
 
-                len = strlen(de->d_name);
+        disk->seg.slot[n].id     = id;
+        disk->seg.slot[n].sealed = 1;
+        disk->seg.slot[n].size   = st.st_size;
+        n++;
 
-                if(len != NST_DISK_FILE_LEN) {
-                    chunk_reset(&trash);
-                    chunk_memcat(&trash, file, nst_disk_path_base_len(root));
-                    chunk_memcat(&trash, "/", 1);
-                    chunk_memcat(&trash, de->d_name, len);
-                    trash.area[trash.data++] = '\0';
+        if(id >= disk->seg.next) {
+            disk->seg.next = id + 1;
+        }
+    }
 
-                    remove(trash.area);
+    closedir(dir);
 
-                    continue;
-                }
+    qsort(disk->seg.slot, n, sizeof(*disk->seg.slot), _nst_disk_segment_cmp);
 
-                memcpy(file + nst_disk_path_base_len(root), "/", 1);
-                memcpy(file + nst_disk_path_base_len(root) + 1, de->d_name, NST_DISK_FILE_LEN);
+    disk->seg.init = n;
 
-                obj.fd = nst_disk_file_open(file);
+    return NST_OK;
+}
 
-                if(obj.fd == -1) {
-                    continue;
-                }
+/*
+ * Must be called with the segment lock held
+ */
+static nst_disk_seg_t *
+_nst_disk_segment_find(nst_disk_t *disk, char *file) {
+    uint32_t  id;
+    int       i;
 
-                if(nst_disk_read_meta(&obj) != NST_OK) {
-                    goto err;
-                }
+    id = strtoul(file + strlen(file) - NST_DISK_SEGMENT_ID_LEN, NULL, 16);
 
-                stale_prop = nst_disk_meta_get_stale(obj.meta);
-                stale      = nst_disk_meta_check_stale(obj.meta) != NST_OK;
-                expired    = nst_disk_meta_check_expire(obj.meta) != NST_OK;
+    for(i = 0; i < disk->seg.count; i++) {
 
-                if(expired && (stale_prop == 0 || (stale_prop > 0 && stale))) {
-                    goto err;
-                }
+        if(disk->seg.slot[i].id == id) {
+            return &disk->seg.slot[i];
+        }
+    }
 
-                if(nst_disk_read_key(&core->store.disk, &obj, &key) != NST_OK) {
-                    goto err;
-                }
+    return NULL;
+}
 
-                prop.pid.len              = nst_disk_meta_get_proxy_len(obj.meta);
-                prop.rid.len              = nst_disk_meta_get_rule_len(obj.meta);
-                txn.req.host.len          = nst_disk_meta_get_host_len(obj.meta);
-                txn.req.path.len          = nst_disk_meta_get_path_len(obj.meta);
-                txn.res.etag.len          = nst_disk_meta_get_etag_len(obj.meta);
-                txn.res.last_modified.len = nst_disk_meta_get_last_modified_len(obj.meta);
+/*
+ * Give the segment of obj back with its new size, seal it once full
+ */
+static void
+_nst_disk_segment_release(nst_disk_t *disk, nst_disk_obj_t *obj, uint64_t size, int seal) {
+    nst_disk_seg_t  *seg;
 
-                buf.size = prop.pid.len + prop.rid.len + txn.req.host.len + txn.req.path.len
-                    + txn.res.etag.len + txn.res.last_modified.len;
+    nst_shctx_lock(&disk->seg);
 
-                buf.data = 0;
-                buf.area = nst_shmem_alloc(core->shmem, buf.size);
+    seg = &disk->seg.slot[obj->seg];
 
-                if(!buf.area) {
-                    goto err;
-                }
+    seg->busy = 0;
+    seg->size = size;
 
-                prop.pid.ptr = buf.area + buf.data;
+    if(seal || seg->size >= disk->seg.size) {
+        seg->sealed = 1;
+    }
 
-                if(nst_disk_read_proxy(&obj, prop.pid) != NST_OK) {
-                    goto err;
-                }
+    nst_shctx_unlock(&disk->seg);
 
-                buf.data += prop.pid.len;
+    if(obj->fd != -1) {
+        close(obj->fd);
+        obj->fd = -1;
+    }
 
-                prop.rid.ptr = buf.area + buf.data;
+    obj->seg = -1;
+}
 
-                if(nst_disk_read_rule(&obj, prop.rid) != NST_OK) {
-                    goto err;
-                }
+/*
+ * Take a writable segment for obj, each segment has at most one writer so an
+ * object is always appended contiguously. obj->file gets the segment path.
+ */
+static int
+_nst_disk_segment_acquire(nst_disk_t *disk, nst_disk_obj_t *obj) {
+    nst_disk_seg_t  *seg = NULL;
+    int              i, unused = -1;
 
-                ttl_extend         = nst_disk_meta_get_ttl_extend(obj.meta);
-                prop.ttl           = ttl_extend >> 32;
-                prop.extend[0]     = *( uint8_t *)(&ttl_extend);
-                prop.extend[1]     = *((uint8_t *)(&ttl_extend) + 1);
-                prop.extend[2]     = *((uint8_t *)(&ttl_extend) + 2);
-                prop.extend[3]     = *((uint8_t *)(&ttl_extend) + 3);
-                prop.etag          = nst_disk_meta_get_etag_prop(obj.meta);
-                prop.last_modified = nst_disk_meta_get_last_modified_prop(obj.meta);
-                prop.stale         = nst_disk_meta_get_stale(obj.meta);
-                prop.inactive      = nst_disk_meta_get_inactive(obj.meta);
+    nst_shctx_lock(&disk->seg);
 
-                buf.data += prop.rid.len;
+    for(i = 0; i < disk->seg.count; i++) {
 
-                txn.req.host.ptr = buf.area + buf.data;
+        if(disk->seg.slot[i].id == 0) {
 
-                if(nst_disk_read_host(&obj, txn.req.host) != NST_OK) {
-                    goto err;
-                }
+            if(unused == -1) {
+                unused = i;
+            }
 
-                buf.data += txn.req.host.len;
+            continue;
+        }
 
-                txn.req.path.ptr = buf.area + buf.data;
+        if(!disk->seg.slot[i].sealed && !disk->seg.slot[i].busy) {
+            seg = &disk->seg.slot[i];
 
-                if(nst_disk_read_path(&obj, txn.req.path) != NST_OK) {
-                    goto err;
-                }
+            break;
+        }
+    }
 
-                buf.data += txn.req.path.len;
+    if(!seg) {
 
-                txn.res.etag.ptr = buf.area + buf.data;
+        if(unused == -1) {
+            unused = disk->seg.count;
 
-                if(nst_disk_read_etag(&obj, txn.res.etag) != NST_OK) {
-                    goto err;
-                }
+            if(_nst_disk_segment_grow(disk) != NST_OK) {
+                goto err;
+            }
+        }
 
-                buf.data += txn.res.etag.len;
+        seg = &disk->seg.slot[unused];
 
-                txn.res.last_modified.ptr = buf.area + buf.data;
+        seg->id     = disk->seg.next++;
+        seg->sealed = 0;
+        seg->size   = 0;
+        seg->dead   = 0;
+    }
 
-                if(nst_disk_read_last_modified(&obj, txn.res.last_modified) != NST_OK) {
-                    goto err;
-                }
+    seg->busy = 1;
 
-                buf.data += txn.res.last_modified.len;
+    obj->seg    = seg - disk->seg.slot;
+    obj->base   = seg->size;
+    obj->offset = seg->size;
 
-                txn.res.header_len  = nst_disk_meta_get_header_len(obj.meta);
-                txn.res.payload_len = nst_disk_meta_get_payload_len(obj.meta);
+    nst_disk_segment_path(disk, obj->file, seg->id);
 
-                expire = nst_disk_meta_get_expire(obj.meta);
+    nst_shctx_unlock(&disk->seg);
 
-                nst_shctx_lock(&core->dict);
+    obj->fd = open(obj->file, O_CREAT | O_WRONLY, 0600);
 
-                ret = nst_dict_set_from_disk(&core->dict, &buf, &key, &txn, &prop, file, expire);
+    if(obj->fd == -1) {
+        _nst_disk_segment_release(disk, obj, obj->base, 1);
 
-                nst_shctx_unlock(&core->dict);
+        return NST_ERR;
+    }
 
-                if(ret != NST_OK) {
-                    goto err;
-                }
+    return NST_OK;
 
-                close(obj.fd);
+err:
+    nst_shctx_unlock(&disk->seg);
 
-                if(nst_time_now_ms() - start >= 300) {
-                    break;
-                }
-            }
+    return NST_ERR;
+}
 
-            if(de == NULL) {
-                core->store.disk.idx++;
-                closedir(core->store.disk.dir);
-                core->store.disk.dir = NULL;
-            }
-        } else {
-            core->store.disk.dir = nst_disk_opendir_by_idx(core->root, file, core->store.disk.idx);
+/*
+ * Mark the object at offset of segment file deleted, the space is reclaimed
+ * by compaction.
+ * -1: error
+ *  0: not found
+ *  1: ok
+ */
+static int
+_nst_disk_segment_kill(nst_disk_t *disk, char *file, uint64_t offset) {
+    nst_disk_seg_t  *seg;
+    nst_disk_obj_t   obj;
+    int              ret = 0;
 
-            if(!core->store.disk.dir) {
-                core->store.disk.idx++;
-            }
-        }
+    obj.fd   = open(file, O_RDWR);
+    obj.base = offset;
 
-        if(core->store.disk.idx == 16 * 16) {
-            core->store.disk.loaded = 1;
-            core->store.disk.idx    = 0;
-        }
+    if(obj.fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
 
-        return;
+    if(nst_disk_read_meta(&obj) != NST_OK || nst_disk_meta_deleted(obj.meta)) {
+        goto out;
+    }
 
-err:
+    obj.meta[NST_DISK_META_POS_FLAGS] |= NST_DISK_FLAG_DELETED;
 
-        if(file) {
-            remove(file);
-        }
+    if(pwrite(obj.fd, obj.meta + NST_DISK_META_POS_FLAGS, 1, offset + NST_DISK_META_POS_FLAGS) != 1) {
+        ret = -1;
 
-        if(obj.fd) {
-            close(obj.fd);
-        }
+        goto out;
+    }
 
-        nst_shmem_free(core->shmem, key.data);
-        nst_shmem_free(core->shmem, buf.area);
+    nst_shctx_lock(&disk->seg);
 
+    seg = _nst_disk_segment_find(disk, file);
+
+    if(seg) {
+        seg->dead += nst_disk_meta_get_record_len(obj.meta);
     }
-}
 
-void
-nst_disk_cleanup(nst_core_t *core) {
-    nst_disk_obj_t  obj;
-    nst_dirent_t   *de;
-    hpx_ist_t       root;
-    uint64_t        start;
-    char           *file;
-    int             len;
+    nst_shctx_unlock(&disk->seg);
 
-    root = core->root;
-    file = core->store.disk.file;
+    ret = 1;
 
-    start  = nst_time_now_ms();
+out:
+    close(obj.fd);
 
-    if(core->root.len && core->store.disk.loaded) {
+    return ret;
+}
 
-        if(core->store.disk.dir) {
+static void
+_nst_disk_segment_dead(nst_disk_t *disk, int idx, uint64_t len) {
+    nst_shctx_lock(&disk->seg);
+    disk->seg.slot[idx].dead += len;
+    nst_shctx_unlock(&disk->seg);
+}
 
-            while((de = readdir(core->store.disk.dir)) != NULL) {
+int
+nst_disk_init(nst_disk_t *disk, hpx_ist_t root, nst_shmem_t *shmem, int clean_temp, int engine,
+        uint64_t segment_size, int threads, void *data) {
 
-                if(de->d_name[0] == '.') {
-                    continue;
-                }
+    if(global.chroot != NULL) {
+        return NST_OK;
+    }
 
-                len = strlen(de->d_name);
+    if(root.len) {
 
-                if(len != NST_DISK_FILE_LEN) {
-                    chunk_reset(&trash);
-                    chunk_memcat(&trash, file, nst_disk_path_base_len(root));
-                    chunk_memcat(&trash, "/", 1);
-                    chunk_memcat(&trash, de->d_name, len);
-                    trash.area[trash.data++] = '\0';
+        /* called again in the worker */
+        if(disk->file) {
+            return NST_OK;
+        }
 
-                    remove(trash.area);
+        disk->shmem   = shmem;
+        disk->root    = root;
+        disk->engine  = engine;
+        disk->threads = threads;
+        disk->file    = nst_shmem_alloc(shmem, nst_disk_path_file_len(root));
 
-                    continue;
-                }
+        if(!disk->file) {
+            return NST_ERR;
+        }
 
-                memcpy(file + nst_disk_path_base_len(root), "/", 1);
-                memcpy(file + nst_disk_path_base_len(root) + 1, de->d_name, NST_DISK_FILE_LEN);
+        sprintf(disk->file, "%s/.tmp", root.ptr);
 
-                obj.fd = nst_disk_file_open(file);
+        if(nst_disk_mkdir(disk->file) == NST_ERR) {
+            fprintf(stderr, "Create `%s` failed\n", disk->file);
 
-                if(obj.fd == -1) {
-                    continue;
-                }
+            return NST_ERR;
+        }
 
-                if(nst_disk_read_meta(&obj) != NST_OK) {
-                    remove(file);
-                    close(obj.fd);
+        if(clean_temp == NST_STATUS_ON) {
+            /* remove files of tmp dir */
+            nst_dirent_t  *de;
+            DIR           *tmp;
 
-                    continue;
-                }
+            tmp = opendir(disk->file);
+
+            if(!tmp) {
+                fprintf(stderr, "Open `%s` failed\n", disk->file);
 
-                if(nst_disk_meta_get_stale(obj.meta) < 0
-                        && nst_disk_meta_check_expire(obj.meta) != NST_OK) {
+                return NST_ERR;
+            }
 
-                    remove(file);
-                    close(obj.fd);
+            while((de = readdir(tmp)) != NULL) {
 
+                if(de->d_name[0] == '.') {
                     continue;
                 }
 
-                close(obj.fd);
+                chunk_reset(&trash);
+                chunk_memcat(&trash, disk->file, nst_disk_path_base_len(root));
+                chunk_memcat(&trash, "/", 1);
+                chunk_memcat(&trash, de->d_name, strlen(de->d_name));
+                trash.area[trash.data++] = '\0';
 
-                if(nst_time_now_ms() - start >= 10) {
-                    break;
-                }
+                remove(trash.area);
             }
 
-            core->store.disk.idx++;
-            closedir(core->store.disk.dir);
-            core->store.disk.dir = NULL;
-        } else {
-            core->store.disk.dir = nst_disk_opendir_by_idx(core->root, file, core->store.disk.idx);
+            closedir(tmp);
+        }
 
-            if(!core->store.disk.dir) {
+        if(nst_disk_segment_on(disk) && _nst_disk_segment_init(disk, segment_size) != NST_OK) {
+            return NST_ERR;
+        }
+
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Start the load thread in the worker, the load state is shared so only one
+ * thread runs.
+ */
+void
+nst_disk_load_start(nst_disk_t *disk, void *data) {
+
+#ifdef USE_THREAD
+    pthread_t  tid;
+
+    if(!disk->loader) {
+        disk->loader = 1;
+
+        pthread_create(&tid, NULL, nst_disk_load_thread, data);
+    }
+#endif
+
+}
+
+/*
+ * Expired and not kept as stale, not loaded
+ */
+static int
+_nst_disk_meta_skip(char *meta) {
+    int  stale_prop, stale, expired;
+
+    stale_prop = nst_disk_meta_get_stale(meta);
+    stale      = nst_disk_meta_check_stale(meta) != NST_OK;
+    expired    = nst_disk_meta_check_expire(meta) != NST_OK;
+
+    return expired && (stale_prop == 0 || (stale_prop > 0 && stale));
+}
+
+/*
+ * Add the object described by meta to the dict, buf holds proxy, rule, host,
+ * path, etag and last-modified in that order. The dict shard of key is locked.
+ */
+static int
+_nst_disk_load_set(nst_core_t *core, char *meta, nst_key_t *key, hpx_buffer_t *buf, char *file,
+        uint64_t base) {
+
+    nst_http_txn_t   txn;
+    nst_rule_prop_t  prop;
+    uint64_t         ttl_extend, expire;
+    char            *p = buf->area;
+
+    prop.pid              = ist2(p, nst_disk_meta_get_proxy_len(meta));
+    p                    += prop.pid.len;
+    prop.rid              = ist2(p, nst_disk_meta_get_rule_len(meta));
+    p                    += prop.rid.len;
+    txn.req.host          = ist2(p, nst_disk_meta_get_host_len(meta));
+    p                    += txn.req.host.len;
+    txn.req.path          = ist2(p, nst_disk_meta_get_path_len(meta));
+    p                    += txn.req.path.len;
+    txn.res.etag          = ist2(p, nst_disk_meta_get_etag_len(meta));
+    p                    += txn.res.etag.len;
+    txn.res.last_modified = ist2(p, nst_disk_meta_get_last_modified_len(meta));
+    prop.uuid             = nst_rule_uuid(prop.pid, prop.rid);
+
+    ttl_extend         = nst_disk_meta_get_ttl_extend(meta);
+    prop.ttl           = ttl_extend >> 32;
+    prop.extend[0]     = *( uint8_t *)(&ttl_extend);
+    prop.extend[1]     = *((uint8_t *)(&ttl_extend) + 1);
+    prop.extend[2]     = *((uint8_t *)(&ttl_extend) + 2);
+    prop.extend[3]     = *((uint8_t *)(&ttl_extend) + 3);
+    prop.etag          = nst_disk_meta_get_etag_prop(meta);
+    prop.last_modified = nst_disk_meta_get_last_modified_prop(meta);
+    prop.stale         = nst_disk_meta_get_stale(meta);
+    prop.inactive      = nst_disk_meta_get_inactive(meta);
+
+    txn.res.header_len  = nst_disk_meta_get_header_len(meta);
+    txn.res.payload_len = nst_disk_meta_get_payload_len(meta);
+
+    expire = nst_disk_meta_get_expire(meta);
+
+    return nst_dict_set_from_disk(&core->dict, buf, key, &txn, &prop, file, base, expire);
+}
+
+static int
+_nst_disk_load_entry(nst_core_t *core, char *meta, nst_key_t *key, hpx_buffer_t *buf, char *file,
+        uint64_t base) {
+
+    int  ret;
+
+    nst_dict_lock(&core->dict, key);
+
+    ret = _nst_disk_load_set(core, meta, key, buf, file, base);
+
+    nst_dict_unlock(&core->dict, key);
+
+    return ret;
+}
+
+/*
+ * Read the key and the strings of the object at obj->base of obj->fd,
+ * obj->meta has been read. key->data and buf->area are freed on error.
+ */
+static int
+_nst_disk_read_obj(nst_core_t *core, nst_disk_obj_t *obj, nst_key_t *key, hpx_buffer_t *buf) {
+    ssize_t  ret;
+
+    key->data = NULL;
+    buf->area = NULL;
+
+    if(_nst_disk_meta_skip(obj->meta)) {
+        goto err;
+    }
+
+    if(nst_disk_read_key(&core->store.disk, obj, key) != NST_OK) {
+        goto err;
+    }
+
+    buf->size = nst_disk_meta_get_proxy_len(obj->meta) + nst_disk_meta_get_rule_len(obj->meta)
+        + nst_disk_meta_get_host_len(obj->meta) + nst_disk_meta_get_path_len(obj->meta)
+        + nst_disk_meta_get_etag_len(obj->meta) + nst_disk_meta_get_last_modified_len(obj->meta);
+
+    buf->data = 0;
+    buf->area = nst_shmem_alloc(core->shmem, buf->size);
+
+    if(!buf->area) {
+        goto err;
+    }
+
+    /* proxy to last-modified are contiguous, read at once */
+    ret = pread(obj->fd, buf->area, buf->size, obj->base + nst_disk_pos_proxy(obj));
+
+    if(ret != buf->size) {
+        goto err;
+    }
+
+    buf->data = buf->size;
+
+    return NST_OK;
+
+err:
+    nst_shmem_free(core->shmem, key->data);
+    nst_shmem_free(core->shmem, buf->area);
+
+    return NST_ERR;
+}
+
+/*
+ * Add the object at obj->base of obj->fd to the dict, obj->meta has been read
+ */
+static int
+_nst_disk_load_obj(nst_core_t *core, nst_disk_obj_t *obj, char *file) {
+    nst_key_t     key;
+    hpx_buffer_t  buf;
+
+    if(_nst_disk_read_obj(core, obj, &key, &buf) != NST_OK) {
+        return NST_ERR;
+    }
+
+    if(_nst_disk_load_entry(core, obj->meta, &key, &buf, file, obj->base) != NST_OK) {
+        nst_shmem_free(core->shmem, key.data);
+        nst_shmem_free(core->shmem, buf.area);
+
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Objects read by a scan thread, added to the dict a shard lock at a time
+ */
+#define NST_DISK_LOAD_BATCH  64
+
+typedef struct nst_disk_batch {
+    int                 count;
+    int                 file_len;
+    char               *files;
+    struct {
+        nst_key_t       key;
+        hpx_buffer_t    buf;
+        char            meta[NST_DISK_META_SIZE];
+    } obj[NST_DISK_LOAD_BATCH];
+} nst_disk_batch_t;
+
+static void
+_nst_disk_batch_flush(nst_core_t *core, nst_disk_batch_t *batch) {
+    nst_dict_shard_t  *shard;
+    char               state[NST_DISK_LOAD_BATCH] = { 0 };
+    char              *file;
+    int                i, j;
+
+    for(i = 0; i < batch->count; i++) {
+
+        if(state[i]) {
+            continue;
+        }
+
+        shard = nst_dict_shard(&core->dict, batch->obj[i].key.hash);
+
+        nst_shctx_lock(shard);
+
+        for(j = i; j < batch->count; j++) {
+
+            if(state[j] || nst_dict_shard(&core->dict, batch->obj[j].key.hash) != shard) {
+                continue;
+            }
+
+            file     = batch->files + j * batch->file_len;
+            state[j] = 1;
+
+            if(_nst_disk_load_set(core, batch->obj[j].meta, &batch->obj[j].key,
+                        &batch->obj[j].buf, file, 0) != NST_OK) {
+
+                state[j] = 2;
+            }
+        }
+
+        nst_shctx_unlock(shard);
+    }
+
+    for(i = 0; i < batch->count; i++) {
+
+        if(state[i] == 2) {
+            nst_shmem_free(core->shmem, batch->obj[i].key.data);
+            nst_shmem_free(core->shmem, batch->obj[i].buf.area);
+
+            remove(batch->files + i * batch->file_len);
+        }
+    }
+
+    batch->count = 0;
+}
+
+static int
+_nst_disk_batch_add(nst_core_t *core, nst_disk_batch_t *batch, nst_disk_obj_t *obj, char *file) {
+    int  i = batch->count;
+
+    if(_nst_disk_read_obj(core, obj, &batch->obj[i].key, &batch->obj[i].buf) != NST_OK) {
+        return NST_ERR;
+    }
+
+    memcpy(batch->obj[i].meta, obj->meta, NST_DISK_META_SIZE);
+    memcpy(batch->files + i * batch->file_len, file, batch->file_len);
+
+    if(++batch->count == NST_DISK_LOAD_BATCH) {
+        _nst_disk_batch_flush(core, batch);
+    }
+
+    return NST_OK;
+}
+
+static inline void
+_nst_disk_index_path(nst_disk_t *disk, char *p, int temp) {
+    sprintf(p, "%s/%sindex", disk->root.ptr, temp ? ".tmp/" : "");
+}
+
+/*
+ * Map root/index if it is valid, the segments it covers are only scanned
+ * past the indexed size.
+ */
+static void
+_nst_disk_index_open(nst_core_t *core) {
+    nst_disk_t      *disk = &core->store.disk;
+    nst_disk_seg_t  *slot;
+    struct stat      st;
+    uint64_t         len, size;
+    uint32_t         nseg, id;
+    char            *map, *p;
+    char             path[PATH_MAX];
+    int              fd, i, j;
+
+    disk->index.state = NST_DISK_INDEX_NONE;
+
+    _nst_disk_index_path(disk, path, 0);
+
+    fd = nst_disk_file_open(path);
+
+    if(fd == -1) {
+        return;
+    }
+
+    if(fstat(fd, &st) != 0 || st.st_size < NST_DISK_INDEX_HEADER_SIZE) {
+        close(fd);
+
+        return;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        return;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    len  = *(uint64_t *)(map + 40);
+    nseg = *(uint32_t *)(map + 32);
+
+    if(memcmp(map, "NSTINDEX", 8) != 0
+            || *(uint32_t *)(map + 8) != NST_DISK_INDEX_VERSION
+            || *(uint32_t *)(map + 12) != disk->engine
+            || len != st.st_size - NST_DISK_INDEX_HEADER_SIZE
+            || (uint64_t)nseg * NST_DISK_INDEX_SEGMENT_SIZE > len
+            || XXH64(map + NST_DISK_INDEX_HEADER_SIZE, len, 0) != *(uint64_t *)(map + 48)) {
+
+        munmap(map, st.st_size);
+
+        return;
+    }
+
+    p = map + NST_DISK_INDEX_HEADER_SIZE;
+
+    nst_shctx_lock(&disk->seg);
+
+    for(i = 0; i < nseg; i++, p += NST_DISK_INDEX_SEGMENT_SIZE) {
+        id   = *(uint32_t *)p;
+        size = *(uint64_t *)(p + 8);
+
+        for(j = 0; j < disk->seg.init; j++) {
+            slot = &disk->seg.slot[j];
+
+            if(slot->id == id) {
+                slot->indexed = size < slot->size ? size : slot->size;
+                slot->dead    = *(uint64_t *)(p + 16);
+
+                break;
+            }
+        }
+    }
+
+    nst_shctx_unlock(&disk->seg);
+
+    disk->index.map   = map;
+    disk->index.len   = st.st_size;
+    disk->index.pos   = p - map;
+    disk->index.time  = *(uint64_t *)(map + 16);
+    disk->index.state = NST_DISK_INDEX_OPEN;
+}
+
+static int
+_nst_disk_index_load_record(nst_core_t *core, char *meta, uint64_t len) {
+    nst_disk_t      *disk = &core->store.disk;
+    nst_disk_seg_t  *slot;
+    nst_key_t        key  = { .data = NULL };
+    hpx_buffer_t     buf  = { .area = NULL };
+    uint64_t         offset;
+    uint32_t         file_len;
+    char            *p;
+
+    offset   = *(uint64_t *)(meta + NST_DISK_META_SIZE);
+    file_len = *(uint32_t *)(meta + NST_DISK_META_SIZE + 8);
+    p        = meta + NST_DISK_INDEX_RECORD_SIZE;
+
+    key.size = nst_disk_meta_get_key_len(meta);
+    buf.size = nst_disk_meta_get_proxy_len(meta) + nst_disk_meta_get_rule_len(meta)
+        + nst_disk_meta_get_host_len(meta) + nst_disk_meta_get_path_len(meta)
+        + nst_disk_meta_get_etag_len(meta) + nst_disk_meta_get_last_modified_len(meta);
+
+    if(NST_DISK_INDEX_RECORD_SIZE + key.size + buf.size + file_len != len
+            || disk->root.len + 1 + file_len >= nst_disk_path_file_len(disk->root)) {
+
+        return NST_ERR;
+    }
+
+    if(_nst_disk_meta_skip(meta)) {
+        return NST_ERR;
+    }
+
+    sprintf(disk->file, "%s/", disk->root.ptr);
+    memcpy(disk->file + disk->root.len + 1, p + key.size + buf.size, file_len);
+    disk->file[disk->root.len + 1 + file_len] = '\0';
+
+    /* the segment is gone or the object is past what was indexed */
+    if(nst_disk_segment_on(disk)) {
+        nst_shctx_lock(&disk->seg);
+        slot = _nst_disk_segment_find(disk, disk->file);
+        len  = slot ? slot->indexed : 0;
+        nst_shctx_unlock(&disk->seg);
+
+        if(offset >= len) {
+            return NST_ERR;
+        }
+    }
+
+    key.data = nst_shmem_alloc(core->shmem, key.size);
+    buf.area = nst_shmem_alloc(core->shmem, buf.size);
+
+    if(!key.data || !buf.area) {
+        goto err;
+    }
+
+    memcpy(key.data, p, key.size);
+    memcpy(buf.area, p + key.size, buf.size);
+
+    memcpy(key.uuid, meta + NST_DISK_META_POS_UUID, NST_KEY_UUID_LEN);
+
+    key.hash = nst_disk_meta_get_hash(meta);
+    buf.data = buf.size;
+
+    if(_nst_disk_load_entry(core, meta, &key, &buf, disk->file, offset) != NST_OK) {
+        goto err;
+    }
+
+    return NST_OK;
+
+err:
+    nst_shmem_free(core->shmem, key.data);
+    nst_shmem_free(core->shmem, buf.area);
+
+    return NST_ERR;
+}
+
+/*
+ * Load the index records once what changed since the index is loaded, the
+ * objects already in the dict are newer and kept.
+ */
+static void
+_nst_disk_index_load(nst_core_t *core) {
+    nst_disk_t  *disk = &core->store.disk;
+    uint64_t     start, len;
+    char        *p;
+
+    start = nst_time_now_ms();
+
+    while(disk->index.len - disk->index.pos >= NST_DISK_INDEX_RECORD_SIZE) {
+        p   = disk->index.map + disk->index.pos;
+        len = nst_disk_meta_get_record_len(p);
+
+        if(len < NST_DISK_INDEX_RECORD_SIZE || len > disk->index.len - disk->index.pos) {
+            break;
+        }
+
+        disk->index.pos += len;
+
+        _nst_disk_index_load_record(core, p, len);
+
+        if(nst_time_now_ms() - start >= 300) {
+            return;
+        }
+    }
+
+    munmap(disk->index.map, disk->index.len);
+
+    disk->index.map   = NULL;
+    disk->index.state = NST_DISK_INDEX_DONE;
+    disk->loaded      = 1;
+}
+
+/*
+ * Everything on disk has been scanned, load the index records if any
+ */
+static void
+_nst_disk_load_scanned(nst_core_t *core) {
+    core->store.disk.idx = 0;
+
+    if(core->store.disk.index.state == NST_DISK_INDEX_OPEN) {
+        core->store.disk.index.state = NST_DISK_INDEX_RECORDS;
+    } else {
+        core->store.disk.loaded = 1;
+    }
+}
+
+/*
+ * Walk the records of the segments found on startup, the dict entries point
+ * to segment file and offset.
+ */
+static void
+_nst_disk_segment_load(nst_core_t *core) {
+    nst_disk_t      *disk = &core->store.disk;
+    nst_disk_obj_t   obj;
+    uint64_t         start, size, len;
+    uint32_t         id;
+    char            *file;
+    int              idx;
+
+    file  = disk->file;
+    start = nst_time_now_ms();
+
+    while(disk->idx < disk->seg.init) {
+        idx = disk->seg.init - 1 - disk->idx;
+
+        nst_shctx_lock(&disk->seg);
+        id   = disk->seg.slot[idx].id;
+        size = disk->seg.slot[idx].size;
+
+        /* the start is in the index */
+        if(disk->seg.pos < disk->seg.slot[idx].indexed) {
+            disk->seg.pos = disk->seg.slot[idx].indexed;
+        }
+
+        nst_shctx_unlock(&disk->seg);
+
+        nst_disk_segment_path(disk, file, id);
+
+        obj.fd = nst_disk_file_open(file);
+
+        while(obj.fd != -1 && disk->seg.pos < size) {
+            obj.base = disk->seg.pos;
+
+            if(nst_disk_read_meta(&obj) != NST_OK) {
+                break;
+            }
+
+            len = nst_disk_meta_get_record_len(obj.meta);
+
+            if(len < NST_DISK_META_SIZE || obj.base + len > size) {
+                break;
+            }
+
+            disk->seg.pos += len;
+
+            if(nst_disk_meta_deleted(obj.meta) || _nst_disk_load_obj(core, &obj, file) != NST_OK) {
+                _nst_disk_segment_dead(disk, idx, len);
+            }
+
+            if(nst_time_now_ms() - start >= 300) {
+                close(obj.fd);
+
+                return;
+            }
+        }
+
+        /* unfinished tail of a crashed writer */
+        if(disk->seg.pos < size) {
+            _nst_disk_segment_dead(disk, idx, size - disk->seg.pos);
+        }
+
+        if(obj.fd != -1) {
+            close(obj.fd);
+        }
+
+        disk->idx++;
+        disk->seg.pos = 0;
+    }
+
+    _nst_disk_load_scanned(core);
+}
+
+/*
+ * Load the object file de of the bucket directory in file, file is then the
+ * object path. Added to batch if any, or to the dict.
+ */
+static void
+_nst_disk_load_file(nst_core_t *core, nst_dirent_t *de, char *file, nst_disk_batch_t *batch) {
+    nst_disk_obj_t  obj;
+    struct stat     st;
+    char            path[PATH_MAX];
+    int             base, ret;
+
+    base = nst_disk_path_base_len(core->root);
+
+    if(strlen(de->d_name) != NST_DISK_FILE_LEN) {
+        snprintf(path, sizeof(path), "%.*s/%s", base, file, de->d_name);
+        remove(path);
+
+        return;
+    }
+
+    memcpy(file + base, "/", 1);
+    memcpy(file + base + 1, de->d_name, NST_DISK_FILE_LEN);
+
+    /* in the index, unchanged since, with a margin for the dict update */
+    if(core->store.disk.index.state == NST_DISK_INDEX_OPEN
+            && stat(file, &st) == 0
+            && (uint64_t)st.st_ctim.tv_sec * 1000 + st.st_ctim.tv_nsec / 1000000 + 1000
+            < core->store.disk.index.time) {
+
+        return;
+    }
+
+    obj.fd   = nst_disk_file_open(file);
+    obj.base = 0;
+
+    if(obj.fd == -1) {
+        return;
+    }
+
+    ret = nst_disk_read_meta(&obj);
+
+    if(ret == NST_OK) {
+        ret = batch ? _nst_disk_batch_add(core, batch, &obj, file) : _nst_disk_load_obj(core, &obj, file);
+    }
+
+    if(ret != NST_OK) {
+        remove(file);
+    }
+
+    close(obj.fd);
+}
+
+void
+nst_disk_load(nst_core_t *core) {
+
+    if(core->root.len && !core->store.disk.loaded) {
+        nst_dirent_t     *de;
+        uint64_t         start;
+        char            *file;
+
+        if(core->store.disk.index.state == NST_DISK_INDEX_INIT) {
+            _nst_disk_index_open(core);
+        }
+
+        if(core->store.disk.index.state == NST_DISK_INDEX_RECORDS) {
+            _nst_disk_index_load(core);
+
+            return;
+        }
+
+        if(nst_disk_segment_on(&core->store.disk)) {
+            _nst_disk_segment_load(core);
+
+            return;
+        }
+
+        file  = core->store.disk.file;
+        start = nst_time_now_ms();
+
+        if(core->store.disk.dir) {
+
+            while((de = readdir(core->store.disk.dir)) != NULL) {
+
+                if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                    continue;
+                }
+
+                _nst_disk_load_file(core, de, file, NULL);
+
+                if(nst_time_now_ms() - start >= 300) {
+                    break;
+                }
+            }
+
+            if(de == NULL) {
+                core->store.disk.idx++;
+                closedir(core->store.disk.dir);
+                core->store.disk.dir = NULL;
+            }
+        } else {
+            core->store.disk.dir = nst_disk_opendir_by_idx(core->root, file, core->store.disk.idx);
+
+            if(!core->store.disk.dir) {
+                core->store.disk.idx++;
+            }
+        }
+
+        if(core->store.disk.idx == 16 * 16) {
+            _nst_disk_load_scanned(core);
+        }
+
+    }
+}
+
+/*
+ * Copy the live object at from->base of a compacted segment to a writable
+ * segment and repoint its dict entry, unless it has been replaced meanwhile.
+ */
+static void
+_nst_disk_segment_move(nst_core_t *core, nst_disk_obj_t *from, char *file, uint64_t len) {
+    nst_disk_t        *disk = &core->store.disk;
+    nst_dict_entry_t  *entry;
+    nst_disk_obj_t     to   = { .aio = NULL };
+    nst_key_t          key  = { .data = NULL };
+    uint64_t           n;
+    ssize_t            ret;
+    char              *old;
+    int                live;
+
+    if(nst_disk_read_key(disk, from, &key) != NST_OK) {
+        return;
+    }
+
+    nst_dict_lock(&core->dict, &key);
+
+    entry = nst_dict_lookup(&core->dict, &key);
+
+    live = entry && entry->store.disk.file && entry->store.disk.offset == from->base
+        && strcmp(entry->store.disk.file, file) == 0;
+
+    nst_dict_unlock(&core->dict, &key);
+
+    if(!live) {
+        goto out;
+    }
+
+    to.file = nst_shmem_alloc(disk->shmem, nst_disk_path_file_len(disk->root));
+
+    if(!to.file) {
+        goto out;
+    }
+
+    if(_nst_disk_segment_acquire(disk, &to) != NST_OK) {
+        nst_shmem_free(disk->shmem, to.file);
+
+        goto out;
+    }
+
+    for(n = 0; n < len; n += ret) {
+        ret = pread(from->fd, trash.area, MIN(trash.size, len - n), from->base + n);
+
+        if(ret <= 0 || pwrite(to.fd, trash.area, ret, to.base + n) != ret) {
+            break;
+        }
+    }
+
+    if(n != len) {
+        nst_disk_obj_abort(disk, &to);
+
+        goto out;
+    }
+
+    _nst_disk_segment_release(disk, &to, to.base + len, 0);
+
+    nst_dict_lock(&core->dict, &key);
+
+    entry = nst_dict_lookup(&core->dict, &key);
+
+    live = entry && entry->store.disk.file && entry->store.disk.offset == from->base
+        && strcmp(entry->store.disk.file, file) == 0;
+
+    if(live) {
+        old = entry->store.disk.file;
+
+        entry->store.disk.file   = to.file;
+        entry->store.disk.offset = to.base;
+
+        nst_shmem_free(disk->shmem, old);
+    }
+
+    nst_dict_unlock(&core->dict, &key);
+
+    if(!live) {
+        _nst_disk_segment_kill(disk, to.file, to.base);
+        nst_shmem_free(disk->shmem, to.file);
+    }
+
+out:
+    nst_shmem_free(disk->shmem, key.data);
+}
+
+/*
+ * Compact one object of a sealed segment which is at least half dead, the
+ * segment file is removed once all its live objects have been moved.
+ */
+static void
+_nst_disk_segment_compact(nst_core_t *core) {
+    nst_disk_t      *disk = &core->store.disk;
+    nst_disk_seg_t  *seg;
+    nst_disk_obj_t   obj;
+    uint64_t         size, len;
+    uint32_t         id;
+    char            *file;
+    int              i;
+
+    file = disk->file;
+
+    if(disk->seg.compact == -1) {
+        nst_shctx_lock(&disk->seg);
+
+        for(i = 0; i < disk->seg.count; i++) {
+            seg = &disk->seg.slot[i];
+
+            if(seg->id && seg->sealed && !seg->busy && seg->dead * 2 >= seg->size) {
+                seg->busy         = 1;
+                disk->seg.compact = i;
+
+                break;
+            }
+        }
+
+        nst_shctx_unlock(&disk->seg);
+
+        if(disk->seg.compact == -1) {
+            return;
+        }
+
+        disk->seg.pos = 0;
+    }
+
+    nst_shctx_lock(&disk->seg);
+    id   = disk->seg.slot[disk->seg.compact].id;
+    size = disk->seg.slot[disk->seg.compact].size;
+    nst_shctx_unlock(&disk->seg);
+
+    nst_disk_segment_path(disk, file, id);
+
+    if(disk->seg.fd == -1) {
+        disk->seg.fd = nst_disk_file_open(file);
+    }
+
+    obj.fd   = disk->seg.fd;
+    obj.base = disk->seg.pos;
+
+    if(obj.fd == -1 || obj.base >= size || nst_disk_read_meta(&obj) != NST_OK) {
+        goto done;
+    }
+
+    len = nst_disk_meta_get_record_len(obj.meta);
+
+    if(len < NST_DISK_META_SIZE || obj.base + len > size) {
+        goto done;
+    }
+
+    disk->seg.pos += len;
+
+    if(!nst_disk_meta_deleted(obj.meta) && !nst_disk_meta_dead(obj.meta)) {
+        _nst_disk_segment_move(core, &obj, file, len);
+    }
+
+    return;
+
+done:
+
+    if(disk->seg.fd != -1) {
+        close(disk->seg.fd);
+        disk->seg.fd = -1;
+    }
+
+    remove(file);
+
+    nst_shctx_lock(&disk->seg);
+    memset(&disk->seg.slot[disk->seg.compact], 0, sizeof(nst_disk_seg_t));
+    nst_shctx_unlock(&disk->seg);
+
+    disk->seg.compact = -1;
+}
+
+/*
+ * Remove the object file de of the bucket directory in file if invalid or
+ * expired and not kept as stale.
+ */
+static void
+_nst_disk_clean_file(nst_core_t *core, nst_dirent_t *de, char *file) {
+    nst_disk_obj_t  obj;
+    char            path[PATH_MAX];
+    int             base;
+
+    base = nst_disk_path_base_len(core->root);
+
+    if(strlen(de->d_name) != NST_DISK_FILE_LEN) {
+        snprintf(path, sizeof(path), "%.*s/%s", base, file, de->d_name);
+        remove(path);
+
+        return;
+    }
+
+    memcpy(file + base, "/", 1);
+    memcpy(file + base + 1, de->d_name, NST_DISK_FILE_LEN);
+
+    obj.fd   = nst_disk_file_open(file);
+    obj.base = 0;
+
+    if(obj.fd == -1) {
+        return;
+    }
+
+    if(nst_disk_read_meta(&obj) != NST_OK
+            || (nst_disk_meta_get_stale(obj.meta) < 0
+                && nst_disk_meta_check_expire(obj.meta) != NST_OK)) {
+
+        remove(file);
+    }
+
+    close(obj.fd);
+}
+
+#ifdef USE_THREAD
+
+typedef struct nst_disk_scan {
+    nst_core_t         *core;
+    int                 from;               /* bucket range [from, to) */
+    int                 to;
+} nst_disk_scan_t;
+
+/*
+ * Start the scan threads of the file engine, each owns a disjoint range of
+ * the 16 * 16 bucket directories. Returns the number of threads started, the
+ * ranges of scan past it have no thread.
+ */
+static int
+_nst_disk_scan_start(nst_core_t *core, void *(*fn)(void *), nst_disk_scan_t *scan, pthread_t *tids) {
+    sigset_t  set, old;
+    int       i, n;
+
+    n = core->store.disk.threads;
+
+    for(i = 0; i < n; i++) {
+        scan[i].core = core;
+        scan[i].from = 16 * 16 * i / n;
+        scan[i].to   = 16 * 16 * (i + 1) / n;
+    }
+
+    /* signals are for the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old);
+
+    for(i = 0; i < n; i++) {
+
+        if(pthread_create(&tids[i], NULL, fn, &scan[i]) != 0) {
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return i;
+}
+
+static void *
+_nst_disk_load_scan(void *data) {
+    nst_disk_scan_t   *scan = data;
+    nst_core_t        *core = scan->core;
+    nst_disk_batch_t  *batch;
+    nst_dirent_t      *de;
+    DIR               *dir;
+    char               file[PATH_MAX];
+    int                idx;
+
+    batch = calloc(1, sizeof(*batch));
+
+    if(batch) {
+        batch->file_len = nst_disk_path_file_len(core->root);
+        batch->files    = malloc(NST_DISK_LOAD_BATCH * batch->file_len);
+
+        /* added one by one then */
+        if(!batch->files) {
+            free(batch);
+            batch = NULL;
+        }
+    }
+
+    for(idx = scan->from; idx < scan->to; idx++) {
+        dir = nst_disk_opendir_by_idx(core->root, file, idx);
+
+        if(!dir) {
+            continue;
+        }
+
+        while((de = readdir(dir)) != NULL) {
+
+            if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+
+            _nst_disk_load_file(core, de, file, batch);
+        }
+
+        closedir(dir);
+    }
+
+    if(batch) {
+        _nst_disk_batch_flush(core, batch);
+
+        free(batch->files);
+        free(batch);
+    }
+
+    return NULL;
+}
+
+static void *
+_nst_disk_clean_scan(void *data) {
+    nst_disk_scan_t  *scan = data;
+    nst_core_t       *core = scan->core;
+    nst_dirent_t     *de;
+    DIR              *dir;
+    char              file[PATH_MAX];
+    int               idx;
+
+    while(1) {
+
+        for(idx = scan->from; idx < scan->to; idx++) {
+            dir = nst_disk_opendir_by_idx(core->root, file, idx);
+
+            if(dir) {
+
+                while((de = readdir(dir)) != NULL) {
+
+                    if(de->d_name[0] == '.') {
+                        continue;
+                    }
+
+                    _nst_disk_clean_file(core, de, file);
+                }
+
+                closedir(dir);
+            }
+
+            /* a bucket per housekeeping interval */
+            usleep(NST_HOUSEKEEPING_INTERVAL * 1000);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * The worker load thread. With several scan threads, the buckets of the file
+ * engine are loaded in parallel, then the index records if any.
+ */
+void *nst_disk_load_thread(void *data) {
+    nst_core_t       *core = (nst_core_t *)data;
+    nst_disk_scan_t  *scan = NULL;
+    pthread_t        *tids = NULL;
+    int               i, n;
+
+    if(core->root.len == 0) {
+        return NULL;
+    }
+
+    n = core->store.disk.threads;
+
+    if(n > 1 && !nst_disk_segment_on(&core->store.disk)) {
+        scan = calloc(n, sizeof(*scan));
+        tids = calloc(n, sizeof(*tids));
+    }
+
+    if(scan && tids) {
+
+        if(core->store.disk.index.state == NST_DISK_INDEX_INIT) {
+            _nst_disk_index_open(core);
+        }
+
+        i = _nst_disk_scan_start(core, _nst_disk_load_scan, scan, tids);
+
+        /* the ranges without a thread are loaded here */
+        while(n > i) {
+            _nst_disk_load_scan(&scan[--n]);
+        }
+
+        while(i--) {
+            pthread_join(tids[i], NULL);
+        }
+
+        _nst_disk_load_scanned(core);
+    }
+
+    free(scan);
+    free(tids);
+
+    while(!core->store.disk.loaded) {
+        nst_disk_load(core);
+    }
+
+    return NULL;
+}
+#endif
+
+void
+nst_disk_cleanup(nst_core_t *core) {
+    nst_dirent_t   *de;
+    uint64_t        start;
+    char           *file;
+
+    file  = core->store.disk.file;
+    start = nst_time_now_ms();
+
+    if(core->root.len && core->store.disk.loaded && nst_disk_segment_on(&core->store.disk)) {
+        _nst_disk_segment_compact(core);
+
+        return;
+    }
+
+#ifdef USE_THREAD
+    /* the scan threads of the master clean in the background */
+    if(core->root.len && core->store.disk.loaded && core->store.disk.threads > 1) {
+
+        if(core->store.disk.cleaner == 0) {
+            nst_disk_scan_t  *scan;
+            pthread_t        *tids;
+            int               i, n, started = 0;
+
+            n    = core->store.disk.threads;
+            scan = calloc(n, sizeof(*scan));
+            tids = calloc(n, sizeof(*tids));
+
+            if(scan && tids) {
+                started = _nst_disk_scan_start(core, _nst_disk_clean_scan, scan, tids);
+            }
+
+            for(i = 0; i < started; i++) {
+                pthread_detach(tids[i]);
+            }
+
+            /* scan is kept by the threads, all cleaned here too if some are missing */
+            core->store.disk.cleaner = started == n ? 1 : -1;
+
+            if(!started) {
+                free(scan);
+            }
+
+            free(tids);
+        }
+
+        if(core->store.disk.cleaner == 1) {
+            return;
+        }
+    }
+#endif
+
+    if(core->root.len && core->store.disk.loaded) {
+
+        if(core->store.disk.dir) {
+
+            while((de = readdir(core->store.disk.dir)) != NULL) {
+
+                if(de->d_name[0] == '.') {
+                    continue;
+                }
+
+                _nst_disk_clean_file(core, de, file);
+
+                if(nst_time_now_ms() - start >= 10) {
+                    break;
+                }
+            }
+
+            core->store.disk.idx++;
+            closedir(core->store.disk.dir);
+            core->store.disk.dir = NULL;
+        } else {
+            core->store.disk.dir = nst_disk_opendir_by_idx(core->root, file, core->store.disk.idx);
+
+            if(!core->store.disk.dir) {
                 core->store.disk.idx++;
             }
         }
@@ -622,8 +1819,14 @@ nst_disk_purge_by_key(nst_disk_obj_t *obj, nst_key_t *key, hpx_ist_t root) {
  *  1: ok
  */
 int
-nst_disk_purge_by_path(char *path) {
-    int  ret = remove(path);
+nst_disk_purge_by_path(nst_disk_t *disk, char *path, uint64_t offset) {
+    int  ret;
+
+    if(nst_disk_segment_on(disk)) {
+        return _nst_disk_segment_kill(disk, path, offset);
+    }
+
+    ret = remove(path);
 
     if(ret == 0) {
         return 1;
@@ -637,7 +1840,7 @@ nst_disk_purge_by_path(char *path) {
 }
 
 void
-nst_disk_update_expire(char *file, uint64_t expire) {
+nst_disk_update_expire(char *file, uint64_t offset, uint64_t expire) {
     int  fd;
 
     fd = open(file, O_WRONLY);
@@ -646,7 +1849,7 @@ nst_disk_update_expire(char *file, uint64_t expire) {
         return;
     }
 
-    pwrite(fd, &expire, 8, NST_DISK_META_POS_EXPIRE);
+    pwrite(fd, &expire, 8, offset + NST_DISK_META_POS_EXPIRE);
 
     close(fd);
 }
@@ -684,14 +1887,27 @@ nst_disk_meta_init(char *p, uint64_t hash, uint64_t expire, uint64_t header_len,
     nst_disk_meta_set_ttl_extend(p, ttl_extend);
     nst_disk_meta_set_stale(p, prop->stale);
     nst_disk_meta_set_inactive(p, prop->inactive);
+    nst_disk_meta_set_record_len(p, 0);
 }
 
+/*
+ * The writes of the object are staged and done by the io threads if task is
+ * set, task is woken up as they complete.
+ */
 int
 nst_disk_obj_create(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, nst_http_txn_t *txn,
-        nst_rule_prop_t *prop) {
+        nst_rule_prop_t *prop, hpx_task_t *task) {
+
+    /* the check of a previous lookup */
+    if(obj->aio) {
+        nst_disk_aio_release(obj->aio, -1);
+    }
 
     obj->file = NULL;
     obj->fd   = -1;
+    obj->seg  = -1;
+    obj->base = 0;
+    obj->aio  = NULL;
 
     obj->file = nst_shmem_alloc(disk->shmem, nst_disk_path_file_len(disk->root));
 
@@ -699,13 +1915,24 @@ nst_disk_obj_create(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, nst_h
         return NST_ERR;
     }
 
-    sprintf(obj->file, "%s/.tmp/%020"PRIx64"%020"PRIu64, disk->root.ptr, ha_random64(),
-            nst_time_now_ns());
+    if(nst_disk_segment_on(disk)) {
+
+        if(_nst_disk_segment_acquire(disk, obj) != NST_OK) {
+            goto err;
+        }
+    } else {
+        sprintf(obj->file, "%s/.tmp/%020"PRIx64"%020"PRIu64, disk->root.ptr, ha_random64(),
+                nst_time_now_ns());
+
+        obj->fd = nst_disk_file_create(obj->file);
 
-    obj->fd = nst_disk_file_create(obj->file);
+        if(obj->fd == -1) {
+            goto err;
+        }
+    }
 
-    if(obj->fd == -1) {
-        goto err;
+    if(task) {
+        obj->aio = nst_disk_aio_create(task, obj->fd);
     }
 
     nst_disk_meta_init(obj->meta, key->hash, 0, 0, 0, key->size, txn, prop);
@@ -733,26 +1960,16 @@ nst_disk_obj_create(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, nst_h
     if(nst_disk_write_etag(obj, txn->res.etag) != NST_OK) {
         goto err;
     }
-
-    if(nst_disk_write_last_modified(obj, txn->res.last_modified) != NST_OK) {
-        goto err;
-    }
-
-    return NST_OK;
-
-err:
-
-    if(obj->fd != -1) {
-        close(obj->fd);
-        obj->fd = -1;
-    }
-
-    if(obj->file) {
-        remove(obj->file);
-        nst_shmem_free(disk->shmem, obj->file);
-        obj->file = NULL;
+
+    if(nst_disk_write_last_modified(obj, txn->res.last_modified) != NST_OK) {
+        goto err;
     }
 
+    return NST_OK;
+
+err:
+    nst_disk_obj_abort(disk, obj);
+
     return NST_ERR;
 }
 
@@ -762,15 +1979,32 @@ nst_disk_obj_finish(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, nst_h
 
     char  *p, *old_file, *new_file;
 
+    /* the caller waited for nst_disk_obj_flushed */
+    if(obj->aio) {
+
+        if(nst_disk_aio_close(obj->aio) != NST_OK) {
+            goto err;
+        }
+
+        obj->aio = NULL;
+    }
+
     nst_disk_meta_set_uuid(obj->meta, key->uuid);
     nst_disk_meta_set_expire(obj->meta, expire);
     nst_disk_meta_set_header_len(obj->meta, txn->res.header_len);
     nst_disk_meta_set_payload_len(obj->meta, txn->res.payload_len);
+    nst_disk_meta_set_record_len(obj->meta, obj->offset - obj->base);
 
     if(nst_disk_write_meta(obj) != NST_OK) {
         goto err;
     }
 
+    if(obj->seg != -1) {
+        _nst_disk_segment_release(disk, obj, obj->base + nst_disk_meta_get_record_len(obj->meta), 0);
+
+        return NST_OK;
+    }
+
     p = trash.area;
 
     nst_key_uuid_stringify(key, p);
@@ -790,6 +2024,7 @@ nst_disk_obj_finish(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, nst_h
     sprintf(new_file, "%s/%c/%c%c/%s", disk->root.ptr, p[0], p[0], p[1], p);
 
     close(obj->fd);
+    obj->fd = -1;
 
     if(rename(old_file, new_file) != 0) {
         goto err;
@@ -800,44 +2035,107 @@ nst_disk_obj_finish(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, nst_h
     return NST_OK;
 
 err:
-    if(obj->fd != -1) {
-        close(obj->fd);
-        obj->fd = -1;
+    nst_disk_obj_abort(disk, obj);
+
+    return NST_ERR;
+}
+
+void
+nst_disk_obj_abort(nst_disk_t *disk, nst_disk_obj_t *obj) {
+
+    if(obj->aio) {
+        nst_disk_aio_t  *aio = obj->aio;
+
+        obj->aio = NULL;
+
+        /* an io thread is still writing it, the aio aborts it once done */
+        if(nst_disk_aio_abort(aio, disk, obj) == NST_OK) {
+            obj->file = NULL;
+            obj->fd   = -1;
+
+            return;
+        }
+    }
+
+    if(obj->seg != -1) {
+        /* drop the partial object, seal the segment if that fails */
+        int  seal = ftruncate(obj->fd, obj->base) != 0;
+
+        _nst_disk_segment_release(disk, obj, obj->base, seal);
+    } else {
+
+        if(obj->fd != -1) {
+            close(obj->fd);
+            obj->fd = -1;
+        }
+
+        if(obj->file) {
+            remove(obj->file);
+        }
     }
 
     if(obj->file) {
-        remove(obj->file);
         nst_shmem_free(disk->shmem, obj->file);
         obj->file = NULL;
     }
-
-    return NST_ERR;
 }
 
+/*
+ * Open obj and check it is the object of key. With task, the check is done
+ * by an io thread which wakes task up, NST_DISK_PENDING is returned until the
+ * next call for the same object consumes it.
+ */
 int
-nst_disk_obj_valid(nst_disk_obj_t *obj, nst_key_t *key) {
-    hpx_buffer_t  *buf;
-    int            ret;
+nst_disk_obj_valid(nst_disk_obj_t *obj, nst_key_t *key, hpx_task_t *task) {
+    nst_disk_aio_t  *aio;
+    hpx_buffer_t    *buf;
+    int              ret;
 
-    buf = get_trash_chunk();
+    if(task && !obj->aio) {
+        obj->aio = nst_disk_aio_create(task, -1);
+    }
 
-    obj->fd = nst_disk_file_open(obj->file);
+    aio = task ? obj->aio : NULL;
 
-    if(obj->fd == -1) {
-        goto err;
+    if(aio) {
+
+        if(aio->op == NST_DISK_AIO_CHECK && (aio->pending || aio->ready)
+                && aio->obj.base == obj->base && strcmp(aio->obj.file, obj->file) == 0) {
+
+            ret = nst_disk_aio_checked(aio, obj, key);
+
+            if(ret == NST_ERR) {
+                nst_disk_aio_release(aio, -1);
+
+                obj->aio = NULL;
+            }
+
+            return ret;
+        }
+
+        if(nst_disk_aio_check(aio, obj->file, obj->base, key) == NST_OK) {
+            return NST_DISK_PENDING;
+        }
+
+        /* too large for the aio buffer, check in place */
+        nst_disk_aio_release(aio, -1);
+
+        obj->aio = NULL;
     }
 
-    ret = pread(obj->fd, obj->meta, NST_DISK_META_SIZE, 0);
+    buf = get_trash_chunk();
 
-    if(ret != NST_DISK_META_SIZE) {
+    obj->fd = nst_disk_file_open(obj->file);
+
+    if(obj->fd == -1) {
         goto err;
     }
 
-    if(memcmp(obj->meta, "NUSTER", 6) !=0) {
+    if(nst_disk_read_meta(obj) != NST_OK) {
         goto err;
     }
 
-    if(obj->meta[7] != NST_DISK_VERSION) {
+    if(nst_disk_meta_deleted(obj->meta)) {
         goto err;
     }
 
@@ -847,7 +2145,7 @@ nst_disk_obj_valid(nst_disk_obj_t *obj, nst_key_t *key) {
         goto err;
     }
 
-    ret = pread(obj->fd, buf->area, key->size, NST_DISK_POS_KEY);
+    ret = pread(obj->fd, buf->area, key->size, obj->base + NST_DISK_POS_KEY);
 
     if(ret != key->size) {
         goto err;
@@ -857,6 +2155,10 @@ nst_disk_obj_valid(nst_disk_obj_t *obj, nst_key_t *key) {
         goto err;
     }
 
+    /* hits are read front to back, let the kernel read ahead */
+    posix_fadvise(obj->fd, obj->base, nst_disk_meta_get_record_len(obj->meta),
+            POSIX_FADV_SEQUENTIAL);
+
     return NST_OK;
 
 err:
@@ -865,16 +2167,26 @@ err:
     return NST_ERR;
 }
 
+/*
+ * Probe the disk for key before the disk is loaded. Objects of the segment
+ * engine can only be found through the dict.
+ */
 int
-nst_disk_obj_exists(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key) {
+nst_disk_obj_exists(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key, hpx_task_t *task) {
     hpx_buffer_t  *buf1, *buf2;
     char          *p;
 
+    if(nst_disk_segment_on(disk)) {
+        return NST_ERR;
+    }
+
     buf1 = get_trash_chunk();
     buf2 = get_trash_chunk();
     p    = buf1->area;
 
     obj->file = buf2->area;
+    obj->seg  = -1;
+    obj->base = 0;
 
     nst_key_uuid_stringify(key, p);
 
@@ -882,10 +2194,438 @@ nst_disk_obj_exists(nst_disk_t *disk, nst_disk_obj_t *obj, nst_key_t *key) {
 
     sprintf(obj->file, "%s/%c/%c%c/%s", disk->root.ptr, p[0], p[0], p[1], p);
 
-    if(nst_disk_obj_valid(obj, key) == NST_OK) {
+    return nst_disk_obj_valid(obj, key, task);
+}
+
+/*
+ * Master local, the bytes of the index gathered under a lock, written to the
+ * index once it is released
+ */
+static struct {
+    char      *area;
+    uint64_t   size;
+    uint64_t   data;
+} nst_disk_index_buf;
+
+static char *
+_nst_disk_index_reserve(uint64_t len) {
+    char      *area;
+    uint64_t   size;
+
+    if(nst_disk_index_buf.data + len > nst_disk_index_buf.size) {
+        size = nst_disk_index_buf.size ? nst_disk_index_buf.size : global.tune.bufsize;
+
+        while(size < nst_disk_index_buf.data + len) {
+            size *= 2;
+        }
+
+        area = realloc(nst_disk_index_buf.area, size);
+
+        if(!area) {
+            return NULL;
+        }
+
+        nst_disk_index_buf.area = area;
+        nst_disk_index_buf.size = size;
+    }
+
+    area = nst_disk_index_buf.area + nst_disk_index_buf.data;
+
+    nst_disk_index_buf.data += len;
+
+    return area;
+}
+
+static int
+_nst_disk_index_flush(nst_disk_t *disk) {
+    uint64_t  len = nst_disk_index_buf.data;
+
+    nst_disk_index_buf.data = 0;
+
+    if(!len) {
+        return NST_OK;
+    }
+
+    if(write(disk->index.fd, nst_disk_index_buf.area, len) != len) {
+        return NST_ERR;
+    }
+
+    XXH64_update(&disk->index.sum, nst_disk_index_buf.area, len);
+
+    disk->index.size += len;
+
+    return NST_OK;
+}
+
+static void
+_nst_disk_index_abort(nst_disk_t *disk) {
+    char  path[PATH_MAX];
+
+    close(disk->index.fd);
+
+    _nst_disk_index_path(disk, path, 1);
+
+    remove(path);
+
+    nst_disk_index_buf.data = 0;
+
+    disk->index.saving = 0;
+}
+
+static int
+_nst_disk_index_begin(nst_disk_t *disk) {
+    char  *p;
+    char   path[PATH_MAX];
+    int    i;
+
+    _nst_disk_index_path(disk, path, 1);
+
+    disk->index.fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+
+    if(disk->index.fd == -1) {
+        return NST_ERR;
+    }
+
+    if(lseek(disk->index.fd, NST_DISK_INDEX_HEADER_SIZE, SEEK_SET) == -1) {
+        goto err;
+    }
+
+    XXH64_reset(&disk->index.sum, 0);
+
+    disk->index.saving = 1;
+    disk->index.start  = nst_time_now_ms();
+    disk->index.shard  = 0;
+    disk->index.idx    = 0;
+    disk->index.tsize  = 0;
+    disk->index.count  = 0;
+    disk->index.size   = 0;
+    disk->index.nseg   = 0;
+
+    if(!nst_disk_segment_on(disk)) {
         return NST_OK;
     }
 
+    /* sizes as of now, the loader scans anything appended later */
+    nst_shctx_lock(&disk->seg);
+
+    for(i = 0; i < disk->seg.count; i++) {
+
+        if(disk->seg.slot[i].id == 0) {
+            continue;
+        }
+
+        p = _nst_disk_index_reserve(NST_DISK_INDEX_SEGMENT_SIZE);
+
+        if(!p) {
+            nst_shctx_unlock(&disk->seg);
+
+            goto err;
+        }
+
+        memset(p, 0, NST_DISK_INDEX_SEGMENT_SIZE);
+
+        *(uint32_t *)p       = disk->seg.slot[i].id;
+        *(uint64_t *)(p + 8) = disk->seg.slot[i].size;
+        *(uint64_t *)(p + 16) = disk->seg.slot[i].dead;
+
+        disk->index.nseg++;
+    }
+
+    nst_shctx_unlock(&disk->seg);
+
+    if(_nst_disk_index_flush(disk) != NST_OK) {
+        goto err;
+    }
+
+    return NST_OK;
+
+err:
+    _nst_disk_index_abort(disk);
+
     return NST_ERR;
 }
 
+/*
+ * Copy the record of entry to the index buffer, called with the shard locked
+ */
+static int
+_nst_disk_index_record(nst_disk_t *disk, nst_dict_entry_t *entry) {
+    nst_http_txn_t  txn;
+    struct iovec    iov[10];
+    char           *meta, *p;
+    char           *file;
+    uint64_t        len;
+    int             i;
+
+    file = entry->store.disk.file + disk->root.len + 1;
+
+    iov[0].iov_base = NULL;
+    iov[0].iov_len  = NST_DISK_INDEX_RECORD_SIZE;
+    iov[1].iov_base = entry->key.data;
+    iov[1].iov_len  = entry->key.size;
+    iov[2].iov_base = entry->prop.pid.ptr;
+    iov[2].iov_len  = entry->prop.pid.len;
+    iov[3].iov_base = entry->prop.rid.ptr;
+    iov[3].iov_len  = entry->prop.rid.len;
+    iov[4].iov_base = entry->host.ptr;
+    iov[4].iov_len  = entry->host.len;
+    iov[5].iov_base = entry->path.ptr;
+    iov[5].iov_len  = entry->path.len;
+    iov[6].iov_base = entry->etag.ptr;
+    iov[6].iov_len  = entry->etag.len;
+    iov[7].iov_base = entry->last_modified.ptr;
+    iov[7].iov_len  = entry->last_modified.len;
+    iov[8].iov_base = file;
+    iov[8].iov_len  = strlen(file);
+
+    for(len = 0, i = 0; i < 9; i++) {
+        len += iov[i].iov_len;
+    }
+
+    meta = _nst_disk_index_reserve(len);
+
+    if(!meta) {
+        return NST_ERR;
+    }
+
+    txn.req.host          = entry->host;
+    txn.req.path          = entry->path;
+    txn.res.etag          = entry->etag;
+    txn.res.last_modified = entry->last_modified;
+
+    nst_disk_meta_init(meta, entry->key.hash, entry->expire, entry->header_len,
+            entry->payload_len, entry->key.size, &txn, &entry->prop);
+
+    nst_disk_meta_set_uuid(meta, entry->key.uuid);
+    nst_disk_meta_set_record_len(meta, len);
+
+    *(uint64_t *)(meta + NST_DISK_META_SIZE)     = entry->store.disk.offset;
+    *(uint32_t *)(meta + NST_DISK_META_SIZE + 8) = strlen(file);
+    *(uint32_t *)(meta + NST_DISK_META_SIZE + 12) = 0;
+
+    p = meta + NST_DISK_INDEX_RECORD_SIZE;
+
+    for(i = 1; i < 9; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    disk->index.count++;
+
+    return NST_OK;
+}
+
+/*
+ * Sync the snapshot and move it in place. It is done by a thread of its own
+ * when threads are built in, the master goes on meanwhile and starts no new
+ * snapshot until it is done.
+ */
+typedef struct nst_disk_index_sync {
+    nst_disk_t  *disk;
+    int          fd;
+    char         tmp[PATH_MAX];
+    char         path[PATH_MAX];
+} nst_disk_index_sync_t;
+
+static void *
+_nst_disk_index_sync(void *data) {
+    nst_disk_index_sync_t  *sync = data;
+
+    if(fdatasync(sync->fd) != 0) {
+        close(sync->fd);
+        remove(sync->tmp);
+    } else {
+        close(sync->fd);
+        rename(sync->tmp, sync->path);
+    }
+
+    HA_ATOMIC_STORE(&sync->disk->index.saving, 0);
+
+    free(sync);
+
+    return NULL;
+}
+
+static int
+_nst_disk_index_end(nst_disk_t *disk) {
+    nst_disk_index_sync_t  *sync;
+    char                    p[NST_DISK_INDEX_HEADER_SIZE];
+
+    memset(p, 0, sizeof(p));
+    memcpy(p, "NSTINDEX", 8);
+
+    *(uint32_t *)(p + 8)  = NST_DISK_INDEX_VERSION;
+    *(uint32_t *)(p + 12) = disk->engine;
+    *(uint64_t *)(p + 16) = disk->index.start;
+    *(uint64_t *)(p + 24) = disk->index.count;
+    *(uint32_t *)(p + 32) = disk->index.nseg;
+    *(uint64_t *)(p + 40) = disk->index.size;
+    *(uint64_t *)(p + 48) = XXH64_digest(&disk->index.sum);
+
+    sync = malloc(sizeof(*sync));
+
+    if(!sync || pwrite(disk->index.fd, p, sizeof(p), 0) != sizeof(p)) {
+        free(sync);
+
+        _nst_disk_index_abort(disk);
+
+        return NST_ERR;
+    }
+
+    sync->disk = disk;
+    sync->fd   = disk->index.fd;
+
+    _nst_disk_index_path(disk, sync->tmp, 1);
+    _nst_disk_index_path(disk, sync->path, 0);
+
+    disk->index.saving = 2;
+
+#ifdef USE_THREAD
+    {
+        sigset_t   set, old;
+        pthread_t  tid;
+        int        ret;
+
+        /* signals are for the main thread */
+        sigfillset(&set);
+        pthread_sigmask(SIG_SETMASK, &set, &old);
+
+        ret = pthread_create(&tid, NULL, _nst_disk_index_sync, sync);
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        if(ret == 0) {
+            pthread_detach(tid);
+
+            return NST_OK;
+        }
+    }
+#endif
+
+    _nst_disk_index_sync(sync);
+
+    return NST_OK;
+}
+
+/*
+ * Write a snapshot of the dict entries stored on disk to root/index, a few
+ * buckets at a time. Restarted if a shard is resized meanwhile.
+ */
+void
+nst_disk_index_save(nst_core_t *core, uint64_t interval) {
+    nst_disk_t        *disk = &core->store.disk;
+    nst_dict_shard_t  *shard;
+    nst_dict_entry_t  *entry;
+    uint64_t           start, n;
+    int                ret;
+
+    if(!core->root.len || !disk->loaded) {
+        return;
+    }
+
+    if(!interval) {
+
+        /* not kept up to date */
+        if(!disk->index.removed) {
+            char  path[PATH_MAX];
+
+            _nst_disk_index_path(disk, path, 0);
+
+            remove(path);
+
+            disk->index.removed = 1;
+        }
+
+        return;
+    }
+
+    start = nst_time_now_ms();
+
+    /* the previous snapshot is being synced */
+    if(HA_ATOMIC_LOAD(&disk->index.saving) == 2) {
+        return;
+    }
+
+    if(!disk->index.saving) {
+
+        if(start < disk->index.next) {
+            return;
+        }
+
+        disk->index.next = start + interval;
+
+        if(_nst_disk_index_begin(disk) != NST_OK) {
+            return;
+        }
+    }
+
+    while(disk->index.shard < NST_DICT_SHARDS) {
+        shard = &core->dict.shard[disk->index.shard];
+
+        nst_shctx_lock(shard);
+
+        /* entries move between buckets while rehashing */
+        if(shard->table[1].size
+                || (disk->index.idx && shard->table[0].size != disk->index.tsize)) {
+
+            nst_shctx_unlock(shard);
+
+            if(disk->index.idx) {
+                _nst_disk_index_abort(disk);
+
+                disk->index.next = start;
+            }
+
+            return;
+        }
+
+        disk->index.tsize = shard->table[0].size;
+
+        ret = NST_OK;
+        n   = 0;
+
+        while(ret == NST_OK && disk->index.idx < shard->table[0].size
+                && n++ < NST_DISK_INDEX_BUCKETS) {
+
+            entry = *nst_dict_bucket(&shard->table[0], disk->index.idx);
+
+            while(ret == NST_OK && entry) {
+
+                if(entry->store.disk.file
+                        && entry->state != NST_DICT_ENTRY_STATE_INIT
+                        && entry->state != NST_DICT_ENTRY_STATE_INVALID) {
+
+                    ret = _nst_disk_index_record(disk, entry);
+                }
+
+                entry = entry->next;
+            }
+
+            disk->index.idx++;
+        }
+
+        nst_shctx_unlock(shard);
+
+        /* the records are written with the shard unlocked */
+        if(ret == NST_OK) {
+            ret = _nst_disk_index_flush(disk);
+        }
+
+        if(ret != NST_OK) {
+            _nst_disk_index_abort(disk);
+
+            return;
+        }
+
+        if(disk->index.idx >= disk->index.tsize) {
+            disk->index.shard++;
+            disk->index.idx = 0;
+        }
+
+        if(nst_time_now_ms() - start >= 10) {
+            return;
+        }
+    }
+
+    _nst_disk_index_end(disk);
+}
@@ -10,14 +10,105 @@
  *
  */
 
+#include <haproxy/applet.h>
 #include <haproxy/htx-t.h>
+#include <haproxy/task.h>
 
 #include <nuster/nuster.h>
 
+/*
+ * Process local, the appctx of this process waiting for more items of an
+ * incomplete object, hashed by object. The object lives in shared memory and
+ * holds no pointer to them.
+ */
+static struct {
+    hpx_list_t          list[NST_MEMORY_READERS];
+    int                 count;
+    hpx_task_t         *poll;
+    __decl_thread(HA_SPINLOCK_T lock);
+} nst_memory_readers;
+
+static inline hpx_list_t *
+_nst_memory_readers(nst_memory_obj_t *obj) {
+    return &nst_memory_readers.list[((uintptr_t)obj >> 6) % NST_MEMORY_READERS];
+}
+
+/*
+ * Readers of this process do not hear from a filler in another process, they
+ * are all woken up every NST_MEMORY_WAIT_POLL ms while any is queued.
+ */
+static struct task *
+_nst_memory_readers_poll(struct task *t, void *context, unsigned short state) {
+    hpx_appctx_t  *appctx;
+    int            i;
+
+    HA_SPIN_LOCK(OTHER_LOCK, &nst_memory_readers.lock);
+
+    for(i = 0; i < NST_MEMORY_READERS; i++) {
+
+        list_for_each_entry(appctx, &nst_memory_readers.list[i], wait_entry) {
+            appctx_wakeup(appctx);
+        }
+    }
+
+    t->expire = nst_memory_readers.count
+        ? tick_add(now_ms, MS_TO_TICKS(NST_MEMORY_WAIT_POLL))
+        : TICK_ETERNITY;
+
+    HA_SPIN_UNLOCK(OTHER_LOCK, &nst_memory_readers.lock);
+
+    return t;
+}
+
+/*
+ * wake up the readers of this process of an incomplete object, the readers of
+ * an other object sharing the list check again and requeue
+ */
+static void
+_nst_memory_obj_wakeup(nst_memory_obj_t *obj) {
+    hpx_appctx_t  *appctx;
+
+    HA_SPIN_LOCK(OTHER_LOCK, &nst_memory_readers.lock);
+
+    list_for_each_entry(appctx, _nst_memory_readers(obj), wait_entry) {
+        appctx_wakeup(appctx);
+    }
+
+    HA_SPIN_UNLOCK(OTHER_LOCK, &nst_memory_readers.lock);
+}
+
+/*
+ * allocate from the memory zone, evict cold objects if it is full
+ */
+static void *
+_nst_memory_alloc(nst_memory_t *mem, int size) {
+    void  *p;
+
+    p = nst_shmem_alloc(mem->shmem, size);
+
+    if(p || !mem->core) {
+        return p;
+    }
+
+    return nst_dict_alloc(&mem->core->dict, size);
+}
+
 int
-nst_memory_init(nst_memory_t *mem, nst_shmem_t *shmem) {
+nst_memory_init(nst_memory_t *mem, nst_shmem_t *shmem, nst_core_t *core) {
+    int  i;
+
+    /* shared by the caches and nosql of this process */
+    if(!nst_memory_readers.list[0].n) {
+
+        for(i = 0; i < NST_MEMORY_READERS; i++) {
+            LIST_INIT(&nst_memory_readers.list[i]);
+        }
+
+        HA_SPIN_INIT(&nst_memory_readers.lock);
+    }
 
     mem->shmem   = shmem;
+    mem->core    = core;
     mem->head    = NULL;
     mem->tail    = NULL;
     mem->count   = 0;
@@ -81,12 +172,43 @@ nst_memory_cleanup(nst_memory_t *mem) {
     nst_shctx_unlock(mem);
 }
 
+nst_memory_item_t *
+nst_memory_alloc_item(nst_memory_t *mem, uint32_t size) {
+    nst_memory_item_t  *item = _nst_memory_alloc(mem, sizeof(nst_memory_item_t) + size);
+
+    if(item) {
+        item->size = size;
+    }
+
+    return item;
+}
+
+/*
+ * give back the unused capacity of a coalescing DATA item
+ */
+static void
+_nst_memory_item_close(nst_memory_t *mem, nst_memory_item_t *item) {
+    uint32_t  len;
+
+    if(!item || (item->info >> 28) != HTX_BLK_DATA) {
+        return;
+    }
+
+    len = item->info & 0xfffffff;
+
+    if(len < item->size) {
+        nst_shmem_shrink(mem->shmem, item, sizeof(*item) + len);
+
+        item->size = len;
+    }
+}
+
 /*
  * create a new nst_memory_object and insert it to nst_memory list
  */
 nst_memory_obj_t *
 nst_memory_obj_create(nst_memory_t *mem) {
-    nst_memory_obj_t  *obj = nst_shmem_alloc(mem->shmem, sizeof(*obj));
+    nst_memory_obj_t  *obj = _nst_memory_alloc(mem, sizeof(*obj));
 
     if(obj) {
         memset(obj, 0, sizeof(*obj));
@@ -118,6 +240,34 @@ nst_memory_obj_create(nst_memory_t *mem) {
     return obj;
 }
 
+/*
+ * invalidate an evicted nst_memory_object and free its items right away if
+ * no client is attached, the object itself is freed later by cleanup
+ */
+void
+nst_memory_obj_release(nst_memory_t *mem, nst_memory_obj_t *obj) {
+    nst_memory_item_t  *item, *tmp;
+
+    nst_shctx_lock(mem);
+
+    obj->invalid = 1;
+    mem->invalid++;
+
+    if(!obj->clients) {
+        item      = obj->item;
+        obj->item = NULL;
+
+        while(item) {
+            tmp  = item;
+            item = item->next;
+
+            nst_shmem_free(mem->shmem, tmp);
+        }
+    }
+
+    nst_shctx_unlock(mem);
+}
+
 int
 nst_memory_obj_append(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_t **tail,
         const char *buf, uint32_t len, uint32_t info) {
@@ -131,9 +281,7 @@ nst_memory_obj_append(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_
     item = nst_memory_alloc_item(mem, len);
 
     if(!item) {
-        obj->invalid = 1;
-
-        nst_memory_incr_invalid(mem);
+        nst_memory_obj_abort(mem, obj);
 
         return NST_ERR;
     }
@@ -143,19 +291,207 @@ nst_memory_obj_append(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_
     item->info = info;
     item->next = NULL;
 
+    _nst_memory_item_close(mem, *tail);
+
+    nst_shctx_lock(mem);
+
+    if(*tail) {
+        (*tail)->next = item;
+    } else {
+        obj->item = item;
+    }
+
+    _nst_memory_obj_wakeup(obj);
+
+    nst_shctx_unlock(mem);
+
+    *tail = item;
+
+    return NST_OK;
+}
+
+/*
+ * Append payload to the tail DATA item until it is full, then to a new item
+ * of NST_MEMORY_ITEM_SIZE, which may be a multi-block extent. If there is no
+ * room for such an item even after evicting cold objects, fall back to an item
+ * of the payload size.
+ */
+int
+nst_memory_obj_append_data(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_t **tail,
+        const char *buf, uint32_t len) {
+
+    nst_memory_item_t  *item = *tail;
+    uint32_t            sz, n;
+
+    if(obj->invalid) {
+        return NST_ERR;
+    }
+
+    if(item && (item->info >> 28) == HTX_BLK_DATA && item->size > (item->info & 0xfffffff)) {
+        sz = item->info & 0xfffffff;
+        n  = item->size - sz;
+
+        if(n > len) {
+            n = len;
+        }
+
+        memcpy(item->data + sz, buf, n);
+
+        nst_shctx_lock(mem);
+
+        item->info += n;
+
+        _nst_memory_obj_wakeup(obj);
+
+        nst_shctx_unlock(mem);
+
+        buf += n;
+        len -= n;
+    }
+
+    if(!len) {
+        return NST_OK;
+    }
+
+    sz   = NST_MEMORY_ITEM_SIZE - sizeof(*item);
+    sz   = len > sz ? len : sz;
+    item = _nst_memory_alloc(mem, sizeof(*item) + sz);
+
+    if(item) {
+        item->size = sz;
+    } else {
+        item = nst_memory_alloc_item(mem, len);
+    }
+
+    if(!item) {
+        nst_memory_obj_abort(mem, obj);
+
+        return NST_ERR;
+    }
+
+    memcpy(item->data, buf, len);
+
+    item->info = (HTX_BLK_DATA << 28) + len;
+    item->next = NULL;
+
+    _nst_memory_item_close(mem, *tail);
+
+    nst_shctx_lock(mem);
+
     if(*tail) {
         (*tail)->next = item;
     } else {
         obj->item = item;
     }
 
+    _nst_memory_obj_wakeup(obj);
+
+    nst_shctx_unlock(mem);
+
     *tail = item;
 
     return NST_OK;
 }
 
+int
+nst_memory_obj_finish(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_t *tail) {
+    _nst_memory_item_close(mem, tail);
+
+    nst_shctx_lock(mem);
+
+    obj->complete = 1;
+
+    _nst_memory_obj_wakeup(obj);
+
+    nst_shctx_unlock(mem);
+
+    return NST_OK;
+}
+
+void
+nst_memory_obj_abort(nst_memory_t *mem, nst_memory_obj_t *obj) {
+    nst_shctx_lock(mem);
+
+    if(obj) {
+        obj->invalid = 1;
+
+        _nst_memory_obj_wakeup(obj);
+    }
+
+    mem->invalid++;
+
+    nst_shctx_unlock(mem);
+}
+
+/*
+ * Get the current length and the next item of item in an object which is
+ * being filled, both may change until it is complete. If item has been read
+ * up to offset and there is no next item yet, appctx is queued on the readers
+ * of this process and woken up by the next append, finish or abort.
+ * Returns 1 if the appctx is queued, 0 otherwise.
+ */
+int
+nst_memory_obj_wait(nst_memory_t *mem, nst_memory_obj_t *obj, nst_memory_item_t *item,
+        uint32_t offset, uint32_t *len, nst_memory_item_t **next, hpx_appctx_t *appctx) {
+
+    int  ret = 0;
+
+    nst_memory_obj_unwait(mem, appctx);
+
+    nst_shctx_lock(mem);
+
+    *len  = nst_memory_item_len(item);
+    *next = item->next;
+
+    if(offset >= *len && !*next && !obj->complete && !obj->invalid) {
+        HA_SPIN_LOCK(OTHER_LOCK, &nst_memory_readers.lock);
+
+        LIST_ADDQ(_nst_memory_readers(obj), &appctx->wait_entry);
+
+        nst_memory_readers.count++;
+
+        if(global.nbproc > 1) {
+
+            if(!nst_memory_readers.poll) {
+                nst_memory_readers.poll = task_new(MAX_THREADS_MASK);
+
+                if(nst_memory_readers.poll) {
+                    nst_memory_readers.poll->process = _nst_memory_readers_poll;
+                }
+            }
+
+            if(nst_memory_readers.poll && !tick_isset(nst_memory_readers.poll->expire)) {
+                task_schedule(nst_memory_readers.poll,
+                        tick_add(now_ms, MS_TO_TICKS(NST_MEMORY_WAIT_POLL)));
+            }
+        }
+
+        HA_SPIN_UNLOCK(OTHER_LOCK, &nst_memory_readers.lock);
+
+        ret = 1;
+    }
+
+    nst_shctx_unlock(mem);
+
+    return ret;
+}
+
+void
+nst_memory_obj_unwait(nst_memory_t *mem, hpx_appctx_t *appctx) {
+    HA_SPIN_LOCK(OTHER_LOCK, &nst_memory_readers.lock);
+
+    if(LIST_ADDED(&appctx->wait_entry)) {
+        LIST_DEL_INIT(&appctx->wait_entry);
+
+        nst_memory_readers.count--;
+    }
+
+    HA_SPIN_UNLOCK(OTHER_LOCK, &nst_memory_readers.lock);
+}
+
 void
 nst_store_memory_sync_disk(nst_core_t *core) {
+    nst_dict_shard_t   *shard;
     nst_dict_entry_t   *entry;
     nst_disk_obj_t      data = { .file = NULL };
     nst_memory_item_t  *item;
@@ -170,15 +506,17 @@ nst_store_memory_sync_disk(nst_core_t *core) {
         return;
     }
 
-    if(!core->dict.used) {
+    shard = &core->dict.shard[__sync_fetch_and_add(&core->dict.sync_idx, 1) % NST_DICT_SHARDS];
+
+    if(!shard->used) {
         return;
     }
 
     start = nst_time_now_ms();
 
-    nst_shctx_lock(&core->dict);
+    nst_shctx_lock(shard);
 
-    entry = core->dict.entry[core->dict.sync_idx];
+    entry = *nst_dict_bucket(&shard->table[0], shard->sync_idx);
 
     while(entry) {
 
@@ -193,14 +531,13 @@ nst_store_memory_sync_disk(nst_core_t *core) {
             txn.res.header_len    = 0;
             txn.res.payload_len   = 0;
 
-            ret = nst_disk_obj_create(&core->store.disk, &data, &entry->key, &txn, &entry->prop);
+            ret = nst_disk_obj_create(&core->store.disk, &data, &entry->key, &txn, &entry->prop,
+                    NULL);
 
             if(ret != NST_OK) {
                 goto next;
             }
 
-            entry->store.disk.file = data.file;
-
             item = entry->store.memory.obj->item;
 
             while(item) {
@@ -236,7 +573,12 @@ nst_store_memory_sync_disk(nst_core_t *core) {
                 item = item->next;
             }
 
-            nst_disk_obj_finish(&core->store.disk, &data, &entry->key, &txn, entry->expire);
+            ret = nst_disk_obj_finish(&core->store.disk, &data, &entry->key, &txn, entry->expire);
+
+            if(ret == NST_OK) {
+                entry->store.disk.file   = data.file;
+                entry->store.disk.offset = data.base;
+            }
         }
 next:
 
@@ -248,14 +590,14 @@ next:
     }
 
     if(entry == NULL) {
-        core->dict.sync_idx++;
+        shard->sync_idx++;
     }
 
-    /* if we have checked the whole dict */
-    if(core->dict.sync_idx == core->dict.size) {
-        core->dict.sync_idx = 0;
+    /* if we have checked the whole shard */
+    if(shard->sync_idx >= shard->table[0].size) {
+        shard->sync_idx = 0;
     }
 
-    nst_shctx_unlock(&core->dict);
+    nst_shctx_unlock(shard);
 }
 